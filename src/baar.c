@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define BAAR_HEADER "BAAR v0.38, \xC2\xA9 BArko, 2025"
 
 const char *baar_header_string(void) {
@@ -22,9 +23,18 @@ const char *baar_header_string(void) {
 #include <utime.h>
 #include <fnmatch.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <ctype.h>
 #include <limits.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <gtk/gtk.h>
 #include <archive.h>
 #include <archive_entry.h>
@@ -58,8 +68,23 @@ static void fmt_size(uint64_t n, char *out, size_t outlen){
 
 #define MAGIC "BAARv1\0"
 #define HEADER_SIZE 32
+/* An archive written to a pipe ('baar a -') cannot patch its header, so the header's index
+   offset stays 0 and the file ends with this trailer: u64 index offset, then the magic. */
+#define TRAILER_MAGIC "BAAREND1"
+#define TRAILER_SIZE 16
+/* With --local-headers each blob is preceded by this magic and a copy of its index record
+   (whose data offset is the byte after the record), so entries can be read without the index. */
+#define LOCAL_HEADER_MAGIC "BAARLHD1"
 #define BAAR_STREAM_THRESHOLD (64ULL * 1024 * 1024)
 #define BAAR_STREAM_CHUNK_SIZE (256 * 1024)
+/* entries at least this large are extracted through a memory-mapped output file */
+#define BAAR_MMAP_EXTRACT_MIN (1024 * 1024)
+/* --read-order: at most this many regular files are deferred and sorted at a time */
+#define BAAR_READ_ORDER_WINDOW 4096
+/* --cdc: chunk size bounds and target average; smaller files are stored whole */
+#define BAAR_CDC_MIN (16 * 1024)
+#define BAAR_CDC_AVG (64 * 1024)
+#define BAAR_CDC_MAX (256 * 1024)
 
 
 #define RESPONSE_OPEN_CREATE 100
@@ -94,6 +119,9 @@ typedef struct {
     uint32_t n;
     uint32_t next_id;
     FILE *archive_fp; /* duplicate of archive FILE* for lazy reads */
+    const char *archive_path; /* set by readers that follow --base references or volumes (not owned) */
+    uint64_t *id_slots; /* lookup table of entry_by_id(), built on first use */
+    uint32_t id_slots_n;
 } index_t;
 
 
@@ -103,11 +131,20 @@ static void free_index(index_t *idx);
 static const char *entry_get_name(index_t *idx, entry_t *e);
 static int entry_load_meta(index_t *idx, entry_t *e);
 static void entry_free_meta(entry_t *e);
+static const char *entry_get_meta_val(index_t *idx, entry_t *e, const char *key);
+static void clone_entry_meta(index_t *idx, entry_t *e, entry_t *dst);
 
 static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uint32_t exclude_count, int quiet);
+static int maybe_compact_archive(const char *archive, int quiet);
+static int remove_entries(const char *archive, const uint32_t *ids, uint32_t id_count,
+                          char **globs, size_t glob_count, int quiet);
 
 static void xor_buf(unsigned char *buf, size_t len, const char *pwd);
-static int stream_copy_file_with_crc(const char *src_path, FILE *dest, const char *pwd, uint64_t *bytes_written, uint32_t *crc_out);
+struct io_worker;
+static int pread_full(int fd, void *buf, size_t len, uint64_t off);
+static int stream_copy_file_with_crc(const char *src_path, FILE *dest, const char *pwd,
+                                     struct io_worker *io, int timeout_ms,
+                                     uint64_t *bytes_written, uint32_t *crc_out, unsigned char *sha_out);
 
 
 static int global_quiet = 0;
@@ -130,13 +167,37 @@ static void usage(){
         "    Add files or directories to <archive> (.baar is appended if missing).\n"
         "    Files may be specified as src:dst to control the archive path or src:level to set per-file compression.\n"
         "    Use --incremental (-i) and/or --mirror (-m) to mirror provided paths: skip unchanged files and remove entries missing on disk.\n"
+        "    With - as <archive>, a new archive is written to standard output (index and trailer at the end).\n"
         "      --incremental, -i     Incremental mode: only add new/changed files.\n"
         "      --mirror, -m         Mirror mode: also mark as deleted files missing from source.\n"
         "      --ignore PATTERN     Skip sources or archive paths matching the glob pattern (can be repeated).\n"
         "      --devdir NAME|PATH   Treat matching sources as pseudo device roots (record immediate entries only). Repeat to add more names.\n"
+        "      --one-file-system, --xdev  Do not descend into directories on a different filesystem than their source root.\n"
+        "      --allow-fs PATH      With --one-file-system, still enter the filesystem PATH lives on (can be repeated).\n"
+        "      --read-order inode|physical  Read each directory's files sorted by inode or by on-disk offset (FIEMAP) to cut seeks.\n"
+        "      --io-timeout DURATION  Skip a source file whose open or read makes no progress for DURATION (e.g. 30s, 500ms, 2m).\n"
+        "      --verify-content     With --incremental, CRC-check same-size files whose inode/ctime/mtime changed and keep them if equal.\n"
+        "      --dedup              Store identical file contents once; duplicates reference the existing data.\n"
+        "      --delta[=DEPTH]      With --incremental, store changed files as deltas against the previous version (chains up to DEPTH, default 8).\n"
+        "      --cdc                Split files of 256 KiB or more into content-defined chunks and store each chunk once.\n"
+        "      --base ARCHIVE       Store files unchanged since ARCHIVE as references into it (a differential archive).\n"
+        "      --low-memory         With -i/-m, plan against the archive through sorted runs on disk instead of in memory.\n"
+        "      --local-headers      Precede each stored file with a copy of its index record, for 'baar x -' and 'baar recover'.\n"
+        "      --volume-size SIZE   Store file data in numbered parts of SIZE (e.g. 50G) beside the archive: <archive>.001, .002, ...\n"
+        "      --stripe N           Spread file data over N volume streams written in parallel (<archive>.s1.001, ...).\n"
+        "      --stripe-dir DIR     Place the volume streams in DIR, one directory per stream in turn (repeatable).\n"
+        "\n"
+        "  baar watch <archive> <dirs...> [-c 0|1|2|3] [-p password] [--interval DURATION] [--ignore PATTERN]\n"
+        "    Mirror the directories into <archive>, then keep it current from inotify events,\n"
+        "    committing the changed paths every DURATION (default 2s) until interrupted.\n"
         "\n"
-        "  baar x <archive> [dest_dir] [-p password]\n"
+        "  baar x <archive> [dest_dir] [-p password] [--update] [--checksum] [--delete] [--include GLOB] [--exclude GLOB] [--prefix PATH]\n"
         "    Extract all files from <archive> into dest_dir (current dir if omitted).\n"
+        "    With - as <archive>, read an archive written with --local-headers from standard input in one pass.\n"
+        "      -u, --update         Skip files whose size and mtime already match.\n"
+        "      --checksum           Skip writing files whose size and CRC32 already match.\n"
+        "      --delete             Remove paths under the archive's top-level entries that it does not contain.\n"
+        "      --include GLOB, --exclude GLOB, --prefix PATH  Extract only matching entries (each can be repeated).\n"
         "\n"
         "  baar l <archive> [-j|--json]\n"
         "    List archive contents (human or JSON).\n"
@@ -146,6 +207,10 @@ static void usage(){
         "\n"
         "  baar f <archive>\n"
         "    Repair/rebuild archive (removes deleted/removed entries).\n"
+        "    'a', 'r' and the GUI only rebuild once deleted data passes --compact-threshold=30%|SIZE|off.\n"
+        "\n"
+        "  baar recover <archive>\n"
+        "    Rebuild a lost or damaged index from the local headers of an archive written with --local-headers.\n"
         "\n"
         "  baar search <archive> <pattern> [-j|--json]\n"
         "    Search entries by name using shell wildcards (* and ?).\n"
@@ -156,8 +221,8 @@ static void usage(){
         "  baar cat <archive> <id> [-p password]\n"
         "    Print entry contents to stdout.\n"
         "\n"
-        "  baar r <archive> <id>\n"
-        "    Remove (mark deleted) entry by id.\n"
+        "  baar r <archive> <id>... [--glob PATTERN]\n"
+        "    Remove (mark deleted) entries by id and/or by name pattern; 'baar f' reclaims the space.\n"
         "\n"
         "  baar mkdir <archive> path/to/dir\n"
         "    Create an empty directory entry inside the archive.\n"
@@ -171,6 +236,22 @@ static void usage(){
     "  baar compress <archive> -c 0|1|2|3|4 [-p password]\n"
         "    Recompress entries safely using the requested level (0=store,1=fast,2=balanced,3=best,4=ultra).\n"
         "\n"
+        "  baar diff <archive> <dir> [--content] [--ignore PATTERN] [--one-file-system] [-j|--json]\n"
+        "    List files added, removed (D) or modified in <dir> compared with the archive, by metadata;\n"
+        "    --content CRC-checks same-size files whose metadata differs. Exit status 1 if anything differs.\n"
+        "    Directories are pruned like 'a' does (--ignore, --one-file-system/--allow-fs, pseudo filesystems).\n"
+        "\n"
+        "  baar flatten <archive> [-p password]\n"
+        "    Copy the data of --base references into <archive> so it no longer needs its base.\n"
+        "\n"
+        "  baar merge <out> <archive>... [--on-conflict=last|first|newer|rename|error]\n"
+        "    Write a new archive holding the entries of all inputs, copying stored data as is.\n"
+        "    A path in several inputs keeps the last (default), first or newer copy, gets a ~N suffix, or aborts.\n"
+        "\n"
+        "  baar batch <archive> [script|-] [-c 0|1|2|3] [-p password]\n"
+        "    Apply add/rename/move/mkdir/remove lines (or NDJSON objects) from script or stdin\n"
+        "    with one index write; nothing is changed if any operation fails.\n"
+        "\n"
         ""
     );
 }
@@ -188,9 +269,57 @@ typedef struct {
     int dev_dir_mode; /* if set, treat the src root as a 'dosdevices' like directory: record immediate children only */
 } add_job_t;
 
+/* Order in which the walker reads the regular files of a directory (--read-order). */
+enum {
+    BAAR_READ_ORDER_READDIR = 0,
+    BAAR_READ_ORDER_INODE,
+    BAAR_READ_ORDER_PHYSICAL
+};
+
+/* Options for 'baar x'. */
+typedef struct {
+    int update; /* --update: skip files whose size and mtime already match the entry */
+    int checksum; /* --checksum: skip writing files whose size and CRC32 already match the entry */
+    int delete_extraneous; /* --delete: remove paths below the archive's top-level entries that it does not contain */
+    /* --include/--exclude globs and --prefix paths selecting the entries to extract (all when empty) */
+    char **include;
+    size_t include_count;
+    char **exclude;
+    size_t exclude_count;
+    char **prefixes;
+    size_t prefix_count;
+} extract_options_t;
+
+/* Options for 'baar a' that apply to every job rather than to a single source. */
+typedef struct {
+    int one_file_system; /* --one-file-system/--xdev: do not descend into directories on another filesystem */
+    char **allow_fs_paths; /* --allow-fs: paths whose filesystems may still be entered with --one-file-system */
+    size_t allow_fs_count;
+    int read_order; /* BAAR_READ_ORDER_* */
+    int io_timeout_ms; /* --io-timeout: abandon a source whose open/read stalls this long (0 = wait forever) */
+    int verify_content; /* --verify-content: with -i, CRC files whose stat cache changed before re-storing them */
+    int dedup; /* --dedup: store identical file contents once */
+    int cdc; /* --cdc: store large files as content-defined chunks shared across entries */
+    int delta_depth; /* --delta[=N]: with -i, store changed files as deltas, chains up to N long (0 = off) */
+    const char *base_path; /* --base: store files unchanged since this archive as references into it */
+    int low_memory; /* --low-memory: plan -i/-m runs by merge-joining sorted runs spilled to disk */
+    int local_headers; /* --local-headers: write each blob after a copy of its index record */
+    uint64_t volume_size; /* --volume-size: blobs go to numbered parts of this size beside the archive */
+    int stripe; /* --stripe: blobs are spread over this many volume streams written in parallel */
+    char **stripe_dirs; /* --stripe-dir: directories the streams are placed in, in turn */
+    size_t stripe_dir_count;
+    /* used by 'baar watch': archive paths (with everything below them) to mark deleted, and the
+       archive paths that mirror deletions are limited to (all entries when mirror_scope_count is 0) */
+    char **remove_paths;
+    size_t remove_count;
+    char **mirror_scope;
+    size_t mirror_scope_count;
+} add_options_t;
+
 static int add_files_streaming(const char *archive, add_job_t *jobs, int job_count,
                                const char *pwd, int incremental_mode, int mirror_mode,
-                               char **ignore_patterns, size_t ignore_count);
+                               char **ignore_patterns, size_t ignore_count,
+                               const add_options_t *opts);
 static GtkWidget *g_main_window = NULL;
 static GtkWidget *g_list_container = NULL;
 static GtkWidget *g_welcome_label = NULL;
@@ -975,14 +1104,7 @@ static void close_archive_gui(void){
 
 
     if(g_current_archive && !g_current_is_libarchive){
-        int has_deleted = 0;
-        for(uint32_t i=0;i<g_current_index.n;i++){
-            if(g_current_index.entries[i].flags & 4){ has_deleted = 1; break; }
-        }
-        if(has_deleted){
-
-            rebuild_archive(g_current_archive, NULL, 0, 1);
-        }
+        maybe_compact_archive(g_current_archive, 1);
     }
     free_index(&g_current_index);
     if(g_current_archive){ free(g_current_archive); g_current_archive = NULL; }
@@ -1078,26 +1200,72 @@ static gboolean destroy_window_cb(gpointer win){
 }
 
 
-static int compress_data_level(int level, const unsigned char *in, size_t in_sz, unsigned char **outp, size_t *out_szp){
+/* Buffers and stream of one compression. Callers reading a mapping that may fault keep it on
+   their side of the SIGBUS guard so the jump path can release it with deflate_state_release(). */
+typedef struct {
+    z_stream zs;
+    int live;               /* zs is between deflateInit2 and deflateEnd */
+    unsigned char *scratch; /* output of the attempt in progress */
+    unsigned char *best;    /* levels 3/4: smallest output so far */
+} deflate_state_t;
+
+static void deflate_state_release(deflate_state_t *st){
+    if(st->live) deflateEnd(&st->zs);
+    free(st->scratch);
+    free(st->best);
+    memset(st, 0, sizeof(*st));
+}
+
+/* One deflate pass of `in` into st->scratch, fed in uInt sized pieces like compress2(). Returns 0
+   with the output length in *out_sz, 1 on allocation failure or 2 on a zlib error. */
+static int deflate_once(deflate_state_t *st, const unsigned char *in, size_t in_sz, int zlevel,
+                        int window_bits, int mem_level, int strategy, size_t *out_sz){
+    uLong bound = compressBound(in_sz);
+    st->scratch = malloc(bound);
+    if(!st->scratch) return 1;
+    memset(&st->zs, 0, sizeof(st->zs));
+    if(deflateInit2(&st->zs, zlevel, Z_DEFLATED, window_bits, mem_level, strategy) != Z_OK){
+        free(st->scratch);
+        st->scratch = NULL;
+        return 2;
+    }
+    st->live = 1;
+    size_t in_left = in_sz, out_left = bound;
+    st->zs.next_in = (Bytef*)in;
+    st->zs.next_out = st->scratch;
+    int zr;
+    do {
+        if(st->zs.avail_out == 0){
+            st->zs.avail_out = out_left > UINT_MAX ? UINT_MAX : (uInt)out_left;
+            out_left -= st->zs.avail_out;
+        }
+        if(st->zs.avail_in == 0){
+            st->zs.avail_in = in_left > UINT_MAX ? UINT_MAX : (uInt)in_left;
+            in_left -= st->zs.avail_in;
+        }
+        zr = deflate(&st->zs, in_left ? Z_NO_FLUSH : Z_FINISH);
+    } while(zr == Z_OK);
+    *out_sz = st->zs.total_out;
+    deflateEnd(&st->zs);
+    st->live = 0;
+    if(zr != Z_STREAM_END){
+        free(st->scratch);
+        st->scratch = NULL;
+        return 2;
+    }
+    return 0;
+}
+
+static int compress_data_state(deflate_state_t *st, int level, const unsigned char *in, size_t in_sz,
+                               unsigned char **outp, size_t *out_szp){
     if(!in || in_sz==0) return 1;
     *outp = NULL; *out_szp = 0;
-    if(level <= 1){
-        uLong bound = compressBound(in_sz);
-        unsigned char *out = malloc(bound);
-        if(!out) return 1;
-        uLong outsz = bound;
-        int zr = compress2(out, &outsz, in, in_sz, Z_BEST_SPEED);
-        if(zr!=Z_OK){ free(out); return 2; }
-        *outp = out; *out_szp = outsz; return 0;
-    }
-    if(level == 2){
-        uLong bound = compressBound(in_sz);
-        unsigned char *out = malloc(bound);
-        if(!out) return 1;
-        uLong outsz = bound;
-        int zr = compress2(out, &outsz, in, in_sz, Z_DEFAULT_COMPRESSION);
-        if(zr!=Z_OK){ free(out); return 2; }
-        *outp = out; *out_szp = outsz; return 0;
+    if(level <= 2){
+        /* same stream as compress2() at Z_BEST_SPEED / Z_DEFAULT_COMPRESSION */
+        size_t outsz = 0;
+        int zr = deflate_once(st, in, in_sz, level <= 1 ? Z_BEST_SPEED : Z_DEFAULT_COMPRESSION, 15, 8, Z_DEFAULT_STRATEGY, &outsz);
+        if(zr != 0) return zr;
+        *outp = st->scratch; st->scratch = NULL; *out_szp = outsz; return 0;
     }
     if(level == 3 || level == 4){
         int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY};
@@ -1106,48 +1274,41 @@ static int compress_data_level(int level, const unsigned char *in, size_t in_sz,
         size_t memLevelsCount = (level == 4) ? 9u : 2u;
         for(size_t i=0;i<9;i++) memLevels[i]= (int)i + 1;
         if(level == 3) { memLevels[0]=9; memLevels[1]=8; }
-        unsigned char *best = NULL; size_t best_sz = 0;
+        size_t best_sz = 0;
         for(size_t wi=0; wi<(level==4?3:2); wi++){
             for(size_t mi=0; mi<memLevelsCount; mi++){
                 for(size_t si=0; si<sizeof(strategies)/sizeof(strategies[0]); si++){
-                    int strat = strategies[si];
-                    z_stream zs; memset(&zs,0,sizeof(zs));
-                    int windowBits = windowBitsOpts[wi]; int memLevel = memLevels[mi];
-                    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, memLevel, strat) != Z_OK) continue;
-                    uLong bound = compressBound(in_sz);
-                    unsigned char *out = malloc(bound);
-                    if(!out){ deflateEnd(&zs); continue; }
-                    zs.next_in = (Bytef*)in; zs.avail_in = (uInt)in_sz;
-                    zs.next_out = out; zs.avail_out = (uInt)bound;
-                    int res = deflate(&zs, Z_FINISH);
-                    if(res == Z_STREAM_END){
-                        size_t outsz = zs.total_out;
-                        if(best==NULL || outsz < best_sz){
-                            if(best) free(best);
-                            best = out;
-                            best_sz = outsz;
-                        } else {
-                            free(out);
-                        }
+                    size_t outsz = 0;
+                    if(deflate_once(st, in, in_sz, Z_BEST_COMPRESSION, windowBitsOpts[wi], memLevels[mi], strategies[si], &outsz) != 0) continue;
+                    if(st->best == NULL || outsz < best_sz){
+                        free(st->best);
+                        st->best = st->scratch;
+                        best_sz = outsz;
+                    } else {
+                        free(st->scratch);
                     }
-                    else { free(out); }
-                    deflateEnd(&zs);
+                    st->scratch = NULL;
                 }
             }
         }
-        if(best){ *outp = best; *out_szp = best_sz; return 0; }
+        if(st->best){ *outp = st->best; st->best = NULL; *out_szp = best_sz; return 0; }
 
-        uLong bound = compressBound(in_sz);
-        unsigned char *outf = malloc(bound);
-        if(!outf) return 1;
-        uLong outszf = bound;
-        int zr = compress2(outf, &outszf, in, in_sz, Z_BEST_COMPRESSION);
-        if(zr!=Z_OK){ free(outf); return 2; }
-        *outp = outf; *out_szp = outszf; return 0;
+        size_t outszf = 0;
+        int zr = deflate_once(st, in, in_sz, Z_BEST_COMPRESSION, 15, 8, Z_DEFAULT_STRATEGY, &outszf);
+        if(zr != 0) return zr;
+        *outp = st->scratch; st->scratch = NULL; *out_szp = outszf; return 0;
     }
     return 1;
 }
 
+static int compress_data_level(int level, const unsigned char *in, size_t in_sz, unsigned char **outp, size_t *out_szp){
+    deflate_state_t st;
+    memset(&st, 0, sizeof(st));
+    int rc = compress_data_state(&st, level, in, in_sz, outp, out_szp);
+    deflate_state_release(&st);
+    return rc;
+}
+
 
 static int auto_choose_clevel(const char *path){
     if(!path) return 1;
@@ -1507,7 +1668,7 @@ static void on_remove_response(GtkDialog *d, int response_id, gpointer user_data
 
 
         if(ex_count > 0){
-            rebuild_archive(g_current_archive, to_exclude, ex_count, 1);
+            remove_entries(g_current_archive, to_exclude, ex_count, NULL, 0, 1);
             free(to_exclude);
 
 
@@ -5205,23 +5366,168 @@ static entry_t *find_entry_by_name_fast(entry_lookup_item_t *items, size_t count
     return NULL;
 }
 
+static int compare_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Entry with `id`, or NULL. Uses idx->id_slots, a sorted (id << 32 | slot) array that is extended
+   in place for appended entries (ids only grow) and rebuilt when the index no longer matches it. */
+static entry_t *entry_by_id(index_t *idx, uint32_t id){
+    if(!idx || !idx->n) return NULL;
+    for(int pass = 0; pass < 2; pass++){
+        if(pass || idx->id_slots_n > idx->n){
+            free(idx->id_slots);
+            idx->id_slots = NULL;
+            idx->id_slots_n = 0;
+        }
+        if(idx->id_slots_n < idx->n){
+            uint64_t *grown = realloc(idx->id_slots, sizeof(*grown) * idx->n);
+            if(!grown){
+                for(uint32_t i=0;i<idx->n;i++) if(idx->entries[i].id == id) return &idx->entries[i];
+                return NULL;
+            }
+            idx->id_slots = grown;
+            int sorted = 1;
+            for(uint32_t i=idx->id_slots_n; i<idx->n; i++){
+                grown[i] = (uint64_t)idx->entries[i].id << 32 | i;
+                if(i > 0 && grown[i] < grown[i-1]) sorted = 0;
+            }
+            if(!sorted) qsort(grown, idx->n, sizeof(*grown), compare_u64);
+            idx->id_slots_n = idx->n;
+        }
+        size_t lo = 0, hi = idx->id_slots_n;
+        uint32_t slot = UINT32_MAX;
+        while(lo < hi){
+            size_t mid = (lo + hi) / 2;
+            uint32_t cur = (uint32_t)(idx->id_slots[mid] >> 32);
+            if(cur == id){ slot = (uint32_t)idx->id_slots[mid]; break; }
+            if(cur < id) lo = mid + 1;
+            else hi = mid;
+        }
+        if(slot == UINT32_MAX) return NULL;
+        if(slot < idx->n && idx->entries[slot].id == id) return &idx->entries[slot];
+        /* entries were replaced or reordered since the map was built */
+    }
+    return NULL;
+}
+
+/* Set of entry ids, one bit per id, grown on demand. */
+typedef struct {
+    uint64_t *words;
+    size_t nwords;
+} id_set_t;
+
+/* Make room for ids up to `max_id`, so adding them cannot fail later. Returns 0 or -1. */
+static int id_set_reserve(id_set_t *s, uint32_t max_id){
+    size_t w = max_id >> 6;
+    if(w < s->nwords) return 0;
+    size_t n = s->nwords ? s->nwords : 64;
+    while(n <= w) n *= 2;
+    uint64_t *grown = realloc(s->words, sizeof(*grown) * n);
+    if(!grown) return -1;
+    memset(grown + s->nwords, 0, sizeof(*grown) * (n - s->nwords));
+    s->words = grown;
+    s->nwords = n;
+    return 0;
+}
+
+/* Returns 1 when `id` was added, 0 when it was already present, -1 when out of memory. */
+static int id_set_add(id_set_t *s, uint32_t id){
+    size_t w = id >> 6;
+    if(id_set_reserve(s, id) != 0) return -1;
+    uint64_t bit = (uint64_t)1 << (id & 63);
+    if(s->words[w] & bit) return 0;
+    s->words[w] |= bit;
+    return 1;
+}
+
+static int id_set_has(const id_set_t *s, uint32_t id){
+    size_t w = id >> 6;
+    return w < s->nwords && (s->words[w] >> (id & 63) & 1);
+}
+
+static void id_set_remove(id_set_t *s, uint32_t id){
+    size_t w = id >> 6;
+    if(w < s->nwords) s->words[w] &= ~((uint64_t)1 << (id & 63));
+}
+
+static void id_set_free(id_set_t *s){
+    free(s->words);
+    s->words = NULL;
+    s->nwords = 0;
+}
+
+/* --base archive opened for 'baar a': its index and name lookup, its real path and the
+   real directory of the archive being written (used to keep BAAR_BASE relative) */
+typedef struct {
+    FILE *f;
+    index_t idx;
+    entry_lookup_item_t *lookup;
+    size_t lookup_count;
+    char *path;
+    char *archive_dir;
+} add_base_t;
+
+static void add_base_close(add_base_t *b);
+
 typedef struct {
     FILE *archive_fp;
-    /* canonical on-disk path for the archive we're writing to; used to avoid including the archive itself */
-    char *archive_path_on_disk;
+    /* identity of the open archive file, cached once; used to avoid including the archive itself */
+    dev_t archive_dev;
+    ino_t archive_ino;
+    int archive_id_valid;
     index_t *idx;
     size_t original_entry_count;
     entry_lookup_item_t *entry_lookup;
     size_t entry_lookup_count;
-    uint8_t *entry_seen;
+    id_set_t *entry_seen; /* --mirror: slots of original entries met during the walk */
     uint32_t **to_remove;
     uint32_t *remove_count;
+    id_set_t *remove_set; /* ids already in *to_remove */
+    /* remove_slot[id] is the position of id in *to_remove while remove_set has it; covers the
+       ids below remove_slot_n, larger ones are searched for */
+    uint32_t *remove_slot;
+    uint32_t remove_slot_n;
     const char *pwd;
     int incremental_mode;
     int mirror_mode;
     char **ignore_patterns;
     size_t ignore_count;
-    uint64_t archive_mtime;
+    int verify_content; /* --verify-content: CRC-compare size-equal files whose stat cache differs */
+    /* --one-file-system: prune directories whose st_dev differs from the job root,
+       unless the device is one of allowed_devs */
+    int one_file_system;
+    dev_t *allowed_devs;
+    size_t allowed_dev_count;
+    int read_order; /* BAAR_READ_ORDER_* */
+    /* symlink target already read by the walker for the entry being processed (or NULL) */
+    const char *symlink_target_hint;
+    /* --io-timeout: sources are read through `io`; paths abandoned after a stall are kept
+       in timed_out_paths for the summary */
+    int io_timeout_ms;
+    struct io_worker *io;
+    char **timed_out_paths;
+    size_t timed_out_count;
+    /* --dedup: content index of stored blobs (NULL when dedup is off) */
+    struct dedup_index *dedup;
+    size_t dedup_hits;
+    uint64_t dedup_bytes;
+    /* --cdc: chunk index of the archive (NULL when chunking is off) */
+    struct cdc_index *cdc;
+    int delta_max_depth; /* --delta: longest delta chain to build (0 = off) */
+    /* -i/--mirror: inode map of the entries for rename detection (built on first use) */
+    struct inode_map *moved;
+    /* --base: unchanged files become references into this archive (NULL when not used) */
+    add_base_t *base;
+    size_t base_refs;
+    uint64_t base_bytes;
+    /* --low-memory: while set, walked files are only recorded here for the merge-join */
+    struct extsort *plan_sink;
+    /* --local-headers: the archive being written; archive_fp is then a spool holding one blob */
+    FILE *local_out;
+    /* --volume-size/--stripe: streams the blobs move to from the spool in archive_fp */
+    struct volume_set *volumes;
 } add_stream_ctx_t;
 
 static char *build_child_path(const char *parent, const char *name){
@@ -5267,46 +5573,94 @@ static int name_looks_like_device_alias(const char *name){
     return 0;
 }
 
-static int looks_like_device_directory(const char *path){
-    if(!path) return 0;
-    DIR *dir = opendir(path);
-    if(!dir) return 0;
-    int result = 0;
-    struct dirent *ent;
-    while((ent = readdir(dir))){
-        if(strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..") == 0) continue;
-        char *child = build_child_path(path, ent->d_name);
-        if(!child){
-            break;
-        }
-        struct stat st;
-        if(lstat(child, &st)==0){
-            if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)){
-                result = 1;
-            } else if(S_ISLNK(st.st_mode)){
-                char target[PATH_MAX+1];
-                ssize_t lr = readlink(child, target, PATH_MAX);
-                if(lr > 0){
-                    target[lr] = '\0';
-                    if(is_pseudo_path(target) || strncmp(target, "/run", 4) == 0 || strncmp(target, "/var/run", 8) == 0){
-                        result = 1;
-                    } else if(name_looks_like_device_alias(ent->d_name)){
-                        result = 1;
-                    }
-                } else if(name_looks_like_device_alias(ent->d_name)){
-                    result = 1;
-                }
-            } else if(name_looks_like_device_alias(ent->d_name)){
-                result = 1;
+/* Decide from the first entry of a directory whether it looks like a 'dosdevices' style
+   directory: a device node or FIFO, a symlink into a pseudo filesystem, or a name such as
+   "c:" / "com1". `st` and `link_target` may be NULL when they could not be read. */
+static int entry_looks_like_device(const char *name, const struct stat *st, const char *link_target){
+    if(st){
+        if(S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) || S_ISFIFO(st->st_mode)) return 1;
+        if(S_ISLNK(st->st_mode) && link_target){
+            if(is_pseudo_path(link_target) || strncmp(link_target, "/run", 4) == 0 || strncmp(link_target, "/var/run", 8) == 0){
+                return 1;
             }
-        } else if(name_looks_like_device_alias(ent->d_name)){
-            result = 1;
         }
-        free(child);
-        break;
     }
-    closedir(dir);
-    return result;
+    return name_looks_like_device_alias(name);
+}
+
+/* lstat() relative to an open directory. statx is asked only for the fields the archiver
+   consumes; kernels or libcs without statx fall back to fstatat. */
+static int stat_at_nofollow(int dfd, const char *name, struct stat *st){
+#ifdef STATX_TYPE
+    struct statx sx;
+    if(statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+             STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_MTIME | STATX_CTIME | STATX_SIZE | STATX_INO, &sx) == 0){
+        memset(st, 0, sizeof(*st));
+        st->st_mode = sx.stx_mode;
+        st->st_uid = sx.stx_uid;
+        st->st_gid = sx.stx_gid;
+        st->st_size = (off_t)sx.stx_size;
+        st->st_ino = (ino_t)sx.stx_ino;
+        st->st_nlink = sx.stx_nlink;
+        st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+        st->st_rdev = makedev(sx.stx_rdev_major, sx.stx_rdev_minor);
+        st->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+        st->st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+        st->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+        return 0;
+    }
+    if(errno != ENOSYS) return -1;
+#endif
+    return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT);
+}
+
+/* With --one-file-system, return true if a directory on device `dev` must not be entered. */
+static int crosses_filesystem(const add_stream_ctx_t *ctx, dev_t root_dev, dev_t dev){
+    if(!ctx->one_file_system || dev == root_dev) return 0;
+    for(size_t i=0;i<ctx->allowed_dev_count;i++){
+        if(ctx->allowed_devs[i] == dev) return 0;
+    }
+    return 1;
+}
+
+/* Return true if the open directory `fd` lives on a kernel pseudo filesystem (procfs, sysfs,
+   cgroup, ...) regardless of where it is mounted. devtmpfs and tmpfs are not included since
+   /run and many real trees use tmpfs; those are still caught by is_pseudo_path(). */
+static int fd_on_pseudo_fs(int fd){
+    static const unsigned long magics[] = {
+        PROC_SUPER_MAGIC, SYSFS_MAGIC, DEVPTS_SUPER_MAGIC,
+#ifdef CGROUP_SUPER_MAGIC
+        CGROUP_SUPER_MAGIC,
+#endif
+#ifdef CGROUP2_SUPER_MAGIC
+        CGROUP2_SUPER_MAGIC,
+#endif
+#ifdef DEBUGFS_MAGIC
+        DEBUGFS_MAGIC,
+#endif
+#ifdef SECURITYFS_MAGIC
+        SECURITYFS_MAGIC,
+#endif
+#ifdef TRACEFS_MAGIC
+        TRACEFS_MAGIC,
+#endif
+#ifdef BPF_FS_MAGIC
+        BPF_FS_MAGIC,
+#endif
+#ifdef PSTOREFS_MAGIC
+        PSTOREFS_MAGIC,
+#endif
+#ifdef EFIVARFS_MAGIC
+        EFIVARFS_MAGIC,
+#endif
+    };
+    struct statfs sfs;
+    if(fstatfs(fd, &sfs) != 0) return 0;
+    for(size_t i=0;i<sizeof(magics)/sizeof(magics[0]);i++){
+        if((unsigned long)sfs.f_type == magics[i]) return 1;
+    }
+    return 0;
 }
 
 static int register_devdir_root(char ***roots, size_t *count, const char *path){
@@ -5380,42 +5734,71 @@ static char *resolve_archive_path(const add_job_t *job, const char *src_path){
     return norm_src;
 }
 
-static void mark_entry_deleted_flag(index_t *idx, uint32_t id){
-    if(!idx) return;
-    for(uint32_t i=0;i<idx->n;i++){
-        if(idx->entries[i].id == id){
-            idx->entries[i].flags |= 4;
-            break;
-        }
+/* Entry names are read back without their leading slashes (entry_get_name()); strip them in place
+   from a name built by resolve_archive_path() before comparing it with stored names. */
+static char *strip_leading_slashes(char *name){
+    if(!name) return NULL;
+    size_t skip = 0;
+    while(name[skip] == '/') skip++;
+    if(skip) memmove(name, name + skip, strlen(name + skip) + 1);
+    return name;
+}
+
+/* True if archive entry `name` is `prefix` itself or lies below it (directory entries keep a
+   trailing slash, so "dir/" is below "dir"). */
+static int archive_path_under_any(const char *name, char **prefixes, size_t count){
+    for(size_t i=0;i<count;i++){
+        const char *p = prefixes[i];
+        size_t pl = strlen(p);
+        while(pl > 0 && p[pl-1] == '/') pl--;
+        if(pl == 0) return 1;
+        if(strncmp(name, p, pl) == 0 && (name[pl] == '\0' || name[pl] == '/')) return 1;
     }
+    return 0;
+}
+
+static void mark_entry_deleted_flag(index_t *idx, uint32_t id){
+    entry_t *e = entry_by_id(idx, id);
+    if(e) e->flags |= 4;
 }
 
 static int process_single_file(add_stream_ctx_t *ctx,
                                const char *src_path, const char *archive_path,
                                int clevel, const struct stat *st);
 static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job);
+static int plan_sink_add(struct extsort *sink, const char *src_path, const char *archive_path,
+                         int clevel, const struct stat *st);
 
-static int add_ignore_pattern(char ***patterns, size_t *count, const char *pattern){
-    if(!patterns || !count || !pattern || !pattern[0]) return -1;
-    char *dup = strdup(pattern);
+/* Append a copy of a non-empty string to a list. Returns 0, or -1 if it cannot be stored. */
+static int str_list_append(char ***list, size_t *count, const char *str){
+    if(!list || !count || !str || !str[0]) return -1;
+    char *dup = strdup(str);
     if(!dup) return -1;
-    char **tmp = realloc(*patterns, sizeof(char*) * (*count + 1));
+    char **tmp = realloc(*list, sizeof(char*) * (*count + 1));
     if(!tmp){
         free(dup);
         return -1;
     }
-    *patterns = tmp;
-    (*patterns)[*count] = dup;
+    *list = tmp;
+    (*list)[*count] = dup;
     (*count)++;
     return 0;
 }
 
-static void free_ignore_patterns(char **patterns, size_t count){
-    if(!patterns) return;
+static void str_list_free(char **list, size_t count){
+    if(!list) return;
     for(size_t i=0;i<count;i++){
-        free(patterns[i]);
+        free(list[i]);
     }
-    free(patterns);
+    free(list);
+}
+
+static int add_ignore_pattern(char ***patterns, size_t *count, const char *pattern){
+    return str_list_append(patterns, count, pattern);
+}
+
+static void free_ignore_patterns(char **patterns, size_t count){
+    str_list_free(patterns, count);
 }
 
 static int should_ignore_path(const char *src_path, const char *archive_path,
@@ -5467,27 +5850,51 @@ static void *spinner_fn(void *arg){
 
 
 
-static void xor_buf(unsigned char *buf, size_t len, const char *pwd){
-    if(!pwd || !pwd[0] || !buf || len==0) return;
+/* Keystream state for the password stream cipher. The key is derived once so a blob can be
+   processed in pieces; `pos` passed to xor_stream_apply is the byte offset inside the blob. */
+typedef struct {
+    int active;
+    int legacy;
+    const char *pwd;
+    size_t pwd_len;
+    unsigned char key[32];
+} xor_stream_t;
+
+static int xor_stream_init(xor_stream_t *xs, const char *pwd){
+    memset(xs, 0, sizeof(*xs));
+    if(!pwd || !pwd[0]) return 0;
+    xs->pwd = pwd;
+    xs->pwd_len = strlen(pwd);
     const char *legacy = getenv("BAAR_LEGACY_XOR");
     if(legacy && legacy[0]){
-        size_t plen = strlen(pwd);
-        for(size_t i=0;i<len;i++) buf[i] ^= (unsigned char)pwd[i%plen];
-        return;
+        xs->legacy = 1;
+        xs->active = 1;
+        return 0;
     }
 
     unsigned char salt_full[32];
-    SHA256_CTX shactx; SHA256_Init(&shactx); SHA256_Update(&shactx, pwd, strlen(pwd)); SHA256_Final(salt_full, &shactx);
+    SHA256_CTX shactx; SHA256_Init(&shactx); SHA256_Update(&shactx, pwd, xs->pwd_len); SHA256_Final(salt_full, &shactx);
     unsigned char salt[16]; memcpy(salt, salt_full, 16);
-    unsigned char key[32];
-    if(!PKCS5_PBKDF2_HMAC(pwd, (int)strlen(pwd), salt, 16, 100000, EVP_sha256(), 32, key)){
-        fprintf(stderr, "[BAAR] PBKDF2 failed\n"); return; }
+    if(!PKCS5_PBKDF2_HMAC(pwd, (int)xs->pwd_len, salt, 16, 100000, EVP_sha256(), 32, xs->key)){
+        OPENSSL_cleanse(salt_full, sizeof(salt_full));
+        fprintf(stderr, "[BAAR] PBKDF2 failed\n"); return -1; }
+    OPENSSL_cleanse(salt_full, sizeof(salt_full));
+    xs->active = 1;
+    return 0;
+}
+
+static void xor_stream_apply(xor_stream_t *xs, unsigned char *buf, size_t len, uint64_t pos){
+    if(!xs || !xs->active || !buf || len==0) return;
+    if(xs->legacy){
+        for(size_t i=0;i<len;i++) buf[i] ^= (unsigned char)xs->pwd[(pos + i) % xs->pwd_len];
+        return;
+    }
 
-    uint64_t counter = 0; size_t offset = 0; unsigned char ks[32];
+    uint64_t counter = pos / 32; size_t skip = (size_t)(pos % 32); size_t offset = 0; unsigned char ks[32];
     while(offset < len){
         HMAC_CTX *hctx = HMAC_CTX_new();
         if(!hctx){ fprintf(stderr, "[BAAR] HMAC alloc failed\n"); return; }
-        if(!HMAC_Init_ex(hctx, key, 32, EVP_sha256(), NULL)){
+        if(!HMAC_Init_ex(hctx, xs->key, 32, EVP_sha256(), NULL)){
             HMAC_CTX_free(hctx); fprintf(stderr, "[BAAR] HMAC init failed\n"); return; }
         const char marker[] = "BAARSTREAM";
         HMAC_Update(hctx, (unsigned char*)marker, sizeof(marker)-1);
@@ -5497,149 +5904,935 @@ static void xor_buf(unsigned char *buf, size_t len, const char *pwd){
         unsigned int outl=0; HMAC_Final(hctx, ks, &outl); HMAC_CTX_free(hctx);
         if(outl < 32){
             SHA256_CTX sh2; SHA256_Init(&sh2); SHA256_Update(&sh2, ks, outl); SHA256_Final(ks, &sh2); outl = 32; }
-        size_t to_xor = (len - offset) < 32 ? (len - offset) : 32;
-        for(size_t j=0;j<to_xor;j++) buf[offset + j] ^= ks[j];
-        offset += to_xor; counter++;
+        size_t avail = 32 - skip;
+        size_t to_xor = (len - offset) < avail ? (len - offset) : avail;
+        for(size_t j=0;j<to_xor;j++) buf[offset + j] ^= ks[skip + j];
+        offset += to_xor; counter++; skip = 0;
     }
+}
 
-    OPENSSL_cleanse(key, sizeof(key));
-    OPENSSL_cleanse(salt_full, sizeof(salt_full));
+static void xor_stream_clear(xor_stream_t *xs){
+    if(!xs) return;
+    OPENSSL_cleanse(xs->key, sizeof(xs->key));
+    xs->active = 0;
 }
 
-static int stream_copy_file_with_crc(const char *src_path, FILE *dest, const char *pwd,
-                                     uint64_t *bytes_written, uint32_t *crc_out){
-    FILE *src = fopen(src_path, "rb");
-    if(!src) return -1;
-    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
-    if(!chunk){
-        fclose(src);
-        errno = ENOMEM;
-        return -1;
-    }
-    uint32_t crc = crc32(0L, Z_NULL, 0);
-    uint64_t total = 0;
-    while(1){
-        size_t readn = fread(chunk, 1, BAAR_STREAM_CHUNK_SIZE, src);
-        if(readn == 0){
-            if(ferror(src)){
-                int err = errno;
-                free(chunk);
-                fclose(src);
-                errno = err;
-                return -1;
-            }
-            break;
-        }
-        crc = crc32(crc, chunk, readn);
-        if(pwd && pwd[0]){ xor_buf(chunk, readn, pwd); }
-        size_t written = fwrite(chunk, 1, readn, dest);
-        if(written != readn){
-            int err = errno;
-            free(chunk);
-            fclose(src);
-            errno = err;
-            return -1;
-        }
-        total += readn;
-    }
-    free(chunk);
-    fclose(src);
-    if(bytes_written) *bytes_written = total;
-    if(crc_out) *crc_out = crc;
-    return 0;
+static void xor_buf(unsigned char *buf, size_t len, const char *pwd){
+    if(!pwd || !pwd[0] || !buf || len==0) return;
+    xor_stream_t xs;
+    if(xor_stream_init(&xs, pwd) != 0) return;
+    xor_stream_apply(&xs, buf, len, 0);
+    xor_stream_clear(&xs);
 }
 
-static index_t load_index(FILE *f){
-    index_t idx = {0};
-    fseek(f,0,SEEK_SET);
-    char magic[8]={0};
-    fread(magic,1,8,f);
-    if(strncmp(magic,MAGIC,6)!=0){ return idx; }
-    uint64_t index_offset = read_u64(f);
-    if(index_offset==0){ return idx; }
-    fseek(f,index_offset,SEEK_SET);
-    uint32_t n = read_u32(f);
-    idx.n = n;
-    idx.entries = calloc(n,sizeof(entry_t));
-    /* duplicate file handle so we can lazy-load names/meta later */
-    idx.archive_fp = NULL;
-    int fd = fileno(f);
-    if(fd >= 0){
-        int dupfd = dup(fd);
-        if(dupfd >= 0){ idx.archive_fp = fdopen(dupfd, "rb"); }
-    }
-    uint32_t maxid=0;
-    for(uint32_t i=0;i<n;i++){
-        entry_t *e = &idx.entries[i];
-        e->id = read_u32(f);
-    uint16_t namelen = read_u16(f);
-    e->name = NULL; e->name_len = namelen; e->name_off = ftell(f);
-    if(namelen) fseek(f, namelen, SEEK_CUR);
-    /* strip leading slashes so UI shows top-level folders like 'home' instead of '/' */
-    if(e->name && e->name[0] == '/'){
-        char *tmp = e->name;
-        while(tmp[0] == '/') tmp++;
-        if(tmp != e->name){
-            char *newn = strdup(tmp);
-            free(e->name);
-            e->name = newn ? newn : strdup("");
-        }
+/* crc32() takes a uInt length; feed large buffers in pieces so entries over 4 GiB hash correctly. */
+static uint32_t crc32_buf(uint32_t crc, const unsigned char *buf, size_t len){
+    while(len > 0){
+        uInt piece = len > (1u << 30) ? (1u << 30) : (uInt)len;
+        crc = (uint32_t)crc32(crc, buf, piece);
+        buf += piece;
+        len -= piece;
     }
-    e->flags = fgetc(f);
-    e->comp_level = fgetc(f);
-    e->data_offset = read_u64(f);
-    e->comp_size = read_u64(f);
-    e->uncomp_size = read_u64(f);
-    e->crc32 = read_u32(f);
+    return crc;
+}
 
-    e->mode = read_u32(f);
-    e->uid = read_u32(f);
-    e->gid = read_u32(f);
-    e->mtime = read_u64(f);
+/* Small sources on the buffered add path are mapped rather than read into the heap. A file
+   truncated while mapped raises SIGBUS on the missing pages; the guard below turns that into
+   an ordinary read error for the entry being added. */
+static __thread sigjmp_buf *g_source_map_guard = NULL;
+/* The handler is installed while at least one thread is inside a guarded section and the
+   previous disposition is put back when the last one leaves. */
+static pthread_mutex_t g_source_map_guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_source_map_guard_users = 0;
+static struct sigaction g_source_map_prev_sigbus;
+
+static void source_map_sigbus(int sig, siginfo_t *si, void *uc){
+    (void)si; (void)uc;
+    if(g_source_map_guard) siglongjmp(*g_source_map_guard, 1);
+    /* not ours: hand the re-raised fault to the previous disposition */
+    sigaction(sig, &g_source_map_prev_sigbus, NULL);
+}
 
-    e->meta_n = read_u32(f);
-    if(e->meta_n){
-        e->meta = NULL; /* not loaded yet */
-        e->meta_off = ftell(f);
-        /* skip meta contents */
-        for(uint32_t m=0;m<e->meta_n;m++){
-            uint16_t klen = read_u16(f); if(klen) fseek(f, klen, SEEK_CUR);
-            uint16_t vlen = read_u16(f); if(vlen) fseek(f, vlen, SEEK_CUR);
-        }
-    } else { e->meta = NULL; e->meta_off = 0; }
-    if(e->id>maxid) maxid=e->id;
-    }
-    idx.next_id = maxid+1;
-    return idx;
+/* Enter a guarded section; call sigsetjmp(*jb, 1) right after. */
+static void source_map_guard_begin(sigjmp_buf *jb){
+    pthread_mutex_lock(&g_source_map_guard_lock);
+    if(g_source_map_guard_users++ == 0){
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = source_map_sigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &g_source_map_prev_sigbus);
+    }
+    pthread_mutex_unlock(&g_source_map_guard_lock);
+    g_source_map_guard = jb;
 }
 
+/* Leave the guarded section of this thread, if any; also used on the jump path. */
+static void source_map_guard_end(void){
+    if(!g_source_map_guard) return;
+    g_source_map_guard = NULL;
+    pthread_mutex_lock(&g_source_map_guard_lock);
+    if(--g_source_map_guard_users == 0) sigaction(SIGBUS, &g_source_map_prev_sigbus, NULL);
+    pthread_mutex_unlock(&g_source_map_guard_lock);
+}
 
-static index_t load_libarchive_index(const char *path){
-    index_t idx = {0};
+static unsigned char *map_source_file(const char *path, size_t len){
+    if(len == 0) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) return NULL;
+    madvise(p, len, MADV_SEQUENTIAL);
+    return (unsigned char*)p;
+}
 
-    struct archive *a = archive_read_new();
-    archive_read_support_filter_all(a);
-    archive_read_support_format_all(a);
+/* --dedup: whole-file content index. Entries stored with --dedup carry BAAR_SHA256 (hex of the
+   uncompressed content, keyed with the derived password key when encrypting so the clear index
+   does not give away plaintext digests and only runs with the same password match); a later file with the same size and digest becomes a header-only entry
+   pointing at the existing blob. Sizes are kept in a separate set so files whose size matches
+   nothing are never hashed ahead of being stored. */
+typedef struct {
+    unsigned char sha[32];
+    uint64_t size;
+    uint32_t slot; /* index into idx->entries */
+    int used;
+} dedup_slot_t;
+
+typedef struct dedup_index {
+    dedup_slot_t *slots;
+    size_t cap;
+    size_t count;
+    uint64_t *sizes; /* open addressing, 0 = empty */
+    size_t size_cap;
+    size_t size_count;
+    xor_stream_t xs; /* password key of this run; inactive without a password */
+} dedup_index_t;
+
+/* Turn the SHA-256 of the plain content into the digest stored and looked up for this run: with
+   a password it becomes SHA-256(key || digest), as cdc_chunk_key() keys chunks. */
+static void dedup_key_digest(const dedup_index_t *dd, unsigned char *sha){
+    if(!dd || !dd->xs.active) return;
+    SHA256_CTX sc;
+    SHA256_Init(&sc);
+    if(dd->xs.legacy) SHA256_Update(&sc, dd->xs.pwd, dd->xs.pwd_len);
+    else SHA256_Update(&sc, dd->xs.key, sizeof(dd->xs.key));
+    SHA256_Update(&sc, sha, 32);
+    SHA256_Final(sha, &sc);
+}
 
+static size_t dedup_size_hash(uint64_t v, size_t cap){
+    v ^= v >> 33; v *= 0xff51afd7ed558ccdULL; v ^= v >> 33;
+    return (size_t)v & (cap - 1);
+}
 
-    if (g_archive_password) {
-        archive_read_add_passphrase(a, g_archive_password);
+static int dedup_has_size(const dedup_index_t *dd, uint64_t size){
+    if(!dd || !dd->size_cap || size == 0) return 0;
+    for(size_t i = dedup_size_hash(size, dd->size_cap); dd->sizes[i]; i = (i + 1) & (dd->size_cap - 1)){
+        if(dd->sizes[i] == size) return 1;
+    }
+    return 0;
+}
 
-        g_archive_was_encrypted = 1;
+static dedup_slot_t *dedup_probe(dedup_slot_t *slots, size_t cap, const unsigned char *sha, uint64_t size){
+    size_t i;
+    memcpy(&i, sha, sizeof(i));
+    for(i &= cap - 1; slots[i].used; i = (i + 1) & (cap - 1)){
+        if(slots[i].size == size && memcmp(slots[i].sha, sha, 32) == 0) break;
     }
+    return &slots[i];
+}
 
+static int dedup_insert(dedup_index_t *dd, const unsigned char *sha, uint64_t size, uint32_t slot){
+    if(size == 0) return 0;
+    if((dd->count + 1) * 2 > dd->cap){
+        size_t ncap = dd->cap ? dd->cap * 2 : 1024;
+        dedup_slot_t *ns = calloc(ncap, sizeof(*ns));
+        if(!ns) return -1;
+        for(size_t i=0;i<dd->cap;i++){
+            if(dd->slots[i].used) *dedup_probe(ns, ncap, dd->slots[i].sha, dd->slots[i].size) = dd->slots[i];
+        }
+        free(dd->slots);
+        dd->slots = ns;
+        dd->cap = ncap;
+    }
+    dedup_slot_t *s = dedup_probe(dd->slots, dd->cap, sha, size);
+    if(s->used) return 0; /* keep the first copy */
+    memcpy(s->sha, sha, 32);
+    s->size = size;
+    s->slot = slot;
+    s->used = 1;
+    dd->count++;
+
+    if(dedup_has_size(dd, size)) return 0;
+    if((dd->size_count + 1) * 2 > dd->size_cap){
+        size_t ncap = dd->size_cap ? dd->size_cap * 2 : 1024;
+        uint64_t *ns = calloc(ncap, sizeof(*ns));
+        if(!ns) return -1;
+        for(size_t i=0;i<dd->size_cap;i++){
+            if(!dd->sizes[i]) continue;
+            size_t j = dedup_size_hash(dd->sizes[i], ncap);
+            while(ns[j]) j = (j + 1) & (ncap - 1);
+            ns[j] = dd->sizes[i];
+        }
+        free(dd->sizes);
+        dd->sizes = ns;
+        dd->size_cap = ncap;
+    }
+    size_t j = dedup_size_hash(size, dd->size_cap);
+    while(dd->sizes[j]) j = (j + 1) & (dd->size_cap - 1);
+    dd->sizes[j] = size;
+    dd->size_count++;
+    return 0;
+}
 
-    int open_r = archive_read_open_filename(a, path, 10240);
-    if (open_r != ARCHIVE_OK) {
-        archive_read_free(a);
+/* read_batch_flush() reordered the `n` entries from slot `first` on: the one that was at
+   first + i is now at moved_to[i]. */
+static void dedup_remap(dedup_index_t *dd, uint32_t first, size_t n, const uint32_t *moved_to){
+    for(size_t i=0; dd && i<dd->cap; i++){
+        dedup_slot_t *s = &dd->slots[i];
+        if(s->used && s->slot >= first && s->slot - first < n) s->slot = moved_to[s->slot - first];
+    }
+}
 
-        if (g_main_window && !g_archive_password) {
-            if (show_password_dialog("Archive may be password-protected. Enter password to open or Cancel to skip.")) {
-                if (g_archive_password) {
-                    fprintf(stderr, "[DEBUG] load_libarchive_index: user provided a password (len=%zu)\n", strlen(g_archive_password));
-                } else {
-                    fprintf(stderr, "[DEBUG] load_libarchive_index: show_password_dialog returned true but no password set\n");
-                }
+static void sha256_hex(const unsigned char *sha, char *out){
+    static const char hx[] = "0123456789abcdef";
+    for(int i=0;i<32;i++){ out[i*2] = hx[sha[i] >> 4]; out[i*2+1] = hx[sha[i] & 15]; }
+    out[64] = '\0';
+}
+
+static int sha256_parse_hex(const char *hex, unsigned char *sha){
+    if(!hex || strlen(hex) != 64) return -1;
+    for(int i=0;i<32;i++){
+        unsigned int b;
+        if(!isxdigit((unsigned char)hex[i*2]) || !isxdigit((unsigned char)hex[i*2+1]) ||
+           sscanf(hex + i*2, "%2x", &b) != 1) return -1;
+        sha[i] = (unsigned char)b;
+    }
+    return 0;
+}
+
+/* Return the entry holding a blob with this content, usable with the given encryption flag.
+   The entry's own digest is checked too, so a slot that no longer points at the blob it was
+   recorded for can only miss, never hand out another file's data. */
+static entry_t *dedup_lookup(dedup_index_t *dd, index_t *idx, const unsigned char *sha, uint64_t size, uint8_t enc_flag){
+    if(!dd || !dd->cap) return NULL;
+    dedup_slot_t *s = dedup_probe(dd->slots, dd->cap, sha, size);
+    if(!s->used || s->slot >= idx->n) return NULL;
+    entry_t *m = &idx->entries[s->slot];
+    if(m->uncomp_size != size || (m->flags & 2) != enc_flag) return NULL;
+    /* the blob of a delta is not the content; references and volume entries have none here */
+    if(m->flags & (16 | 32 | 64)) return NULL;
+    unsigned char stored[32];
+    if(sha256_parse_hex(entry_get_meta_val(idx, m, "BAAR_SHA256"), stored) != 0 ||
+       memcmp(stored, sha, 32) != 0) return NULL;
+    return m;
+}
+
+static dedup_index_t *dedup_index_build(index_t *idx, const char *pwd){
+    dedup_index_t *dd = calloc(1, sizeof(*dd));
+    if(!dd) return NULL;
+    if(xor_stream_init(&dd->xs, pwd) != 0){ free(dd); return NULL; }
+    for(uint32_t i=0;i<idx->n;i++){
+        entry_t *e = &idx->entries[i];
+        if(e->uncomp_size == 0 || e->meta_n == 0) continue;
+        /* deltas, --base references and volume entries carry the digest of their content, but
+           no blob in this archive that holds it */
+        if(e->flags & (16 | 32 | 64)) continue;
+        unsigned char sha[32];
+        if(sha256_parse_hex(entry_get_meta_val(idx, e, "BAAR_SHA256"), sha) == 0){
+            dedup_insert(dd, sha, e->uncomp_size, i);
+        }
+    }
+    return dd;
+}
+
+static void dedup_index_free(dedup_index_t *dd){
+    if(!dd) return;
+    xor_stream_clear(&dd->xs);
+    free(dd->slots);
+    free(dd->sizes);
+    free(dd);
+}
+
+/* --cdc: content-defined chunking. A chunked entry (flag 8) stores a manifest as its blob: the
+   magic "BCD1", a u32 chunk count and one record per chunk (32-byte key, u64 offset, u32 stored
+   size, u32 plain size, u8 flags: 1 = compressed). Chunk data lives elsewhere in the archive and
+   may be shared by any number of manifests. The key is the SHA-256 of the plain chunk, prefixed
+   with the derived password key for encrypted entries, so the manifest itself can stay plain
+   (rebuilds do not need the password) without revealing chunk hashes. */
+#define BAAR_CDC_MAGIC "BCD1"
+#define BAAR_CDC_HEADER_SIZE 8
+#define BAAR_CDC_RECORD_SIZE 49
+
+static uint64_t g_cdc_gear[256];
+static pthread_once_t g_cdc_gear_once = PTHREAD_ONCE_INIT;
+
+/* The gear table is part of the format: changing it moves every cut point. */
+static void cdc_gear_init(void){
+    uint64_t x = 0x6261617263646331ULL; /* "baarcdc1" */
+    for(int i=0;i<256;i++){
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g_cdc_gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* FastCDC cut point in p[0..n): no cut before BAAR_CDC_MIN, a stricter mask up to the average
+   size and a looser one after it, forced at BAAR_CDC_MAX. The masks use the top bits of the
+   gear hash, which depend on the last 64 bytes. n < BAAR_CDC_MAX only at end of file. */
+static size_t cdc_cut(const unsigned char *p, size_t n){
+    const uint64_t mask_s = ~0ULL << (64 - 18);
+    const uint64_t mask_l = ~0ULL << (64 - 14);
+    if(n <= BAAR_CDC_MIN) return n;
+    size_t max = n < BAAR_CDC_MAX ? n : BAAR_CDC_MAX;
+    size_t normal = max < BAAR_CDC_AVG ? max : BAAR_CDC_AVG;
+    uint64_t h = 0;
+    size_t i = BAAR_CDC_MIN;
+    for(; i < normal; i++){
+        h = (h << 1) + g_cdc_gear[p[i]];
+        if(!(h & mask_s)) return i + 1;
+    }
+    for(; i < max; i++){
+        h = (h << 1) + g_cdc_gear[p[i]];
+        if(!(h & mask_l)) return i + 1;
+    }
+    return max;
+}
+
+typedef struct {
+    unsigned char key[32];
+    uint64_t offset;
+    uint32_t comp_size;
+    uint32_t size;
+    uint8_t flags; /* 1 = compressed, 2 = encrypted (index only; taken from the entry) */
+} cdc_chunk_t;
+
+static void cdc_record_put(unsigned char *rec, const cdc_chunk_t *c){
+    memcpy(rec, c->key, 32);
+    for(int i=0;i<8;i++) rec[32 + i] = (unsigned char)(c->offset >> (8 * i));
+    for(int i=0;i<4;i++) rec[40 + i] = (unsigned char)(c->comp_size >> (8 * i));
+    for(int i=0;i<4;i++) rec[44 + i] = (unsigned char)(c->size >> (8 * i));
+    rec[48] = c->flags & 1;
+}
+
+static void cdc_record_get(const unsigned char *rec, cdc_chunk_t *c){
+    memcpy(c->key, rec, 32);
+    c->offset = 0; c->comp_size = 0; c->size = 0;
+    for(int i=0;i<8;i++) c->offset |= (uint64_t)rec[32 + i] << (8 * i);
+    for(int i=0;i<4;i++) c->comp_size |= (uint32_t)rec[40 + i] << (8 * i);
+    for(int i=0;i<4;i++) c->size |= (uint32_t)rec[44 + i] << (8 * i);
+    c->flags = rec[48] & 1;
+}
+
+/* Validate a manifest blob and return its chunk count, or -1 if malformed. */
+static long cdc_manifest_count(const unsigned char *m, size_t len){
+    if(len < BAAR_CDC_HEADER_SIZE || memcmp(m, BAAR_CDC_MAGIC, 4) != 0) return -1;
+    uint32_t n = (uint32_t)m[4] | (uint32_t)m[5] << 8 | (uint32_t)m[6] << 16 | (uint32_t)m[7] << 24;
+    if((uint64_t)n * BAAR_CDC_RECORD_SIZE != len - BAAR_CDC_HEADER_SIZE) return -1;
+    return (long)n;
+}
+
+/* Read the manifest of chunked entry `e` into a malloc'd buffer. Returns the chunk count or -1. */
+static long cdc_manifest_read(int fd, const entry_t *e, unsigned char **out){
+    *out = NULL;
+    if(e->comp_size < BAAR_CDC_HEADER_SIZE || e->comp_size > SIZE_MAX) return -1;
+    unsigned char *m = malloc((size_t)e->comp_size);
+    if(!m) return -1;
+    long n = -1;
+    if(pread_full(fd, m, (size_t)e->comp_size, e->data_offset) == 0) n = cdc_manifest_count(m, (size_t)e->comp_size);
+    if(n < 0){ free(m); return -1; }
+    *out = m;
+    return n;
+}
+
+/* Chunks stored in the archive, keyed by chunk key; built from every chunked entry's manifest
+   (deleted ones too: their chunks stay in the file until a rebuild). */
+typedef struct cdc_index {
+    cdc_chunk_t *items;
+    uint8_t *used;
+    size_t cap;
+    size_t count;
+    xor_stream_t xs; /* keystream of the current run's password (inactive without one) */
+    size_t new_chunks;
+    size_t reused_chunks;
+    uint64_t reused_bytes;
+} cdc_index_t;
+
+static size_t cdc_index_probe(const cdc_index_t *ci, const unsigned char *key){
+    size_t i;
+    memcpy(&i, key, sizeof(i));
+    for(i &= ci->cap - 1; ci->used[i]; i = (i + 1) & (ci->cap - 1)){
+        if(memcmp(ci->items[i].key, key, 32) == 0) break;
+    }
+    return i;
+}
+
+static int cdc_index_insert(cdc_index_t *ci, const cdc_chunk_t *c){
+    if((ci->count + 1) * 2 > ci->cap){
+        size_t ncap = ci->cap ? ci->cap * 2 : 4096;
+        cdc_index_t grown = { .cap = ncap };
+        grown.items = malloc(ncap * sizeof(*grown.items));
+        grown.used = calloc(ncap, 1);
+        if(!grown.items || !grown.used){ free(grown.items); free(grown.used); return -1; }
+        for(size_t i=0;i<ci->cap;i++){
+            if(!ci->used[i]) continue;
+            size_t j = cdc_index_probe(&grown, ci->items[i].key);
+            grown.items[j] = ci->items[i];
+            grown.used[j] = 1;
+        }
+        free(ci->items);
+        free(ci->used);
+        ci->items = grown.items;
+        ci->used = grown.used;
+        ci->cap = ncap;
+    }
+    size_t i = cdc_index_probe(ci, c->key);
+    if(ci->used[i] && !(ci->items[i].flags & 0x80)) return 0;
+    if(!ci->used[i]) ci->count++;
+    ci->items[i] = *c;
+    ci->used[i] = 1;
+    return 0;
+}
+
+static const cdc_chunk_t *cdc_index_find(const cdc_index_t *ci, const unsigned char *key, uint8_t enc_flag){
+    if(!ci || !ci->cap) return NULL;
+    size_t i = cdc_index_probe(ci, key);
+    if(!ci->used[i] || (ci->items[i].flags & 0x80) || (ci->items[i].flags & 2) != enc_flag) return NULL;
+    return &ci->items[i];
+}
+
+/* Drop chunks at or past `offset` after the archive was truncated there. Entries stay in
+   their probe chains but point nowhere usable, so they are only marked stale. */
+static void cdc_index_forget_from(cdc_index_t *ci, uint64_t offset){
+    for(size_t i=0; ci && i<ci->cap; i++){
+        if(ci->used[i] && ci->items[i].offset >= offset){
+            ci->items[i].flags |= 0x80;
+        }
+    }
+}
+
+static cdc_index_t *cdc_index_build(FILE *f, index_t *idx, const char *pwd){
+    pthread_once(&g_cdc_gear_once, cdc_gear_init);
+    cdc_index_t *ci = calloc(1, sizeof(*ci));
+    if(!ci) return NULL;
+    if(xor_stream_init(&ci->xs, pwd) != 0){ free(ci); return NULL; }
+    for(uint32_t i=0;i<idx->n;i++){
+        entry_t *e = &idx->entries[i];
+        if(!(e->flags & 8)) continue;
+        unsigned char *m = NULL;
+        long n = cdc_manifest_read(fileno(f), e, &m);
+        for(long k=0;k<n;k++){
+            cdc_chunk_t c;
+            cdc_record_get(m + BAAR_CDC_HEADER_SIZE + (size_t)k * BAAR_CDC_RECORD_SIZE, &c);
+            c.flags |= e->flags & 2;
+            cdc_index_insert(ci, &c);
+        }
+        free(m);
+    }
+    return ci;
+}
+
+static void cdc_index_free(cdc_index_t *ci){
+    if(!ci) return;
+    free(ci->items);
+    free(ci->used);
+    xor_stream_clear(&ci->xs);
+    free(ci);
+}
+
+/* Chunk key: SHA-256 of the plain data, preceded by the derived password key when encrypting. */
+static void cdc_chunk_key(const cdc_index_t *ci, const unsigned char *data, size_t len, unsigned char *key){
+    if(!ci->xs.active){
+        SHA256(data, len, key);
+        return;
+    }
+    SHA256_CTX sc;
+    SHA256_Init(&sc);
+    if(ci->xs.legacy) SHA256_Update(&sc, ci->xs.pwd, ci->xs.pwd_len);
+    else SHA256_Update(&sc, ci->xs.key, sizeof(ci->xs.key));
+    SHA256_Update(&sc, data, len);
+    SHA256_Final(key, &sc);
+}
+
+/* SHA-256 of a mapped source under the SIGBUS guard. Returns 0, or -1 if the file shrank. */
+static int sha256_mapped(const unsigned char *map, size_t len, unsigned char *sha){
+    sigjmp_buf jb;
+    source_map_guard_begin(&jb);
+    if(sigsetjmp(jb, 1) != 0){
+        source_map_guard_end();
+        return -1;
+    }
+    SHA256(map, len, sha);
+    source_map_guard_end();
+    return 0;
+}
+
+/* Write one blob from a mapped source: CRC and compression read the mapping directly and
+   stored data is written from it without a heap copy (through a bounce chunk when it has to
+   be encrypted). On a read or write failure the archive is truncated back to data_offset.
+   sha_out, if not NULL, receives the SHA-256 of the source. Returns 0 on success, 2 if the source
+   shrank while being read or 1 on a write error (both already reported). */
+static int write_mapped_blob(FILE *dst, const char *src_path, const unsigned char *map, size_t len,
+                             int clevel, const char *pwd, uint64_t data_offset,
+                             uint32_t *crc_out, size_t *final_out, int *compressed_out,
+                             unsigned char *sha_out){
+    sigjmp_buf jb;
+    unsigned char *volatile out = NULL;
+    unsigned char *volatile chunk = NULL;
+    xor_stream_t xs;
+    memset(&xs, 0, sizeof(xs));
+    deflate_state_t zst; /* kept here so a fault mid-deflate can release the stream */
+    memset(&zst, 0, sizeof(zst));
+    volatile int shrank = 0;
+
+    source_map_guard_begin(&jb);
+    if(sigsetjmp(jb, 1) != 0){
+        source_map_guard_end();
+        deflate_state_release(&zst);
+        free(out);
+        free(chunk);
+        xor_stream_clear(&xs);
+        fprintf(stderr, "Warning: %s shrank while being read; skipped\n", src_path);
+        shrank = 1;
+        goto rollback;
+    }
+
+    if(sha_out) SHA256(map, len, sha_out);
+    uint32_t crc = crc32_buf(0, map, len);
+    size_t out_sz = 0;
+    if(clevel > 0){
+        unsigned char *tmpout = NULL; size_t tmpoutsz = 0;
+        if(compress_data_state(&zst, clevel, map, len, &tmpout, &tmpoutsz) == 0){
+            if(tmpoutsz < len){ out = tmpout; out_sz = tmpoutsz; }
+            else free(tmpout);
+        }
+    }
+
+    if(out){
+        source_map_guard_end();
+        if(pwd && pwd[0]) xor_buf(out, out_sz, pwd);
+        size_t written = fwrite(out, 1, out_sz, dst);
+        free(out);
+        if(written != out_sz){
+            fprintf(stderr, "Write error while adding %s\n", src_path);
+            goto rollback;
+        }
+        *crc_out = crc; *final_out = out_sz; *compressed_out = 1;
+        return 0;
+    }
+
+    if(pwd && pwd[0]){
+        chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+        if(!chunk || xor_stream_init(&xs, pwd) != 0){
+            source_map_guard_end();
+            free(chunk);
+            fprintf(stderr, "Cannot process %s: %s\n", src_path, strerror(ENOMEM));
+            goto rollback;
+        }
+        for(size_t off = 0; off < len; off += BAAR_STREAM_CHUNK_SIZE){
+            size_t n = len - off < BAAR_STREAM_CHUNK_SIZE ? len - off : BAAR_STREAM_CHUNK_SIZE;
+            memcpy(chunk, map + off, n);
+            xor_stream_apply(&xs, chunk, n, off);
+            if(fwrite(chunk, 1, n, dst) != n){
+                source_map_guard_end();
+                xor_stream_clear(&xs);
+                free(chunk);
+                fprintf(stderr, "Write error while adding %s\n", src_path);
+                goto rollback;
+            }
+        }
+        source_map_guard_end();
+        xor_stream_clear(&xs);
+        free(chunk);
+    } else {
+        /* write(2) straight from the mapping: a page lost to truncation makes the kernel
+           return EFAULT instead of raising SIGBUS, so stdio is never interrupted mid-call */
+        source_map_guard_end();
+        if(fflush(dst) != 0){
+            fprintf(stderr, "Write error while adding %s\n", src_path);
+            goto rollback;
+        }
+        int fd = fileno(dst);
+        size_t off = 0;
+        while(off < len){
+            ssize_t w = pwrite(fd, map + off, len - off, (off_t)(data_offset + off));
+            if(w < 0 && errno == EINTR) continue;
+            if(w <= 0){
+                if(w < 0 && errno == EFAULT){
+                    fprintf(stderr, "Warning: %s shrank while being read; skipped\n", src_path);
+                    shrank = 1;
+                } else {
+                    fprintf(stderr, "Write error while adding %s\n", src_path);
+                }
+                goto rollback;
+            }
+            off += (size_t)w;
+        }
+        fseeko(dst, (off_t)(data_offset + len), SEEK_SET);
+    }
+    *crc_out = crc; *final_out = len; *compressed_out = 0;
+    return 0;
+
+rollback:
+    fflush(dst);
+    if(ftruncate(fileno(dst), (off_t)data_offset) != 0){ /* stale bytes stay unreferenced until compaction */ }
+    fseeko(dst, (off_t)data_offset, SEEK_SET);
+    return shrank ? 2 : 1;
+}
+
+/* --io-timeout: source files are opened and read by a helper thread so that a call which
+   hangs (a dead NFS server, a stuck FUSE daemon) can be abandoned. The worker owns its fd,
+   path copy and chunk buffer; an abandoned worker frees them itself once the blocked call
+   finally returns, so the caller never touches memory the stuck thread may still write. */
+enum { IO_OP_NONE = 0, IO_OP_OPEN, IO_OP_READ };
+
+typedef struct io_worker {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int refs;  /* owner + worker thread */
+    int quit;
+    int op;    /* IO_OP_* pending, IO_OP_NONE when idle */
+    int done;
+    char *path;
+    int fd;
+    off_t off;
+    size_t len;
+    unsigned char *buf;
+    ssize_t result;
+    int err;
+} io_worker_t;
+
+static void io_worker_free(io_worker_t *w){
+    if(w->fd >= 0) close(w->fd);
+    free(w->path);
+    free(w->buf);
+    pthread_mutex_destroy(&w->mu);
+    pthread_cond_destroy(&w->cv);
+    free(w);
+}
+
+static void *io_worker_main(void *arg){
+    io_worker_t *w = arg;
+    pthread_mutex_lock(&w->mu);
+    for(;;){
+        while(w->op == IO_OP_NONE && !w->quit) pthread_cond_wait(&w->cv, &w->mu);
+        if(w->quit) break;
+        int op = w->op;
+        pthread_mutex_unlock(&w->mu);
+        ssize_t r = 0;
+        int err = 0;
+        if(op == IO_OP_OPEN){
+            if(w->fd >= 0) close(w->fd);
+            w->fd = open(w->path, O_RDONLY | O_CLOEXEC);
+            r = w->fd < 0 ? -1 : 0;
+            err = errno;
+        } else {
+            do { r = pread(w->fd, w->buf, w->len, w->off); } while(r < 0 && errno == EINTR);
+            err = errno;
+        }
+        pthread_mutex_lock(&w->mu);
+        w->result = r;
+        w->err = err;
+        w->op = IO_OP_NONE;
+        w->done = 1;
+        pthread_cond_broadcast(&w->cv);
+    }
+    int last = --w->refs == 0;
+    pthread_mutex_unlock(&w->mu);
+    if(last) io_worker_free(w);
+    return NULL;
+}
+
+static io_worker_t *io_worker_start(void){
+    io_worker_t *w = calloc(1, sizeof(*w));
+    if(!w) return NULL;
+    w->fd = -1;
+    w->buf = malloc(BAAR_STREAM_CHUNK_SIZE);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&w->mu, NULL);
+    pthread_cond_init(&w->cv, &ca);
+    pthread_condattr_destroy(&ca);
+    w->refs = 2;
+    pthread_attr_t ta;
+    pthread_attr_init(&ta);
+    pthread_attr_setdetachstate(&ta, PTHREAD_CREATE_DETACHED);
+    pthread_t th;
+    int rc = w->buf ? pthread_create(&th, &ta, io_worker_main, w) : ENOMEM;
+    pthread_attr_destroy(&ta);
+    if(rc != 0){
+        io_worker_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* Drop the owner's reference. A worker blocked in open/pread exits when that call returns. */
+static void io_worker_release(io_worker_t *w){
+    if(!w) return;
+    pthread_mutex_lock(&w->mu);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->cv);
+    int last = --w->refs == 0;
+    pthread_mutex_unlock(&w->mu);
+    if(last) io_worker_free(w);
+}
+
+/* Run the prepared request and wait up to timeout_ms for it.
+   Returns the call's result (errno set on -1), or -2 with errno = ETIMEDOUT. */
+static ssize_t io_worker_run(io_worker_t *w, int op, int timeout_ms){
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){ deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&w->mu);
+    w->op = op;
+    w->done = 0;
+    pthread_cond_broadcast(&w->cv);
+    while(!w->done){
+        if(pthread_cond_timedwait(&w->cv, &w->mu, &deadline) == ETIMEDOUT && !w->done){
+            pthread_mutex_unlock(&w->mu);
+            errno = ETIMEDOUT;
+            return -2;
+        }
+    }
+    ssize_t r = w->result;
+    int err = w->err;
+    pthread_mutex_unlock(&w->mu);
+    if(r < 0) errno = err;
+    return r;
+}
+
+static int io_worker_open(io_worker_t *w, const char *path, int timeout_ms){
+    char *copy = strdup(path);
+    if(!copy){ errno = ENOMEM; return -1; }
+    free(w->path);
+    w->path = copy;
+    return (int)io_worker_run(w, IO_OP_OPEN, timeout_ms);
+}
+
+/* pread through the worker; at most BAAR_STREAM_CHUNK_SIZE bytes per call. */
+static ssize_t io_worker_pread(io_worker_t *w, unsigned char *dst, size_t len, uint64_t off, int timeout_ms){
+    if(len > BAAR_STREAM_CHUNK_SIZE) len = BAAR_STREAM_CHUNK_SIZE;
+    w->len = len;
+    w->off = (off_t)off;
+    ssize_t r = io_worker_run(w, IO_OP_READ, timeout_ms);
+    if(r > 0) memcpy(dst, w->buf, (size_t)r);
+    return r;
+}
+
+/* Read exactly len bytes of path into dst under --io-timeout.
+   Returns 0, -1 on error (errno set, ENODATA for a short file) or -2 on timeout. */
+static int io_worker_read_file(io_worker_t *w, const char *path, unsigned char *dst, size_t len, int timeout_ms){
+    int r = io_worker_open(w, path, timeout_ms);
+    if(r != 0) return r;
+    size_t got = 0;
+    while(got < len){
+        ssize_t n = io_worker_pread(w, dst + got, len - got, got, timeout_ms);
+        if(n == -2) return -2;
+        if(n < 0) return -1;
+        if(n == 0){ errno = ENODATA; return -1; }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/* Parse a --io-timeout value: a positive number with an optional ms, s or m suffix (default s). */
+static int parse_duration_ms(const char *s, int *out_ms){
+    if(!s || !*s) return -1;
+    char *end = NULL;
+    errno = 0;
+    double v = strtod(s, &end);
+    if(errno != 0 || end == s || v <= 0) return -1;
+    double mul = 1000.0;
+    if(strcmp(end, "ms") == 0) mul = 1.0;
+    else if(strcmp(end, "m") == 0) mul = 60000.0;
+    else if(*end && strcmp(end, "s") != 0) return -1;
+    double ms = v * mul;
+    if(ms < 1.0 || ms > (double)INT_MAX) return -1;
+    *out_ms = (int)ms;
+    return 0;
+}
+
+/* Copy src_path into dest chunk by chunk. With an io worker every open/read goes through it
+   and -2 (errno ETIMEDOUT) is returned when one makes no progress within timeout_ms.
+   sha_out, if not NULL, receives the SHA-256 of the copied content. */
+static int stream_copy_file_with_crc(const char *src_path, FILE *dest, const char *pwd,
+                                     struct io_worker *io, int timeout_ms,
+                                     uint64_t *bytes_written, uint32_t *crc_out, unsigned char *sha_out){
+    FILE *src = NULL;
+    if(io){
+        int r = io_worker_open(io, src_path, timeout_ms);
+        if(r != 0) return r;
+    } else {
+        src = fopen(src_path, "rb");
+        if(!src) return -1;
+    }
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    if(!chunk){
+        if(src) fclose(src);
+        errno = ENOMEM;
+        return -1;
+    }
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    uint64_t total = 0;
+    SHA256_CTX shactx;
+    if(sha_out) SHA256_Init(&shactx);
+    while(1){
+        size_t readn;
+        if(io){
+            ssize_t n = io_worker_pread(io, chunk, BAAR_STREAM_CHUNK_SIZE, total, timeout_ms);
+            if(n < 0){
+                int err = errno;
+                free(chunk);
+                errno = err;
+                return n == -2 ? -2 : -1;
+            }
+            readn = (size_t)n;
+        } else {
+            readn = fread(chunk, 1, BAAR_STREAM_CHUNK_SIZE, src);
+        }
+        if(readn == 0){
+            if(src && ferror(src)){
+                int err = errno;
+                free(chunk);
+                fclose(src);
+                errno = err;
+                return -1;
+            }
+            break;
+        }
+        crc = crc32(crc, chunk, readn);
+        if(sha_out) SHA256_Update(&shactx, chunk, readn);
+        if(pwd && pwd[0]){ xor_buf(chunk, readn, pwd); }
+        size_t written = fwrite(chunk, 1, readn, dest);
+        if(written != readn){
+            int err = errno;
+            free(chunk);
+            if(src) fclose(src);
+            errno = err;
+            return -1;
+        }
+        total += readn;
+    }
+    free(chunk);
+    if(src) fclose(src);
+    if(sha_out) SHA256_Final(sha_out, &shactx);
+    if(bytes_written) *bytes_written = total;
+    if(crc_out) *crc_out = crc;
+    return 0;
+}
+
+/* Index offset of a streamed archive, read from the trailer at EOF; 0 if there is none. */
+static uint64_t trailer_index_offset(FILE *f){
+    struct stat st;
+    if(fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    if(st.st_size < HEADER_SIZE + 4 + TRAILER_SIZE) return 0;
+    if(fseeko(f, -(off_t)TRAILER_SIZE, SEEK_END) != 0) return 0;
+    uint64_t off = read_u64(f);
+    char magic[8] = {0};
+    if(fread(magic, 1, 8, f) != 8 || memcmp(magic, TRAILER_MAGIC, 8) != 0) return 0;
+    if(off < HEADER_SIZE || off > (uint64_t)st.st_size - TRAILER_SIZE - 4) return 0;
+    return off;
+}
+
+static index_t load_index(FILE *f){
+    index_t idx = {0};
+    fseek(f,0,SEEK_SET);
+    char magic[8]={0};
+    fread(magic,1,8,f);
+    if(strncmp(magic,MAGIC,6)!=0){ return idx; }
+    uint64_t index_offset = read_u64(f);
+    if(index_offset==0) index_offset = trailer_index_offset(f);
+    if(index_offset==0){ return idx; }
+    fseek(f,index_offset,SEEK_SET);
+    uint32_t n = read_u32(f);
+    idx.n = n;
+    idx.entries = calloc(n,sizeof(entry_t));
+    /* duplicate file handle so we can lazy-load names/meta later */
+    idx.archive_fp = NULL;
+    int fd = fileno(f);
+    if(fd >= 0){
+        int dupfd = dup(fd);
+        if(dupfd >= 0){ idx.archive_fp = fdopen(dupfd, "rb"); }
+    }
+    uint32_t maxid=0;
+    for(uint32_t i=0;i<n;i++){
+        entry_t *e = &idx.entries[i];
+        e->id = read_u32(f);
+    uint16_t namelen = read_u16(f);
+    e->name = NULL; e->name_len = namelen; e->name_off = ftell(f);
+    if(namelen) fseek(f, namelen, SEEK_CUR);
+    /* strip leading slashes so UI shows top-level folders like 'home' instead of '/' */
+    if(e->name && e->name[0] == '/'){
+        char *tmp = e->name;
+        while(tmp[0] == '/') tmp++;
+        if(tmp != e->name){
+            char *newn = strdup(tmp);
+            free(e->name);
+            e->name = newn ? newn : strdup("");
+        }
+    }
+    e->flags = fgetc(f);
+    e->comp_level = fgetc(f);
+    e->data_offset = read_u64(f);
+    e->comp_size = read_u64(f);
+    e->uncomp_size = read_u64(f);
+    e->crc32 = read_u32(f);
+
+    e->mode = read_u32(f);
+    e->uid = read_u32(f);
+    e->gid = read_u32(f);
+    e->mtime = read_u64(f);
+
+    e->meta_n = read_u32(f);
+    if(e->meta_n){
+        e->meta = NULL; /* not loaded yet */
+        e->meta_off = ftell(f);
+        /* skip meta contents */
+        for(uint32_t m=0;m<e->meta_n;m++){
+            uint16_t klen = read_u16(f); if(klen) fseek(f, klen, SEEK_CUR);
+            uint16_t vlen = read_u16(f); if(vlen) fseek(f, vlen, SEEK_CUR);
+        }
+    } else { e->meta = NULL; e->meta_off = 0; }
+    if(e->id>maxid) maxid=e->id;
+    }
+    idx.next_id = maxid+1;
+    return idx;
+}
+
+
+static index_t load_libarchive_index(const char *path){
+    index_t idx = {0};
+
+    struct archive *a = archive_read_new();
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+
+
+    if (g_archive_password) {
+        archive_read_add_passphrase(a, g_archive_password);
+
+        g_archive_was_encrypted = 1;
+    }
+
+
+    int open_r = archive_read_open_filename(a, path, 10240);
+    if (open_r != ARCHIVE_OK) {
+        archive_read_free(a);
+
+        if (g_main_window && !g_archive_password) {
+            if (show_password_dialog("Archive may be password-protected. Enter password to open or Cancel to skip.")) {
+                if (g_archive_password) {
+                    fprintf(stderr, "[DEBUG] load_libarchive_index: user provided a password (len=%zu)\n", strlen(g_archive_password));
+                } else {
+                    fprintf(stderr, "[DEBUG] load_libarchive_index: show_password_dialog returned true but no password set\n");
+                }
 
                 a = archive_read_new();
                 archive_read_support_filter_all(a);
@@ -5830,21 +7023,33 @@ static void free_index(index_t *idx){
     }
     free(idx->entries);
     idx->entries=NULL; idx->n=0;
+    free(idx->id_slots);
+    idx->id_slots = NULL; idx->id_slots_n = 0;
     if(idx->archive_fp){ fclose(idx->archive_fp); idx->archive_fp = NULL; }
 }
 
+/* Lazy name/meta loads use pread on the dup'd descriptor: it shares its file offset with the
+   FILE the index was loaded from, which may be in the middle of writing a new index. */
+static int pread_full(int fd, void *buf, size_t len, uint64_t off){
+    size_t got = 0;
+    while(got < len){
+        ssize_t r = pread(fd, (char*)buf + got, len - got, (off_t)(off + got));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        got += (size_t)r;
+    }
+    return 0;
+}
+
 static const char *entry_get_name(index_t *idx, entry_t *e){
     if(!e) return NULL;
     if(e->name) return e->name;
     if(e->name_len == 0){ e->name = strdup(""); return e->name; }
     if(!idx || !idx->archive_fp) return NULL;
-    long cur = ftell(idx->archive_fp);
-    if(fseek(idx->archive_fp, (long)e->name_off, SEEK_SET) != 0){ if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET); return NULL; }
     char *buf = malloc(e->name_len + 1);
-    if(!buf){ if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET); return NULL; }
-    size_t rn = fread(buf, 1, e->name_len, idx->archive_fp);
+    if(!buf) return NULL;
+    if(pread_full(fileno(idx->archive_fp), buf, e->name_len, e->name_off) != 0){ free(buf); return NULL; }
     buf[e->name_len] = 0;
-    if(rn != e->name_len){ free(buf); if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET); return NULL; }
     /* strip leading slashes so UI shows top-level folders like 'home' instead of '/' */
     if(buf[0] == '/'){
         char *tmp = buf;
@@ -5859,12 +7064,12 @@ static const char *entry_get_name(index_t *idx, entry_t *e){
     } else {
         e->name = buf;
     }
-    if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET);
     return e->name;
 }
 
 static int entry_is_effectively_compressed(const entry_t *e){
     if(!e) return 0;
+    if(e->flags & (8 | 16 | 32 | 64)) return 0; /* chunked, delta, reference or volume: decoded by their own paths */
     if(e->flags & 1) return 1;
     if(e->uncomp_size == 0) return 0;
     if(e->comp_size > 0 && e->comp_size < e->uncomp_size) return 1;
@@ -5872,22 +7077,741 @@ static int entry_is_effectively_compressed(const entry_t *e){
     return 0;
 }
 
-static int entry_load_meta(index_t *idx, entry_t *e){
-    if(!e) return 1;
-    if(e->meta_n == 0) return 0;
-    if(e->meta) return 0;
+/* --delta: a changed file can be stored as a delta against the entry it supersedes (flag 16,
+   BAAR_DELTA_BASE = id of that entry, BAAR_DELTA_DEPTH = length of the chain). The delta is
+   "BDL1", a u64 target size, then ops: 'A' varint len + literal bytes, or 'C' varint base offset
+   + varint len. Base blocks are found with the rsync rolling checksum and verified byte-wise. */
+#define BAAR_DELTA_MAGIC "BDL1"
+#define BAAR_DELTA_DEFAULT_DEPTH 8
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    size_t limit; /* give up once the delta grows past this */
+} delta_buf_t;
+
+static int delta_put(delta_buf_t *d, const void *p, size_t n){
+    if(d->len + n > d->limit) return -1;
+    if(d->len + n > d->cap){
+        size_t ncap = d->cap ? d->cap * 2 : 4096;
+        while(ncap < d->len + n) ncap *= 2;
+        unsigned char *grown = realloc(d->data, ncap);
+        if(!grown) return -1;
+        d->data = grown;
+        d->cap = ncap;
+    }
+    memcpy(d->data + d->len, p, n);
+    d->len += n;
+    return 0;
+}
+
+static int delta_put_varint(delta_buf_t *d, uint64_t v){
+    unsigned char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        if(v) tmp[n] |= 0x80;
+        n++;
+    } while(v);
+    return delta_put(d, tmp, n);
+}
+
+static int delta_get_varint(const unsigned char *p, size_t len, size_t *pos, uint64_t *out){
+    uint64_t v = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        if(*pos >= len) return -1;
+        unsigned char b = p[(*pos)++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)){ *out = v; return 0; }
+    }
+    return -1;
+}
+
+static int delta_put_literal(delta_buf_t *d, const unsigned char *p, size_t n){
+    if(n == 0) return 0;
+    unsigned char op = 'A';
+    if(delta_put(d, &op, 1) != 0 || delta_put_varint(d, n) != 0) return -1;
+    return delta_put(d, p, n);
+}
+
+/* Encode `t` against `base`. Returns 0 with a malloc'd delta, or -1 if it would exceed `limit`. */
+static int delta_encode(const unsigned char *base, size_t bn, const unsigned char *t, size_t tn,
+                        size_t limit, unsigned char **out, size_t *out_len){
+    delta_buf_t d = { .limit = limit };
+    *out = NULL;
+    *out_len = 0;
+    size_t bs = 512;
+    while(bs < (1u << 16) && bs * bs < bn) bs <<= 1;
+    size_t nblocks = bn / bs;
+
+    /* weak checksum of every whole base block -> first block with it */
+    size_t cap = 16;
+    while(cap < nblocks * 2) cap <<= 1;
+    uint32_t *weak = calloc(cap, sizeof(*weak));
+    uint32_t *slot = calloc(cap, sizeof(*slot)); /* block index + 1, 0 = empty */
+    if(!weak || !slot){ free(weak); free(slot); return -1; }
+    for(size_t k=0;k<nblocks;k++){
+        const unsigned char *p = base + k * bs;
+        uint32_t a = 0, b = 0;
+        for(size_t i=0;i<bs;i++){ a += p[i]; b += (uint32_t)(bs - i) * p[i]; }
+        uint32_t w = (a & 0xffff) | (b << 16);
+        size_t h = (size_t)(w * 0x9e3779b1u) & (cap - 1);
+        while(slot[h] && weak[h] != w) h = (h + 1) & (cap - 1);
+        if(!slot[h]){ weak[h] = w; slot[h] = (uint32_t)k + 1; }
+    }
+
+    unsigned char hdr[12];
+    memcpy(hdr, BAAR_DELTA_MAGIC, 4);
+    for(int i=0;i<8;i++) hdr[4 + i] = (unsigned char)((uint64_t)tn >> (8 * i));
+    int status = delta_put(&d, hdr, sizeof(hdr));
+
+    size_t i = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    int primed = 0;
+    while(status == 0 && nblocks > 0 && i + bs <= tn){
+        if(!primed){
+            a = 0; b = 0;
+            for(size_t j=0;j<bs;j++){ a += t[i + j]; b += (uint32_t)(bs - j) * t[i + j]; }
+            primed = 1;
+        }
+        uint32_t w = (a & 0xffff) | (b << 16);
+        size_t h = (size_t)(w * 0x9e3779b1u) & (cap - 1);
+        while(slot[h] && weak[h] != w) h = (h + 1) & (cap - 1);
+        if(slot[h]){
+            size_t boff = (size_t)(slot[h] - 1) * bs;
+            if(memcmp(base + boff, t + i, bs) == 0){
+                size_t len = bs;
+                while(i + len < tn && boff + len < bn && t[i + len] == base[boff + len]) len++;
+                unsigned char op = 'C';
+                if(delta_put_literal(&d, t + lit, i - lit) != 0 || delta_put(&d, &op, 1) != 0 ||
+                   delta_put_varint(&d, boff) != 0 || delta_put_varint(&d, len) != 0){
+                    status = -1;
+                    break;
+                }
+                i += len;
+                lit = i;
+                primed = 0;
+                continue;
+            }
+        }
+        if(i + bs < tn){
+            uint32_t old = t[i], nxt = t[i + bs];
+            a = a - old + nxt;
+            b = b - (uint32_t)bs * old + a;
+        }
+        i++;
+    }
+    if(status == 0) status = delta_put_literal(&d, t + lit, tn - lit);
+    free(weak);
+    free(slot);
+    if(status != 0){ free(d.data); return -1; }
+    *out = d.data;
+    *out_len = d.len;
+    return 0;
+}
+
+/* Rebuild the target from `base` and a delta into dst (capacity cap). Returns 0 or -1. */
+static int delta_apply(const unsigned char *base, size_t bn, const unsigned char *d, size_t dn,
+                       unsigned char *dst, size_t cap, size_t *produced){
+    if(dn < 12 || memcmp(d, BAAR_DELTA_MAGIC, 4) != 0) return -1;
+    uint64_t tn = 0;
+    for(int i=0;i<8;i++) tn |= (uint64_t)d[4 + i] << (8 * i);
+    if(tn > cap) return -1;
+    size_t pos = 12, out = 0;
+    while(pos < dn){
+        unsigned char op = d[pos++];
+        uint64_t off = 0, len = 0;
+        if(op == 'C'){
+            if(delta_get_varint(d, dn, &pos, &off) != 0 || delta_get_varint(d, dn, &pos, &len) != 0) return -1;
+            if(off > bn || len > bn - off || len > tn - out) return -1;
+            memcpy(dst + out, base + off, (size_t)len);
+        } else if(op == 'A'){
+            if(delta_get_varint(d, dn, &pos, &len) != 0) return -1;
+            if(len > dn - pos || len > tn - out) return -1;
+            memcpy(dst + out, d + pos, (size_t)len);
+            pos += (size_t)len;
+        } else {
+            return -1;
+        }
+        out += (size_t)len;
+    }
+    if(out != tn) return -1;
+    if(produced) *produced = out;
+    return 0;
+}
+
+/* The entry a delta entry was encoded against, or NULL if it is gone. */
+static entry_t *delta_base_entry(index_t *idx, entry_t *e){
+    const char *v = entry_get_meta_val(idx, e, "BAAR_DELTA_BASE");
+    if(!v) return NULL;
+    entry_t *base = entry_by_id(idx, (uint32_t)strtoul(v, NULL, 10));
+    return base != e ? base : NULL;
+}
+
+static int entry_decode_into(FILE *f, index_t *idx, entry_t *e, const char *pwd,
+                             unsigned char *dst, size_t dst_cap, size_t *produced);
+
+/* delta chains are capped when written; this only stops a corrupt index from recursing forever */
+static __thread int g_delta_nesting;
+
+/* Decode delta entry `e`: expand its base (recursively), then apply the delta blob. */
+static int delta_decode_into(FILE *f, index_t *idx, entry_t *e, const char *pwd,
+                             unsigned char *dst, size_t dst_cap, size_t *produced){
+    entry_t *base = idx ? delta_base_entry(idx, e) : NULL;
+    if(!base || base->uncomp_size > SIZE_MAX || g_delta_nesting >= 64) return -1;
+    size_t bn = (size_t)base->uncomp_size;
+    unsigned char *bbuf = malloc(bn ? bn : 1);
+    unsigned char *blob = malloc(e->comp_size ? (size_t)e->comp_size : 1);
+    unsigned char *delta = NULL;
+    size_t delta_len = 0;
+    int status = (bbuf && blob) ? 0 : -1;
+    size_t got = 0;
+    if(status == 0){
+        g_delta_nesting++;
+        status = entry_decode_into(f, idx, base, pwd, bbuf, bn, &got);
+        g_delta_nesting--;
+        if(status == 0 && (got != bn || crc32_buf(0, bbuf, bn) != base->crc32)) status = -1;
+    }
+    if(status == 0 && pread_full(fileno(f), blob, (size_t)e->comp_size, e->data_offset) != 0) status = -1;
+    if(status == 0 && (e->flags & 2)) xor_buf(blob, (size_t)e->comp_size, pwd);
+    if(status == 0 && (e->flags & 1)){
+        z_stream zs; memset(&zs, 0, sizeof(zs));
+        size_t cap = (size_t)e->comp_size * 4 + 4096;
+        delta = malloc(cap);
+        if(!delta || inflateInit2(&zs, 15 + 32) != Z_OK) status = -1;
+        else {
+            zs.next_in = blob;
+            zs.avail_in = (uInt)e->comp_size;
+            int zr = Z_OK;
+            while(zr == Z_OK){
+                if(delta_len == cap){
+                    unsigned char *grown = realloc(delta, cap * 2);
+                    if(!grown){ zr = Z_MEM_ERROR; break; }
+                    delta = grown;
+                    cap *= 2;
+                }
+                zs.next_out = delta + delta_len;
+                zs.avail_out = (uInt)(cap - delta_len > UINT_MAX ? UINT_MAX : cap - delta_len);
+                uInt before = zs.avail_out;
+                zr = inflate(&zs, Z_NO_FLUSH);
+                delta_len += before - zs.avail_out;
+            }
+            if(zr != Z_STREAM_END) status = -1;
+            inflateEnd(&zs);
+        }
+    } else if(status == 0){
+        delta = blob;
+        blob = NULL;
+        delta_len = (size_t)e->comp_size;
+    }
+    if(status == 0) status = delta_apply(bbuf, bn, delta, delta_len, dst, dst_cap, produced);
+    free(bbuf);
+    free(blob);
+    free(delta);
+    return status;
+}
+
+/* --volume-size/--stripe: entries with flag 64 keep their blob in a volume stream beside the
+   archive. BAAR_VOLUME names the stream (resolved like BAAR_BASE) and data_offset is the
+   position in it. A stream is cut into parts <stream>.001, .002, ... of BAAR_VOLUME_SIZE bytes
+   (one part when the key is absent) and a blob may continue into the next part. */
+#define BAAR_VOLUME_CHUNK (1024 * 1024)
+#define BAAR_VOLUME_QUEUE_BYTES (64ULL * 1024 * 1024)
+#define BAAR_VOLUME_READAHEAD (256ULL * 1024 * 1024)
+
+typedef struct {
+    char *path;
+    FILE *f;
+} volume_part_t;
+
+/* parts opened for reading, kept open for the rest of the command like the --base archives */
+static volume_part_t *g_volume_parts;
+static size_t g_volume_part_count;
+
+static void volume_part_name(const char *stream, uint32_t part, char *out, size_t outlen){
+    int n = snprintf(out, outlen, "%s.%03u", stream, part);
+    if(n < 0 || (size_t)n >= outlen) out[0] = '\0'; /* fails to open rather than naming another file */
+}
+
+/* Part number of stream position `off` and the offset inside that part. */
+static uint32_t volume_part_at(uint64_t vsize, uint64_t off, uint64_t *inner){
+    *inner = vsize ? off % vsize : off;
+    return vsize ? (uint32_t)(off / vsize) + 1 : 1;
+}
+
+static FILE *volume_part_open(const char *path){
+    for(size_t i=0;i<g_volume_part_count;i++){
+        if(strcmp(g_volume_parts[i].path, path) == 0) return g_volume_parts[i].f;
+    }
+    FILE *f = fopen(path, "rb");
+    if(!f) return NULL;
+    volume_part_t *grown = realloc(g_volume_parts, sizeof(*grown) * (g_volume_part_count + 1));
+    char *dup = grown ? strdup(path) : NULL;
+    if(grown) g_volume_parts = grown;
+    if(!dup){ fclose(f); errno = ENOMEM; return NULL; }
+    g_volume_parts[g_volume_part_count].path = dup;
+    g_volume_parts[g_volume_part_count].f = f;
+    g_volume_part_count++;
+    return f;
+}
+
+static void volume_parts_close(void){
+    for(size_t i=0;i<g_volume_part_count;i++){
+        fclose(g_volume_parts[i].f);
+        free(g_volume_parts[i].path);
+    }
+    free(g_volume_parts);
+    g_volume_parts = NULL;
+    g_volume_part_count = 0;
+}
+
+/* --base: reference entries (flag 32) carry no blob; BAAR_BASE names the archive that holds the
+   data (relative to the referencing archive's directory unless absolute) and BAAR_BASE_ID the
+   entry there. Referenced archives are opened once per process and kept in this cache. */
+typedef struct {
+    char *path;
+    FILE *f;
+    index_t idx;
+} ref_base_t;
+
+static ref_base_t **g_ref_bases; /* entries stay put while the table grows */
+static size_t g_ref_base_count;
+
+static ref_base_t *ref_base_open(const char *path){
+    for(size_t i=0;i<g_ref_base_count;i++){
+        if(strcmp(g_ref_bases[i]->path, path) == 0) return g_ref_bases[i];
+    }
+    FILE *f = fopen(path, "rb");
+    if(!f) return NULL;
+    ref_base_t **grown = realloc(g_ref_bases, sizeof(*grown) * (g_ref_base_count + 1));
+    ref_base_t *rb = grown ? calloc(1, sizeof(*rb)) : NULL;
+    if(grown) g_ref_bases = grown;
+    if(!rb){ fclose(f); return NULL; }
+    rb->path = strdup(path);
+    rb->f = f;
+    rb->idx = load_index(f);
+    rb->idx.archive_path = rb->path;
+    if(!rb->path){
+        free_index(&rb->idx); fclose(f); free(rb);
+        return NULL;
+    }
+    g_ref_bases[g_ref_base_count++] = rb;
+    return rb;
+}
+
+static void ref_bases_close(void){
+    for(size_t i=0;i<g_ref_base_count;i++){
+        free_index(&g_ref_bases[i]->idx);
+        fclose(g_ref_bases[i]->f);
+        free(g_ref_bases[i]->path);
+        free(g_ref_bases[i]);
+    }
+    free(g_ref_bases);
+    g_ref_bases = NULL;
+    g_ref_base_count = 0;
+    volume_parts_close();
+}
+
+/* Path `v` as stored in BAAR_BASE or BAAR_VOLUME: relative to the directory of the archive
+   `idx` was loaded from unless absolute. Returns 0 or -1. */
+static int archive_relative_path(index_t *idx, const char *v, char *out, size_t outlen){
+    if(!v || !v[0]) return -1;
+    if(v[0] == '/' || !idx->archive_path || !strchr(idx->archive_path, '/')){
+        snprintf(out, outlen, "%s", v);
+        return 0;
+    }
+    const char *slash = strrchr(idx->archive_path, '/');
+    int n = snprintf(out, outlen, "%.*s/%s", (int)(slash - idx->archive_path), idx->archive_path, v);
+    return (n < 0 || (size_t)n >= outlen) ? -1 : 0;
+}
+
+/* Resolve the archive a reference entry points to. Returns 0 or -1. */
+static int ref_resolve_path(index_t *idx, entry_t *e, char *out, size_t outlen){
+    return archive_relative_path(idx, entry_get_meta_val(idx, e, "BAAR_BASE"), out, outlen);
+}
+
+/* The entry holding the data of reference entry `e` (following references), or NULL. */
+static entry_t *ref_holder(index_t *idx, entry_t *e, ref_base_t **rb_out){
+    for(int hops = 0; hops < 64 && (e->flags & 32); hops++){
+        char path[PATH_MAX];
+        const char *id = entry_get_meta_val(idx, e, "BAAR_BASE_ID");
+        if(!id || ref_resolve_path(idx, e, path, sizeof(path)) != 0) return NULL;
+        ref_base_t *rb = ref_base_open(path);
+        entry_t *be = rb ? entry_by_id(&rb->idx, (uint32_t)strtoul(id, NULL, 10)) : NULL;
+        if(!be || be->uncomp_size != e->uncomp_size || be->crc32 != e->crc32) return NULL;
+        *rb_out = rb;
+        idx = &rb->idx;
+        e = be;
+    }
+    return (e->flags & 32) ? NULL : e;
+}
+
+static int ref_decode_into(index_t *idx, entry_t *e, const char *pwd,
+                           unsigned char *dst, size_t dst_cap, size_t *produced){
+    ref_base_t *rb = NULL;
+    entry_t *be = idx ? ref_holder(idx, e, &rb) : NULL;
+    if(!be){
+        const char *v = idx ? entry_get_meta_val(idx, e, "BAAR_BASE") : NULL;
+        fprintf(stderr, "Base archive data missing for %s (base %s)\n",
+                idx ? entry_get_name(idx, e) : "?", v ? v : "?");
+        return -1;
+    }
+    return entry_decode_into(rb->f, &rb->idx, be, pwd, dst, dst_cap, produced);
+}
+
+/* Stream path and part size (0 = one part) of volume entry `e`. Returns 0 or -1. */
+static int volume_stream_of(index_t *idx, entry_t *e, char *out, size_t outlen, uint64_t *vsize){
+    const char *vs = entry_get_meta_val(idx, e, "BAAR_VOLUME_SIZE");
+    *vsize = vs ? strtoull(vs, NULL, 10) : 0;
+    return archive_relative_path(idx, entry_get_meta_val(idx, e, "BAAR_VOLUME"), out, outlen);
+}
+
+/* Decode volume entry `e` (flag 64) from its part file(s). */
+static int volume_decode_into(index_t *idx, entry_t *e, const char *pwd,
+                              unsigned char *dst, size_t dst_cap, size_t *produced){
+    char stream[PATH_MAX], path[PATH_MAX];
+    uint64_t vsize = 0, inner = 0;
+    if(!idx || volume_stream_of(idx, e, stream, sizeof(stream), &vsize) != 0){
+        fprintf(stderr, "Volume of %s not recorded\n", idx ? entry_get_name(idx, e) : "?");
+        return -1;
+    }
+    /* the blob itself is an ordinary one, only in another file */
+    entry_t local = *e;
+    local.flags &= (uint8_t)~64;
+    local.meta = NULL;
+    local.meta_n = 0;
+    uint32_t part = volume_part_at(vsize, e->data_offset, &inner);
+    volume_part_name(stream, part, path, sizeof(path));
+    FILE *pf = volume_part_open(path);
+    if(!pf){
+        fprintf(stderr, "Volume %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(!vsize || e->comp_size <= vsize - inner){
+        local.data_offset = inner;
+        return entry_decode_into(pf, NULL, &local, pwd, dst, dst_cap, produced);
+    }
+    /* it continues into the following parts: gather it in a scratch file first */
+    FILE *tmp = tmpfile();
+    unsigned char *chunk = tmp ? malloc(BAAR_VOLUME_CHUNK) : NULL;
+    int status = chunk ? 0 : -1;
+    for(uint64_t done = 0; status == 0 && done < e->comp_size; ){
+        part = volume_part_at(vsize, e->data_offset + done, &inner);
+        volume_part_name(stream, part, path, sizeof(path));
+        pf = volume_part_open(path);
+        if(!pf){
+            fprintf(stderr, "Volume %s: %s\n", path, strerror(errno));
+            status = -1;
+            break;
+        }
+        uint64_t left = e->comp_size - done;
+        if(left > vsize - inner) left = vsize - inner;
+        size_t want = left > BAAR_VOLUME_CHUNK ? BAAR_VOLUME_CHUNK : (size_t)left;
+        if(pread_full(fileno(pf), chunk, want, inner) != 0 || fwrite(chunk, 1, want, tmp) != want) status = -1;
+        done += want;
+    }
+    if(status == 0 && fflush(tmp) == 0){
+        local.data_offset = 0;
+        status = entry_decode_into(tmp, NULL, &local, pwd, dst, dst_cap, produced);
+    } else {
+        status = -1;
+    }
+    free(chunk);
+    if(tmp) fclose(tmp);
+    return status;
+}
+
+/* Readahead for volume entries about to be decoded, kept BAAR_VOLUME_READAHEAD bytes ahead of
+   the reader. The hints go to every part involved at once, so the disks of a striped set
+   are read concurrently while entries are decoded one after another. */
+typedef struct {
+    index_t *idx;
+    entry_t **queue;
+    size_t n, next;
+    uint64_t issued, consumed;
+} volume_readahead_t;
+
+static void volume_readahead_init(volume_readahead_t *ra, index_t *idx){
+    memset(ra, 0, sizeof(*ra));
+    ra->idx = idx;
+    /* hints only: without the queue entries are simply read on demand */
+    ra->queue = malloc(sizeof(*ra->queue) * (idx->n ? idx->n : 1));
+}
+
+static void volume_readahead_add(volume_readahead_t *ra, entry_t *e){
+    if(ra->queue && (e->flags & 64) && e->comp_size > 0) ra->queue[ra->n++] = e;
+}
+
+static void volume_readahead_hint(index_t *idx, entry_t *e){
+    char stream[PATH_MAX], path[PATH_MAX];
+    uint64_t vsize = 0, inner = 0;
+    if(volume_stream_of(idx, e, stream, sizeof(stream), &vsize) != 0) return;
+    for(uint64_t done = 0; done < e->comp_size; ){
+        uint32_t part = volume_part_at(vsize, e->data_offset + done, &inner);
+        uint64_t len = e->comp_size - done;
+        if(vsize && len > vsize - inner) len = vsize - inner;
+        volume_part_name(stream, part, path, sizeof(path));
+        FILE *pf = volume_part_open(path);
+        if(pf) posix_fadvise(fileno(pf), (off_t)inner, (off_t)len, POSIX_FADV_WILLNEED);
+        done += len;
+    }
+}
+
+/* Call with each entry, in the order of the queue, just before reading it. */
+static void volume_readahead_step(volume_readahead_t *ra, entry_t *e){
+    if(e->flags & 64) ra->consumed += e->comp_size;
+    while(ra->next < ra->n && ra->issued < ra->consumed + BAAR_VOLUME_READAHEAD){
+        entry_t *q = ra->queue[ra->next++];
+        volume_readahead_hint(ra->idx, q);
+        ra->issued += q->comp_size;
+    }
+}
+
+static void volume_readahead_free(volume_readahead_t *ra){
+    free(ra->queue);
+    ra->queue = NULL;
+}
+
+/* Decode chunked entry `e` (flag 8) into `dst` by following its manifest. */
+static int cdc_decode_into(FILE *f, entry_t *e, const char *pwd,
+                           unsigned char *dst, size_t dst_cap, size_t *produced){
+    unsigned char *m = NULL;
+    long n = cdc_manifest_read(fileno(f), e, &m);
+    if(n < 0) return -1;
+    xor_stream_t xs;
+    if(xor_stream_init(&xs, (e->flags & 2) ? pwd : NULL) != 0){ free(m); return -1; }
+    unsigned char *chunk = malloc(BAAR_CDC_MAX + 1024);
+    size_t chunk_cap = BAAR_CDC_MAX + 1024;
+    size_t out_pos = 0;
+    int status = chunk ? 0 : -1;
+    for(long k=0; status == 0 && k<n; k++){
+        cdc_chunk_t c;
+        cdc_record_get(m + BAAR_CDC_HEADER_SIZE + (size_t)k * BAAR_CDC_RECORD_SIZE, &c);
+        if(c.size > dst_cap - out_pos){ status = -1; break; }
+        if(c.comp_size > chunk_cap){
+            unsigned char *grown = realloc(chunk, c.comp_size);
+            if(!grown){ status = -1; break; }
+            chunk = grown;
+            chunk_cap = c.comp_size;
+        }
+        if(pread_full(fileno(f), chunk, c.comp_size, c.offset) != 0){ status = -1; break; }
+        xor_stream_apply(&xs, chunk, c.comp_size, 0);
+        if(c.flags & 1){
+            z_stream zs; memset(&zs, 0, sizeof(zs));
+            /* 15 + 32: zlib or gzip wrapped, as in entry_decode_into */
+            if(inflateInit2(&zs, 15 + 32) != Z_OK){ status = -1; break; }
+            zs.next_in = chunk;
+            zs.avail_in = c.comp_size;
+            zs.next_out = dst + out_pos;
+            zs.avail_out = c.size;
+            int zr = inflate(&zs, Z_FINISH);
+            if(zr != Z_STREAM_END || zs.total_out != c.size) status = -1;
+            inflateEnd(&zs);
+        } else {
+            if(c.comp_size != c.size){ status = -1; break; }
+            memcpy(dst + out_pos, chunk, c.size);
+        }
+        out_pos += c.size;
+    }
+    free(chunk);
+    free(m);
+    xor_stream_clear(&xs);
+    if(status == 0 && produced) *produced = out_pos;
+    return status;
+}
+
+/* Decode the blob of entry `e` into `dst` (capacity `dst_cap`). The blob is read from `f` in
+   BAAR_STREAM_CHUNK_SIZE pieces, decrypted in place and inflated straight into `dst`, so the
+   compressed data is never resident as a whole. `idx` is only needed for delta entries.
+   Returns 0 and sets *produced on success. */
+static int entry_decode_into(FILE *f, index_t *idx, entry_t *e, const char *pwd,
+                             unsigned char *dst, size_t dst_cap, size_t *produced){
+    if(produced) *produced = 0;
+    if(!f || !e) return -1;
+    if(e->comp_size == 0 && !(e->flags & 32)) return 0;
+    if(e->flags & 8) return cdc_decode_into(f, e, pwd, dst, dst_cap, produced);
+    if(e->flags & 16) return delta_decode_into(f, idx, e, pwd, dst, dst_cap, produced);
+    if(e->flags & 32) return ref_decode_into(idx, e, pwd, dst, dst_cap, produced);
+    if(e->flags & 64) return volume_decode_into(idx, e, pwd, dst, dst_cap, produced);
+    if(fseek(f, (long)e->data_offset, SEEK_SET) != 0) return -1;
+
+    xor_stream_t xs;
+    if(xor_stream_init(&xs, (e->flags & 2) ? pwd : NULL) != 0) return -1;
+    int status = 0;
+
+    if(!entry_is_effectively_compressed(e)){
+        if(e->comp_size > dst_cap){ xor_stream_clear(&xs); return -1; }
+        size_t pos = 0, total = (size_t)e->comp_size;
+        while(pos < total){
+            size_t want = total - pos;
+            if(want > BAAR_STREAM_CHUNK_SIZE) want = BAAR_STREAM_CHUNK_SIZE;
+            if(fread(dst + pos, 1, want, f) != want){ status = -1; break; }
+            xor_stream_apply(&xs, dst + pos, want, pos);
+            pos += want;
+        }
+        xor_stream_clear(&xs);
+        if(status == 0 && produced) *produced = pos;
+        return status;
+    }
+
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    if(!chunk){ xor_stream_clear(&xs); return -1; }
+    z_stream zs; memset(&zs, 0, sizeof(zs));
+    /* 15 + 32: accept both zlib and gzip wrapped streams (level 3 may pick either) */
+    if(inflateInit2(&zs, 15 + 32) != Z_OK){ free(chunk); xor_stream_clear(&xs); return -1; }
+
+    uint64_t in_pos = 0;
+    size_t out_pos = 0;
+    int zr = Z_OK;
+    while(zr != Z_STREAM_END){
+        if(zs.avail_in == 0){
+            if(in_pos >= e->comp_size){ status = -1; break; }
+            size_t want = (size_t)(e->comp_size - in_pos);
+            if(want > BAAR_STREAM_CHUNK_SIZE) want = BAAR_STREAM_CHUNK_SIZE;
+            if(fread(chunk, 1, want, f) != want){ status = -1; break; }
+            xor_stream_apply(&xs, chunk, want, in_pos);
+            in_pos += want;
+            zs.next_in = chunk;
+            zs.avail_in = (uInt)want;
+        }
+        size_t room = dst_cap - out_pos;
+        uInt avail = room > UINT_MAX ? UINT_MAX : (uInt)room;
+        zs.next_out = dst + out_pos;
+        zs.avail_out = avail;
+        zr = inflate(&zs, Z_NO_FLUSH);
+        out_pos += avail - zs.avail_out;
+        if(zr == Z_STREAM_END) break;
+        if(zr == Z_BUF_ERROR && zs.avail_in == 0 && room > 0) continue;
+        if(zr != Z_OK){ status = -1; break; }
+    }
+    inflateEnd(&zs);
+    free(chunk);
+    xor_stream_clear(&xs);
+    if(status == 0 && produced) *produced = out_pos;
+    return status;
+}
+
+/* Try to extract a large regular entry through a shared mapping of a temporary file created next
+   to `outpath`: the file is preallocated to uncomp_size, the blob is inflated/decrypted directly
+   into the mapping and the CRC is computed on the mapped output before the temp file is renamed
+   over `outpath`. Returns 0 on success, -1 after reporting an error, and 1 when the destination
+   filesystem cannot preallocate or mmap so the caller should fall back to write(). */
+static int extract_entry_mmap(FILE *f, index_t *idx, entry_t *e, const char *ename, const char *pwd, const char *outpath){
+    if(e->uncomp_size > SIZE_MAX) return 1;
+    size_t size = (size_t)e->uncomp_size;
+    char *tmppath = make_name(outpath, ".XXXXXX");
+    if(!tmppath) return 1;
+    int fd = mkstemp(tmppath);
+    if(fd < 0){ free(tmppath); return 1; }
+    /* mkstemp creates 0600; give the file the mode fopen() would have */
+    mode_t um = umask(0); umask(um);
+    fchmod(fd, 0666 & ~um);
+    if(fallocate(fd, 0, 0, (off_t)size) != 0){
+        int err = errno;
+        close(fd); unlink(tmppath); free(tmppath);
+        if(err == ENOSPC || err == EFBIG || err == EDQUOT){
+            fprintf(stderr, "Cannot write to %s: %s\n", outpath, strerror(err));
+            return -1;
+        }
+        return 1;
+    }
+    unsigned char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        close(fd); unlink(tmppath); free(tmppath);
+        return 1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    size_t produced = 0;
+    int dr = entry_decode_into(f, idx, e, pwd, map, size, &produced);
+    uint32_t crc = dr == 0 ? crc32_buf(0, map, produced) : 0;
+    munmap(map, size);
+    int close_rc = close(fd);
+    if(dr != 0 || produced != size){
+        fprintf(stderr, "Decompression failed for %s\n", ename);
+        unlink(tmppath); free(tmppath);
+        return -1;
+    }
+    if(crc != e->crc32){
+        fprintf(stderr, "CRC mismatch (wrong password or corrupted entry): %s\n", ename);
+        unlink(tmppath); free(tmppath);
+        return -1;
+    }
+    if(close_rc != 0 || rename(tmppath, outpath) != 0){
+        fprintf(stderr, "Cannot write to %s: %s\n", outpath, strerror(errno));
+        unlink(tmppath); free(tmppath);
+        return -1;
+    }
+    free(tmppath);
+    return 0;
+}
+
+/* Extract the data of regular-file entry `e` to `outpath`, verifying the CRC before the
+   destination is replaced. Returns 0 on success; errors are reported here. */
+static int extract_entry_file(FILE *f, index_t *idx, entry_t *e, const char *ename, const char *pwd, const char *outpath){
+    if(e->uncomp_size >= BAAR_MMAP_EXTRACT_MIN &&
+       (entry_is_effectively_compressed(e) || e->comp_size == e->uncomp_size || (e->flags & (8 | 16 | 32 | 64)))){
+        int mr = extract_entry_mmap(f, idx, e, ename, pwd, outpath);
+        if(mr <= 0) return mr == 0 ? 0 : 1;
+    }
+    size_t outcap = (size_t)e->uncomp_size;
+    if(!entry_is_effectively_compressed(e) && e->comp_size > outcap) outcap = (size_t)e->comp_size;
+    unsigned char *out = malloc(outcap + 1);
+    if(!out){
+        fprintf(stderr, "Out of memory while extracting %s\n", ename);
+        return 1;
+    }
+    size_t produced = 0;
+    if(entry_decode_into(f, idx, e, pwd, out, outcap, &produced) != 0){
+        fprintf(stderr, "Decompression failed for %s\n", ename);
+        free(out);
+        return 1;
+    }
+    if(crc32_buf(0, out, produced) != e->crc32){
+        fprintf(stderr, "CRC mismatch (wrong password or corrupted entry): %s\n", ename);
+        free(out);
+        return 1;
+    }
+    FILE *outf = fopen(outpath, "wb");
+    if(!outf){
+        fprintf(stderr, "Cannot write to %s: %s\n", outpath, strerror(errno));
+        free(out);
+        return 1;
+    }
+    int status = 0;
+    if(produced && fwrite(out, 1, produced, outf) != produced) status = 1;
+    if(fclose(outf) != 0) status = 1;
+    if(status) fprintf(stderr, "Cannot write to %s: %s\n", outpath, strerror(errno));
+    free(out);
+    return status;
+}
+
+static int entry_load_meta(index_t *idx, entry_t *e){
+    if(!e) return 1;
+    if(e->meta_n == 0) return 0;
+    if(e->meta) return 0;
     if(!idx || !idx->archive_fp) return 1;
-    long cur = ftell(idx->archive_fp);
-    if(fseek(idx->archive_fp, (long)e->meta_off, SEEK_SET) != 0){ if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET); return 1; }
+    int fd = fileno(idx->archive_fp);
+    uint64_t off = e->meta_off;
     e->meta = calloc(e->meta_n, sizeof(*e->meta));
-    if(!e->meta){ if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET); return 1; }
+    if(!e->meta) return 1;
     for(uint32_t m=0;m<e->meta_n;m++){
-        uint16_t klen = read_u16(idx->archive_fp);
-        if(klen){ e->meta[m].key = malloc(klen+1); fread(e->meta[m].key,1,klen,idx->archive_fp); e->meta[m].key[klen]=0; } else e->meta[m].key = NULL;
-        uint16_t vlen = read_u16(idx->archive_fp);
-        if(vlen){ e->meta[m].value = malloc(vlen+1); fread(e->meta[m].value,1,vlen,idx->archive_fp); e->meta[m].value[vlen]=0; } else e->meta[m].value = NULL;
+        char **fields[2] = { &e->meta[m].key, &e->meta[m].value };
+        for(int k=0;k<2;k++){
+            uint16_t len = 0;
+            if(pread_full(fd, &len, 2, off) != 0) return 1;
+            off += 2;
+            *fields[k] = NULL;
+            if(len){
+                char *v = malloc((size_t)len + 1);
+                if(!v || pread_full(fd, v, len, off) != 0){ free(v); return 1; }
+                v[len] = 0;
+                *fields[k] = v;
+                off += len;
+            }
+        }
     }
-    if(cur>=0) fseek(idx->archive_fp, cur, SEEK_SET);
     return 0;
 }
 
@@ -5898,37 +7822,92 @@ static void entry_free_meta(entry_t *e){
     free(e->meta); e->meta = NULL; e->meta_n = 0;
 }
 
+/* Set a meta key on an entry, replacing an existing value. Lazily stored meta is loaded first. */
+static int entry_set_meta(index_t *idx, entry_t *e, const char *key, const char *value){
+    if(!e || !key || !value) return 1;
+    if(e->meta_n && !e->meta && entry_load_meta(idx, e) != 0) return 1;
+    for(uint32_t m=0;m<e->meta_n;m++){
+        if(e->meta[m].key && strcmp(e->meta[m].key, key) == 0){
+            char *v = strdup(value);
+            if(!v) return 1;
+            free(e->meta[m].value);
+            e->meta[m].value = v;
+            return 0;
+        }
+    }
+    void *tmp = realloc(e->meta, sizeof(*e->meta) * (e->meta_n + 1));
+    if(!tmp) return 1;
+    e->meta = tmp;
+    e->meta[e->meta_n].key = strdup(key);
+    e->meta[e->meta_n].value = strdup(value);
+    e->meta_n++;
+    return 0;
+}
+
+/* BAAR_STAT meta: "dev:ino:ctime_sec.nsec:mtime_sec.nsec" of a regular file when it was stored.
+   Incremental runs compare it with the current stat to skip unchanged files without reading them. */
+static void format_stat_cache(const struct stat *st, char *out, size_t outlen){
+    snprintf(out, outlen, "%llu:%llu:%lld.%09ld:%lld.%09ld",
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+             (long long)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec,
+             (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+}
+
+/* Incremental change test: size and permission bits must match; entries with a stat cache
+   must also match it exactly, entries written before it existed fall back to whole-second mtime. */
+static int stat_matches_entry(uint64_t entry_size, uint32_t entry_mode, uint64_t entry_mtime,
+                              const char *cached, const struct stat *st){
+    /* symlinks, directories and device nodes are stored header-only with size 0 */
+    uint64_t size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+    if(entry_size != size) return 0;
+    if((entry_mode & 07777u) != (uint32_t)(st->st_mode & 07777u)) return 0;
+    if(cached){
+        char cur[128];
+        format_stat_cache(st, cur, sizeof(cur));
+        return strcmp(cached, cur) == 0;
+    }
+    return entry_mtime == (uint64_t)st->st_mtime;
+}
+
+static int source_unchanged(index_t *idx, entry_t *existing, const struct stat *st){
+    return stat_matches_entry(existing->uncomp_size, existing->mode, existing->mtime,
+                              entry_get_meta_val(idx, existing, "BAAR_STAT"), st);
+}
+
+static void write_index_entry(FILE *f, index_t *idx, entry_t *e){
+    write_u32(f, e->id);
+    const char *namep = e->name ? e->name : entry_get_name(idx, e);
+    uint16_t namelen = namep ? (uint16_t)strlen(namep) : 0;
+    write_u16(f, namelen);
+    if(namep && namelen) fwrite(namep,1,namelen,f);
+    fputc(e->flags,f);
+    fputc(e->comp_level,f);
+    write_u64(f, e->data_offset);
+    write_u64(f, e->comp_size);
+    write_u64(f, e->uncomp_size);
+    write_u32(f, e->crc32);
+
+    write_u32(f, e->mode);
+    write_u32(f, e->uid);
+    write_u32(f, e->gid);
+    write_u64(f, e->mtime);
+
+    write_u32(f, e->meta_n);
+    if(e->meta_n && !e->meta && idx) entry_load_meta(idx, e);
+    for(uint32_t m=0;m<e->meta_n;m++){
+        uint16_t klen = e->meta[m].key ? strlen(e->meta[m].key) : 0;
+        uint16_t vlen = e->meta[m].value ? strlen(e->meta[m].value) : 0;
+        write_u16(f, klen); if(klen) fwrite(e->meta[m].key,1,klen,f);
+        write_u16(f, vlen); if(vlen) fwrite(e->meta[m].value,1,vlen,f);
+    }
+}
+
 static int write_index(FILE *f, index_t *idx){
 
     uint64_t off = ftell(f);
     write_u32(f, idx->n);
     for(uint32_t i=0;i<idx->n;i++){
-        entry_t *e = &idx->entries[i];
-        write_u32(f, e->id);
-        const char *namep = e->name ? e->name : entry_get_name(idx, e);
-        uint16_t namelen = namep ? (uint16_t)strlen(namep) : 0;
-        write_u16(f, namelen);
-        if(namep && namelen) fwrite(namep,1,namelen,f);
-        fputc(e->flags,f);
-        fputc(e->comp_level,f);
-        write_u64(f, e->data_offset);
-        write_u64(f, e->comp_size);
-        write_u64(f, e->uncomp_size);
-        write_u32(f, e->crc32);
-
-        write_u32(f, e->mode);
-        write_u32(f, e->uid);
-        write_u32(f, e->gid);
-        write_u64(f, e->mtime);
-
-        write_u32(f, e->meta_n);
-        if(e->meta_n && !e->meta && idx) entry_load_meta(idx, e);
-        for(uint32_t m=0;m<e->meta_n;m++){
-            uint16_t klen = e->meta[m].key ? strlen(e->meta[m].key) : 0;
-            uint16_t vlen = e->meta[m].value ? strlen(e->meta[m].value) : 0;
-            write_u16(f, klen); if(klen) fwrite(e->meta[m].key,1,klen,f);
-            write_u16(f, vlen); if(vlen) fwrite(e->meta[m].value,1,vlen,f);
-        }
+        write_index_entry(f, idx, &idx->entries[i]);
     }
     return (int)off;
 }
@@ -5963,6 +7942,44 @@ static int ensure_header(FILE *f){
     return 0;
 }
 
+/* 'baar a -' writes through a cookie stream that counts bytes, so the add path's
+   fseek(SEEK_END)/ftell() pairs still yield blob offsets; seeking anywhere else fails. */
+typedef struct {
+    int fd;
+    uint64_t pos;
+} pipe_out_t;
+
+static ssize_t pipe_out_write(void *cookie, const char *buf, size_t len){
+    pipe_out_t *p = cookie;
+    size_t done = 0;
+    while(done < len){
+        ssize_t w = write(p->fd, buf + done, len - done);
+        if(w < 0 && errno == EINTR) continue;
+        if(w <= 0) break;
+        done += (size_t)w;
+    }
+    p->pos += done;
+    return done ? (ssize_t)done : -1;
+}
+
+static int pipe_out_seek(void *cookie, off64_t *off, int whence){
+    pipe_out_t *p = cookie;
+    if((whence == SEEK_SET && *off >= 0 && (uint64_t)*off == p->pos) ||
+       ((whence == SEEK_CUR || whence == SEEK_END) && *off == 0)){
+        *off = (off64_t)p->pos;
+        return 0;
+    }
+    errno = ESPIPE;
+    return -1;
+}
+
+static FILE *pipe_out_open(pipe_out_t *p){
+    cookie_io_functions_t fns = { .read = NULL, .write = pipe_out_write, .seek = pipe_out_seek, .close = NULL };
+    FILE *f = fopencookie(p, "w", fns);
+    if(f) setvbuf(f, NULL, _IOFBF, BAAR_STREAM_CHUNK_SIZE);
+    return f;
+}
+
 typedef enum {
     FILE_PLAN_ADD = 0,
     FILE_PLAN_SKIP_UNCHANGED,
@@ -6040,15 +8057,25 @@ static int name_in_desired(char **arr, size_t count, const char *name){
     return 0;
 }
 
-static void append_unique_id(uint32_t **arr, uint32_t *count, uint32_t id){
+/* Append `id` unless `seen` already has it. The array doubles from 16 slots, so its capacity is
+   implied by the count. */
+static void append_unique_id(uint32_t **arr, uint32_t *count, id_set_t *seen, uint32_t id){
     if(!arr || !count) return;
-    for(uint32_t i=0;i<*count;i++){
-        if((*arr)[i] == id) return;
+    int added = id_set_add(seen, id);
+    if(added == 0) return;
+    if(added < 0){
+        for(uint32_t i=0;i<*count;i++){
+            if((*arr)[i] == id) return;
+        }
     }
-    uint32_t *tmp = realloc(*arr, sizeof(uint32_t) * (*count + 1));
-    if(!tmp) return;
-    *arr = tmp;
-    (*arr)[*count] = id;
+    uint32_t n = *count;
+    if(n == 0 || (n >= 16 && !(n & (n - 1)))){
+        size_t cap = n ? (size_t)n * 2 : 16;
+        uint32_t *tmp = realloc(*arr, sizeof(uint32_t) * cap);
+        if(!tmp) return;
+        *arr = tmp;
+    }
+    (*arr)[n] = id;
     (*count)++;
 }
 
@@ -6058,9 +8085,6 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
     if(!f) f = fopen(archive, "w+b");
     if(!f) { perror("open archive"); return 1; }
     ensure_header(f);
-    uint64_t archive_mtime = 0;
-    struct stat arch_st;
-    if(stat(archive, &arch_st) == 0){ archive_mtime = (uint64_t)arch_st.st_mtime; }
     index_t idx = load_index(f);
     const char *mirror_debug = getenv("BAAR_DEBUG_MIRROR");
 
@@ -6094,6 +8118,7 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
 
     char **desired_names = NULL;
     size_t desired_count = 0;
+    size_t desired_cap = 0;
     int desired_valid = 1;
 
     if(plans){
@@ -6137,8 +8162,9 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
                 }
             }
 
+            entry_t *existing = NULL;
             if(filepairs[i].archive_path){
-                entry_t *existing = find_entry_by_name(entry_lookup, entry_lookup_count, filepairs[i].archive_path);
+                existing = find_entry_by_name(entry_lookup, entry_lookup_count, filepairs[i].archive_path);
                 if(existing){
                     plan->existing_id = existing->id;
                     plan->existing_valid = 1;
@@ -6150,37 +8176,22 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
 
             if(mirror_mode){
                 if(plan->counts_for_desired && filepairs[i].archive_path && desired_valid){
-                    char **tmp = realloc(desired_names, sizeof(char*) * (desired_count + 1));
-                    if(!tmp){
+                    if(desired_count == desired_cap){
+                        size_t ncap = desired_cap ? desired_cap * 2 : 64;
+                        char **tmp = realloc(desired_names, sizeof(char*) * ncap);
+                        if(tmp){ desired_names = tmp; desired_cap = ncap; }
+                    }
+                    if(desired_count == desired_cap){
                         desired_valid = 0;
                     } else {
-                        desired_names = tmp;
                         desired_names[desired_count++] = filepairs[i].archive_path;
                     }
                 }
             }
 
             if(incremental_mode){
-                if(plan->stat_ok && plan->readable && plan->existing_valid){
-                    if(plan->existing_uncomp == (uint64_t)plan->st.st_size &&
-                       (plan->existing_mode & 07777u) == (uint32_t)(plan->st.st_mode & 07777u)){
-                        /* If mtimes match exactly, skip unchanged (fast-path) */
-                        if(plan->existing_mtime == (uint64_t)plan->st.st_mtime){
-                            plan->action = FILE_PLAN_SKIP_UNCHANGED;
-                        } else {
-                            /* If st_mtime and existing_mtime are both older or equal to the archive
-                               mtime, treat as unchanged (handles mirrored copies and small clock shifts). */
-                                     /* allow a small grace window after archive modification to account
-                                         for mirroring, time skew, and copy utilities which may update mtime
-                                         within a short period; default is 1 hour */
-                                     uint64_t grace = 60ULL * 60ULL;
-                                     if(archive_mtime != 0 &&
-                                         (uint64_t)plan->st.st_mtime <= (archive_mtime + grace) &&
-                                         plan->existing_mtime <= (archive_mtime + grace)){
-                                plan->action = FILE_PLAN_SKIP_UNCHANGED;
-                            }
-                        }
-                    }
+                if(plan->stat_ok && plan->readable && existing && source_unchanged(&idx, existing, &plan->st)){
+                    plan->action = FILE_PLAN_SKIP_UNCHANGED;
                 }
             }
 
@@ -6206,6 +8217,7 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
 
     uint32_t *to_remove = NULL;
     uint32_t remove_count = 0;
+    id_set_t remove_set = {0};
 
     if(mirror_mode && desired_valid){
         if(desired_count > 1 && desired_names){
@@ -6219,7 +8231,7 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
                 keep = 0;
             }
             if(!keep){
-                append_unique_id(&to_remove, &remove_count, e->id);
+                append_unique_id(&to_remove, &remove_count, &remove_set, e->id);
             }
         }
     }
@@ -6228,10 +8240,11 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
         for(int i=0;i<nfiles;i++){
             file_plan_t *plan = &plans[i];
             if(plan->existing_valid && plan->action == FILE_PLAN_ADD){
-                append_unique_id(&to_remove, &remove_count, plan->existing_id);
+                append_unique_id(&to_remove, &remove_count, &remove_set, plan->existing_id);
             }
         }
     }
+    id_set_free(&remove_set);
 
     free(entry_lookup);
     entry_lookup = NULL;
@@ -6240,49 +8253,18 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
         fprintf(stderr, "[BAAR mirror] desired=%zu remove=%u valid=%d\n", desired_count, remove_count, desired_valid);
     }
 
-    if(incremental_mode){
-        if(remove_count > 0 && to_remove){
-            if(!global_quiet && mirror_mode){
-                fprintf(stderr, "Mirror: marking %u entries as deleted\n", remove_count);
-            }
-            for(uint32_t i=0;i<remove_count;i++){
-                uint32_t rid = to_remove[i];
-                for(uint32_t j=0;j<idx.n;j++){
-                    if(idx.entries[j].id == rid){
-                        idx.entries[j].flags |= 4;
-                        break;
-                    }
-                }
-            }
-        }
-        free(to_remove);
-        to_remove = NULL;
-    } else if(remove_count > 0){
-        fclose(f);
-        if(rebuild_archive(archive, to_remove, remove_count, global_quiet) != 0){
-            free(to_remove);
-            free(desired_names);
-            free(plans);
-            free_index(&idx);
-            return 1;
+    /* superseded entries are only flagged; the compaction policy decides when to rebuild */
+    uint32_t superseded = remove_count;
+    if(remove_count > 0 && to_remove){
+        if(!global_quiet && mirror_mode){
+            fprintf(stderr, "Mirror: marking %u entries as deleted\n", remove_count);
         }
-        free(to_remove);
-        to_remove = NULL;
-        f = fopen(archive, "r+b");
-        if(!f) f = fopen(archive, "w+b");
-        if(!f){
-            perror("reopen archive");
-            free(desired_names);
-            free(plans);
-            free_index(&idx);
-            return 1;
+        for(uint32_t i=0;i<remove_count;i++){
+            mark_entry_deleted_flag(&idx, to_remove[i]);
         }
-        ensure_header(f);
-        free_index(&idx);
-        idx = load_index(f);
-    } else {
-        free(to_remove);
     }
+    free(to_remove);
+    to_remove = NULL;
 
     fseek(f,0,SEEK_END);
 
@@ -6320,13 +8302,15 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
             size_t fsize = (size_t)plan->st.st_size;
             int streaming_mode = (fsize > BAAR_STREAM_THRESHOLD);
             unsigned char *buf = NULL;
+            unsigned char *src_map = NULL;
             unsigned char *out = NULL;
             size_t final_sz = 0;
             uint32_t crc = 0;
             int compressed = 0;
             if(!streaming_mode && fsize > 0){
-                buf = malloc(fsize);
-                if(!buf){
+                src_map = map_source_file(path, fsize);
+                if(!src_map) buf = malloc(fsize);
+                if(!src_map && !buf){
                     streaming_mode = 1;
                 }
             }
@@ -6357,7 +8341,7 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
                 final_sz = 0;
                 crc = 0;
             } else if(streaming_mode){
-                if(stream_copy_file_with_crc(path, f, pwd, &final_sz, &crc) != 0){
+                if(stream_copy_file_with_crc(path, f, pwd, NULL, 0, &final_sz, &crc, NULL) != 0){
                     if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
                     if(sarg) free(sarg);
                     fprintf(stderr, "Cannot process %s: %s\n", path, strerror(errno));
@@ -6365,6 +8349,15 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
                     continue;
                 }
                 compressed = 0;
+            } else if(src_map){
+                int rc = write_mapped_blob(f, path, src_map, fsize, clevel, pwd,
+                                           data_offset, &crc, &final_sz, &compressed, NULL);
+                munmap(src_map, fsize);
+                if(rc != 0){
+                    if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+                    if(sarg) free(sarg);
+                    continue;
+                }
             } else {
                 FILE *in = fopen(path, "rb");
                 if(!in){
@@ -6419,6 +8412,9 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
             e->uid = (uint32_t)plan->st.st_uid;
             e->gid = (uint32_t)plan->st.st_gid;
             e->mtime = (uint64_t)plan->st.st_mtime;
+            char stat_buf[128];
+            format_stat_cache(&plan->st, stat_buf, sizeof(stat_buf));
+            entry_set_meta(&idx, e, "BAAR_STAT", stat_buf);
 
             unsigned int percent = 0;
             if(fsize>0 && final_sz <= fsize){
@@ -6457,72 +8453,991 @@ static int add_files(const char *archive, filepair_t *filepairs, int *clevels, i
     free(desired_names);
     free(plans);
     free_index(&idx);
+    if(!incremental_mode && superseded > 0){
+        return maybe_compact_archive(archive, global_quiet);
+    }
     return 0;
 }
 
-static int process_single_file(add_stream_ctx_t *ctx,
-                               const char *src_path, const char *archive_path,
-                               int clevel, const struct stat *st){
-    if(!ctx || !ctx->idx || !ctx->archive_fp || !src_path || !archive_path || !st){
-        return 1;
-    }
-    if(g_abort_requested) return 1;
-    /* Only skip if stat failed. We allow regular files and a subset of special
-       types (symlinks, char/block devices, fifos). Further filtering based on
-       pseudo-roots and ignore patterns is handled by walk_job_tree. */
-    if(!st) return 1;
-    if(!(S_ISREG(st->st_mode) || S_ISLNK(st->st_mode) || S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) || S_ISFIFO(st->st_mode) || S_ISDIR(st->st_mode))){
-        if(!global_quiet){
-            fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
-        }
-        return 0;
-    }
+/* A source stalled past --io-timeout: abandon the blocked reader, drop whatever part of the
+   blob was already written and remember the path for the end-of-run summary. */
+static void note_io_timeout(add_stream_ctx_t *ctx, const char *src_path, uint64_t data_offset){
+    io_worker_release(ctx->io);
+    ctx->io = NULL;
+    fflush(ctx->archive_fp);
+    if(ftruncate(fileno(ctx->archive_fp), (off_t)data_offset) != 0){ /* left unreferenced */ }
+    fseeko(ctx->archive_fp, (off_t)data_offset, SEEK_SET);
+    fprintf(stderr, "Timed out reading %s (no progress for %d ms); skipped\n", src_path, ctx->io_timeout_ms);
+    str_list_append(&ctx->timed_out_paths, &ctx->timed_out_count, src_path);
+}
 
-    /* Avoid adding the archive file itself if it resides inside the source tree being added.
-       Compare device/inode obtained from stat of the archive path (if available) to the src file stat. */
-    if(ctx && ctx->archive_path_on_disk) {
-        struct stat arch_st;
-        if(stat(ctx->archive_path_on_disk, &arch_st) == 0){
-            if(arch_st.st_ino == st->st_ino && arch_st.st_dev == st->st_dev){
-                if(!global_quiet) fprintf(stderr, "Skipping archive file itself: %s\n", src_path);
-                return 0;
-            }
-        }
+/* Queue an existing entry for removal, noting where its id landed in *to_remove. */
+static void queue_removal(add_stream_ctx_t *ctx, uint32_t id){
+    uint32_t pos = *ctx->remove_count;
+    append_unique_id(ctx->to_remove, ctx->remove_count, ctx->remove_set, id);
+    if(*ctx->remove_count != pos && ctx->remove_slot && id < ctx->remove_slot_n) ctx->remove_slot[id] = pos;
+}
+
+/* Take `id` back out of *to_remove; the last id moves into its place. */
+static void unqueue_removal(add_stream_ctx_t *ctx, uint32_t id){
+    if(!ctx->remove_set || !id_set_has(ctx->remove_set, id)) return;
+    uint32_t *ids = *ctx->to_remove;
+    uint32_t pos = (ctx->remove_slot && id < ctx->remove_slot_n) ? ctx->remove_slot[id] : UINT32_MAX;
+    if(pos >= *ctx->remove_count || ids[pos] != id){
+        for(pos=0; pos<*ctx->remove_count && ids[pos] != id; pos++);
+        if(pos == *ctx->remove_count) return;
+    }
+    uint32_t last = ids[--(*ctx->remove_count)];
+    ids[pos] = last;
+    if(ctx->remove_slot && last < ctx->remove_slot_n) ctx->remove_slot[last] = pos;
+    id_set_remove(ctx->remove_set, id);
+}
+
+/* Undo process_single_file's bookkeeping for an entry whose data could not be stored: the slot
+   being filled is dropped and a previous version of the same path stays in the archive. */
+static void discard_pending_entry(add_stream_ctx_t *ctx, size_t replaced_idx, uint32_t replaced_flags){
+    entry_t *e = &ctx->idx->entries[ctx->idx->n];
+    free(e->name);
+    e->name = NULL;
+    ctx->idx->next_id--;
+    if(replaced_idx != SIZE_MAX){
+        entry_t *prev = &ctx->idx->entries[replaced_idx];
+        prev->flags = replaced_flags;
+        unqueue_removal(ctx, prev->id);
     }
-    if(clevel < 0) clevel = 0;
-    if(clevel > 3) clevel = 3;
+}
 
-    entry_t *existing = find_entry_by_name_fast(ctx->entry_lookup, ctx->entry_lookup_count,
-                                                ctx->idx, archive_path);
+/* A source stalled past --io-timeout: the entry is dropped and the run goes on. */
+static int abandon_timed_out_entry(add_stream_ctx_t *ctx, const char *src_path, uint64_t data_offset,
+                                   size_t replaced_idx, uint32_t replaced_flags){
+    note_io_timeout(ctx, src_path, data_offset);
+    discard_pending_entry(ctx, replaced_idx, replaced_flags);
+    return 0;
+}
+
+/* CRC and/or SHA-256 of a source file (--verify-content, --dedup), read through the io worker
+   under --io-timeout. Either output may be NULL. Returns 0, -1 on error or -2 on timeout. */
+static int source_digest(add_stream_ctx_t *ctx, const char *path, uint32_t *crc_out, unsigned char *sha_out){
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    if(!chunk) return -1;
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    SHA256_CTX shactx;
+    SHA256_Init(&shactx);
+    if(ctx->io_timeout_ms > 0 && !ctx->io) ctx->io = io_worker_start();
+    int status = 0;
+    if(ctx->io){
+        status = io_worker_open(ctx->io, path, ctx->io_timeout_ms);
+        for(uint64_t off = 0; status == 0; ){
+            ssize_t n = io_worker_pread(ctx->io, chunk, BAAR_STREAM_CHUNK_SIZE, off, ctx->io_timeout_ms);
+            if(n < 0){ status = (int)n; break; }
+            if(n == 0) break;
+            if(crc_out) crc = (uint32_t)crc32(crc, chunk, (uInt)n);
+            if(sha_out) SHA256_Update(&shactx, chunk, (size_t)n);
+            off += (uint64_t)n;
+        }
+    } else {
+        FILE *in = fopen(path, "rb");
+        if(!in) status = -1;
+        size_t n;
+        while(in && (n = fread(chunk, 1, BAAR_STREAM_CHUNK_SIZE, in)) > 0){
+            if(crc_out) crc = (uint32_t)crc32(crc, chunk, (uInt)n);
+            if(sha_out) SHA256_Update(&shactx, chunk, n);
+        }
+        if(in && ferror(in)) status = -1;
+        if(in) fclose(in);
+    }
+    free(chunk);
+    if(crc_out) *crc_out = crc;
+    if(sha_out) SHA256_Final(sha_out, &shactx);
+    return status;
+}
+
+/* --delta: encode src_path against the decoded data of `base`. The source is read through a
+   mapping (guarded against truncation). On success *blob_out holds the (possibly compressed)
+   delta to store; returns 1 when a full copy should be stored instead (delta not at least
+   half the size, base unreadable, mapping failed). */
+static int try_delta_blob(add_stream_ctx_t *ctx, entry_t *base, const char *src_path,
+                          unsigned char *src_map, size_t fsize, int clevel,
+                          unsigned char **blob_out, size_t *blob_sz, int *compressed_out,
+                          uint32_t *crc_out, unsigned char *sha_out){
+    if(base->uncomp_size > SIZE_MAX) return 1;
+    size_t bn = (size_t)base->uncomp_size;
+    unsigned char *bbuf = malloc(bn);
+    if(!bbuf) return 1;
+    size_t got = 0;
+    fflush(ctx->archive_fp);
+    if(entry_decode_into(ctx->archive_fp, ctx->idx, base, NULL, bbuf, bn, &got) != 0 ||
+       got != bn || crc32_buf(0, bbuf, bn) != base->crc32){
+        free(bbuf);
+        return 1;
+    }
+    unsigned char *map = src_map ? src_map : map_source_file(src_path, fsize);
+    if(!map){ free(bbuf); return 1; }
+
+    unsigned char *delta = NULL;
+    size_t delta_len = 0;
+    uint32_t crc = 0;
+    int status = 1;
+    sigjmp_buf jb;
+    source_map_guard_begin(&jb);
+    if(sigsetjmp(jb, 1) == 0){
+        if(delta_encode(bbuf, bn, map, fsize, fsize / 2, &delta, &delta_len) == 0){
+            crc = crc32_buf(0, map, fsize);
+            if(sha_out) SHA256(map, fsize, sha_out);
+            status = 0;
+        }
+    } else {
+        free(delta); /* file shrank while being read; the regular path reports it */
+        delta = NULL;
+    }
+    source_map_guard_end();
+    if(!src_map) munmap(map, fsize);
+    free(bbuf);
+    if(status != 0) return 1;
+
+    int compressed = 0;
+    unsigned char *tmpout = NULL;
+    size_t tmpoutsz = 0;
+    if(clevel > 0 && compress_data_level(clevel, delta, delta_len, &tmpout, &tmpoutsz) == 0){
+        if(tmpoutsz < delta_len){
+            free(delta);
+            delta = tmpout;
+            delta_len = tmpoutsz;
+            compressed = 1;
+        } else {
+            free(tmpout);
+        }
+    }
+    *blob_out = delta;
+    *blob_sz = delta_len;
+    *compressed_out = compressed;
+    *crc_out = crc;
+    return 0;
+}
+
+/* --cdc: store src_path as content-defined chunks followed by its manifest. Chunks already in
+   ctx->cdc are referenced instead of written. The manifest offset/size become the entry's blob.
+   Returns 0, 1 after reporting an error (archive truncated back to data_offset) or -2 when a
+   read timed out under --io-timeout (the caller abandons the entry). */
+static int write_chunked_blob(add_stream_ctx_t *ctx, const char *src_path, size_t fsize, int clevel,
+                              uint64_t data_offset, uint32_t *crc_out, uint64_t *manifest_off,
+                              size_t *manifest_size, unsigned char *sha_out){
+    cdc_index_t *ci = ctx->cdc;
+    uint8_t enc_flag = ci->xs.active ? 2 : 0;
+    size_t cap = 8 * (size_t)BAAR_CDC_MAX;
+    unsigned char *buf = malloc(cap);
+    size_t nchunks_est = fsize / BAAR_CDC_AVG + 16;
+    size_t mcap = BAAR_CDC_HEADER_SIZE + nchunks_est * BAAR_CDC_RECORD_SIZE;
+    unsigned char *man = malloc(mcap);
+    size_t mlen = BAAR_CDC_HEADER_SIZE;
+    int fd = -1;
+    int status = (buf && man) ? 0 : 1;
+    if(status) fprintf(stderr, "Out of memory while chunking %s\n", src_path);
+    if(status == 0){
+        if(ctx->io){
+            int r = io_worker_open(ctx->io, src_path, ctx->io_timeout_ms);
+            if(r == -2) status = -2;
+            else if(r != 0) status = 1;
+        } else {
+            fd = open(src_path, O_RDONLY | O_CLOEXEC);
+            if(fd < 0) status = 1;
+            else posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        if(status == 1) fprintf(stderr, "Cannot open %s: %s\n", src_path, strerror(errno));
+    }
+
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    SHA256_CTX shactx;
+    if(sha_out) SHA256_Init(&shactx);
+    uint64_t read_off = 0;
+    size_t start = 0, end = 0;
+    uint32_t nchunks = 0;
+    size_t added = 0, reused = 0;
+    uint64_t reused_bytes = 0;
+    while(status == 0){
+        /* keep at least BAAR_CDC_MAX bytes ahead of the cut search unless at end of file */
+        if(end - start < BAAR_CDC_MAX && read_off < fsize){
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+            while(end < cap && read_off < fsize){
+                size_t want = cap - end;
+                if(want > fsize - read_off) want = (size_t)(fsize - read_off);
+                ssize_t n;
+                if(ctx->io) n = io_worker_pread(ctx->io, buf + end, want, read_off, ctx->io_timeout_ms);
+                else {
+                    do { n = pread(fd, buf + end, want, (off_t)read_off); } while(n < 0 && errno == EINTR);
+                }
+                if(n == -2){ status = -2; break; }
+                if(n < 0){
+                    fprintf(stderr, "Read error for %s: %s\n", src_path, strerror(errno));
+                    status = 1;
+                    break;
+                }
+                if(n == 0){
+                    fprintf(stderr, "Read error for %s: unexpected end of file\n", src_path);
+                    status = 1;
+                    break;
+                }
+                end += (size_t)n;
+                read_off += (uint64_t)n;
+            }
+            if(status) break;
+        }
+        if(start == end) break;
+
+        const unsigned char *p = buf + start;
+        size_t len = cdc_cut(p, end - start);
+        crc = crc32_buf(crc, p, len);
+        if(sha_out) SHA256_Update(&shactx, p, len);
+        cdc_chunk_t c;
+        cdc_chunk_key(ci, p, len, c.key);
+        const cdc_chunk_t *hit = cdc_index_find(ci, c.key, enc_flag);
+        if(hit){
+            c = *hit;
+            reused++;
+            reused_bytes += c.comp_size;
+        } else {
+            unsigned char *tmpout = NULL;
+            size_t tmpoutsz = 0;
+            const unsigned char *stored = p;
+            size_t stored_sz = len;
+            c.flags = enc_flag;
+            if(clevel > 0 && compress_data_level(clevel, p, len, &tmpout, &tmpoutsz) == 0){
+                if(tmpoutsz < len){
+                    stored = tmpout;
+                    stored_sz = tmpoutsz;
+                    c.flags |= 1;
+                } else {
+                    free(tmpout);
+                    tmpout = NULL;
+                }
+            }
+            unsigned char *wbuf = (unsigned char *)stored;
+            if(enc_flag){
+                /* the window must survive for the next cut, so encrypt a copy */
+                if(!tmpout){
+                    tmpout = malloc(len);
+                    if(tmpout) memcpy(tmpout, p, len);
+                }
+                wbuf = tmpout;
+                if(wbuf) xor_stream_apply(&ci->xs, wbuf, stored_sz, 0);
+            }
+            c.offset = (uint64_t)ftello(ctx->archive_fp);
+            c.comp_size = (uint32_t)stored_sz;
+            c.size = (uint32_t)len;
+            if(!wbuf || fwrite(wbuf, 1, stored_sz, ctx->archive_fp) != stored_sz){
+                fprintf(stderr, "Write error while adding %s\n", src_path);
+                free(tmpout);
+                status = 1;
+                break;
+            }
+            free(tmpout);
+            cdc_index_insert(ci, &c);
+            added++;
+        }
+        c.size = (uint32_t)len;
+        if(mlen + BAAR_CDC_RECORD_SIZE > mcap){
+            size_t ncap = mcap * 2;
+            unsigned char *grown = realloc(man, ncap);
+            if(!grown){
+                fprintf(stderr, "Out of memory while chunking %s\n", src_path);
+                status = 1;
+                break;
+            }
+            man = grown;
+            mcap = ncap;
+        }
+        cdc_record_put(man + mlen, &c);
+        mlen += BAAR_CDC_RECORD_SIZE;
+        nchunks++;
+        start += len;
+    }
+    if(fd >= 0) close(fd);
+
+    if(status == 0){
+        memcpy(man, BAAR_CDC_MAGIC, 4);
+        for(int i=0;i<4;i++) man[4 + i] = (unsigned char)(nchunks >> (8 * i));
+        *manifest_off = (uint64_t)ftello(ctx->archive_fp);
+        if(fwrite(man, 1, mlen, ctx->archive_fp) != mlen){
+            fprintf(stderr, "Write error while adding %s\n", src_path);
+            status = 1;
+        }
+    }
+    free(buf);
+    free(man);
+    if(status != 0){
+        cdc_index_forget_from(ci, data_offset);
+        if(status == 1){
+            fflush(ctx->archive_fp);
+            if(ftruncate(fileno(ctx->archive_fp), (off_t)data_offset) != 0){ /* best effort */ }
+            fseeko(ctx->archive_fp, (off_t)data_offset, SEEK_SET);
+        }
+        return status;
+    }
+    ci->new_chunks += added;
+    ci->reused_chunks += reused;
+    ci->reused_bytes += reused_bytes;
+    *manifest_size = mlen;
+    *crc_out = crc;
+    if(sha_out) SHA256_Final(sha_out, &shactx);
+    return 0;
+}
+
+/* Rename detection for -i/--mirror: archive entries keyed by the (dev, inode) recorded in their
+   BAAR_STAT, so a file that shows up under a new path can take over the stored data of the entry
+   it was moved from. Built on the first new path, for entries present before this run. */
+typedef struct inode_map {
+    struct { uint64_t dev, ino; uint32_t slot; int used; } *items;
+    size_t cap;
+    size_t hits;
+    uint64_t bytes;
+} inode_map_t;
+
+static int parse_stat_cache(const char *s, uint64_t *dev, uint64_t *ino, long long *mt_sec, long *mt_nsec){
+    unsigned long long d, i;
+    long long cs;
+    long cns;
+    if(!s || sscanf(s, "%llu:%llu:%lld.%ld:%lld.%ld", &d, &i, &cs, &cns, mt_sec, mt_nsec) != 6) return -1;
+    *dev = d;
+    *ino = i;
+    return 0;
+}
+
+static inode_map_t *inode_map_build(index_t *idx, size_t count){
+    inode_map_t *m = calloc(1, sizeof(*m));
+    if(!m) return NULL;
+    m->cap = 64;
+    while(m->cap < count * 2) m->cap <<= 1;
+    m->items = calloc(m->cap, sizeof(*m->items));
+    if(!m->items){ free(m); return NULL; }
+    for(size_t s=0; s<count; s++){
+        entry_t *e = &idx->entries[s];
+        uint64_t dev, ino; long long sec; long nsec;
+        if((e->flags & 4) || e->uncomp_size == 0) continue;
+        if(parse_stat_cache(entry_get_meta_val(idx, e, "BAAR_STAT"), &dev, &ino, &sec, &nsec) != 0) continue;
+        size_t i = dedup_size_hash(dev * 0x9e3779b97f4a7c15ULL ^ ino, m->cap);
+        while(m->items[i].used) i = (i + 1) & (m->cap - 1);
+        m->items[i].dev = dev;
+        m->items[i].ino = ino;
+        m->items[i].slot = (uint32_t)s;
+        m->items[i].used = 1;
+    }
+    return m;
+}
+
+static void inode_map_free(inode_map_t *m){
+    if(!m) return;
+    free(m->items);
+    free(m);
+}
+
+/* A live entry whose stat cache has the same inode, size and mtime as `st`, or NULL. Several
+   entries may share an inode (hard links); any of them holds the same data. */
+static entry_t *inode_map_lookup(inode_map_t *m, index_t *idx, const struct stat *st, int enc_flag){
+    uint64_t dev = (uint64_t)st->st_dev, ino = (uint64_t)st->st_ino;
+    for(size_t i = dedup_size_hash(dev * 0x9e3779b97f4a7c15ULL ^ ino, m->cap); m->items[i].used;
+        i = (i + 1) & (m->cap - 1)){
+        if(m->items[i].dev != dev || m->items[i].ino != ino) continue;
+        entry_t *e = &idx->entries[m->items[i].slot];
+        uint64_t d, n; long long sec; long nsec;
+        if((e->flags & 4) || (e->flags & 2) != enc_flag || e->uncomp_size != (uint64_t)st->st_size) continue;
+        if(parse_stat_cache(entry_get_meta_val(idx, e, "BAAR_STAT"), &d, &n, &sec, &nsec) != 0) continue;
+        if(sec == (long long)st->st_mtim.tv_sec && nsec == (long)st->st_mtim.tv_nsec) return e;
+    }
+    return NULL;
+}
+
+/* Store `archive_path` as a moved copy of an existing entry: the new entry shares its data (and
+   the meta describing that data) and nothing is read. Returns 0 when the entry was added. */
+static int add_moved_entry(add_stream_ctx_t *ctx, const char *src_path, const char *archive_path,
+                           const struct stat *st){
+    if(!ctx->moved){
+        ctx->moved = inode_map_build(ctx->idx, ctx->original_entry_count);
+        if(!ctx->moved) return 1;
+    }
+    entry_t *old = inode_map_lookup(ctx->moved, ctx->idx, st, (ctx->pwd && ctx->pwd[0]) ? 2 : 0);
+    if(!old) return 1;
+    size_t old_slot = (size_t)(old - ctx->idx->entries);
+    char *name = strdup(archive_path);
+    entry_t *grown = name ? realloc(ctx->idx->entries, sizeof(entry_t) * (ctx->idx->n + 1)) : NULL;
+    if(!grown){
+        free(name);
+        return 1;
+    }
+    ctx->idx->entries = grown;
+    old = &ctx->idx->entries[old_slot];
+    entry_t *e = &ctx->idx->entries[ctx->idx->n];
+    memset(e, 0, sizeof(*e));
+    e->id = ctx->idx->next_id++;
+    e->name = name;
+    e->flags = old->flags;
+    e->comp_level = old->comp_level;
+    e->data_offset = old->data_offset;
+    e->comp_size = old->comp_size;
+    e->uncomp_size = old->uncomp_size;
+    e->crc32 = old->crc32;
+    e->mode = (uint32_t)(st->st_mode & 07777u);
+    e->uid = (uint32_t)st->st_uid;
+    e->gid = (uint32_t)st->st_gid;
+    e->mtime = (uint64_t)st->st_mtime;
+    clone_entry_meta(ctx->idx, old, e);
+    ctx->idx->n++;
+    char stat_buf[128];
+    format_stat_cache(st, stat_buf, sizeof(stat_buf));
+    entry_set_meta(ctx->idx, e, "BAAR_STAT", stat_buf);
+
+    ctx->moved->hits++;
+    ctx->moved->bytes += e->uncomp_size;
+    if(global_verbose){
+        const char *oldname = entry_get_name(ctx->idx, old);
+        fprintf(stderr, "Moved: %s -> %s\n", oldname ? oldname : "?", archive_path);
+    } else if(!global_quiet){
+        const char *bn = strrchr(src_path, '/');
+        fprintf(stderr, "\rAdding files: %s (moved)\x1b[K\r\n", bn ? bn + 1 : src_path);
+        fflush(stderr);
+    }
+    return 0;
+}
+
+/* Resolved directory of `archive` into out[PATH_MAX]; the archive itself may not exist yet. */
+static int archive_dir_real(const char *archive, char *out){
+    char arch_dir[PATH_MAX];
+    snprintf(arch_dir, sizeof(arch_dir), "%s", archive);
+    char *slash = strrchr(arch_dir, '/');
+    if(slash) *slash = '\0';
+    else snprintf(arch_dir, sizeof(arch_dir), ".");
+    if(!realpath(slash && !arch_dir[0] ? "/" : arch_dir, out)){
+        fprintf(stderr, "Cannot resolve the directory of %s: %s\n", archive, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* --base: open `base_path` read-only for reference lookups while adding to `archive`.
+   Returns NULL (after reporting why) when the base cannot be used. */
+static add_base_t *add_base_open(const char *base_path, const char *archive){
+    char base_real[PATH_MAX], arch_real[PATH_MAX];
+    if(!realpath(base_path, base_real)){
+        fprintf(stderr, "Base archive %s: %s\n", base_path, strerror(errno));
+        return NULL;
+    }
+    if(realpath(archive, arch_real) && strcmp(arch_real, base_real) == 0){
+        fprintf(stderr, "Base archive %s is the archive being written\n", base_path);
+        return NULL;
+    }
+    if(archive_dir_real(archive, arch_real) != 0) return NULL;
+    add_base_t *b = calloc(1, sizeof(*b));
+    if(!b){ fprintf(stderr, "Out of memory while opening base archive\n"); return NULL; }
+    b->f = fopen(base_real, "rb");
+    if(!b->f){
+        fprintf(stderr, "Base archive %s: %s\n", base_path, strerror(errno));
+        free(b);
+        return NULL;
+    }
+    b->path = strdup(base_real);
+    b->archive_dir = strdup(arch_real);
+    b->idx = load_index(b->f);
+    b->idx.archive_path = b->path;
+    b->lookup = build_entry_lookup_items(&b->idx, &b->lookup_count);
+    if(!b->path || !b->archive_dir){
+        add_base_close(b);
+        fprintf(stderr, "Out of memory while opening base archive\n");
+        return NULL;
+    }
+    return b;
+}
+
+static void add_base_close(add_base_t *b){
+    if(!b) return;
+    free(b->lookup);
+    free_index(&b->idx);
+    if(b->f) fclose(b->f);
+    free(b->path);
+    free(b->archive_dir);
+    free(b);
+}
+
+/* BAAR_BASE value naming `holder` (an absolute path) from an archive in `archive_dir`:
+   the file name when both sit in the same directory, so the pair can be moved together. */
+static char *base_ref_name(const char *holder, const char *archive_dir){
+    const char *slash = strrchr(holder, '/');
+    size_t dl = slash ? (size_t)(slash - holder) : 0;
+    if(slash && strlen(archive_dir) == (dl ? dl : 1) && strncmp(archive_dir, holder, dl ? dl : 1) == 0){
+        return strdup(slash + 1);
+    }
+    return strdup(holder);
+}
+
+/* BAAR_VOLUME value naming the stream of volume entry `e` from an archive in `archive_dir`. */
+static char *volume_ref_name(index_t *idx, entry_t *e, const char *archive_dir){
+    char stream[PATH_MAX], dir[PATH_MAX], full[PATH_MAX];
+    uint64_t vsize = 0;
+    if(volume_stream_of(idx, e, stream, sizeof(stream), &vsize) != 0) return NULL;
+    /* the stream itself is no file, only its parts are */
+    const char *slash = strrchr(stream, '/');
+    char *name = stream + (slash ? slash - stream + 1 : 0);
+    if(slash) stream[slash - stream] = '\0';
+    if(!realpath(slash ? (stream[0] ? stream : "/") : ".", dir)) return NULL;
+    int n = snprintf(full, sizeof(full), "%s/%s", strcmp(dir, "/") ? dir : "", name);
+    if(n < 0 || (size_t)n >= sizeof(full)) return NULL;
+    return base_ref_name(full, archive_dir);
+}
+
+/* --base: store `st` as a reference to the unchanged copy of `archive_path` in the base archive.
+   Returns 0 when the reference entry was added, 1 when the file has to be stored normally. */
+static int add_base_reference(add_stream_ctx_t *ctx, const char *archive_path, const struct stat *st){
+    add_base_t *b = ctx->base;
+    entry_t *be = find_entry_by_name_fast(b->lookup, b->lookup_count, &b->idx, archive_path);
+    if(!be || (be->flags & 4) || !source_unchanged(&b->idx, be, st)) return 1;
+    if(((be->flags & 2) != 0) != (ctx->pwd && ctx->pwd[0])) return 1;
+    if(entry_get_meta_val(&b->idx, be, "BAAR_TYPE")) return 1;
+
+    /* a reference in the base points straight at the archive holding the data */
+    char holder[PATH_MAX];
+    uint32_t holder_id = be->id;
+    if(be->flags & 32){
+        const char *id = entry_get_meta_val(&b->idx, be, "BAAR_BASE_ID");
+        char resolved[PATH_MAX];
+        if(!id || ref_resolve_path(&b->idx, be, resolved, sizeof(resolved)) != 0 ||
+           !realpath(resolved, holder)) return 1;
+        holder_id = (uint32_t)strtoul(id, NULL, 10);
+    } else {
+        snprintf(holder, sizeof(holder), "%s", b->path);
+    }
+    char *ref = base_ref_name(holder, b->archive_dir);
+    char *name = strdup(archive_path);
+    entry_t *grown = (ref && name) ? realloc(ctx->idx->entries, sizeof(entry_t) * (ctx->idx->n + 1)) : NULL;
+    if(!grown){
+        free(ref);
+        free(name);
+        fprintf(stderr, "Out of memory while tracking %s\n", archive_path);
+        return 1;
+    }
+    ctx->idx->entries = grown;
+    entry_t *e = &ctx->idx->entries[ctx->idx->n];
+    memset(e, 0, sizeof(*e));
+    e->id = ctx->idx->next_id++;
+    e->name = name;
+    e->flags = 32 | (be->flags & 2);
+    e->uncomp_size = be->uncomp_size;
+    e->crc32 = be->crc32;
+    e->mode = (uint32_t)(st->st_mode & 07777u);
+    e->uid = (uint32_t)st->st_uid;
+    e->gid = (uint32_t)st->st_gid;
+    e->mtime = (uint64_t)st->st_mtime;
+    ctx->idx->n++;
+
+    char buf[128];
+    format_stat_cache(st, buf, sizeof(buf));
+    entry_set_meta(ctx->idx, e, "BAAR_STAT", buf);
+    entry_set_meta(ctx->idx, e, "BAAR_BASE", ref);
+    snprintf(buf, sizeof(buf), "%u", holder_id);
+    entry_set_meta(ctx->idx, e, "BAAR_BASE_ID", buf);
+    const char *sha = entry_get_meta_val(&b->idx, be, "BAAR_SHA256");
+    if(sha) entry_set_meta(ctx->idx, e, "BAAR_SHA256", sha);
+    free(ref);
+
+    ctx->base_refs++;
+    ctx->base_bytes += e->uncomp_size;
+    if(global_verbose) fprintf(stderr, "Referenced from base: %s\n", archive_path);
+    return 0;
+}
+
+/* Bytes write_index_entry() produces for `e`. */
+static uint64_t index_entry_size(index_t *idx, entry_t *e){
+    const char *namep = e->name ? e->name : entry_get_name(idx, e);
+    uint64_t n = 4 + 2 + (namep ? strlen(namep) : 0) + 54;
+    if(e->meta_n && !e->meta && idx) entry_load_meta(idx, e);
+    for(uint32_t m=0; e->meta && m<e->meta_n; m++){
+        n += 4;
+        if(e->meta[m].key) n += strlen(e->meta[m].key);
+        if(e->meta[m].value) n += strlen(e->meta[m].value);
+    }
+    return n;
+}
+
+/* --local-headers: process_single_file() left the entry's blob in the spool; append the local
+   header and the blob to the archive and point the entry at its new position. */
+static int local_header_emit(add_stream_ctx_t *ctx, entry_t *e){
+    FILE *out = ctx->local_out;
+    FILE *spool = ctx->archive_fp;
+    int status = fflush(spool) == 0 ? 0 : -1;
+    uint64_t spool_off = e->data_offset;
+    fseeko(out, 0, SEEK_END);
+    uint64_t header_off = (uint64_t)ftello(out);
+    e->data_offset = header_off + 8 + index_entry_size(ctx->idx, e);
+    fwrite(LOCAL_HEADER_MAGIC, 1, 8, out);
+    write_index_entry(out, ctx->idx, e);
+    unsigned char *chunk = e->comp_size ? malloc(BAAR_STREAM_CHUNK_SIZE) : NULL;
+    if(e->comp_size && !chunk) status = -1;
+    for(uint64_t done = 0; status == 0 && done < e->comp_size; ){
+        size_t want = e->comp_size - done > BAAR_STREAM_CHUNK_SIZE ? BAAR_STREAM_CHUNK_SIZE : (size_t)(e->comp_size - done);
+        if(pread_full(fileno(spool), chunk, want, spool_off + done) != 0 ||
+           fwrite(chunk, 1, want, out) != want) status = -1;
+        done += want;
+    }
+    free(chunk);
+    if(ftruncate(fileno(spool), 0) != 0){ /* the next blob overwrites it anyway */ }
+    fseeko(spool, 0, SEEK_SET);
+    if(ferror(out)) status = -1;
+    return status;
+}
+
+/* --volume-size/--stripe: one stream of parts, filled by its own writer thread so the blobs
+   of a striped set reach their disks in parallel while the next file is compressed. */
+typedef struct volume_chunk {
+    struct volume_chunk *next;
+    uint64_t offset; /* position in the stream */
+    size_t len;
+    unsigned char data[];
+} volume_chunk_t;
+
+typedef struct {
+    char *path; /* parts are <path>.001, .002, ... */
+    char *ref; /* BAAR_VOLUME value for the entries stored here */
+    uint64_t end; /* next free position */
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volume_chunk_t *head, *tail;
+    uint64_t queued;
+    int closing;
+    int error; /* errno of the first failed write */
+    /* writer thread only */
+    uint64_t vsize;
+    int fd;
+    uint32_t part;
+} volume_stream_t;
+
+typedef struct volume_set {
+    volume_stream_t *streams;
+    size_t count;
+    uint64_t vsize;
+} volume_set_t;
+
+static int volume_write_at(volume_stream_t *s, const unsigned char *data, size_t len, uint64_t off){
+    while(len > 0){
+        uint64_t inner = 0;
+        uint32_t part = volume_part_at(s->vsize, off, &inner);
+        size_t n = len;
+        if(s->vsize && n > s->vsize - inner) n = (size_t)(s->vsize - inner);
+        if(part != s->part){
+            char path[PATH_MAX];
+            if(s->fd >= 0) close(s->fd);
+            volume_part_name(s->path, part, path, sizeof(path));
+            s->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            s->part = s->fd >= 0 ? part : 0;
+            if(s->fd < 0) return errno ? errno : EIO;
+        }
+        for(size_t done = 0; done < n; ){
+            ssize_t w = pwrite(s->fd, data + done, n - done, (off_t)(inner + done));
+            if(w < 0 && errno == EINTR) continue;
+            if(w <= 0) return w < 0 ? errno : EIO;
+            done += (size_t)w;
+        }
+        data += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static void *volume_writer_main(void *arg){
+    volume_stream_t *s = arg;
+    pthread_mutex_lock(&s->lock);
+    for(;;){
+        while(!s->head && !s->closing) pthread_cond_wait(&s->cond, &s->lock);
+        volume_chunk_t *c = s->head;
+        if(!c) break;
+        s->head = c->next;
+        if(!s->head) s->tail = NULL;
+        int failed = s->error;
+        pthread_mutex_unlock(&s->lock);
+        int err = failed ? 0 : volume_write_at(s, c->data, c->len, c->offset);
+        pthread_mutex_lock(&s->lock);
+        if(err && !s->error) s->error = err;
+        s->queued -= c->len;
+        free(c);
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Hands `c` to the writer of `s`, waiting while BAAR_VOLUME_QUEUE_BYTES are still queued. */
+static int volume_stream_push(volume_stream_t *s, volume_chunk_t *c){
+    pthread_mutex_lock(&s->lock);
+    while(s->queued >= BAAR_VOLUME_QUEUE_BYTES && !s->error) pthread_cond_wait(&s->cond, &s->lock);
+    int err = s->error;
+    if(!err){
+        c->next = NULL;
+        if(s->tail) s->tail->next = c;
+        else s->head = c;
+        s->tail = c;
+        s->queued += c->len;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if(err){ free(c); return -1; }
+    return 0;
+}
+
+/* Waits for the writers and releases the set. Returns 0, or -1 after reporting a failed write. */
+static int volume_set_close(volume_set_t *vs){
+    if(!vs) return 0;
+    int status = 0;
+    for(size_t i=0;i<vs->count;i++){
+        volume_stream_t *s = &vs->streams[i];
+        if(s->thread_started){
+            pthread_mutex_lock(&s->lock);
+            s->closing = 1;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            pthread_join(s->thread, NULL);
+            pthread_mutex_destroy(&s->lock);
+            pthread_cond_destroy(&s->cond);
+        }
+        if(s->fd >= 0 && close(s->fd) != 0 && !s->error) s->error = errno;
+        if(s->error){
+            fprintf(stderr, "Write error on volume %s: %s\n", s->path, strerror(s->error));
+            status = -1;
+        }
+        free(s->path);
+        free(s->ref);
+    }
+    free(vs->streams);
+    free(vs);
+    return status;
+}
+
+/* Sets up the streams for `archive`: <archive> in the archive's directory, or <archive>.s1 ..
+   .sN with --stripe, placed in the --stripe-dir directories in turn. Writing continues after
+   the data of earlier runs, in a new part when parts have a size. */
+static volume_set_t *volume_set_open(const char *archive, const add_options_t *opts){
+    char arch_dir[PATH_MAX];
+    if(archive_dir_real(archive, arch_dir) != 0) return NULL;
+    const char *slash = strrchr(archive, '/');
+    const char *name = slash ? slash + 1 : archive;
+    size_t count = opts->stripe > 0 ? (size_t)opts->stripe : 1;
+    volume_set_t *vs = calloc(1, sizeof(*vs));
+    if(vs) vs->streams = calloc(count, sizeof(*vs->streams));
+    if(!vs || !vs->streams){
+        free(vs);
+        fprintf(stderr, "Out of memory while opening volumes\n");
+        return NULL;
+    }
+    vs->vsize = opts->volume_size;
+    for(size_t i=0;i<count;i++) vs->streams[i].fd = -1;
+    vs->count = count;
+    for(size_t i=0;i<count;i++){
+        volume_stream_t *s = &vs->streams[i];
+        char dir[PATH_MAX], path[PATH_MAX], part[PATH_MAX];
+        if(opts->stripe_dir_count > 0){
+            const char *d = opts->stripe_dirs[i % opts->stripe_dir_count];
+            if(!realpath(d, dir)){
+                fprintf(stderr, "Stripe directory %s: %s\n", d, strerror(errno));
+                volume_set_close(vs);
+                return NULL;
+            }
+        } else {
+            snprintf(dir, sizeof(dir), "%s", arch_dir);
+        }
+        char suffix[16] = "";
+        if(opts->stripe > 0) snprintf(suffix, sizeof(suffix), ".s%zu", i + 1);
+        int n = snprintf(path, sizeof(path), "%s/%s%s", strcmp(dir, "/") ? dir : "", name, suffix);
+        s->path = (n > 0 && (size_t)n < sizeof(path)) ? strdup(path) : NULL;
+        s->ref = s->path ? base_ref_name(s->path, arch_dir) : NULL;
+        if(!s->ref){
+            fprintf(stderr, "Cannot name the volumes of %s\n", archive);
+            volume_set_close(vs);
+            return NULL;
+        }
+        uint32_t last = 0;
+        struct stat pst;
+        for(;;){
+            volume_part_name(s->path, last + 1, part, sizeof(part));
+            if(stat(part, &pst) != 0) break;
+            last++;
+            if(!vs->vsize) s->end = (uint64_t)pst.st_size;
+        }
+        if(vs->vsize) s->end = (uint64_t)last * vs->vsize;
+        s->vsize = vs->vsize;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        if(pthread_create(&s->thread, NULL, volume_writer_main, s) != 0){
+            pthread_mutex_destroy(&s->lock);
+            pthread_cond_destroy(&s->cond);
+            fprintf(stderr, "Cannot start the volume writer for %s\n", s->path);
+            volume_set_close(vs);
+            return NULL;
+        }
+        s->thread_started = 1;
+    }
+    return vs;
+}
+
+/* Moves the blob process_single_file() left in the spool to the stream with the least data
+   so far, which spreads a striped set evenly, and points the entry at it. */
+static int volume_emit(add_stream_ctx_t *ctx, entry_t *e){
+    if(e->comp_size == 0) return 0;
+    volume_set_t *vs = ctx->volumes;
+    volume_stream_t *s = &vs->streams[0];
+    for(size_t i=1;i<vs->count;i++){
+        if(vs->streams[i].end < s->end) s = &vs->streams[i];
+    }
+    FILE *spool = ctx->archive_fp;
+    int status = fflush(spool) == 0 ? 0 : -1;
+    for(uint64_t done = 0; status == 0 && done < e->comp_size; ){
+        size_t want = e->comp_size - done > BAAR_VOLUME_CHUNK ? BAAR_VOLUME_CHUNK : (size_t)(e->comp_size - done);
+        volume_chunk_t *c = malloc(sizeof(*c) + want);
+        if(!c || pread_full(fileno(spool), c->data, want, e->data_offset + done) != 0){
+            free(c);
+            status = -1;
+            break;
+        }
+        c->offset = s->end + done;
+        c->len = want;
+        if(volume_stream_push(s, c) != 0) status = -1;
+        done += want;
+    }
+    if(ftruncate(fileno(spool), 0) != 0){ /* the next blob overwrites it anyway */ }
+    fseeko(spool, 0, SEEK_SET);
+    if(status != 0) return -1;
+    e->flags |= 64;
+    e->data_offset = s->end;
+    s->end += e->comp_size;
+    entry_set_meta(ctx->idx, e, "BAAR_VOLUME", s->ref);
+    if(vs->vsize){
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%" PRIu64, vs->vsize);
+        entry_set_meta(ctx->idx, e, "BAAR_VOLUME_SIZE", buf);
+    }
+    return 0;
+}
+
+/* Whether `src_path` is one of the parts being written, which a source tree may contain. */
+static int volume_set_owns(volume_set_t *vs, const char *src_path){
+    const char *bn = strrchr(src_path, '/');
+    bn = bn ? bn + 1 : src_path;
+    for(size_t i=0;i<vs->count;i++){
+        const char *path = vs->streams[i].path;
+        const char *sb = strrchr(path, '/') + 1;
+        size_t l = strlen(sb), pl = strlen(path);
+        char real[PATH_MAX];
+        if(strncmp(bn, sb, l) != 0 || bn[l] != '.' || !isdigit((unsigned char)bn[l + 1])) continue;
+        if(realpath(src_path, real) && strncmp(real, path, pl) == 0 && real[pl] == '.') return 1;
+    }
+    return 0;
+}
+
+static int process_single_file(add_stream_ctx_t *ctx,
+                               const char *src_path, const char *archive_path,
+                               int clevel, const struct stat *st){
+    if(!ctx || !ctx->idx || !ctx->archive_fp || !src_path || !archive_path || !st){
+        return 1;
+    }
+    if(g_abort_requested) return 1;
+    /* Only skip if stat failed. We allow regular files and a subset of special
+       types (symlinks, char/block devices, fifos). Further filtering based on
+       pseudo-roots and ignore patterns is handled by walk_job_tree. */
+    if(!st) return 1;
+    if(!(S_ISREG(st->st_mode) || S_ISLNK(st->st_mode) || S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) || S_ISFIFO(st->st_mode) || S_ISDIR(st->st_mode))){
+        if(!global_quiet){
+            fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+        }
+        return 0;
+    }
+
+    /* Avoid adding the archive file itself if it resides inside the source tree being added.
+       Compare device/inode obtained from stat of the archive path (if available) to the src file stat. */
+    if(ctx->archive_id_valid && ctx->archive_ino == st->st_ino && ctx->archive_dev == st->st_dev){
+        if(!global_quiet) fprintf(stderr, "Skipping archive file itself: %s\n", src_path);
+        return 0;
+    }
+    if(ctx->volumes && S_ISREG(st->st_mode) && volume_set_owns(ctx->volumes, src_path)){
+        if(!global_quiet) fprintf(stderr, "Skipping archive volume itself: %s\n", src_path);
+        return 0;
+    }
+    if(clevel < 0) clevel = 0;
+    if(clevel > 3) clevel = 3;
+    if(ctx->plan_sink) return plan_sink_add(ctx->plan_sink, src_path, archive_path, clevel, st);
+
+    entry_t *existing = find_entry_by_name_fast(ctx->entry_lookup, ctx->entry_lookup_count,
+                                                ctx->idx, archive_path);
+    /* remembered so a timed-out re-read can keep the previous version */
+    size_t replaced_idx = SIZE_MAX;
+    uint32_t replaced_flags = 0;
     if(existing){
+        replaced_idx = (size_t)(existing - ctx->idx->entries);
+        replaced_flags = existing->flags;
         size_t existing_idx = (size_t)(existing - ctx->idx->entries);
         if(ctx->entry_seen && existing_idx < ctx->original_entry_count){
-            ctx->entry_seen[existing_idx] = 1;
+            id_set_add(ctx->entry_seen, (uint32_t)existing_idx);
         }
         if(ctx->incremental_mode){
-            if(existing->uncomp_size == (uint64_t)st->st_size &&
+            if(source_unchanged(ctx->idx, existing, st)){
+                if(!global_quiet){ fprintf(stderr, "Skipping unchanged: %s\n", src_path); }
+                return 0;
+            }
+            /* --verify-content: the stat cache says changed but the size matches; compare the
+               CRC before re-storing and only refresh the cached metadata if the data is equal */
+            if(ctx->verify_content && S_ISREG(st->st_mode) &&
+               existing->uncomp_size == (uint64_t)st->st_size &&
                (existing->mode & 07777u) == (uint32_t)(st->st_mode & 07777u)){
-                /* If mtimes match exactly, skip unchanged (fast-path) */
-                if(existing->mtime == (uint64_t)st->st_mtime){
-                    if(!global_quiet){ fprintf(stderr, "Skipping unchanged: %s\n", src_path); }
+                uint32_t crc = 0;
+                int vr = source_digest(ctx, src_path, &crc, NULL);
+                if(vr == -2){
+                    fseek(ctx->archive_fp, 0, SEEK_END);
+                    note_io_timeout(ctx, src_path, (uint64_t)ftell(ctx->archive_fp));
                     return 0;
                 }
-                /* If mtimes differ, but both the archive entry and the file have
-                   mtimes older or equal to the last archive modification time,
-                   we can treat them as unchanged (mirrored updates or clock drift). */
-                     uint64_t grace = 60ULL * 60ULL;
-                     if(ctx->archive_mtime != 0 &&
-                         (uint64_t)st->st_mtime <= (ctx->archive_mtime + grace) &&
-                         existing->mtime <= (ctx->archive_mtime + grace)){
-                    if(!global_quiet){ fprintf(stderr, "Skipping unchanged (by archive mtime): %s\n", src_path); }
+                if(vr == 0 && crc == existing->crc32){
+                    char stat_buf[128];
+                    format_stat_cache(st, stat_buf, sizeof(stat_buf));
+                    entry_set_meta(ctx->idx, existing, "BAAR_STAT", stat_buf);
+                    existing->mtime = (uint64_t)st->st_mtime;
+                    existing->uid = (uint32_t)st->st_uid;
+                    existing->gid = (uint32_t)st->st_gid;
+                    if(!global_quiet){ fprintf(stderr, "Skipping unchanged (same content): %s\n", src_path); }
                     return 0;
                 }
             }
         }
-        append_unique_id(ctx->to_remove, ctx->remove_count, existing->id);
-        if(ctx->incremental_mode){
-            mark_entry_deleted_flag(ctx->idx, existing->id);
+        queue_removal(ctx, existing->id);
+        existing->flags |= 4;
+    }
+
+    /* --delta: a changed regular file may be stored against the entry it supersedes, as long
+       as the chain stays within the configured depth. Not used with a password, since
+       compaction has to expand deltas without one, nor under --io-timeout, since the encoder
+       reads a mapping of the source that a hung mount could stall. */
+    size_t delta_base_idx = SIZE_MAX;
+    int delta_depth = 0;
+    if(ctx->delta_max_depth > 0 && ctx->incremental_mode && existing && S_ISREG(st->st_mode) &&
+       !(ctx->pwd && ctx->pwd[0]) && !(existing->flags & 2) && existing->uncomp_size > 0 &&
+       st->st_size > 0 && ctx->io_timeout_ms <= 0 && !entry_get_meta_val(ctx->idx, existing, "BAAR_TYPE")){
+        const char *d = entry_get_meta_val(ctx->idx, existing, "BAAR_DELTA_DEPTH");
+        delta_depth = (d ? atoi(d) : 0) + 1;
+        if(delta_depth <= ctx->delta_max_depth) delta_base_idx = replaced_idx;
+    }
+
+    /* a file under a new path may have been moved or renamed: reuse the data of its old entry */
+    if(!existing && !ctx->local_out && !ctx->volumes && (ctx->incremental_mode || ctx->mirror_mode) && S_ISREG(st->st_mode) &&
+       st->st_size > 0 && ctx->original_entry_count > 0 &&
+       add_moved_entry(ctx, src_path, archive_path, st) == 0){
+        return 0;
+    }
+
+    if(ctx->base && S_ISREG(st->st_mode) && st->st_size > 0 &&
+       add_base_reference(ctx, archive_path, st) == 0){
+        if(!global_quiet && !global_verbose){
+            const char *bn = strrchr(src_path, '/');
+            fprintf(stderr, "\rAdding files: %s (base)\x1b[K\r\n", bn ? bn + 1 : src_path);
+            fflush(stderr);
         }
+        return 0;
     }
 
     uint64_t file_sz64 = (uint64_t)st->st_size;
@@ -6535,28 +9450,34 @@ static int process_single_file(add_stream_ctx_t *ctx,
     if(S_ISLNK(st->st_mode) || S_ISDIR(st->st_mode) || S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) || S_ISFIFO(st->st_mode)){
         fsize = 0;
     }
-    int streaming_mode = (fsize > BAAR_STREAM_THRESHOLD);
+    /* --cdc: files that span more than one chunk are stored as chunks plus a manifest */
+    int chunking = ctx->cdc && S_ISREG(st->st_mode) && fsize >= BAAR_CDC_MAX;
+    int streaming_mode = !chunking && (fsize > BAAR_STREAM_THRESHOLD);
     /* debug output removed for production */
     unsigned char *buf = NULL;
+    unsigned char *src_map = NULL;
     unsigned char *out = NULL;
     size_t final_sz = 0;
     uint32_t crc = 0;
     int compressed = 0;
-    if(!streaming_mode && fsize > 0){
-        buf = malloc(fsize);
-        if(!buf){
+    int chunked = 0;
+    uint32_t delta_base_id = 0;
+    int is_delta = 0;
+    if(fsize > 0 && ctx->io_timeout_ms > 0 && !ctx->io){
+        ctx->io = io_worker_start();
+        if(!ctx->io) fprintf(stderr, "Warning: cannot start reader thread; --io-timeout not applied to %s\n", src_path);
+    }
+    if(!streaming_mode && !chunking && fsize > 0){
+        /* page faults on a hung mount cannot be timed out, so --io-timeout reads into the heap */
+        /* write_mapped_blob pwrite()s uncompressed data at its offset, which a pipe cannot take */
+        if(!ctx->io && fileno(ctx->archive_fp) >= 0) src_map = map_source_file(src_path, fsize);
+        if(!src_map) buf = malloc(fsize);
+        if(!src_map && !buf){
             streaming_mode = 1;
         }
     }
     /* For symlink and directory special handling: if it's a symlink, we store target as metadata rather than raw content.
        For directories, and device nodes/fifos, we do not store content. */
-    /* If symlink, read target so we can record it in meta; if it's missing, we'll still
-       record the symlink entry where appropriate. fsize already forced to 0 earlier. */
-    if(S_ISLNK(st->st_mode)){
-        char ltarget[PATH_MAX+1]; ssize_t lr = readlink(src_path, ltarget, PATH_MAX);
-        if(lr >= 0){ ltarget[lr] = '\0'; }
-    }
-    /* Symlink targets stored in metadata instead of file content; already read above. */
 
     volatile int spinner_run = 1;
     spinner_arg_t *sarg = NULL;
@@ -6565,7 +9486,7 @@ static int process_single_file(add_stream_ctx_t *ctx,
     if(spinner_base) spinner_name = spinner_base + 1;
     pthread_t spinner_thread;
     int spinner_created = 0;
-    if(streaming_mode && !global_quiet){
+    if((streaming_mode || chunking) && !global_quiet){
         sarg = malloc(sizeof(*sarg));
         if(sarg){
             sarg->name = spinner_name;
@@ -6586,6 +9507,7 @@ static int process_single_file(add_stream_ctx_t *ctx,
         fprintf(stderr, "Out of memory while tracking %s\n", archive_path);
         if(out) free(out);
         if(buf) free(buf);
+        if(src_map) munmap(src_map, fsize);
         return 1;
     }
 
@@ -6597,6 +9519,7 @@ static int process_single_file(add_stream_ctx_t *ctx,
         free(archive_name);
         if(out) free(out);
         if(buf) free(buf);
+        if(src_map) munmap(src_map, fsize);
         return 1;
     }
     ctx->idx->entries = tmp_entries;
@@ -6607,28 +9530,121 @@ static int process_single_file(add_stream_ctx_t *ctx,
 
     fseek(ctx->archive_fp, 0, SEEK_END);
     uint64_t data_offset = ftell(ctx->archive_fp);
-    if(fsize > 0){
-        if(streaming_mode){
-            if(stream_copy_file_with_crc(src_path, ctx->archive_fp, ctx->pwd, &final_sz, &crc) != 0){
+    /* --dedup: only a size that is already stored is worth hashing before writing; on a
+       digest match the entry references the existing blob and nothing is written */
+    unsigned char sha[32];
+    int want_sha = ctx->dedup && S_ISREG(st->st_mode) && fsize > 0;
+    int have_sha = 0;
+    int deduped = 0;
+    if(want_sha && dedup_has_size(ctx->dedup, fsize)){
+        int hr = src_map ? sha256_mapped(src_map, fsize, sha) : source_digest(ctx, src_path, NULL, sha);
+        if(hr == -2){
+            if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+            if(sarg) free(sarg);
+            if(buf) free(buf);
+            return abandon_timed_out_entry(ctx, src_path, data_offset, replaced_idx, replaced_flags);
+        }
+        have_sha = (hr == 0);
+        if(have_sha) dedup_key_digest(ctx->dedup, sha);
+        entry_t *match = have_sha ? dedup_lookup(ctx->dedup, ctx->idx, sha, fsize,
+                                                 (ctx->pwd && ctx->pwd[0]) ? 2 : 0) : NULL;
+        if(match){
+            data_offset = match->data_offset;
+            final_sz = match->comp_size;
+            compressed = match->flags & 1;
+            chunked = (match->flags & 8) != 0;
+            clevel = match->comp_level;
+            crc = match->crc32;
+            deduped = 1;
+            ctx->dedup_hits++;
+            ctx->dedup_bytes += final_sz;
+            if(src_map){ munmap(src_map, fsize); src_map = NULL; }
+        }
+    }
+    if(fsize > 0 && !deduped){
+        unsigned char *sha_out = (want_sha && !have_sha) ? sha : NULL;
+        if(delta_base_idx != SIZE_MAX && !chunking &&
+           try_delta_blob(ctx, &ctx->idx->entries[delta_base_idx], src_path, src_map, fsize, clevel,
+                          &out, &final_sz, &compressed, &crc, sha_out) == 0){
+            fseek(ctx->archive_fp, 0, SEEK_END);
+            if(src_map){ munmap(src_map, fsize); src_map = NULL; }
+            if(fwrite(out, 1, final_sz, ctx->archive_fp) != final_sz){
+                if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+                if(sarg) free(sarg);
+                fprintf(stderr, "Write error while adding %s\n", src_path);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
+                free(out);
+                if(buf) free(buf);
+                return 1;
+            }
+            delta_base_id = ctx->idx->entries[delta_base_idx].id;
+            is_delta = 1;
+        } else if(chunking){
+            uint64_t manifest_off = 0;
+            int cr = write_chunked_blob(ctx, src_path, fsize, clevel, data_offset, &crc,
+                                        &manifest_off, &final_sz, sha_out);
+            if(cr != 0){
+                if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+                if(sarg) free(sarg);
+                if(cr == -2) return abandon_timed_out_entry(ctx, src_path, data_offset, replaced_idx, replaced_flags);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
+                return 1;
+            }
+            data_offset = manifest_off;
+            chunked = 1;
+        } else if(streaming_mode){
+            int sr = stream_copy_file_with_crc(src_path, ctx->archive_fp, ctx->pwd, ctx->io, ctx->io_timeout_ms, &final_sz, &crc, sha_out);
+            if(sr == -2){
+                if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+                if(sarg) free(sarg);
+                if(buf) free(buf);
+                return abandon_timed_out_entry(ctx, src_path, data_offset, replaced_idx, replaced_flags);
+            }
+            if(sr != 0){
                 if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
                 if(sarg) free(sarg);
                 fprintf(stderr, "Cannot process %s: %s\n", src_path, strerror(errno));
                 if(out) free(out);
                 if(buf) free(buf);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
                 return 1;
             }
+        } else if(src_map){
+            int rc = write_mapped_blob(ctx->archive_fp, src_path, src_map, fsize, clevel, ctx->pwd,
+                                       data_offset, &crc, &final_sz, &compressed, sha_out);
+            munmap(src_map, fsize);
+            if(rc != 0){
+                if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
+                if(sarg) free(sarg);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
+                /* a source that shrank is skipped like a vanished one; the walk goes on */
+                return rc == 2 ? 0 : 1;
+            }
         } else {
             /* debug output removed for production */
-            FILE *in = fopen(src_path, "rb");
-            if(!in){
+            int rr = ctx->io ? io_worker_read_file(ctx->io, src_path, buf, fsize, ctx->io_timeout_ms) : 1;
+            if(rr == -2){
+                free(buf);
+                return abandon_timed_out_entry(ctx, src_path, data_offset, replaced_idx, replaced_flags);
+            }
+            if(rr == -1){
+                fprintf(stderr, "Read error for %s: %s\n", src_path,
+                        errno == ENODATA ? "unexpected end of file" : strerror(errno));
+                free(buf);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
+                return 1;
+            }
+            FILE *in = rr == 0 ? NULL : fopen(src_path, "rb");
+            if(rr != 0 && !in){
                 if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
                 if(sarg) free(sarg);
                 fprintf(stderr, "Cannot open %s: %s\n", src_path, strerror(errno));
                 if(out) free(out);
                 if(buf) free(buf);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
                 return 1;
             }
-            size_t readn = fread(buf,1,fsize,in);
+            size_t readn = in ? fread(buf,1,fsize,in) : fsize;
             if(readn != fsize){
                 if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
                 if(sarg) free(sarg);
@@ -6637,10 +9653,12 @@ static int process_single_file(add_stream_ctx_t *ctx,
                 fclose(in);
                 free(buf);
                 if(out) free(out);
+                discard_pending_entry(ctx, replaced_idx, replaced_flags);
                 return 1;
             }
-            fclose(in);
+            if(in) fclose(in);
             crc = crc32(0, buf, fsize);
+            if(sha_out) SHA256(buf, fsize, sha_out);
             size_t out_sz = 0;
             if(clevel > 0){
                 unsigned char *tmpout = NULL; size_t tmpoutsz = 0;
@@ -6663,9 +9681,7 @@ static int process_single_file(add_stream_ctx_t *ctx,
                 size_t written = fwrite(final,1,final_sz,ctx->archive_fp);
                 if(written != final_sz){
                     fprintf(stderr, "Write error while adding %s\n", src_path);
-                    ctx->idx->next_id--;
-                    free(e->name);
-                    e->name = NULL;
+                    discard_pending_entry(ctx, replaced_idx, replaced_flags);
                     if(out) free(out);
                     if(buf) free(buf);
                     if(spinner_created){ spinner_run = 0; pthread_join(spinner_thread, NULL); }
@@ -6674,10 +9690,12 @@ static int process_single_file(add_stream_ctx_t *ctx,
                 }
             }
         }
+        if(sha_out) dedup_key_digest(ctx->dedup, sha);
+        have_sha = want_sha;
     }
 
-    e->flags = (compressed ? 1 : 0) | ((ctx->pwd && ctx->pwd[0]) ? 2 : 0);
-    e->comp_level = compressed ? clevel : 0;
+    e->flags = (compressed ? 1 : 0) | ((ctx->pwd && ctx->pwd[0]) ? 2 : 0) | (chunked ? 8 : 0) | (is_delta ? 16 : 0);
+    e->comp_level = (compressed || chunked) ? clevel : 0;
     e->data_offset = data_offset;
     e->comp_size = final_sz;
     e->uncomp_size = fsize;
@@ -6726,17 +9744,49 @@ static int process_single_file(add_stream_ctx_t *ctx,
         e->meta_n = 1;
         e->meta = calloc(1, sizeof(*e->meta));
         if(e->meta){ e->meta[0].key = strdup("BAAR_TYPE"); e->meta[0].value = strdup("SYMLINK"); }
-        char ltarget[PATH_MAX+1]; ssize_t lr = readlink(src_path, ltarget, PATH_MAX);
+        char ltarget[PATH_MAX+1]; ssize_t lr;
+        if(ctx->symlink_target_hint){
+            lr = (ssize_t)strlen(ctx->symlink_target_hint);
+            memcpy(ltarget, ctx->symlink_target_hint, (size_t)lr + 1);
+        } else {
+            lr = readlink(src_path, ltarget, PATH_MAX);
+        }
         if(lr >= 0){ ltarget[lr] = '\0'; /* add another meta key for target */
             e->meta_n = 2; e->meta = realloc(e->meta, sizeof(*e->meta) * 2);
             if(e->meta){ e->meta[1].key = strdup("BAAR_SYMLINK_TARGET"); e->meta[1].value = strdup(ltarget); }
         }
+    } else if(S_ISREG(st->st_mode)){
+        char stat_buf[128];
+        format_stat_cache(st, stat_buf, sizeof(stat_buf));
+        entry_set_meta(ctx->idx, e, "BAAR_STAT", stat_buf);
+        if(is_delta){
+            char num[32];
+            snprintf(num, sizeof(num), "%u", delta_base_id);
+            entry_set_meta(ctx->idx, e, "BAAR_DELTA_BASE", num);
+            snprintf(num, sizeof(num), "%d", delta_depth);
+            entry_set_meta(ctx->idx, e, "BAAR_DELTA_DEPTH", num);
+        }
+        if(have_sha){
+            char hex[65];
+            sha256_hex(sha, hex);
+            entry_set_meta(ctx->idx, e, "BAAR_SHA256", hex);
+            if(!deduped && !is_delta) dedup_insert(ctx->dedup, sha, fsize, ctx->idx->n - 1);
+        }
     }
 
     spinner_run = 0;
     if(spinner_created){ pthread_join(spinner_thread, NULL); }
     if(sarg) free(sarg);
 
+    if((ctx->local_out && local_header_emit(ctx, e) != 0) ||
+       (ctx->volumes && volume_emit(ctx, e) != 0)){
+        fprintf(stderr, "Write error while adding %s\n", src_path);
+        e->flags |= 4;
+        if(out) free(out);
+        if(buf) free(buf);
+        return 1;
+    }
+
     unsigned int percent = 0;
     if(fsize > 0 && final_sz <= fsize){
         long long diff = (long long)fsize - (long long)final_sz;
@@ -6761,12 +9811,180 @@ static int process_single_file(add_stream_ctx_t *ctx,
     return 0;
 }
 
-static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
-    if(!ctx || !job || !job->src_root) return 0;
+/* Entries deferred by --read-order so a directory (or a window of at most
+   BAAR_READ_ORDER_WINDOW entries) can be read in on-disk order. */
+typedef struct {
+    char *src_path;
+    char *archive_path;
+    char *link_target;
+    struct stat st;
+    uint64_t key; /* 0 for header-only entries, else physical offset of the first extent or UINT64_MAX */
+    size_t seq;   /* position in readdir order */
+} read_batch_item_t;
 
-    char *root_archive = resolve_archive_path(job, job->src_root);
-    if(root_archive){
-        if(should_ignore_path(job->src_root, root_archive, ctx->ignore_patterns, ctx->ignore_count)){
+typedef struct {
+    read_batch_item_t *items;
+    size_t count;
+    size_t cap;
+} read_batch_t;
+
+/* Physical byte offset of the first extent of `name` (relative to `dfd`) via FIEMAP.
+   Returns UINT64_MAX if the filesystem does not support it or the file has no extents. */
+static uint64_t first_extent_physical(int dfd, const char *name){
+    int fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) return UINT64_MAX;
+    union {
+        struct fiemap fm;
+        unsigned char raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    memset(&u, 0, sizeof(u));
+    u.fm.fm_start = 0;
+    u.fm.fm_length = FIEMAP_MAX_OFFSET;
+    u.fm.fm_extent_count = 1;
+    uint64_t phys = UINT64_MAX;
+    if(ioctl(fd, FS_IOC_FIEMAP, &u.fm) == 0 && u.fm.fm_mapped_extents > 0){
+        if(!(u.fm.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))){
+            phys = u.fm.fm_extents[0].fe_physical;
+        }
+    }
+    close(fd);
+    return phys;
+}
+
+static int read_batch_push(read_batch_t *b, const char *src_path, const char *archive_path, const char *link_target,
+                           const struct stat *st, uint64_t key, size_t seq){
+    if(b->count == b->cap){
+        size_t ncap = b->cap ? b->cap * 2 : 64;
+        read_batch_item_t *tmp = realloc(b->items, ncap * sizeof(*tmp));
+        if(!tmp) return -1;
+        b->items = tmp;
+        b->cap = ncap;
+    }
+    read_batch_item_t *it = &b->items[b->count];
+    it->src_path = strdup(src_path);
+    it->archive_path = strdup(archive_path);
+    it->link_target = link_target ? strdup(link_target) : NULL;
+    if(!it->src_path || !it->archive_path || (link_target && !it->link_target)){
+        free(it->src_path); free(it->archive_path); free(it->link_target);
+        return -1;
+    }
+    b->count++;
+    it->st = *st;
+    it->key = key;
+    it->seq = seq;
+    return 0;
+}
+
+static int read_batch_cmp(const void *a, const void *b){
+    const read_batch_item_t *x = a, *y = b;
+    if(x->key != y->key) return x->key < y->key ? -1 : 1;
+    if(x->st.st_ino != y->st.st_ino) return x->st.st_ino < y->st.st_ino ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+typedef struct { size_t seq; size_t slot; } read_batch_slot_t;
+
+static int read_batch_slot_cmp(const void *a, const void *b){
+    const read_batch_slot_t *x = a, *y = b;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+static int id_cmp(const void *a, const void *b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+/* Add the deferred files of `b` in on-disk order, then put the entries they produced back
+   into readdir order (ids included) so the index looks as if they had been added in turn. */
+static int read_batch_flush(add_stream_ctx_t *ctx, read_batch_t *b, int clevel){
+    if(b->count == 0) return 0;
+    qsort(b->items, b->count, sizeof(*b->items), read_batch_cmp);
+    uint32_t first = ctx->idx->n;
+    read_batch_slot_t *slots = malloc(b->count * sizeof(*slots));
+    int status = 0;
+    size_t produced = 0;
+    for(size_t i=0;i<b->count;i++){
+        read_batch_item_t *it = &b->items[i];
+        if(status == 0 && !g_abort_requested){
+            uint32_t before = ctx->idx->n;
+            ctx->symlink_target_hint = it->link_target;
+            if(process_single_file(ctx, it->src_path, it->archive_path, clevel, &it->st) != 0) status = 1;
+            ctx->symlink_target_hint = NULL;
+            if(ctx->idx->n == before + 1 && slots){
+                slots[produced].seq = it->seq;
+                slots[produced].slot = before - first;
+                produced++;
+            }
+        }
+        free(it->src_path);
+        free(it->archive_path);
+        free(it->link_target);
+    }
+    b->count = 0;
+    if(g_abort_requested) status = 1;
+
+    entry_t *tmp = produced > 1 ? malloc(produced * sizeof(*tmp)) : NULL;
+    uint32_t *ids = produced > 1 ? malloc(produced * sizeof(*ids)) : NULL;
+    if(tmp && ids && produced == ctx->idx->n - first){
+        entry_t *slice = &ctx->idx->entries[first];
+        for(size_t i=0;i<produced;i++) ids[i] = slice[i].id;
+        qsort(slots, produced, sizeof(*slots), read_batch_slot_cmp);
+        qsort(ids, produced, sizeof(*ids), id_cmp);
+        for(size_t i=0;i<produced;i++){
+            tmp[i] = slice[slots[i].slot];
+            tmp[i].id = ids[i];
+        }
+        memcpy(slice, tmp, produced * sizeof(*tmp));
+        /* the dedup index refers to these entries by slot */
+        if(ctx->dedup){
+            uint32_t *moved_to = ids; /* the ids are assigned, reuse the buffer */
+            for(size_t i=0;i<produced;i++) moved_to[slots[i].slot] = first + (uint32_t)i;
+            dedup_remap(ctx->dedup, first, produced, moved_to);
+        }
+    }
+    free(tmp);
+    free(ids);
+    free(slots);
+    return status;
+}
+
+/* Hand one walked entry to process_single_file(), or with --read-order queue it so the
+   directory's entries are read in inode/physical order. Header-only entries sort first. */
+static int walk_emit(add_stream_ctx_t *ctx, read_batch_t *b, size_t *seq, int dfd, const char *name,
+                     const char *src_path, const char *archive_path, const struct stat *st,
+                     const char *link_target, int clevel){
+    if(ctx->read_order != BAAR_READ_ORDER_READDIR){
+        uint64_t key = 0;
+        if(S_ISREG(st->st_mode)){
+            key = ctx->read_order == BAAR_READ_ORDER_PHYSICAL ? first_extent_physical(dfd, name) : UINT64_MAX;
+        }
+        if(read_batch_push(b, src_path, archive_path, link_target, st, key, (*seq)++) == 0){
+            if(b->count >= BAAR_READ_ORDER_WINDOW) return read_batch_flush(ctx, b, clevel);
+            return 0;
+        }
+    }
+    ctx->symlink_target_hint = link_target;
+    int r = process_single_file(ctx, src_path, archive_path, clevel, st);
+    ctx->symlink_target_hint = NULL;
+    return r;
+}
+
+static void read_batch_free(read_batch_t *b){
+    for(size_t i=0;i<b->count;i++){
+        free(b->items[i].src_path);
+        free(b->items[i].archive_path);
+        free(b->items[i].link_target);
+    }
+    free(b->items);
+    memset(b, 0, sizeof(*b));
+}
+
+static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
+    if(!ctx || !job || !job->src_root) return 0;
+
+    char *root_archive = resolve_archive_path(job, job->src_root);
+    if(root_archive){
+        if(should_ignore_path(job->src_root, root_archive, ctx->ignore_patterns, ctx->ignore_count)){
             free(root_archive);
             return 0;
         }
@@ -6788,18 +10006,23 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
     if(job->src_root && is_pseudo_root(job->src_root)){
         limit_depth = 1;
     }
+    /* filesystem of the job root; --one-file-system keeps the walk on it */
+    dev_t root_dev = 0;
+    if(ctx->one_file_system){
+        struct stat root_st;
+        if(lstat(job->src_root, &root_st) == 0) root_dev = root_st.st_dev;
+    }
+
     int dev_dir_mode = job->dev_dir_mode ? 1 : 0;
     char **devdir_roots = NULL;
     size_t devdir_root_count = 0;
     if(dev_dir_mode){
         register_devdir_root(&devdir_roots, &devdir_root_count, job->src_root);
-    } else if(looks_like_device_directory(job->src_root)){
-        if(register_devdir_root(&devdir_roots, &devdir_root_count, job->src_root) == 0){
-            dev_dir_mode = 1;
-        }
     }
 
     path_stack_t stack = {0};
+    read_batch_t batch = {0};
+    size_t batch_seq = 0;
     /* dev_dir_mode indicates special handling for 'dosdevices' like directories; debug print removed */
     if(path_stack_push(&stack, job->src_root) != 0){
         fprintf(stderr, "Out of memory while scheduling %s\n", job->src_root);
@@ -6816,20 +10039,36 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
         char *current = path_stack_pop(&stack);
         if(!current) break;
         struct stat st;
-        /* Use lstat here so we can detect symlinks and avoid following them by default */
-        if(lstat(current, &st)!=0){
-            fprintf(stderr, "Skipping %s: %s\n", current, strerror(errno));
-            free(current);
-            continue;
+        /* Everything pushed below is a directory, so open it directly instead of lstat+opendir.
+           O_NOFOLLOW keeps symlinks from being followed; when the open fails (the job root is a
+           file or symlink, or the path vanished) fall back to lstat to classify it. */
+        int dfd = open(current, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if(dfd < 0){
+            int open_errno = errno;
+            if(lstat(current, &st)!=0){
+                fprintf(stderr, "Skipping %s: %s\n", current, strerror(errno));
+                free(current);
+                continue;
+            }
+            if(S_ISDIR(st.st_mode)){
+                fprintf(stderr, "Cannot open directory %s: %s\n", current, strerror(open_errno));
+                free(current);
+                continue;
+            }
         }
 
-        if(S_ISDIR(st.st_mode)){
-            DIR *dir = opendir(current);
+        if(dfd >= 0){
+            DIR *dir = fdopendir(dfd);
             if(!dir){
                 fprintf(stderr, "Cannot open directory %s: %s\n", current, strerror(errno));
+                close(dfd);
                 free(current);
                 continue;
             }
+            /* one statfs per directory catches procfs/sysfs/... mounted anywhere */
+            int dir_pseudo = fd_on_pseudo_fs(dfd);
+            /* directories not already under a device root are probed from their first entry */
+            int probe_devdir = find_devdir_root(devdir_roots, devdir_root_count, current, NULL) < 0;
             struct dirent *ent;
             while((ent = readdir(dir))){
                 if(g_abort_requested){
@@ -6848,9 +10087,33 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                     status = 1;
                     break;
                 }
+                /* d_type lets subdirectories skip the stat entirely; everything else needs the
+                   inode fields for the index entry anyway. */
                 struct stat child_st;
-                if(lstat(child, &child_st)!=0){
-                    fprintf(stderr, "Skipping %s: %s\n", child, strerror(errno));
+                int child_st_ok = 0, child_st_full = 0, child_errno = 0;
+                if(ent->d_type == DT_DIR && !ctx->one_file_system){
+                    memset(&child_st, 0, sizeof(child_st));
+                    child_st.st_mode = S_IFDIR;
+                    child_st_ok = 1;
+                } else if(stat_at_nofollow(dfd, ent->d_name, &child_st) == 0){
+                    child_st_ok = child_st_full = 1;
+                } else {
+                    child_errno = errno;
+                }
+                char link_target[PATH_MAX+1];
+                ssize_t link_len = -1;
+                if(child_st_ok && S_ISLNK(child_st.st_mode)){
+                    link_len = readlinkat(dfd, ent->d_name, link_target, PATH_MAX);
+                    if(link_len >= 0) link_target[link_len] = '\0';
+                }
+                if(probe_devdir){
+                    probe_devdir = 0;
+                    if(entry_looks_like_device(ent->d_name, child_st_full ? &child_st : NULL, link_len > 0 ? link_target : NULL)){
+                        register_devdir_root(&devdir_roots, &devdir_root_count, current);
+                    }
+                }
+                if(!child_st_ok){
+                    fprintf(stderr, "Skipping %s: %s\n", child, strerror(child_errno));
                     free(child);
                     continue;
                 }
@@ -6865,7 +10128,8 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                         char *archive_path = resolve_archive_path(job, child);
                         if(archive_path){
                             if(!should_ignore_path(child, archive_path, ctx->ignore_patterns, ctx->ignore_count)){
-                                if(process_single_file(ctx, child, archive_path, job->clevel, &child_st) != 0){
+                                if(walk_emit(ctx, &batch, &batch_seq, dfd, ent->d_name, child, archive_path, &child_st,
+                                             link_len >= 0 ? link_target : NULL, job->clevel) != 0){
                                     free(archive_path);
                                     free(child);
                                     status = 1;
@@ -6878,9 +10142,7 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                         continue;
                     }
                     /* If the symlink points outside the archive root or points to device/mount targets like /dev /proc /run /sys /run/media, skip it. */
-                    char link_target[PATH_MAX+1];
-                    ssize_t r = readlink(child, link_target, PATH_MAX);
-                    if(r > 0){ link_target[r] = '\0';
+                    if(link_len > 0){
                         char *resolved = realpath(child, NULL);
                         if(resolved){
                                 /* Skip if it points to /proc /sys or outside the initial job->src_root. Symlinks
@@ -6910,7 +10172,8 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                                         char *archive_path = resolve_archive_path(job, child);
                                         if(archive_path){
                                             if(!should_ignore_path(child, archive_path, ctx->ignore_patterns, ctx->ignore_count)){
-                                                if(process_single_file(ctx, child, archive_path, job->clevel, &child_st) != 0){
+                                                if(walk_emit(ctx, &batch, &batch_seq, dfd, ent->d_name, child, archive_path, &child_st,
+                                                             link_target, job->clevel) != 0){
                                                     free(archive_path);
                                                     free(resolved);
                                                     free(child);
@@ -6950,10 +10213,15 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                     int devdir_match = find_devdir_root(devdir_roots, devdir_root_count, child, &devdir_depth);
                     if(devdir_match >= 0 && devdir_depth >= 1){
                         if(devdir_depth == 1){
+                            if(!child_st_full && stat_at_nofollow(dfd, ent->d_name, &child_st) != 0){
+                                fprintf(stderr, "Skipping %s: %s\n", child, strerror(errno));
+                                free(child);
+                                continue;
+                            }
                             char *archive_path = resolve_archive_path(job, child);
                             if(archive_path){
                                 if(!should_ignore_path(child, archive_path, ctx->ignore_patterns, ctx->ignore_count)){
-                                    if(process_single_file(ctx, child, archive_path, job->clevel, &child_st) != 0){
+                                    if(walk_emit(ctx, &batch, &batch_seq, dfd, ent->d_name, child, archive_path, &child_st, NULL, job->clevel) != 0){
                                         free(archive_path);
                                         free(child);
                                         status = 1;
@@ -6970,13 +10238,20 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                         free(child);
                         continue;
                     }
-                    if(devdir_match < 0 && looks_like_device_directory(child)){
-                        register_devdir_root(&devdir_roots, &devdir_root_count, child);
-                    }
                     if(limit_depth >= 0 && path_relative_depth(job->src_root, child) > limit_depth){
                         free(child);
                         continue;
                     }
+                    if(crosses_filesystem(ctx, root_dev, child_st.st_dev)){
+                        if(global_verbose) fprintf(stderr, "Skipping mount point (other filesystem): %s\n", child);
+                        free(child);
+                        continue;
+                    }
+                    /* subdirectories of a pseudo filesystem stay on it; nothing below is archived */
+                    if(dir_pseudo && limit_depth < 0){
+                        free(child);
+                        continue;
+                    }
                     if(path_stack_push(&stack, child)!=0){
                         fprintf(stderr, "Out of memory while scheduling %s\n", child);
                         free(child);
@@ -6989,7 +10264,7 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                 if(S_ISREG(child_st.st_mode)){
                     int devdir_depth = -1;
                     int devdir_match = find_devdir_root(devdir_roots, devdir_root_count, child, &devdir_depth);
-                    if(devdir_match < 0 && is_pseudo_path(child)){
+                    if(devdir_match < 0 && (dir_pseudo || is_pseudo_path(child))){
                         if(limit_depth >= 0){
                             if(path_relative_depth(job->src_root, child) > limit_depth){
                                 if(!global_quiet) fprintf(stderr, "Skipping special/pseudo path (too deep): %s\n", child);
@@ -7019,7 +10294,7 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                         continue;
                     }
                     if(!should_ignore_path(child, archive_path, ctx->ignore_patterns, ctx->ignore_count)){
-                        if(process_single_file(ctx, child, archive_path, job->clevel, &child_st) != 0){
+                        if(walk_emit(ctx, &batch, &batch_seq, dfd, ent->d_name, child, archive_path, &child_st, NULL, job->clevel) != 0){
                             status = 1;
                             free(archive_path);
                             free(child);
@@ -7038,7 +10313,7 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                         free(child);
                         continue;
                     }
-                    if(devdir_match < 0 && is_pseudo_path(child) && limit_depth >= 0 && path_relative_depth(job->src_root, child) > limit_depth){
+                    if(devdir_match < 0 && (dir_pseudo || is_pseudo_path(child)) && limit_depth >= 0 && path_relative_depth(job->src_root, child) > limit_depth){
                         if(!global_quiet) fprintf(stderr, "Skipping device-like path (too deep): %s\n", child);
                         free(child);
                         continue;
@@ -7046,7 +10321,7 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                     char *archive_path = resolve_archive_path(job, child);
                     if(!archive_path){ fprintf(stderr, "Out of memory while preparing %s\n", child); free(child); status = 1; continue; }
                     if(!should_ignore_path(child, archive_path, ctx->ignore_patterns, ctx->ignore_count)){
-                        if(process_single_file(ctx, child, archive_path, job->clevel, &child_st) != 0){ status = 1; free(archive_path); free(child); break; }
+                        if(walk_emit(ctx, &batch, &batch_seq, dfd, ent->d_name, child, archive_path, &child_st, NULL, job->clevel) != 0){ status = 1; free(archive_path); free(child); break; }
                     }
                     free(archive_path);
                     free(child);
@@ -7054,6 +10329,9 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
                 }
                 free(child);
             }
+            if(batch.count && !g_abort_requested && read_batch_flush(ctx, &batch, job->clevel) != 0){
+                status = 1;
+            }
             if(g_abort_requested){
                 closedir(dir);
                 free(current);
@@ -7110,29 +10388,672 @@ static int walk_job_tree(add_stream_ctx_t *ctx, const add_job_t *job){
         status = 1;
     }
     path_stack_free(&stack);
+    read_batch_free(&batch);
     free_devdir_roots(devdir_roots, devdir_root_count);
     /* resolved_root_buf is on stack so no free required */
     return status;
 }
 
-static int add_files_streaming(const char *archive, add_job_t *jobs, int job_count,
-                               const char *pwd, int incremental_mode, int mirror_mode,
-                               char **ignore_patterns, size_t ignore_count){
+/* --low-memory: incremental and mirror runs normally hold every archived name, a lookup table
+   over them and the whole index in memory. Instead, the live index records and the walked
+   files are each written as sorted runs to unlinked temp files next to the archive, merged
+   back in name order and joined; only the entries stored by this run are kept in memory,
+   and those are spilled every BAAR_LOWMEM_FLUSH_ENTRIES. */
+#define BAAR_LOWMEM_SORT_BUDGET (64u * 1024 * 1024)
+#define BAAR_LOWMEM_FLUSH_ENTRIES 65536
+
+typedef struct {
+    FILE *f;
+    unsigned char *rec; /* current record: key bytes, then payload */
+    size_t rec_cap;
+    uint32_t key_len, payload_len;
+} sort_run_t;
+
+/* External sort of (key, payload) records ordered by key bytes. */
+typedef struct extsort {
+    const char *near_path; /* spill files are created next to this path */
+    unsigned char *buf; /* pending records: u32 key_len, key, u32 payload_len, payload */
+    size_t buf_len, buf_cap;
+    size_t *offs;
+    size_t offs_n, offs_cap;
+    sort_run_t *runs;
+    size_t run_count;
+    size_t *heap; /* run indices, smallest current key first */
+    size_t heap_n;
+    int handed_out; /* the top run's record was returned by extsort_next() */
+    uint64_t records;
+    int failed;
+} extsort_t;
+
+static FILE *spill_file_open(const char *near_path){
+    size_t len = strlen(near_path) + 16;
+    char *tmpl = malloc(len);
+    if(!tmpl) return NULL;
+    snprintf(tmpl, len, "%s.sortXXXXXX", near_path);
+    int fd = mkstemp(tmpl);
+    FILE *f = NULL;
+    if(fd >= 0){
+        unlink(tmpl);
+        f = fdopen(fd, "w+b");
+        if(!f) close(fd);
+    }
+    free(tmpl);
+    /* the archive's directory may not be writable; fall back to TMPDIR */
+    return f ? f : tmpfile();
+}
+
+static const unsigned char *g_extsort_buf; /* qsort has no context argument */
+
+static int extsort_key_cmp(const unsigned char *a, uint32_t alen, const unsigned char *b, uint32_t blen){
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if(c) return c;
+    return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
+
+static int extsort_cmp_offs(const void *pa, const void *pb){
+    const unsigned char *a = g_extsort_buf + *(const size_t*)pa;
+    const unsigned char *b = g_extsort_buf + *(const size_t*)pb;
+    uint32_t alen, blen;
+    memcpy(&alen, a, 4);
+    memcpy(&blen, b, 4);
+    int c = extsort_key_cmp(a + 4, alen, b + 4, blen);
+    if(c) return c;
+    /* keep insertion order between equal keys */
+    return *(const size_t*)pa < *(const size_t*)pb ? -1 : 1;
+}
+
+static int extsort_spill(extsort_t *s){
+    if(s->offs_n == 0) return 0;
+    FILE *f = spill_file_open(s->near_path);
+    sort_run_t *tmp = f ? realloc(s->runs, sizeof(*s->runs) * (s->run_count + 1)) : NULL;
+    if(!tmp){
+        if(f) fclose(f);
+        s->failed = 1;
+        return -1;
+    }
+    s->runs = tmp;
+    g_extsort_buf = s->buf;
+    qsort(s->offs, s->offs_n, sizeof(*s->offs), extsort_cmp_offs);
+    for(size_t i=0;i<s->offs_n;i++){
+        const unsigned char *r = s->buf + s->offs[i];
+        uint32_t klen, plen;
+        memcpy(&klen, r, 4);
+        memcpy(&plen, r + 4 + klen, 4);
+        fwrite(r, 1, 8 + (size_t)klen + plen, f);
+    }
+    if(fflush(f) != 0 || ferror(f)){
+        fprintf(stderr, "Error: cannot write sort run: %s\n", strerror(errno));
+        fclose(f);
+        s->failed = 1;
+        return -1;
+    }
+    rewind(f);
+    memset(&s->runs[s->run_count], 0, sizeof(s->runs[0]));
+    s->runs[s->run_count++].f = f;
+    s->buf_len = 0;
+    s->offs_n = 0;
+    return 0;
+}
+
+static int extsort_add(extsort_t *s, const char *key, uint32_t key_len, const void *payload, uint32_t payload_len){
+    if(s->failed) return -1;
+    size_t need = 8 + (size_t)key_len + payload_len;
+    if(s->buf_len + need > BAAR_LOWMEM_SORT_BUDGET && extsort_spill(s) != 0) return -1;
+    if(s->buf_len + need > s->buf_cap){
+        size_t cap = s->buf_cap ? s->buf_cap * 2 : (1u << 20);
+        while(cap < s->buf_len + need) cap *= 2;
+        unsigned char *tmp = realloc(s->buf, cap);
+        if(!tmp){ s->failed = 1; return -1; }
+        s->buf = tmp;
+        s->buf_cap = cap;
+    }
+    if(s->offs_n == s->offs_cap){
+        size_t cap = s->offs_cap ? s->offs_cap * 2 : 4096;
+        size_t *tmp = realloc(s->offs, sizeof(*s->offs) * cap);
+        if(!tmp){ s->failed = 1; return -1; }
+        s->offs = tmp;
+        s->offs_cap = cap;
+    }
+    s->offs[s->offs_n++] = s->buf_len;
+    unsigned char *w = s->buf + s->buf_len;
+    memcpy(w, &key_len, 4);
+    memcpy(w + 4, key, key_len);
+    memcpy(w + 4 + key_len, &payload_len, 4);
+    if(payload_len) memcpy(w + 8 + key_len, payload, payload_len);
+    s->buf_len += need;
+    s->records++;
+    return 0;
+}
+
+/* 1 when the run's next record was read, 0 at its end, -1 on error. */
+static int sort_run_advance(sort_run_t *r){
+    uint32_t klen, plen;
+    if(fread(&klen, 4, 1, r->f) != 1) return 0;
+    if(klen > r->rec_cap || !r->rec){
+        size_t cap = r->rec_cap ? r->rec_cap : 512;
+        while(cap < klen) cap *= 2;
+        unsigned char *tmp = realloc(r->rec, cap);
+        if(!tmp) return -1;
+        r->rec = tmp;
+        r->rec_cap = cap;
+    }
+    if(fread(r->rec, 1, klen, r->f) != klen || fread(&plen, 4, 1, r->f) != 1) return -1;
+    if((size_t)klen + plen > r->rec_cap){
+        size_t cap = r->rec_cap;
+        while(cap < (size_t)klen + plen) cap *= 2;
+        unsigned char *tmp = realloc(r->rec, cap);
+        if(!tmp) return -1;
+        r->rec = tmp;
+        r->rec_cap = cap;
+    }
+    if(fread(r->rec + klen, 1, plen, r->f) != plen) return -1;
+    r->key_len = klen;
+    r->payload_len = plen;
+    return 1;
+}
+
+static int extsort_heap_less(const extsort_t *s, size_t a, size_t b){
+    const sort_run_t *ra = &s->runs[a], *rb = &s->runs[b];
+    int c = extsort_key_cmp(ra->rec, ra->key_len, rb->rec, rb->key_len);
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void extsort_sift_down(extsort_t *s, size_t i){
+    for(;;){
+        size_t l = 2 * i + 1, m = i;
+        if(l < s->heap_n && extsort_heap_less(s, s->heap[l], s->heap[m])) m = l;
+        if(l + 1 < s->heap_n && extsort_heap_less(s, s->heap[l + 1], s->heap[m])) m = l + 1;
+        if(m == i) return;
+        size_t t = s->heap[i]; s->heap[i] = s->heap[m]; s->heap[m] = t;
+        i = m;
+    }
+}
+
+/* Ends the input phase: spills what is still buffered and primes the merge. */
+static int extsort_finish(extsort_t *s){
+    if(s->failed || extsort_spill(s) != 0) return -1;
+    free(s->buf); s->buf = NULL; s->buf_cap = 0;
+    free(s->offs); s->offs = NULL; s->offs_cap = 0;
+    if(s->run_count == 0) return 0;
+    s->heap = malloc(sizeof(*s->heap) * s->run_count);
+    if(!s->heap) return -1;
+    for(size_t i=0;i<s->run_count;i++){
+        int rc = sort_run_advance(&s->runs[i]);
+        if(rc < 0) return -1;
+        if(rc > 0) s->heap[s->heap_n++] = i;
+    }
+    for(size_t i=s->heap_n;i-- > 0;) extsort_sift_down(s, i);
+    return 0;
+}
+
+/* Next record in key order; the pointers stay valid until the following call.
+   1 = record, 0 = done, -1 = read error. */
+static int extsort_next(extsort_t *s, const char **key, uint32_t *key_len,
+                        const unsigned char **payload, uint32_t *payload_len){
+    if(s->handed_out){
+        s->handed_out = 0;
+        int rc = sort_run_advance(&s->runs[s->heap[0]]);
+        if(rc < 0) return -1;
+        if(rc == 0) s->heap[0] = s->heap[--s->heap_n];
+        if(s->heap_n) extsort_sift_down(s, 0);
+    }
+    if(s->heap_n == 0) return 0;
+    sort_run_t *r = &s->runs[s->heap[0]];
+    *key = (const char*)r->rec;
+    *key_len = r->key_len;
+    *payload = r->rec + r->key_len;
+    *payload_len = r->payload_len;
+    s->handed_out = 1;
+    return 1;
+}
+
+static void extsort_free(extsort_t *s){
+    for(size_t i=0;i<s->run_count;i++){
+        if(s->runs[i].f) fclose(s->runs[i].f);
+        free(s->runs[i].rec);
+    }
+    free(s->runs);
+    free(s->heap);
+    free(s->buf);
+    free(s->offs);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Walk output record: clevel, the source stat and its path. */
+static int plan_sink_add(struct extsort *sink, const char *src_path, const char *archive_path,
+                         int clevel, const struct stat *st){
+    size_t src_len = strlen(src_path);
+    size_t plen = 1 + sizeof(*st) + src_len;
+    unsigned char *p = malloc(plen);
+    if(!p) return 1;
+    p[0] = (unsigned char)clevel;
+    memcpy(p + 1, st, sizeof(*st));
+    memcpy(p + 1 + sizeof(*st), src_path, src_len);
+    int rc = extsort_add(sink, archive_path, (uint32_t)strlen(archive_path), p, (uint32_t)plen);
+    free(p);
+    return rc == 0 ? 0 : 1;
+}
+
+/* One index record read verbatim, with the fields the merge-join needs. */
+typedef struct {
+    unsigned char *buf;
+    size_t len, cap;
+    uint32_t id;
+    uint16_t name_len;
+    size_t flags_off; /* offset of the flags byte in buf */
+    uint64_t uncomp_size;
+    uint32_t mode;
+    uint64_t mtime;
+    size_t stat_off; /* BAAR_STAT value in buf (stat_len 0 when absent) */
+    uint16_t stat_len;
+} index_record_t;
+
+static int index_record_take(FILE *f, index_record_t *r, size_t n){
+    if(r->len + n > r->cap){
+        size_t cap = r->cap ? r->cap : 1024;
+        while(cap < r->len + n) cap *= 2;
+        unsigned char *tmp = realloc(r->buf, cap);
+        if(!tmp) return -1;
+        r->buf = tmp;
+        r->cap = cap;
+    }
+    if(n && fread(r->buf + r->len, 1, n, f) != n) return -1;
+    r->len += n;
+    return 0;
+}
+
+static int index_record_read(FILE *f, index_record_t *r){
+    r->len = 0;
+    r->stat_len = 0;
+    if(index_record_take(f, r, 6) != 0) return -1;
+    memcpy(&r->id, r->buf, 4);
+    memcpy(&r->name_len, r->buf + 4, 2);
+    /* name, flags, comp_level, offset/sizes, crc, mode, uid, gid, mtime, meta_n */
+    if(index_record_take(f, r, (size_t)r->name_len + 54) != 0) return -1;
+    size_t p = 6 + r->name_len;
+    r->flags_off = p;
+    memcpy(&r->uncomp_size, r->buf + p + 18, 8);
+    memcpy(&r->mode, r->buf + p + 30, 4);
+    memcpy(&r->mtime, r->buf + p + 42, 8);
+    uint32_t meta_n;
+    memcpy(&meta_n, r->buf + p + 50, 4);
+    for(uint32_t m=0;m<meta_n;m++){
+        uint16_t klen, vlen;
+        size_t koff = r->len + 2;
+        if(index_record_take(f, r, 2) != 0) return -1;
+        memcpy(&klen, r->buf + r->len - 2, 2);
+        if(index_record_take(f, r, (size_t)klen + 2) != 0) return -1;
+        memcpy(&vlen, r->buf + r->len - 2, 2);
+        size_t voff = r->len;
+        if(index_record_take(f, r, vlen) != 0) return -1;
+        if(klen == 9 && memcmp(r->buf + koff, "BAAR_STAT", 9) == 0){
+            r->stat_off = voff;
+            r->stat_len = vlen;
+        }
+    }
+    return 0;
+}
+
+/* Writes the entries stored so far to the spill file and frees them. */
+static int lowmem_flush_new(index_t *idx, FILE *out, uint64_t *written){
+    for(uint32_t i=0;i<idx->n;i++){
+        write_index_entry(out, idx, &idx->entries[i]);
+    }
+    if(ferror(out)) return -1;
+    *written += idx->n;
+    uint32_t next_id = idx->next_id;
+    free_index(idx);
+    idx->next_id = next_id;
+    return 0;
+}
+
+static int add_files_low_memory(const char *archive, add_job_t *jobs, int job_count,
+                                const char *pwd, int mirror_mode,
+                                char **ignore_patterns, size_t ignore_count,
+                                const add_options_t *opts){
+    if(opts->dedup || opts->cdc || opts->delta_depth > 0 || opts->base_path || opts->verify_content){
+        fprintf(stderr, "Warning: --dedup, --cdc, --delta, --base and --verify-content need the whole index; ignored with --low-memory\n");
+    }
     FILE *f = fopen(archive, "r+b");
     if(!f) f = fopen(archive, "w+b");
     if(!f){ perror("open archive"); return 1; }
     ensure_header(f);
-    index_t idx = load_index(f);
+    fseeko(f, 8, SEEK_SET);
+    uint64_t old_index_offset = read_u64(f);
+    if(old_index_offset == 0) old_index_offset = trailer_index_offset(f);
+
+    extsort_t names = { .near_path = archive };
+    extsort_t walked = { .near_path = archive };
+    index_record_t rec = {0};
+    FILE *new_entries = NULL;
+    uint32_t old_n = 0;
+    uint32_t maxid = 0;
+    int overall_status = 0;
+    id_set_t deleted = {0};
+    uint32_t deleted_count = 0;
+    uint32_t prior_deleted = 0;
+    uint64_t new_count = 0;
+    index_t idx = {0};
+
+    /* live index entries, keyed by name; the payload keeps the record's ordinal */
+    if(old_index_offset){
+        fseeko(f, (off_t)old_index_offset, SEEK_SET);
+        old_n = read_u32(f);
+        for(uint32_t i=0;i<old_n;i++){
+            if(index_record_read(f, &rec) != 0){
+                fprintf(stderr, "Error: truncated index in %s\n", archive);
+                overall_status = 1;
+                goto out;
+            }
+            if(rec.id > maxid) maxid = rec.id;
+            if(rec.buf[rec.flags_off] & 4){ prior_deleted++; continue; }
+            unsigned char payload[4 + 8 + 4 + 8 + 65535];
+            memcpy(payload, &i, 4);
+            memcpy(payload + 4, &rec.uncomp_size, 8);
+            memcpy(payload + 12, &rec.mode, 4);
+            memcpy(payload + 16, &rec.mtime, 8);
+            if(rec.stat_len) memcpy(payload + 24, rec.buf + rec.stat_off, rec.stat_len);
+            if(extsort_add(&names, (const char*)rec.buf + 6, rec.name_len, payload, 24 + rec.stat_len) != 0){
+                fprintf(stderr, "Error: cannot sort the archive index\n");
+                overall_status = 1;
+                goto out;
+            }
+        }
+    }
+    idx.next_id = maxid + 1;
+
+    add_stream_ctx_t ctx = {
+        .archive_fp = f,
+        .idx = &idx,
+        .pwd = pwd,
+        .incremental_mode = 1,
+        .mirror_mode = mirror_mode,
+        .ignore_patterns = ignore_patterns,
+        .ignore_count = ignore_count,
+        .read_order = opts->read_order,
+        .io_timeout_ms = opts->io_timeout_ms,
+        .plan_sink = &walked
+    };
+    uint32_t *to_remove = NULL;
+    uint32_t remove_count = 0;
+    ctx.to_remove = &to_remove;
+    ctx.remove_count = &remove_count;
+
+    struct stat arch_st;
+    if(fstat(fileno(f), &arch_st) == 0){
+        ctx.archive_dev = arch_st.st_dev;
+        ctx.archive_ino = arch_st.st_ino;
+        ctx.archive_id_valid = 1;
+    }
+    dev_t *allowed_devs = NULL;
+    if(opts->one_file_system){
+        ctx.one_file_system = 1;
+        if(opts->allow_fs_count > 0){
+            allowed_devs = calloc(opts->allow_fs_count, sizeof(*allowed_devs));
+        }
+        for(size_t i=0; allowed_devs && i<opts->allow_fs_count; i++){
+            struct stat ast;
+            if(stat(opts->allow_fs_paths[i], &ast) != 0){
+                fprintf(stderr, "Warning: --allow-fs %s: %s\n", opts->allow_fs_paths[i], strerror(errno));
+                continue;
+            }
+            allowed_devs[ctx.allowed_dev_count++] = ast.st_dev;
+        }
+        ctx.allowed_devs = allowed_devs;
+    }
+
+    if(!global_quiet && !global_verbose){
+        fprintf(stderr, "%s\n", BAAR_HEADER);
+        fprintf(stderr, "Adding files:\n"); fflush(stderr);
+    }
+
+    for(int i=0;i<job_count;i++){
+        if(g_abort_requested) break;
+        if(!jobs[i].src_root) continue;
+        if(walk_job_tree(&ctx, &jobs[i]) != 0){
+            overall_status = 1;
+            if(g_abort_requested) break;
+        }
+    }
+    ctx.plan_sink = NULL;
+    if(walked.failed || names.failed || extsort_finish(&names) != 0 || extsort_finish(&walked) != 0){
+        fprintf(stderr, "Error: cannot sort the walked files\n");
+        overall_status = 1;
+        goto finalize;
+    }
+    if(!(new_entries = spill_file_open(archive))){
+        fprintf(stderr, "Error: cannot create a temp file for new entries\n");
+        overall_status = 1;
+        goto finalize;
+    }
+
+    /* merge-join: both streams are in name order, so each side is read once */
+    const char *ak = NULL, *bk = NULL;
+    uint32_t akl = 0, bkl = 0, apl = 0, bpl = 0;
+    const unsigned char *ap = NULL, *bp = NULL;
+    int ahave = extsort_next(&names, &ak, &akl, &ap, &apl);
+    int bhave = extsort_next(&walked, &bk, &bkl, &bp, &bpl);
+    while((ahave > 0 || bhave > 0) && !g_abort_requested){
+        int c = ahave <= 0 ? 1 : (bhave <= 0 ? -1 : extsort_key_cmp((const unsigned char*)ak, akl, (const unsigned char*)bk, bkl));
+        uint32_t ordinal = 0;
+        if(c <= 0) memcpy(&ordinal, ap, 4);
+        if(c < 0){
+            /* archived but not walked */
+            if(mirror_mode && id_set_add(&deleted, ordinal) > 0) deleted_count++;
+            ahave = extsort_next(&names, &ak, &akl, &ap, &apl);
+            continue;
+        }
+        struct stat st;
+        memcpy(&st, bp + 1, sizeof(st));
+        int clevel = bp[0];
+        char *src = strndup((const char*)bp + 1 + sizeof(st), bpl - 1 - sizeof(st));
+        char *dst = strndup(bk, bkl);
+        if(!src || !dst){
+            free(src); free(dst);
+            overall_status = 1;
+            break;
+        }
+        int store = 1;
+        if(c == 0){
+            uint64_t size; uint32_t mode; uint64_t mtime;
+            memcpy(&size, ap + 4, 8);
+            memcpy(&mode, ap + 12, 4);
+            memcpy(&mtime, ap + 16, 8);
+            char *cached = apl > 24 ? strndup((const char*)ap + 24, apl - 24) : NULL;
+            if(stat_matches_entry(size, mode, mtime, cached, &st)){
+                if(!global_quiet){ fprintf(stderr, "Skipping unchanged: %s\n", src); }
+                store = 0;
+            }
+            free(cached);
+        }
+        if(store){
+            uint32_t before = idx.n;
+            if(process_single_file(&ctx, src, dst, clevel, &st) != 0){
+                overall_status = 1;
+            } else if(c == 0 && idx.n > before && id_set_add(&deleted, ordinal) > 0){
+                /* replaced by the entry just stored */
+                deleted_count++;
+            }
+        }
+        free(src);
+        free(dst);
+        if(idx.n >= BAAR_LOWMEM_FLUSH_ENTRIES && lowmem_flush_new(&idx, new_entries, &new_count) != 0){
+            fprintf(stderr, "Error: cannot write new entries: %s\n", strerror(errno));
+            overall_status = 1;
+            break;
+        }
+        if(c == 0) ahave = extsort_next(&names, &ak, &akl, &ap, &apl);
+        bhave = extsort_next(&walked, &bk, &bkl, &bp, &bpl);
+    }
+    if(ahave < 0 || bhave < 0){
+        fprintf(stderr, "Error: cannot read a sort run: %s\n", strerror(errno));
+        overall_status = 1;
+    }
+
+finalize:
+    if(g_abort_requested && !global_quiet){
+        fprintf(stderr, "\nInterrupt received. Finalizing archive metadata...\n");
+    }
+    if(!global_quiet && mirror_mode && deleted_count > 0){
+        if(!global_verbose) fprintf(stderr, "\n");
+        fprintf(stderr, "Mirror: marking %u entries as deleted\n", deleted_count);
+    }
+    if(new_entries && lowmem_flush_new(&idx, new_entries, &new_count) == 0 && fflush(new_entries) == 0){
+        /* new index: the old records with replaced/removed ones flagged deleted, then the new entries */
+        FILE *rf = old_n ? fopen(archive, "rb") : NULL;
+        if(old_n && !rf){
+            perror("open archive");
+            overall_status = 1;
+        } else {
+            fseeko(f, 0, SEEK_END);
+            uint64_t index_offset = (uint64_t)ftello(f);
+            write_u32(f, old_n + (uint32_t)new_count);
+            int ok = 1;
+            if(rf) fseeko(rf, (off_t)old_index_offset + 4, SEEK_SET);
+            for(uint32_t i=0;ok && i<old_n;i++){
+                if(index_record_read(rf, &rec) != 0){ ok = 0; break; }
+                if(id_set_has(&deleted, i)) rec.buf[rec.flags_off] |= 4;
+                fwrite(rec.buf, 1, rec.len, f);
+            }
+            rewind(new_entries);
+            unsigned char copy[64 * 1024];
+            size_t got;
+            while(ok && (got = fread(copy, 1, sizeof(copy), new_entries)) > 0){
+                if(fwrite(copy, 1, got, f) != got) ok = 0;
+            }
+            if(rf) fclose(rf);
+            if(ok && fflush(f) == 0){
+                update_header_index_offset(f, index_offset);
+                uint64_t total = old_n + new_count;
+                if(!global_quiet && total > 0 && prior_deleted + deleted_count > total / 2){
+                    fprintf(stderr, "Hint: archive contains many deleted entries; run 'baar f %s' to compact.\n", archive);
+                }
+            } else {
+                /* the header still points at the previous index */
+                fprintf(stderr, "Error: cannot write the index: %s\n", strerror(errno));
+                fflush(f);
+                if(ftruncate(fileno(f), (off_t)index_offset) != 0){ /* keep going */ }
+                overall_status = 1;
+            }
+        }
+    } else if(new_entries){
+        fprintf(stderr, "Error: cannot write new entries: %s\n", strerror(errno));
+        overall_status = 1;
+    }
+
+    io_worker_release(ctx.io);
+    if(ctx.timed_out_count > 0){
+        if(!global_verbose && !global_quiet) fprintf(stderr, "\n");
+        fprintf(stderr, "Timed out (%zu file(s) skipped), retry these:\n", ctx.timed_out_count);
+        for(size_t i=0;i<ctx.timed_out_count;i++){
+            fprintf(stderr, "  %s\n", ctx.timed_out_paths[i]);
+        }
+        overall_status = 1;
+    }
+    str_list_free(ctx.timed_out_paths, ctx.timed_out_count);
+    free(to_remove);
+    free(allowed_devs);
+out:
+    if(new_entries) fclose(new_entries);
+    extsort_free(&names);
+    extsort_free(&walked);
+    id_set_free(&deleted);
+    free(rec.buf);
+    free_index(&idx);
+    fclose(f);
+    if(!global_verbose && !global_quiet){ fprintf(stderr, "\n"); }
+    if(g_abort_requested){
+        return overall_status == 0 ? 130 : overall_status;
+    }
+    return overall_status;
+}
+
+static int add_files_streaming(const char *archive, add_job_t *jobs, int job_count,
+                               const char *pwd, int incremental_mode, int mirror_mode,
+                               char **ignore_patterns, size_t ignore_count,
+                               const add_options_t *opts){
+    int to_stdout = strcmp(archive, "-") == 0;
+    int volumes = opts && (opts->volume_size > 0 || opts->stripe > 0);
+    add_options_t pipe_opts;
+    if(to_stdout){
+        /* nothing to compare against or read back: every source is stored in full */
+        if(incremental_mode || (opts && (opts->dedup || opts->cdc || opts->delta_depth > 0 ||
+                                         opts->base_path || opts->verify_content || opts->low_memory))){
+            fprintf(stderr, "Note: -i/-m, --dedup, --cdc, --delta, --base, --verify-content and --low-memory are ignored when writing to stdout\n");
+        }
+        incremental_mode = 0;
+        mirror_mode = 0;
+    } else if(opts && (opts->local_headers || volumes) &&
+              (opts->dedup || opts->cdc || opts->delta_depth > 0 || opts->base_path || opts->low_memory)){
+        /* every entry must own the blob that follows its local header or sits in a volume */
+        fprintf(stderr, "Note: --dedup, --cdc, --delta, --base and --low-memory are ignored with %s\n",
+                opts->local_headers ? "--local-headers" : "--volume-size and --stripe");
+    }
+    if(opts && opts->local_headers && opts->read_order != BAAR_READ_ORDER_READDIR){
+        /* local headers carry their id as soon as the file is written; a reordered batch would
+           renumber the entries afterwards and 'baar recover' would restore the wrong ids */
+        fprintf(stderr, "Note: --read-order is ignored with --local-headers\n");
+    }
+    if(opts && (to_stdout || opts->local_headers || volumes)){
+        pipe_opts = *opts;
+        pipe_opts.dedup = 0;
+        pipe_opts.cdc = 0;
+        pipe_opts.delta_depth = 0;
+        pipe_opts.base_path = NULL;
+        pipe_opts.low_memory = 0;
+        if(to_stdout) pipe_opts.verify_content = 0;
+        if(opts->local_headers) pipe_opts.read_order = BAAR_READ_ORDER_READDIR;
+        opts = &pipe_opts;
+    }
+    if(opts && opts->low_memory){
+        if(incremental_mode){
+            return add_files_low_memory(archive, jobs, job_count, pwd, mirror_mode,
+                                        ignore_patterns, ignore_count, opts);
+        }
+        fprintf(stderr, "Note: --low-memory only applies with --incremental or --mirror\n");
+    }
+    FILE *f = NULL;
+    index_t idx = {0};
+    pipe_out_t pipe_out = { STDOUT_FILENO, 0 };
+    if(to_stdout){
+        if(isatty(STDOUT_FILENO)){
+            fprintf(stderr, "Refusing to write an archive to a terminal; redirect or pipe standard output\n");
+            return 1;
+        }
+        f = pipe_out_open(&pipe_out);
+        if(!f){ perror("stdout"); return 1; }
+        char magic[8] = {0};
+        memcpy(magic, MAGIC, 6);
+        fwrite(magic, 1, 8, f);
+        write_u64(f, 0);
+        for(int i=16;i<HEADER_SIZE;i++) fputc(0, f);
+    } else {
+        f = fopen(archive, "r+b");
+        if(!f) f = fopen(archive, "w+b");
+        if(!f){ perror("open archive"); return 1; }
+        ensure_header(f);
+        idx = load_index(f);
+        idx.archive_path = archive;
+    }
+    FILE *spool = NULL;
+    if(opts && (opts->local_headers || volumes)){
+        spool = to_stdout ? tmpfile() : spill_file_open(archive);
+        if(!spool){
+            perror(volumes ? "volume spool" : "local header spool");
+            free_index(&idx);
+            fclose(f);
+            return 1;
+        }
+    }
     size_t original_entries = idx.n;
 
     size_t lookup_count = 0;
     entry_lookup_item_t *lookup = build_entry_lookup_items(&idx, &lookup_count);
 
-    uint8_t *entry_seen = NULL;
+    id_set_t entry_seen = {0};
     int mirror_tracking_ok = 1;
     if(mirror_mode && original_entries > 0){
-        entry_seen = calloc(original_entries, 1);
-        if(!entry_seen){
+        if(id_set_reserve(&entry_seen, (uint32_t)(original_entries - 1)) != 0){
             mirror_tracking_ok = 0;
             if(!global_quiet){
                 fprintf(stderr, "Warning: mirror tracking disabled due to low memory; skipped deletions.\n");
@@ -7142,16 +11063,19 @@ static int add_files_streaming(const char *archive, add_job_t *jobs, int job_cou
 
     uint32_t *to_remove = NULL;
     uint32_t remove_count = 0;
+    id_set_t remove_set = {0};
 
     add_stream_ctx_t ctx = {
-        .archive_fp = f,
+        .archive_fp = spool ? spool : f,
+        .local_out = (opts && opts->local_headers) ? f : NULL,
         .idx = &idx,
         .original_entry_count = original_entries,
         .entry_lookup = lookup,
         .entry_lookup_count = lookup_count,
-        .entry_seen = entry_seen,
+        .entry_seen = (mirror_mode && mirror_tracking_ok) ? &entry_seen : NULL,
         .to_remove = &to_remove,
         .remove_count = &remove_count,
+        .remove_set = &remove_set,
         .pwd = pwd,
         .incremental_mode = incremental_mode,
         .mirror_mode = mirror_mode,
@@ -7159,17 +11083,75 @@ static int add_files_streaming(const char *archive, add_job_t *jobs, int job_cou
         .ignore_count = ignore_count
     };
 
-    /* store canonical path of the archive file (on disk) so we can avoid adding it */
-    char *archive_canon = realpath(archive, NULL);
-    if(!archive_canon) archive_canon = strdup(archive);
-    ctx.archive_path_on_disk = archive_canon;
-
-     /* record archive file modification time for incremental detection
-         This value is used to treat files with mtime <= archive_mtime as unchanged
-         if index entries also predate the archive's mtime. */
      struct stat arch_st;
-     ctx.archive_mtime = 0;
-     if(stat(archive, &arch_st) == 0){ ctx.archive_mtime = (uint64_t)arch_st.st_mtime; }
+     if(fstat(to_stdout ? STDOUT_FILENO : fileno(f), &arch_st) == 0 && (!to_stdout || S_ISREG(arch_st.st_mode))){
+         ctx.archive_dev = arch_st.st_dev;
+         ctx.archive_ino = arch_st.st_ino;
+         ctx.archive_id_valid = 1;
+     }
+
+    dev_t *allowed_devs = NULL;
+    if(opts && opts->one_file_system){
+        ctx.one_file_system = 1;
+        if(opts->allow_fs_count > 0){
+            allowed_devs = calloc(opts->allow_fs_count, sizeof(*allowed_devs));
+        }
+        for(size_t i=0; allowed_devs && i<opts->allow_fs_count; i++){
+            struct stat ast;
+            if(stat(opts->allow_fs_paths[i], &ast) != 0){
+                fprintf(stderr, "Warning: --allow-fs %s: %s\n", opts->allow_fs_paths[i], strerror(errno));
+                continue;
+            }
+            allowed_devs[ctx.allowed_dev_count++] = ast.st_dev;
+        }
+        ctx.allowed_devs = allowed_devs;
+    }
+    if(opts){
+        ctx.read_order = opts->read_order;
+        ctx.io_timeout_ms = opts->io_timeout_ms;
+        ctx.verify_content = opts->verify_content;
+        if(opts->dedup){
+            ctx.dedup = dedup_index_build(&idx, pwd);
+            if(!ctx.dedup) fprintf(stderr, "Warning: out of memory for the dedup index; --dedup ignored\n");
+        }
+        ctx.delta_max_depth = opts->delta_depth;
+        if(opts->delta_depth > 0 && !incremental_mode){
+            fprintf(stderr, "Warning: --delta only applies with --incremental; storing full copies\n");
+        }
+        if(opts->cdc){
+            ctx.cdc = cdc_index_build(f, &idx, pwd);
+            if(!ctx.cdc) fprintf(stderr, "Warning: cannot build the chunk index; --cdc ignored\n");
+        }
+        if(opts->base_path){
+            ctx.base = add_base_open(opts->base_path, archive);
+            if(!ctx.base){
+                dedup_index_free(ctx.dedup);
+                cdc_index_free(ctx.cdc);
+                free(allowed_devs);
+                free(lookup);
+                id_set_free(&entry_seen);
+                free_index(&idx);
+                fclose(f);
+                return 1;
+            }
+        }
+        if(volumes){
+            ctx.volumes = volume_set_open(archive, opts);
+            if(!ctx.volumes){
+                free(allowed_devs);
+                free(lookup);
+                id_set_free(&entry_seen);
+                free_index(&idx);
+                fclose(f);
+                fclose(spool);
+                return 1;
+            }
+        }
+    }
+
+    /* without the slot map a failed re-read searches to_remove for the id it takes back */
+    ctx.remove_slot = calloc(idx.next_id ? idx.next_id : 1, sizeof(uint32_t));
+    ctx.remove_slot_n = ctx.remove_slot ? idx.next_id : 0;
 
     /* Compact CLI mode: print header and a single dynamic info line under it */
     if(!global_quiet && !global_verbose){
@@ -7191,31 +11173,56 @@ static int add_files_streaming(const char *archive, add_job_t *jobs, int job_cou
         for(size_t i=0;i<original_entries;i++){
             entry_t *e = &idx.entries[i];
             if(!e->name || (e->flags & 4)) continue;
-            if(entry_seen && entry_seen[i]) continue;
-            append_unique_id(&to_remove, &remove_count, e->id);
-            if(incremental_mode){
-                e->flags |= 4;
-            }
+            if(id_set_has(&entry_seen, (uint32_t)i)) continue;
+            if(opts && opts->mirror_scope_count > 0 &&
+               !archive_path_under_any(e->name, opts->mirror_scope, opts->mirror_scope_count)) continue;
+            append_unique_id(&to_remove, &remove_count, &remove_set, e->id);
+            e->flags |= 4;
+        }
+    }
+    if(opts && opts->remove_count > 0){
+        for(size_t i=0;i<original_entries;i++){
+            entry_t *e = &idx.entries[i];
+            if(!e->name || (e->flags & 4)) continue;
+            if(!archive_path_under_any(e->name, opts->remove_paths, opts->remove_count)) continue;
+            append_unique_id(&to_remove, &remove_count, &remove_set, e->id);
+            e->flags |= 4;
         }
     }
 
-    if(incremental_mode && remove_count > 0 && to_remove){
+    if(remove_count > 0 && to_remove){
         if(!global_quiet && mirror_mode){
             fprintf(stderr, "Mirror: marking %u entries as deleted\n", remove_count);
         }
-        for(uint32_t i=0;i<remove_count;i++){
-            mark_entry_deleted_flag(&idx, to_remove[i]);
+        for(uint32_t i=0;i<idx.n;i++){
+            if(id_set_has(&remove_set, idx.entries[i].id)) idx.entries[i].flags |= 4;
         }
     }
+    id_set_free(&remove_set);
+    free(ctx.remove_slot);
+    ctx.remove_slot = NULL;
+    ctx.remove_slot_n = 0;
 
     if(g_abort_requested && !global_quiet){
         fprintf(stderr, "\nInterrupt received. Finalizing archive metadata...\n");
     }
 
+    /* the index only goes out once every blob it points to is in its volume */
+    if(volume_set_close(ctx.volumes) != 0) overall_status = 1;
+
     fseek(f,0,SEEK_END);
     uint64_t index_offset = ftell(f);
     write_index(f, &idx);
-    update_header_index_offset(f, index_offset);
+    if(to_stdout){
+        write_u64(f, index_offset);
+        fwrite(TRAILER_MAGIC, 1, 8, f);
+        if(fflush(f) != 0){
+            fprintf(stderr, "Write error on standard output: %s\n", strerror(errno));
+            overall_status = 1;
+        }
+    } else {
+        update_header_index_offset(f, index_offset);
+    }
     if(incremental_mode && !global_quiet){
         uint32_t deleted_entries = 0;
         for(uint32_t i=0;i<idx.n;i++){
@@ -7226,15 +11233,52 @@ static int add_files_streaming(const char *archive, add_job_t *jobs, int job_cou
         }
     }
     fclose(f);
+    if(spool) fclose(spool);
+
+    io_worker_release(ctx.io);
+    if(ctx.timed_out_count > 0){
+        if(!global_verbose && !global_quiet) fprintf(stderr, "\n");
+        fprintf(stderr, "Timed out (%zu file(s) skipped), retry these:\n", ctx.timed_out_count);
+        for(size_t i=0;i<ctx.timed_out_count;i++){
+            fprintf(stderr, "  %s\n", ctx.timed_out_paths[i]);
+        }
+        overall_status = 1;
+    }
+    str_list_free(ctx.timed_out_paths, ctx.timed_out_count);
+    if(ctx.dedup_hits > 0 && !global_quiet){
+        if(!global_verbose) fprintf(stderr, "\n");
+        fprintf(stderr, "Dedup: %zu file(s) share existing data (%llu bytes not written)\n",
+                ctx.dedup_hits, (unsigned long long)ctx.dedup_bytes);
+    }
+    dedup_index_free(ctx.dedup);
+    if(ctx.cdc && (ctx.cdc->new_chunks || ctx.cdc->reused_chunks) && !global_quiet){
+        if(!global_verbose && !ctx.dedup_hits) fprintf(stderr, "\n");
+        fprintf(stderr, "Chunks: %zu new, %zu reused (%llu bytes not written)\n",
+                ctx.cdc->new_chunks, ctx.cdc->reused_chunks, (unsigned long long)ctx.cdc->reused_bytes);
+    }
+    cdc_index_free(ctx.cdc);
+    if(ctx.base_refs > 0 && !global_quiet){
+        if(!global_verbose && !ctx.dedup_hits && !(ctx.cdc && ctx.cdc->new_chunks)) fprintf(stderr, "\n");
+        fprintf(stderr, "Base: %zu file(s) referenced from %s (%llu bytes not written)\n",
+                ctx.base_refs, opts->base_path, (unsigned long long)ctx.base_bytes);
+    }
+    add_base_close(ctx.base);
+    ref_bases_close();
+    if(ctx.moved && ctx.moved->hits > 0 && !global_quiet){
+        if(!global_verbose && !ctx.dedup_hits && !(ctx.cdc && ctx.cdc->new_chunks) && !ctx.base_refs) fprintf(stderr, "\n");
+        fprintf(stderr, "Moved: %zu file(s) matched by inode (%llu bytes not re-read)\n",
+                ctx.moved->hits, (unsigned long long)ctx.moved->bytes);
+    }
+    inode_map_free(ctx.moved);
 
     free(lookup);
-    free(entry_seen);
-    if(ctx.archive_path_on_disk) free(ctx.archive_path_on_disk);
+    id_set_free(&entry_seen);
+    free(allowed_devs);
 
     int rebuild_status = 0;
-    if(!incremental_mode && remove_count > 0 && to_remove){
+    if(!incremental_mode && remove_count > 0){
         if(!global_verbose && !global_quiet) fprintf(stderr, "\n");
-        rebuild_status = rebuild_archive(archive, to_remove, remove_count, global_quiet);
+        rebuild_status = maybe_compact_archive(archive, global_quiet);
     }
 
     free(to_remove);
@@ -7273,8 +11317,184 @@ static char *escape_json_string(const char *s){
     return out;
 }
 
-static int list_archive(const char *archive, int json){
-    FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
+/* --compact-threshold: replacing or removing entries only flags them deleted; the archive is
+   rebuilt once the data only deleted entries use exceeds `percent` of the stored data or
+   `bytes` (either check is off when negative/zero). */
+typedef struct {
+    int percent;
+    uint64_t bytes;
+} compact_policy_t;
+
+static compact_policy_t g_compact_policy = { 30, 0 };
+
+/* A byte count with an optional K/M/G/T suffix ("512M", "4GiB"); zero is rejected. */
+static int parse_size_suffix(const char *s, uint64_t *out){
+    if(!s || !*s) return -1;
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if(errno != 0 || end == s) return -1;
+    unsigned shift = 0;
+    switch(*end){
+        case '\0': break;
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        case 't': case 'T': shift = 40; break;
+        default: return -1;
+    }
+    if(*end && end[1] && strcmp(end + 1, "B") != 0 && strcmp(end + 1, "iB") != 0) return -1;
+    if(v == 0 || v > (UINT64_MAX >> shift)) return -1;
+    *out = (uint64_t)v << shift;
+    return 0;
+}
+
+/* "30%", a size with an optional K/M/G/T suffix, or "off". */
+static int parse_compact_threshold(const char *s, compact_policy_t *out){
+    if(!s || !*s) return -1;
+    if(strcmp(s, "off") == 0 || strcmp(s, "never") == 0){
+        out->percent = -1;
+        out->bytes = 0;
+        return 0;
+    }
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if(errno != 0 || end == s) return -1;
+    if(strcmp(end, "%") == 0){
+        if(v > 100) return -1;
+        out->percent = (int)v;
+        out->bytes = 0;
+        return 0;
+    }
+    uint64_t bytes = 0;
+    if(parse_size_suffix(s, &bytes) != 0) return -1;
+    out->percent = -1;
+    out->bytes = bytes;
+    return 0;
+}
+
+static void format_compact_threshold(const compact_policy_t *p, char *out, size_t outlen){
+    if(p->bytes) snprintf(out, outlen, "%llu bytes", (unsigned long long)p->bytes);
+    else if(p->percent >= 0) snprintf(out, outlen, "%d%%", p->percent);
+    else snprintf(out, outlen, "off");
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    int live;
+} blob_span_t;
+
+static int compare_blob_span(const void *a, const void *b){
+    const blob_span_t *x = a, *y = b;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+static int blob_span_add(blob_span_t **spans, size_t *n, size_t *cap, uint64_t offset, uint64_t size, int live){
+    if(*n == *cap){
+        size_t ncap = *cap ? *cap * 2 : 64;
+        blob_span_t *grown = realloc(*spans, sizeof(*grown) * ncap);
+        if(!grown) return -1;
+        *spans = grown;
+        *cap = ncap;
+    }
+    (*spans)[*n].offset = offset;
+    (*spans)[*n].size = size;
+    (*spans)[*n].live = live;
+    (*n)++;
+    return 0;
+}
+
+/* Stored bytes by blob: `dead` counts blobs that only deleted entries use, `live` the rest.
+   Blobs shared by several entries (dedup, moves, --cdc chunks) are counted once. The chunks
+   of a chunked entry count with it, and a deleted delta base still needed by a live delta
+   counts as live: a rebuild would have to expand those deltas rather than reclaim it. */
+static int archive_garbage(index_t *idx, uint64_t *live, uint64_t *dead, uint32_t *deleted){
+    *live = *dead = 0;
+    *deleted = 0;
+    uint8_t *needed = calloc(idx->n ? idx->n : 1, 1);
+    if(!needed) return -1;
+    for(uint32_t i=0;i<idx->n;i++){
+        entry_t *e = &idx->entries[i];
+        if(e->flags & 4) continue;
+        for(int hops = 0; hops < 64 && (e->flags & 16); hops++){
+            entry_t *base = delta_base_entry(idx, e);
+            if(!base) break;
+            needed[base - idx->entries] = 1;
+            e = base;
+        }
+    }
+    int fd = idx->archive_fp ? fileno(idx->archive_fp) : -1;
+    blob_span_t *spans = NULL;
+    size_t n = 0, cap = 0;
+    int status = 0;
+    for(uint32_t i=0; status == 0 && i<idx->n; i++){
+        entry_t *e = &idx->entries[i];
+        if(e->flags & 4) (*deleted)++;
+        /* --base references and volume entries keep their data outside the archive */
+        if(e->comp_size == 0 || (e->flags & (32 | 64))) continue;
+        int in_use = !(e->flags & 4) || needed[i];
+        status = blob_span_add(&spans, &n, &cap, e->data_offset, e->comp_size, in_use);
+        if(status != 0 || !(e->flags & 8) || fd < 0) continue;
+        unsigned char *m = NULL;
+        long chunks = cdc_manifest_read(fd, e, &m);
+        for(long k=0; status == 0 && k<chunks; k++){
+            cdc_chunk_t c;
+            cdc_record_get(m + BAAR_CDC_HEADER_SIZE + (size_t)k * BAAR_CDC_RECORD_SIZE, &c);
+            status = blob_span_add(&spans, &n, &cap, c.offset, c.comp_size, in_use);
+        }
+        free(m);
+    }
+    free(needed);
+    if(status != 0){ free(spans); return -1; }
+    qsort(spans, n, sizeof(*spans), compare_blob_span);
+    for(size_t i=0;i<n;){
+        size_t j = i;
+        int any_live = 0;
+        uint64_t size = 0;
+        while(j < n && spans[j].offset == spans[i].offset){
+            any_live |= spans[j].live;
+            if(spans[j].size > size) size = spans[j].size;
+            j++;
+        }
+        if(any_live) *live += size;
+        else *dead += size;
+        i = j;
+    }
+    free(spans);
+    return 0;
+}
+
+static int compact_due(const compact_policy_t *p, uint64_t live, uint64_t dead){
+    if(dead == 0) return 0;
+    if(p->bytes && dead >= p->bytes) return 1;
+    if(p->percent >= 0 && (long double)dead * 100.0L > (long double)p->percent * (long double)(live + dead)) return 1;
+    return 0;
+}
+
+/* Rebuilds the archive when its deleted data passes g_compact_policy. */
+static int maybe_compact_archive(const char *archive, int quiet){
+    FILE *f = fopen(archive, "rb");
+    if(!f) return 0;
+    index_t idx = load_index(f);
+    uint64_t live = 0, dead = 0;
+    uint32_t deleted = 0;
+    int have = archive_garbage(&idx, &live, &dead, &deleted) == 0;
+    free_index(&idx);
+    fclose(f);
+    if(!have || !compact_due(&g_compact_policy, live, dead)) return 0;
+    if(!quiet){
+        char thr[64];
+        format_compact_threshold(&g_compact_policy, thr, sizeof(thr));
+        fprintf(stderr, "Compacting: %llu of %llu stored bytes belong to deleted entries (threshold %s)\n",
+                (unsigned long long)dead, (unsigned long long)(live + dead), thr);
+    }
+    return rebuild_archive(archive, NULL, 0, quiet);
+}
+
+static int list_archive(const char *archive, int json){
+    FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
     index_t idx = load_index(f);
     if(!json){
         printf("Archive: %s\n", archive);
@@ -7285,9 +11505,19 @@ static int list_archive(const char *archive, int json){
             printf("%3u  %02x   %u   %6" PRIu64 "  %6" PRIu64 "  %s\n",
                 e->id, e->flags, e->comp_level, e->uncomp_size, e->comp_size, ename ? ename : "");
         }
+        uint64_t live = 0, dead = 0;
+        uint32_t deleted = 0;
+        if(archive_garbage(&idx, &live, &dead, &deleted) == 0){
+            char thr[64];
+            format_compact_threshold(&g_compact_policy, thr, sizeof(thr));
+            printf("Deleted: %u entr%s, %" PRIu64 " of %" PRIu64 " stored bytes (%.1f%%); compaction threshold %s%s\n",
+                   deleted, deleted == 1 ? "y" : "ies", dead, live + dead,
+                   live + dead ? (double)dead * 100.0 / (double)(live + dead) : 0.0, thr,
+                   compact_due(&g_compact_policy, live, dead) ? " (due)" : "");
+        }
     } else {
-
-        printf("[");
+        /* the entries plus the same deleted-data summary the text form ends with */
+        printf("{\"entries\":[");
         for(uint32_t i=0;i<idx.n;i++){
             entry_t *e = &idx.entries[i];
             const char *ename = entry_get_name(&idx, e);
@@ -7297,7 +11527,16 @@ static int list_archive(const char *archive, int json){
             if(escaped) free(escaped);
             if(i+1<idx.n) printf(",");
         }
-        printf("]\n");
+        printf("]");
+        uint64_t live = 0, dead = 0;
+        uint32_t deleted = 0;
+        if(archive_garbage(&idx, &live, &dead, &deleted) == 0){
+            char thr[64];
+            format_compact_threshold(&g_compact_policy, thr, sizeof(thr));
+            printf(",\"deleted\":%u,\"reclaimable_bytes\":%" PRIu64 ",\"threshold\":\"%s\",\"due\":%s",
+                   deleted, dead, thr, compact_due(&g_compact_policy, live, dead) ? "true" : "false");
+        }
+        printf("}\n");
     }
     if(!global_quiet && !global_verbose) fprintf(stderr, "\n");
     if(!global_quiet && !global_verbose) fprintf(stderr, "\n");
@@ -7392,138 +11631,627 @@ static int search_archive(const char *archive, const char *pattern, int json){
     free_index(&idx); fclose(f); return 0;
 }
 
-static int extract_archive(const char *archive, const char *dest, const char *pwd){
-    FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
-    index_t idx = load_index(f);
-    if(dest && dest[0]){
-        mkpath_local(dest, 0755);
+/* CRC32 of a file on disk (for 'x --checksum'). Returns 0 or -1. */
+static int file_crc32(const char *path, uint32_t *crc_out){
+    FILE *in = fopen(path, "rb");
+    if(!in) return -1;
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    if(!chunk){ fclose(in); return -1; }
+    uint32_t crc = crc32(0L, Z_NULL, 0);
+    size_t n;
+    while((n = fread(chunk, 1, BAAR_STREAM_CHUNK_SIZE, in)) > 0) crc = (uint32_t)crc32(crc, chunk, (uInt)n);
+    int status = ferror(in) ? -1 : 0;
+    free(chunk);
+    fclose(in);
+    *crc_out = crc;
+    return status;
+}
+
+/* 'x --update/--checksum': 1 when the regular file at `outpath` already holds the data of `e`
+   (2 when only its attributes need to be restored), 0 when it has to be written. */
+static int extract_dest_current(const char *outpath, const entry_t *e, const extract_options_t *opts){
+    struct stat st;
+    if(lstat(outpath, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != e->uncomp_size) return 0;
+    if(opts->update && (uint64_t)st.st_mtime == e->mtime) return 1;
+    if(opts->checksum){
+        uint32_t crc = 0;
+        if(file_crc32(outpath, &crc) == 0 && crc == e->crc32) return 2;
     }
-    uint32_t total_entries = 0; for(uint32_t ii=0; ii<idx.n; ii++) if(!(idx.entries[ii].flags & 4)) total_entries++;
-    uint32_t processed_entries = 0;
-    for(uint32_t i=0;i<idx.n;i++){
-        entry_t *e = &idx.entries[i];
-        if(e->flags & 4) continue;
-        const char *ename = entry_get_name(&idx, e);
-        if(!ename){
-            if(!global_quiet) fprintf(stderr, "Skipping entry id %u: missing name\n", e->id);
+    return 0;
+}
+
+static int compare_cstr(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Remove what lies below `full` (archive path `rel`) but is not in the sorted `names`. */
+static void extract_prune_dir(const char *full, const char *rel, char **names, size_t count, uint32_t *removed){
+    DIR *dir = opendir(full);
+    if(!dir) return;
+    struct dirent *ent;
+    while((ent = readdir(dir))){
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        char child[PATH_MAX * 2], child_rel[PATH_MAX * 2];
+        snprintf(child, sizeof(child), "%s/%s", full, ent->d_name);
+        snprintf(child_rel, sizeof(child_rel), "%s/%s", rel, ent->d_name);
+        const char *key = child_rel;
+        if(!bsearch(&key, names, count, sizeof(*names), compare_cstr)){
+            if(global_verbose) fprintf(stderr, "Deleting: %s\n", child);
+            remove_path_recursive(child);
+            (*removed)++;
             continue;
         }
-        fseek(f, e->data_offset, SEEK_SET);
-        unsigned char *enc = malloc(e->comp_size);
-        fread(enc,1,e->comp_size,f);
-        if(e->flags & 2){ xor_buf(enc, e->comp_size, pwd); }
-        int entry_compressed = entry_is_effectively_compressed(e);
-        size_t outcap = e->uncomp_size;
-        if(!entry_compressed && e->comp_size > outcap){
-            outcap = e->comp_size;
-        }
-        unsigned char *out = malloc(outcap + 1);
-        char *outpath = NULL;
-        if(!out){
-            fprintf(stderr, "Out of memory while extracting %s\n", ename);
-            free(enc);
-            break;
+        struct stat st;
+        if(lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) extract_prune_dir(child, child_rel, names, count, removed);
+    }
+    closedir(dir);
+}
+
+/* 'x --delete': remove files and directories below the archive's top-level paths in `dest` that
+   the archive does not contain. Paths outside those top-level entries are never touched. */
+static uint32_t extract_delete_extraneous(const char *dest, index_t *idx){
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    uint32_t removed = 0;
+    int oom = 0;
+    for(uint32_t i=0;i<idx->n;i++){
+        entry_t *e = &idx->entries[i];
+        const char *ename = (e->flags & 4) ? NULL : entry_get_name(idx, e);
+        if(!ename) continue;
+        while(ename[0] == '/') ename++;
+        char *p = strdup(ename);
+        if(!p){ oom = 1; break; }
+        size_t len = strlen(p);
+        while(len > 0 && p[len-1] == '/') p[--len] = '\0';
+        /* the entry itself and every directory above it */
+        while(p[0]){
+            if(count == cap){
+                size_t ncap = cap ? cap * 2 : 256;
+                char **grown = realloc(names, sizeof(*names) * ncap);
+                if(!grown){ oom = 1; break; }
+                names = grown;
+                cap = ncap;
+            }
+            if(!(names[count] = strdup(p))){ oom = 1; break; }
+            count++;
+            char *cut = strrchr(p, '/');
+            if(!cut) break;
+            *cut = '\0';
+        }
+        free(p);
+    }
+    if(oom){
+        fprintf(stderr, "Out of memory while listing archive paths; --delete skipped\n");
+        for(size_t i=0;i<count;i++) free(names[i]);
+        free(names);
+        return 0;
+    }
+    qsort(names, count, sizeof(*names), compare_cstr);
+    for(size_t i=0;i<count;i++){
+        if(strchr(names[i], '/') || (i > 0 && strcmp(names[i], names[i-1]) == 0)) continue;
+        char *full = compose_extract_path(dest, names[i]);
+        struct stat st;
+        if(full && lstat(full, &st) == 0 && S_ISDIR(st.st_mode)) extract_prune_dir(full, names[i], names, count, &removed);
+        free(full);
+    }
+    for(size_t i=0;i<count;i++) free(names[i]);
+    free(names);
+    return removed;
+}
+
+/* 'baar diff': a source file whose metadata differs from its entry but whose size matches is a
+   candidate; with --content its CRC32 decides (computed by a few threads). */
+typedef struct {
+    char *path;
+    char *name;
+    uint32_t crc32;
+    int differs;
+} diff_candidate_t;
+
+typedef struct {
+    index_t *idx;
+    entry_lookup_item_t *lookup;
+    size_t lookup_count;
+    uint8_t *seen;
+    const add_job_t *job;
+    int content;
+    dev_t archive_dev;
+    ino_t archive_ino;
+    /* pruning shared with walk_job_tree(): ignore patterns and --one-file-system live in
+       `filter`, the rest mirrors the walker's locals */
+    const add_stream_ctx_t *filter;
+    const char *resolved_root;
+    int limit_depth;
+    dev_t root_dev;
+    char **devdir_roots;
+    size_t devdir_root_count;
+    char **added;
+    size_t added_count;
+    char **modified;
+    size_t modified_count;
+    diff_candidate_t *cands;
+    size_t cand_count;
+    size_t cand_cap;
+    size_t next_cand; /* claimed by the CRC threads */
+    pthread_mutex_t lock;
+    int status;
+} diff_state_t;
+
+static void diff_note(diff_state_t *ds, char ***list, size_t *count, const char *name){
+    if(str_list_append(list, count, name) != 0) ds->status = 2;
+}
+
+/* Compare the non-directory `path` (archive name `name`) with its entry by metadata only. */
+static void diff_check(diff_state_t *ds, const char *path, const char *name, const struct stat *st){
+    entry_t *e = find_entry_by_name_fast(ds->lookup, ds->lookup_count, ds->idx, name);
+    if(!e){
+        diff_note(ds, &ds->added, &ds->added_count, name);
+        return;
+    }
+    ds->seen[e - ds->idx->entries] = 1;
+    const char *type = entry_get_meta_val(ds->idx, e, "BAAR_TYPE");
+    const char *want = S_ISLNK(st->st_mode) ? "SYMLINK" : S_ISFIFO(st->st_mode) ? "FIFO" :
+                       S_ISCHR(st->st_mode) ? "CHARDEV" : S_ISBLK(st->st_mode) ? "BLKDEV" : NULL;
+    int same = (type && want) ? strcmp(type, want) == 0 : (!type && !want);
+    if(same && S_ISLNK(st->st_mode)){
+        char target[PATH_MAX + 1];
+        ssize_t n = readlink(path, target, PATH_MAX);
+        const char *stored = entry_get_meta_val(ds->idx, e, "BAAR_SYMLINK_TARGET");
+        if(n >= 0) target[n] = '\0';
+        same = n >= 0 && stored && strcmp(stored, target) == 0;
+    } else if(same && (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))){
+        const char *maj = entry_get_meta_val(ds->idx, e, "BAAR_DEV_MAJOR");
+        const char *min = entry_get_meta_val(ds->idx, e, "BAAR_DEV_MINOR");
+        same = maj && min && strtoul(maj, NULL, 10) == major(st->st_rdev) && strtoul(min, NULL, 10) == minor(st->st_rdev);
+    } else if(same && S_ISREG(st->st_mode) && !source_unchanged(ds->idx, e, st)){
+        same = 0;
+        if(ds->content && e->uncomp_size == (uint64_t)st->st_size){
+            if(ds->cand_count == ds->cand_cap){
+                size_t ncap = ds->cand_cap ? ds->cand_cap * 2 : 64;
+                diff_candidate_t *grown = realloc(ds->cands, sizeof(*grown) * ncap);
+                if(!grown){ ds->status = 2; return; }
+                ds->cands = grown;
+                ds->cand_cap = ncap;
+            }
+            diff_candidate_t *c = &ds->cands[ds->cand_count];
+            c->path = strdup(path);
+            c->name = strdup(name);
+            c->crc32 = e->crc32;
+            c->differs = 0;
+            if(!c->path || !c->name){ free(c->path); free(c->name); ds->status = 2; return; }
+            ds->cand_count++;
+            return;
+        }
+    }
+    if(!same) diff_note(ds, &ds->modified, &ds->modified_count, name);
+}
+
+static int diff_ignored(diff_state_t *ds, const char *path){
+    char *name = resolve_archive_path(ds->job, path);
+    int skip = should_ignore_path(path, name ? name : path, ds->filter->ignore_patterns, ds->filter->ignore_count);
+    free(name);
+    return skip;
+}
+
+static void diff_compare(diff_state_t *ds, const char *path, const struct stat *st){
+    if(diff_ignored(ds, path)) return;
+    char *name = strip_leading_slashes(resolve_archive_path(ds->job, path));
+    if(!name){ ds->status = 2; return; }
+    diff_check(ds, path, name, st);
+    free(name);
+}
+
+/* Return true if walk_job_tree() skips the symlink `path` (target `link_target`): the link is
+   dangling, leaves the source root or points into a pseudo filesystem. */
+static int diff_skip_symlink(diff_state_t *ds, const char *path, const char *link_target){
+    if(!link_target || !link_target[0]) return 1;
+    char *resolved = realpath(path, NULL);
+    if(!resolved) return 1;
+    int skip = strncmp(resolved, "/proc", 5) == 0 || strncmp(resolved, "/sys", 4) == 0;
+    if(!skip && (strncmp(resolved, "/dev", 4) == 0 || strncmp(resolved, "/run", 4) == 0 || strncmp(resolved, "/var/run", 8) == 0)){
+        skip = ds->limit_depth < 0 || path_relative_depth(ds->job->src_root, resolved) > ds->limit_depth;
+    }
+    if(!skip){
+        size_t root_len = strlen(ds->resolved_root);
+        skip = strncmp(resolved, ds->resolved_root, root_len) != 0 || (resolved[root_len] != '/' && resolved[root_len] != '\0');
+    }
+    free(resolved);
+    return skip;
+}
+
+/* Walk the directory `path` applying the same pruning as walk_job_tree(), so a tree that was
+   just added with the same options compares clean. */
+static void diff_walk(diff_state_t *ds, const char *path){
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    DIR *dir = dfd >= 0 ? fdopendir(dfd) : NULL;
+    if(!dir){
+        fprintf(stderr, "Cannot open directory %s: %s\n", path, strerror(errno));
+        if(dfd >= 0) close(dfd);
+        ds->status = 2;
+        return;
+    }
+    int dir_pseudo = fd_on_pseudo_fs(dfd);
+    int probe_devdir = find_devdir_root(ds->devdir_roots, ds->devdir_root_count, path, NULL) < 0;
+    struct dirent *ent;
+    while((ent = readdir(dir)) && !g_abort_requested){
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        char *child = build_child_path(path, ent->d_name);
+        if(!child){ ds->status = 2; break; }
+        struct stat st;
+        if(stat_at_nofollow(dfd, ent->d_name, &st) != 0){
+            fprintf(stderr, "Skipping %s: %s\n", child, strerror(errno));
+            ds->status = 2;
+            free(child);
+            continue;
         }
-        uLong produced = e->uncomp_size;
-        if(entry_compressed){
-            produced = outcap;
-            int res = uncompress(out, &produced, enc, e->comp_size);
-            if(res!=Z_OK){
-                fprintf(stderr,"Decompression failed for %s\n", ename);
-                free(outpath);
-                free(enc); free(out); continue;
+        char link_target[PATH_MAX + 1];
+        ssize_t link_len = -1;
+        if(S_ISLNK(st.st_mode)){
+            link_len = readlinkat(dfd, ent->d_name, link_target, PATH_MAX);
+            if(link_len >= 0) link_target[link_len] = '\0';
+        }
+        if(probe_devdir){
+            probe_devdir = 0;
+            if(entry_looks_like_device(ent->d_name, &st, link_len > 0 ? link_target : NULL)){
+                register_devdir_root(&ds->devdir_roots, &ds->devdir_root_count, path);
+            }
+        }
+        int devdir_depth = -1;
+        int devdir_match = find_devdir_root(ds->devdir_roots, ds->devdir_root_count, child, &devdir_depth);
+        int pseudo = devdir_match < 0 && (dir_pseudo || is_pseudo_path(child));
+        int too_deep = ds->limit_depth >= 0 && path_relative_depth(ds->job->src_root, child) > ds->limit_depth;
+        if(st.st_dev == ds->archive_dev && st.st_ino == ds->archive_ino){
+            /* the archive itself */
+        } else if(devdir_match >= 0){
+            /* 'dosdevices' style directory: only its immediate entries are archived */
+            if(devdir_depth == 1) diff_compare(ds, child, &st);
+        } else if(S_ISLNK(st.st_mode)){
+            if(!diff_skip_symlink(ds, child, link_len >= 0 ? link_target : NULL)) diff_compare(ds, child, &st);
+        } else if(S_ISDIR(st.st_mode)){
+            if(!diff_ignored(ds, child) && !too_deep && !crosses_filesystem(ds->filter, ds->root_dev, st.st_dev) &&
+               !(dir_pseudo && ds->limit_depth < 0)){
+                diff_walk(ds, child);
             }
-        } else {
-            if(e->comp_size > 0){
-                memcpy(out, enc, e->comp_size);
-            }
-            if(!produced) produced = e->comp_size;
-        }
-
-        uint32_t crc = crc32(0, out, produced);
-        if(crc != e->crc32){
-            fprintf(stderr, "CRC mismatch (wrong password or corrupted entry): %s\n", ename);
-            free(outpath);
-            free(enc); free(out); continue;
-        }
-
-        outpath = compose_extract_path(dest, ename);
-        if(!outpath){
-            fprintf(stderr, "Out of memory while building output path for %s\n", ename);
-            free(enc); free(out); continue;
-        }
-        /* Check for metadata that indicates special type: symlink, fifo, device or dir */
-        const char *baar_type = entry_get_meta_val(&idx, e, "BAAR_TYPE");
-        const char *symlink_target = entry_get_meta_val(&idx, e, "BAAR_SYMLINK_TARGET");
-        const char *maj_s = entry_get_meta_val(&idx, e, "BAAR_DEV_MAJOR");
-        const char *min_s = entry_get_meta_val(&idx, e, "BAAR_DEV_MINOR");
-        /* Ensure parent directory exists */
-        char *parent = strdup(outpath);
-        if(parent){
-            char *trim = parent;
-            size_t plen = strlen(trim);
-            while(plen>0 && trim[plen-1] == '/') trim[--plen] = '\0';
-            char *ps = strrchr(trim, '/');
-            if(ps){
-                *ps = '\0';
-                if(trim[0]) mkpath_local(trim, 0755);
-            } else if(dest && dest[0]){
-                mkpath_local(dest, 0755);
-            }
-            free(parent);
-        }
-
-        if(baar_type && strcmp(baar_type, "SYMLINK") == 0 && symlink_target){
-            /* create symlink */
-            unlink(outpath); /* remove existing */
-            if(symlink(symlink_target, outpath) != 0){ fprintf(stderr, "Cannot create symlink %s -> %s: %s\n", outpath, symlink_target, strerror(errno)); }
-            else {
-                if(e->uid || e->gid){ if(lchown(outpath, (uid_t)e->uid, (gid_t)e->gid) != 0 && geteuid() == 0) { fprintf(stderr, "Warning: lchown failed for %s: %s\n", outpath, strerror(errno)); } }
-                struct timespec times[2]; times[0].tv_nsec = UTIME_NOW; times[1].tv_nsec = UTIME_NOW; /* best-effort; real mtime may not be preserved */
-                /* use utimensat with AT_SYMLINK_NOFOLLOW if available */
+        } else if(S_ISREG(st.st_mode)){
+            if(!pseudo || (ds->limit_depth >= 0 && !too_deep)) diff_compare(ds, child, &st);
+        } else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)){
+            if(!(pseudo && too_deep)) diff_compare(ds, child, &st);
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+/* Compare the job root of a diff; directories are walked with diff_walk(). */
+static void diff_walk_root(diff_state_t *ds, const char *root){
+    struct stat st;
+    if(lstat(root, &st) != 0){
+        fprintf(stderr, "Skipping %s: %s\n", root, strerror(errno));
+        ds->status = 2;
+        return;
+    }
+    if(diff_ignored(ds, root)) return;
+    if(S_ISDIR(st.st_mode)){
+        ds->root_dev = st.st_dev;
+        diff_walk(ds, root);
+    } else if(S_ISREG(st.st_mode)){
+        if(!is_pseudo_path(root)) diff_compare(ds, root, &st);
+    } else if(S_ISLNK(st.st_mode) || S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)){
+        diff_compare(ds, root, &st);
+    }
+}
+
+static void *diff_crc_worker(void *arg){
+    diff_state_t *ds = arg;
+    for(;;){
+        pthread_mutex_lock(&ds->lock);
+        size_t i = ds->next_cand++;
+        pthread_mutex_unlock(&ds->lock);
+        if(i >= ds->cand_count || g_abort_requested) break;
+        uint32_t crc = 0;
+        ds->cands[i].differs = file_crc32(ds->cands[i].path, &crc) != 0 || crc != ds->cands[i].crc32;
+    }
+    return NULL;
+}
+
+static void diff_print_list(const char *key, char **list, size_t count, int json, int *first_key){
+    qsort(list, count, sizeof(*list), compare_cstr);
+    if(!json){
+        for(size_t i=0;i<count;i++) printf("%c %s\n", key[0] == 'a' ? 'A' : key[0] == 'r' ? 'D' : 'M', list[i]);
+        return;
+    }
+    printf("%s\"%s\":[", *first_key ? "" : ",", key);
+    *first_key = 0;
+    for(size_t i=0;i<count;i++){
+        char *esc = escape_json_string(list[i]);
+        printf("%s\"%s\"", i ? "," : "", esc ? esc : "");
+        free(esc);
+    }
+    printf("]");
+}
+
+/* Compare `dir` with the entries of `archive` it would be stored as. Only metadata (the same
+   stat cache 'a -i' uses) is compared unless `content` is set; archive data is never read.
+   `ignore_patterns` and the --one-file-system options in `opts` prune the walk as they do for
+   'a'. Returns 0 when nothing differs, 1 when something does, 2 on errors. */
+static int diff_archive(const char *archive, const char *dir, int content, int json,
+                        char **ignore_patterns, size_t ignore_count, const add_options_t *opts){
+    FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 2; }
+    struct stat arch_st;
+    if(fstat(fileno(f), &arch_st) != 0){ perror("stat"); fclose(f); return 2; }
+    index_t idx = load_index(f);
+    char *root = normalize_path_basic(dir);
+    add_job_t job = { .src_root = root };
+    add_stream_ctx_t filter = { .ignore_patterns = ignore_patterns, .ignore_count = ignore_count };
+    dev_t *allowed_devs = NULL;
+    if(opts && opts->one_file_system){
+        filter.one_file_system = 1;
+        if(opts->allow_fs_count > 0) allowed_devs = calloc(opts->allow_fs_count, sizeof(*allowed_devs));
+        for(size_t i=0; allowed_devs && i<opts->allow_fs_count; i++){
+            struct stat ast;
+            if(stat(opts->allow_fs_paths[i], &ast) != 0){
+                fprintf(stderr, "Warning: --allow-fs %s: %s\n", opts->allow_fs_paths[i], strerror(errno));
+                continue;
+            }
+            allowed_devs[filter.allowed_dev_count++] = ast.st_dev;
+        }
+        filter.allowed_devs = allowed_devs;
+    }
+    char resolved_root_buf[PATH_MAX+1];
+    const char *resolved_root = root ? realpath(root, resolved_root_buf) : NULL;
+    if(!resolved_root) resolved_root = root ? root : "";
+    diff_state_t ds = { .idx = &idx, .job = &job, .content = content,
+                        .archive_dev = arch_st.st_dev, .archive_ino = arch_st.st_ino,
+                        .filter = &filter, .resolved_root = resolved_root,
+                        .limit_depth = root && is_pseudo_root(root) ? 1 : -1 };
+    pthread_mutex_init(&ds.lock, NULL);
+    ds.lookup = build_entry_lookup_items(&idx, &ds.lookup_count);
+    ds.seen = calloc(idx.n ? idx.n : 1, 1);
+    if(!root || !ds.seen){
+        fprintf(stderr, "Out of memory\n");
+        ds.status = 2;
+    } else {
+        diff_walk_root(&ds, root);
+    }
+
+    if(ds.cand_count > 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+        if(nthreads > 8) nthreads = 8;
+        if(nthreads > ds.cand_count) nthreads = ds.cand_count;
+        pthread_t threads[8];
+        size_t started = 0;
+        for(; started < nthreads; started++){
+            if(pthread_create(&threads[started], NULL, diff_crc_worker, &ds) != 0) break;
+        }
+        if(started == 0) diff_crc_worker(&ds);
+        for(size_t i=0;i<started;i++) pthread_join(threads[i], NULL);
+        for(size_t i=0;i<ds.cand_count;i++){
+            if(ds.cands[i].differs) diff_note(&ds, &ds.modified, &ds.modified_count, ds.cands[i].name);
+            free(ds.cands[i].path);
+            free(ds.cands[i].name);
+        }
+    }
+
+    /* entries below the compared root that the walk did not find */
+    char **removed = NULL;
+    size_t removed_count = 0;
+    char *prefix = root ? strip_leading_slashes(resolve_archive_path(&job, root)) : NULL;
+    for(uint32_t i=0; prefix && ds.seen && i<idx.n; i++){
+        entry_t *e = &idx.entries[i];
+        if((e->flags & 4) || ds.seen[i]) continue;
+        const char *ename = entry_get_name(&idx, e);
+        if(!ename || !archive_path_under_any(ename, &prefix, 1)) continue;
+        if(should_ignore_path(NULL, ename, ignore_patterns, ignore_count)) continue;
+        size_t nl = strlen(ename);
+        if(nl > 0 && ename[nl-1] == '/'){
+            /* directory entries ('baar mkdir') only need the directory to exist */
+            char *disk = NULL;
+            size_t pl = strlen(prefix);
+            if(asprintf(&disk, "%s%s", root, ename + pl) >= 0){
+                struct stat dst;
+                int present = lstat(disk, &dst) == 0 && S_ISDIR(dst.st_mode);
+                free(disk);
+                if(present) continue;
+            }
+        }
+        diff_note(&ds, &removed, &removed_count, ename);
+    }
+
+    int first_key = 1;
+    if(json) printf("{");
+    diff_print_list("added", ds.added, ds.added_count, json, &first_key);
+    diff_print_list("removed", removed, removed_count, json, &first_key);
+    diff_print_list("modified", ds.modified, ds.modified_count, json, &first_key);
+    if(json) printf("}\n");
+    else if(!global_quiet){
+        fflush(stdout);
+        fprintf(stderr, "%zu added, %zu removed, %zu modified\n", ds.added_count, removed_count, ds.modified_count);
+    }
+
+    int status = ds.status ? ds.status : (ds.added_count || removed_count || ds.modified_count) ? 1 : 0;
+    str_list_free(ds.added, ds.added_count);
+    str_list_free(ds.modified, ds.modified_count);
+    str_list_free(removed, removed_count);
+    free(ds.cands);
+    free(ds.seen);
+    free(ds.lookup);
+    free_devdir_roots(ds.devdir_roots, ds.devdir_root_count);
+    free(allowed_devs);
+    free(prefix);
+    free(root);
+    pthread_mutex_destroy(&ds.lock);
+    free_index(&idx);
+    fclose(f);
+    return status;
+}
+
+/* Creates one entry below `dest`; its data is read from `f` at e->data_offset. Returns 1 when
+   the entry was skipped because of an error (already reported). */
+static int extract_entry_to(FILE *f, index_t *idx, entry_t *e, const char *ename, const char *dest,
+                            const char *pwd, const extract_options_t *opts, uint32_t *current_entries){
+    char *outpath = NULL;
+    outpath = compose_extract_path(dest, ename);
+    if(!outpath){
+        fprintf(stderr, "Out of memory while building output path for %s\n", ename);
+        return 1;
+    }
+    /* Check for metadata that indicates special type: symlink, fifo, device or dir */
+    const char *baar_type = entry_get_meta_val(idx, e, "BAAR_TYPE");
+    const char *symlink_target = entry_get_meta_val(idx, e, "BAAR_SYMLINK_TARGET");
+    const char *maj_s = entry_get_meta_val(idx, e, "BAAR_DEV_MAJOR");
+    const char *min_s = entry_get_meta_val(idx, e, "BAAR_DEV_MINOR");
+    /* Ensure parent directory exists */
+    char *parent = strdup(outpath);
+    if(parent){
+        char *trim = parent;
+        size_t plen = strlen(trim);
+        while(plen>0 && trim[plen-1] == '/') trim[--plen] = '\0';
+        char *ps = strrchr(trim, '/');
+        if(ps){
+            *ps = '\0';
+            if(trim[0]) mkpath_local(trim, 0755);
+        } else if(dest && dest[0]){
+            mkpath_local(dest, 0755);
+        }
+        free(parent);
+    }
+
+    if(baar_type && strcmp(baar_type, "SYMLINK") == 0 && symlink_target){
+        /* create symlink */
+        unlink(outpath); /* remove existing */
+        if(symlink(symlink_target, outpath) != 0){ fprintf(stderr, "Cannot create symlink %s -> %s: %s\n", outpath, symlink_target, strerror(errno)); }
+        else {
+            if(e->uid || e->gid){ if(lchown(outpath, (uid_t)e->uid, (gid_t)e->gid) != 0 && geteuid() == 0) { fprintf(stderr, "Warning: lchown failed for %s: %s\n", outpath, strerror(errno)); } }
+            struct timespec times[2]; times[0].tv_nsec = UTIME_NOW; times[1].tv_nsec = UTIME_NOW; /* best-effort; real mtime may not be preserved */
+            /* use utimensat with AT_SYMLINK_NOFOLLOW if available */
 #ifdef UTIME_OMIT
-                if(utimensat(AT_FDCWD, outpath, times, AT_SYMLINK_NOFOLLOW) != 0){ /* ignore error */ }
+            if(utimensat(AT_FDCWD, outpath, times, AT_SYMLINK_NOFOLLOW) != 0){ /* ignore error */ }
 #endif
-            }
-        } else if(baar_type && strcmp(baar_type, "FIFO") == 0){
-            /* create FIFO */
-            unlink(outpath);
-            if(mkfifo(outpath, (mode_t)e->mode) != 0){ fprintf(stderr, "Cannot create FIFO %s: %s\n", outpath, strerror(errno)); }
-            else {
-                safe_chown_path(outpath, e->uid, e->gid);
-                /* set mtime */
-                struct utimbuf utb = { .actime = (time_t)e->mtime, .modtime = (time_t)e->mtime };
-                utime(outpath, &utb);
-            }
-        } else if(maj_s && min_s){
-            /* create device node if running as root */
-            unsigned int maj = (unsigned int)strtoul(maj_s, NULL, 10);
-            unsigned int min = (unsigned int)strtoul(min_s, NULL, 10);
-            dev_t dev = makedev(maj, min);
-            mode_t m = (mode_t)((e->mode & 07777u) | S_IFCHR);
-            /* if BAAR_TYPE says BLKDEV, use block */
-            if(baar_type && strcmp(baar_type, "BLKDEV") == 0) m = (mode_t)((e->mode & 07777u) | S_IFBLK);
-            unlink(outpath);
-            if(geteuid() == 0){
-                if(mknod(outpath, m, dev) != 0){ fprintf(stderr, "Cannot mknod %s: %s\n", outpath, strerror(errno)); }
-                else { safe_chown_path(outpath, e->uid, e->gid); if(chmod(outpath, e->mode) != 0) { /* ignore */ } }
-            } else {
-                fprintf(stderr, "Skipping device node %s: need root to create device nodes\n", outpath);
-            }
-        } else if(strlen(ename) > 0 && ename[strlen(ename)-1] == '/'){
-            /* directory */
-            mkpath_local(outpath, (mode_t)e->mode ? (mode_t)e->mode : 0755);
+        }
+    } else if(baar_type && strcmp(baar_type, "FIFO") == 0){
+        /* create FIFO */
+        unlink(outpath);
+        if(mkfifo(outpath, (mode_t)e->mode) != 0){ fprintf(stderr, "Cannot create FIFO %s: %s\n", outpath, strerror(errno)); }
+        else {
             safe_chown_path(outpath, e->uid, e->gid);
+            /* set mtime */
             struct utimbuf utb = { .actime = (time_t)e->mtime, .modtime = (time_t)e->mtime };
             utime(outpath, &utb);
+        }
+    } else if(maj_s && min_s){
+        /* create device node if running as root */
+        unsigned int maj = (unsigned int)strtoul(maj_s, NULL, 10);
+        unsigned int min = (unsigned int)strtoul(min_s, NULL, 10);
+        dev_t dev = makedev(maj, min);
+        mode_t m = (mode_t)((e->mode & 07777u) | S_IFCHR);
+        /* if BAAR_TYPE says BLKDEV, use block */
+        if(baar_type && strcmp(baar_type, "BLKDEV") == 0) m = (mode_t)((e->mode & 07777u) | S_IFBLK);
+        unlink(outpath);
+        if(geteuid() == 0){
+            if(mknod(outpath, m, dev) != 0){ fprintf(stderr, "Cannot mknod %s: %s\n", outpath, strerror(errno)); }
+            else { safe_chown_path(outpath, e->uid, e->gid); if(chmod(outpath, e->mode) != 0) { /* ignore */ } }
         } else {
-            FILE *outf = fopen(outpath, "wb");
-            if(!outf){ fprintf(stderr,"Cannot write to %s: %s\n", outpath, strerror(errno)); }
-            else { fwrite(out,1,produced,outf); fclose(outf); }
-            if(outf){ safe_chown_path(outpath, e->uid, e->gid); chmod(outpath, e->mode); struct utimbuf utb = { .actime = (time_t)e->mtime, .modtime = (time_t)e->mtime }; utime(outpath, &utb); }
+            fprintf(stderr, "Skipping device node %s: need root to create device nodes\n", outpath);
+        }
+    } else if(strlen(ename) > 0 && ename[strlen(ename)-1] == '/'){
+        /* directory */
+        mkpath_local(outpath, (mode_t)e->mode ? (mode_t)e->mode : 0755);
+        safe_chown_path(outpath, e->uid, e->gid);
+        struct utimbuf utb = { .actime = (time_t)e->mtime, .modtime = (time_t)e->mtime };
+        utime(outpath, &utb);
+    } else {
+        int current = (opts && (opts->update || opts->checksum)) ? extract_dest_current(outpath, e, opts) : 0;
+        if(current) (*current_entries)++;
+        if(current != 1){
+            if(!current && extract_entry_file(f, idx, e, ename, pwd, outpath) != 0){ free(outpath); return 1; }
+            safe_chown_path(outpath, e->uid, e->gid); chmod(outpath, e->mode); struct utimbuf utb = { .actime = (time_t)e->mtime, .modtime = (time_t)e->mtime }; utime(outpath, &utb);
+        }
+    }
+    free(outpath);
+    return 0;
+}
+
+/* True if `pattern` matches `name` or one of its leading directories, so a glob naming
+   a directory selects everything below it. */
+static int extract_glob_match(const char *pattern, const char *name){
+    if(fnmatch(pattern, name, 0) == 0) return 1;
+    char buf[PATH_MAX];
+    size_t len = strlen(name);
+    if(len >= sizeof(buf)) return 0;
+    memcpy(buf, name, len + 1);
+    for(size_t i=len; i-- > 1;){
+        if(buf[i] != '/') continue;
+        buf[i] = '\0';
+        if(fnmatch(pattern, buf, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+static int extract_selected(const extract_options_t *opts, const char *name){
+    if(!opts) return 1;
+    if(opts->prefix_count && !archive_path_under_any(name, opts->prefixes, opts->prefix_count)) return 0;
+    if(opts->include_count){
+        size_t i = 0;
+        while(i < opts->include_count && !extract_glob_match(opts->include[i], name)) i++;
+        if(i == opts->include_count) return 0;
+    }
+    for(size_t i=0;i<opts->exclude_count;i++){
+        if(extract_glob_match(opts->exclude[i], name)) return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    int has_data; /* header-only entries (directories, links, nodes) come first */
+    uint64_t offset;
+    uint32_t pos;
+} extract_order_t;
+
+static int compare_extract_order(const void *a, const void *b){
+    const extract_order_t *x = a, *y = b;
+    if(x->has_data != y->has_data) return x->has_data - y->has_data;
+    if(x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->pos < y->pos ? -1 : (x->pos > y->pos);
+}
+
+static int extract_archive(const char *archive, const char *dest, const char *pwd, const extract_options_t *opts){
+    FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
+    index_t idx = load_index(f);
+    idx.archive_path = archive;
+    if(dest && dest[0]){
+        mkpath_local(dest, 0755);
+    }
+    /* select once from the index, then read the blobs in archive order so a partial restore
+       from a large archive is one forward pass instead of seeking back and forth */
+    extract_order_t *order = malloc(sizeof(*order) * (idx.n ? idx.n : 1));
+    if(!order){ fprintf(stderr, "Out of memory\n"); free_index(&idx); fclose(f); return 1; }
+    uint32_t total_entries = 0;
+    for(uint32_t ii=0; ii<idx.n; ii++){
+        entry_t *e = &idx.entries[ii];
+        if(e->flags & 4) continue;
+        const char *ename = entry_get_name(&idx, e);
+        if(ename && !extract_selected(opts, ename)) continue;
+        order[total_entries].has_data = e->comp_size > 0 && !(e->flags & 32);
+        order[total_entries].offset = e->data_offset;
+        order[total_entries].pos = ii;
+        total_entries++;
+    }
+    qsort(order, total_entries, sizeof(*order), compare_extract_order);
+    volume_readahead_t ra;
+    volume_readahead_init(&ra, &idx);
+    for(uint32_t oi=0;oi<total_entries;oi++) volume_readahead_add(&ra, &idx.entries[order[oi].pos]);
+    uint32_t processed_entries = 0;
+    uint32_t current_entries = 0;
+    for(uint32_t oi=0;oi<total_entries;oi++){
+        entry_t *e = &idx.entries[order[oi].pos];
+        volume_readahead_step(&ra, e);
+        const char *ename = entry_get_name(&idx, e);
+        if(!ename){
+            if(!global_quiet) fprintf(stderr, "Skipping entry id %u: missing name\n", e->id);
+            continue;
         }
-        free(outpath);
-        free(enc); free(out);
+        if(extract_entry_to(f, &idx, e, ename, dest, pwd, opts, &current_entries) != 0) continue;
         processed_entries++;
         if(!global_quiet){
             if(global_verbose) fprintf(stderr, "Extracted: %s\n", ename);
@@ -7535,14 +12263,193 @@ static int extract_archive(const char *archive, const char *dest, const char *pw
             }
         }
     }
-    free_index(&idx); fclose(f); return 0;
+    uint32_t deleted = (opts && opts->delete_extraneous) ? extract_delete_extraneous(dest, &idx) : 0;
+    if(!global_quiet && opts){
+        if(opts->update || opts->checksum) fprintf(stderr, "Up to date: %u file(s) not rewritten\n", current_entries);
+        if(opts->delete_extraneous) fprintf(stderr, "Deleted: %u extraneous path(s)\n", deleted);
+    }
+    if(!global_quiet && opts && (opts->include_count || opts->exclude_count || opts->prefix_count) && total_entries == 0){
+        fprintf(stderr, "No entries selected\n");
+    }
+    free(order);
+    volume_readahead_free(&ra);
+    free_index(&idx); ref_bases_close(); fclose(f); return 0;
+}
+
+
+/* Reads `n` bytes of a local header, counting them in *pos. */
+static int local_header_take(FILE *in, void *buf, size_t n, uint64_t *pos){
+    size_t got = n ? fread(buf, 1, n, in) : 0;
+    *pos += got;
+    return got == n ? 0 : -1;
+}
+
+/* Parses the index record after a local header magic into `e`, which then owns its name and meta. */
+static int local_header_read(FILE *in, entry_t *e, uint64_t *pos){
+    memset(e, 0, sizeof(*e));
+    uint16_t namelen = 0;
+    unsigned char fixed[54];
+    uint32_t meta_n = 0;
+    if(local_header_take(in, &e->id, 4, pos) != 0 || local_header_take(in, &namelen, 2, pos) != 0) return -1;
+    e->name = malloc((size_t)namelen + 1);
+    if(!e->name || local_header_take(in, e->name, namelen, pos) != 0) goto fail;
+    e->name[namelen] = '\0';
+    e->name_len = namelen;
+    if(local_header_take(in, fixed, sizeof(fixed), pos) != 0) goto fail;
+    e->flags = fixed[0];
+    e->comp_level = fixed[1];
+    memcpy(&e->data_offset, fixed + 2, 8);
+    memcpy(&e->comp_size, fixed + 10, 8);
+    memcpy(&e->uncomp_size, fixed + 18, 8);
+    memcpy(&e->crc32, fixed + 26, 4);
+    memcpy(&e->mode, fixed + 30, 4);
+    memcpy(&e->uid, fixed + 34, 4);
+    memcpy(&e->gid, fixed + 38, 4);
+    memcpy(&e->mtime, fixed + 42, 8);
+    memcpy(&meta_n, fixed + 50, 4);
+    if(meta_n > 1024) goto fail; /* the magic was part of some other data */
+    if(meta_n){
+        e->meta = calloc(meta_n, sizeof(*e->meta));
+        if(!e->meta) goto fail;
+        e->meta_n = meta_n;
+    }
+    for(uint32_t m=0;m<meta_n;m++){
+        char **fields[2] = { &e->meta[m].key, &e->meta[m].value };
+        for(int k=0;k<2;k++){
+            uint16_t len = 0;
+            if(local_header_take(in, &len, 2, pos) != 0) goto fail;
+            char *v = malloc((size_t)len + 1);
+            if(!v) goto fail;
+            *fields[k] = v;
+            if(local_header_take(in, v, len, pos) != 0) goto fail;
+            v[len] = '\0';
+        }
+    }
+    return 0;
+fail:
+    entry_free_meta(e);
+    free(e->name);
+    e->name = NULL;
+    return -1;
+}
+
+/* Reads forward to the next local header that is followed by its entry's data, skipping whatever
+   lies in between (the index an earlier add left behind, data of an abandoned file). Returns 1
+   with `e` filled and `in` at the entry's data, 0 at the end of the input. */
+static int local_header_next(FILE *in, uint64_t *pos, entry_t *e){
+    unsigned char win[8];
+    size_t have = 0;
+    int c;
+    while((c = getc(in)) != EOF){
+        (*pos)++;
+        if(have == 8){ memmove(win, win + 1, 7); have = 7; }
+        win[have++] = (unsigned char)c;
+        if(have < 8 || memcmp(win, LOCAL_HEADER_MAGIC, 8) != 0) continue;
+        have = 0;
+        if(local_header_read(in, e, pos) != 0) continue;
+        if(e->data_offset == *pos) return 1;
+        entry_free_meta(e);
+        free(e->name);
+        e->name = NULL;
+    }
+    return 0;
+}
+
+/* Skips `n` bytes of input that may be a pipe. */
+static int stream_skip(FILE *in, uint64_t n, unsigned char *chunk, uint64_t *pos){
+    if(n && fseeko(in, (off_t)n, SEEK_CUR) == 0){ *pos += n; return 0; }
+    while(n > 0){
+        size_t want = n > BAAR_STREAM_CHUNK_SIZE ? BAAR_STREAM_CHUNK_SIZE : (size_t)n;
+        if(local_header_take(in, chunk, want, pos) != 0) return -1;
+        n -= want;
+    }
+    return 0;
 }
 
+/* 'baar x -': extract an archive written with --local-headers from standard input in one pass.
+   Each entry's data is copied to a scratch file and handed to the regular extraction code, so
+   compression, passwords and special files behave as in 'baar x'. The index at the end is not
+   consulted: entries removed with 'baar r' since they were added are extracted as well, and a
+   path stored again later overwrites its earlier copy. */
+static int extract_stream(FILE *in, const char *dest, const char *pwd, const extract_options_t *opts){
+    unsigned char header[HEADER_SIZE];
+    if(fread(header, 1, HEADER_SIZE, in) != HEADER_SIZE || memcmp(header, MAGIC, 6) != 0){
+        fprintf(stderr, "Standard input is not a BAAR archive\n");
+        return 1;
+    }
+    FILE *spool = tmpfile();
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    if(!spool || !chunk){
+        perror("extract stream");
+        if(spool) fclose(spool);
+        free(chunk);
+        return 1;
+    }
+    if(dest && dest[0]) mkpath_local(dest, 0755);
+    uint64_t pos = HEADER_SIZE;
+    entry_t e;
+    index_t one = { .entries = &e, .n = 1 };
+    uint32_t headers = 0, processed = 0, current = 0;
+    int status = 0;
+    while(local_header_next(in, &pos, &e)){
+        headers++;
+        int take = !(e.flags & 4) && extract_selected(opts, e.name);
+        if(take && (e.flags & (8 | 16 | 32))){
+            fprintf(stderr, "Skipping %s: chunked, delta and --base entries need the whole archive\n", e.name);
+            take = 0;
+            status = 1;
+        }
+        int io = 0;
+        if(take){
+            if(ftruncate(fileno(spool), 0) != 0){ /* rewritten from the start below */ }
+            rewind(spool);
+            for(uint64_t left = e.comp_size; io == 0 && left > 0; ){
+                size_t want = left > BAAR_STREAM_CHUNK_SIZE ? BAAR_STREAM_CHUNK_SIZE : (size_t)left;
+                if(local_header_take(in, chunk, want, &pos) != 0 || fwrite(chunk, 1, want, spool) != want) io = -1;
+                left -= want;
+            }
+            if(io == 0 && fflush(spool) != 0) io = -1;
+            if(io == 0){
+                e.data_offset = 0;
+                if(extract_entry_to(spool, &one, &e, e.name, dest, pwd, opts, &current) == 0){
+                    processed++;
+                    if(!global_quiet){
+                        if(global_verbose) fprintf(stderr, "Extracted: %s\n", e.name);
+                        else {
+                            char bn[PATH_MAX]; compact_basename(e.name, bn, sizeof(bn));
+                            fprintf(stderr, "\rExtracting %u: %s\x1b[K", processed, bn); fflush(stderr);
+                        }
+                    }
+                } else {
+                    status = 1;
+                }
+            }
+        } else {
+            io = stream_skip(in, e.comp_size, chunk, &pos);
+        }
+        if(io != 0) fprintf(stderr, "Unexpected end of input in the data of %s\n", e.name);
+        entry_free_meta(&e);
+        free(e.name);
+        if(io != 0){ status = 1; break; }
+    }
+    if(!global_quiet && !global_verbose && processed) fprintf(stderr, "\n");
+    if(headers == 0){
+        fprintf(stderr, "No local headers found; 'baar x -' needs an archive written with --local-headers\n");
+        status = 1;
+    } else if(!global_quiet){
+        if(opts && (opts->update || opts->checksum)) fprintf(stderr, "Up to date: %u file(s) not rewritten\n", current);
+        fprintf(stderr, "Extracted %u of %u entr%s from the stream\n", processed, headers, headers == 1 ? "y" : "ies");
+    }
+    free(chunk);
+    fclose(spool);
+    return status;
+}
 
 static int extract_single_entry(const char *archive, const char *target_name, const char *pwd) {
     FILE *f = fopen(archive, "rb");
     if (!f) { perror("open"); return 1; }
     index_t idx = load_index(f); int found = 0;
+    idx.archive_path = archive;
     for (uint32_t i = 0; i < idx.n; i++) {
         entry_t *e = &idx.entries[i];
         const char *ename = entry_get_name(&idx, e);
@@ -7550,27 +12457,8 @@ static int extract_single_entry(const char *archive, const char *target_name, co
         if (strcmp(ename, target_name) == 0) {
             found = 1;
             if (e->flags & 4) { fprintf(stderr, "Entry '%s' is marked as deleted.\n", target_name); break; }
-            fseek(f, e->data_offset, SEEK_SET);
-            unsigned char *enc = malloc(e->comp_size); fread(enc, 1, e->comp_size, f);
-            if (e->flags & 2) { xor_buf(enc, e->comp_size, pwd); }
-            int entry_compressed = entry_is_effectively_compressed(e);
-            size_t outcap = e->uncomp_size;
-            if(!entry_compressed && e->comp_size > outcap){ outcap = e->comp_size; }
-            unsigned char *out = malloc(outcap + 1); uLong outsz = e->uncomp_size;
-            if(entry_compressed){
-                outsz = outcap;
-                int res = uncompress(out, &outsz, enc, e->comp_size);
-                if (res != Z_OK) { fprintf(stderr, "Decompression failed for '%s'.\n", target_name); free(enc); free(out); break; }
-            } else {
-                if(e->comp_size > 0){ memcpy(out, enc, e->comp_size); }
-                if(!outsz) outsz = e->comp_size;
-            }
-            uint32_t crc = crc32(0, out, outsz);
-            if(crc != e->crc32){ fprintf(stderr, "CRC mismatch (wrong password or corrupted entry): %s\n", target_name); free(enc); free(out); break; }
-            FILE *outf = fopen(target_name, "wb");
-            if (!outf) { fprintf(stderr, "Cannot write to '%s': %s\n", target_name, strerror(errno)); }
-            else { fwrite(out, 1, outsz, outf); fclose(outf); }
-            free(enc); free(out); break;
+            extract_entry_file(f, &idx, e, target_name, pwd, target_name);
+            break;
         }
     }
 
@@ -7578,7 +12466,7 @@ static int extract_single_entry(const char *archive, const char *target_name, co
         fprintf(stderr, "Entry '%s' not found in archive.\n", target_name);
     }
 
-    free_index(&idx);
+    free_index(&idx); ref_bases_close();
     fclose(f);
     return found ? 0 : 1;
 }
@@ -7586,11 +12474,18 @@ static int extract_single_entry(const char *archive, const char *target_name, co
 static int test_archive(const char *archive, const char *pwd, int json){
     FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
     index_t idx = load_index(f);
+    idx.archive_path = archive;
     int ok = 1;
+    volume_readahead_t ra;
+    volume_readahead_init(&ra, &idx);
+    for(uint32_t i=0;i<idx.n;i++){
+        if(!(idx.entries[i].flags & 4)) volume_readahead_add(&ra, &idx.entries[i]);
+    }
     if(!json){
         for(uint32_t i=0;i<idx.n;i++){
             entry_t *e = &idx.entries[i];
             if(e->flags & 4) continue;
+            volume_readahead_step(&ra, e);
             const char *ename = entry_get_name(&idx, e);
             if(!ename) ename = "(unknown)";
             fseek(f, e->data_offset, SEEK_SET);
@@ -7604,7 +12499,11 @@ static int test_archive(const char *archive, const char *pwd, int json){
             if(!out){ printf("%s ERROR\n", ename); ok = 0; free(enc); break; }
             uLong outsz = e->uncomp_size;
             int res = Z_OK;
-            if(entry_compressed){
+            if(e->flags & (8 | 16 | 32 | 64)){
+                size_t produced = 0;
+                res = entry_decode_into(f, &idx, e, pwd, out, outcap, &produced) == 0 ? Z_OK : Z_DATA_ERROR;
+                outsz = produced;
+            } else if(entry_compressed){
                 outsz = outcap;
                 res = uncompress(out, &outsz, enc, e->comp_size);
             } else {
@@ -7626,6 +12525,7 @@ static int test_archive(const char *archive, const char *pwd, int json){
         for(uint32_t i=0;i<idx.n;i++){
             entry_t *e = &idx.entries[i];
             if(e->flags & 4) continue;
+            volume_readahead_step(&ra, e);
             const char *ename = entry_get_name(&idx, e);
             if(!ename) ename = "(unknown)";
             fseek(f, e->data_offset, SEEK_SET);
@@ -7639,7 +12539,11 @@ static int test_archive(const char *archive, const char *pwd, int json){
             if(!out){ free(enc); ok = 0; break; }
             uLong outsz = e->uncomp_size;
             int res = Z_OK;
-            if(entry_compressed){
+            if(e->flags & (8 | 16 | 32 | 64)){
+                size_t produced = 0;
+                res = entry_decode_into(f, &idx, e, pwd, out, outcap, &produced) == 0 ? Z_OK : Z_DATA_ERROR;
+                outsz = produced;
+            } else if(entry_compressed){
                 outsz = outcap;
                 res = uncompress(out, &outsz, enc, e->comp_size);
             } else {
@@ -7661,7 +12565,8 @@ static int test_archive(const char *archive, const char *pwd, int json){
         }
         printf("]\n");
     }
-    free_index(&idx); fclose(f); return ok?0:2;
+    volume_readahead_free(&ra);
+    free_index(&idx); ref_bases_close(); fclose(f); return ok?0:2;
 }
 
 
@@ -7693,6 +12598,7 @@ static int info_entry(const char *archive, uint32_t id, int json){
 static int cat_entry(const char *archive, uint32_t id, const char *pwd){
     FILE *f = fopen(archive, "rb"); if(!f){ perror("open"); return 1; }
     index_t idx = load_index(f); int found = 0;
+    idx.archive_path = archive;
     for(uint32_t i=0;i<idx.n;i++){
         entry_t *e = &idx.entries[i];
         if(e->id == id){
@@ -7705,7 +12611,11 @@ static int cat_entry(const char *archive, uint32_t id, const char *pwd){
             size_t outcap = e->uncomp_size;
             if(!entry_compressed && e->comp_size > outcap){ outcap = e->comp_size; }
             unsigned char *out = malloc(outcap + 1); uLong outsz = e->uncomp_size;
-            if(entry_compressed){
+            if(e->flags & (8 | 16 | 32 | 64)){
+                size_t produced = 0;
+                if(entry_decode_into(f, &idx, e, pwd, out, outcap, &produced) != 0){ fprintf(stderr,"decompress failed\n"); free(buf); free(out); break; }
+                outsz = produced;
+            } else if(entry_compressed){
                 outsz = outcap;
                 int res = uncompress(out, &outsz, buf, e->comp_size);
                 if(res!=Z_OK){ fprintf(stderr,"decompress failed\n"); free(buf); free(out); break; }
@@ -7719,9 +12629,168 @@ static int cat_entry(const char *archive, uint32_t id, const char *pwd){
             free(buf); free(out); break;
         }
     }
-    free_index(&idx); fclose(f); return found?0:2;
+    free_index(&idx); ref_bases_close(); fclose(f); return found?0:2;
+}
+
+
+/* Blobs referenced by more than one entry (--dedup) must be copied once when an archive is
+   rewritten; this maps an old (data_offset, comp_size) to where the blob went. */
+typedef struct {
+    uint64_t old_off;
+    uint64_t size;
+    uint64_t new_off; /* UINT64_MAX until copied */
+    uint64_t new_size;
+    uint32_t new_crc;
+    uint8_t new_flags;
+    uint8_t new_level;
+    int used;
+} blob_remap_item_t;
+
+typedef struct {
+    blob_remap_item_t *items;
+    size_t cap;
+    size_t count;
+} blob_remap_t;
+
+/* Size the table for `count` blobs. Returns 0 or -1 on allocation failure. */
+static int blob_remap_init(blob_remap_t *m, size_t count){
+    size_t cap = 16;
+    while(cap < count * 2) cap <<= 1;
+    m->items = calloc(cap, sizeof(*m->items));
+    m->cap = m->items ? cap : 0;
+    return m->items ? 0 : -1;
+}
+
+/* Find (or with `add`, create) the slot for a blob. NULL if absent or the table is unusable.
+   Adding may grow the table, which invalidates earlier pointers. */
+static blob_remap_item_t *blob_remap_get(blob_remap_t *m, uint64_t off, uint64_t size, int add){
+    if(!m->cap || size == 0) return NULL;
+    if(add && (m->count + 1) * 2 > m->cap){
+        blob_remap_t grown = {0};
+        if(blob_remap_init(&grown, m->cap) == 0){
+            for(size_t j=0;j<m->cap;j++){
+                if(!m->items[j].used) continue;
+                size_t k = dedup_size_hash(m->items[j].old_off, grown.cap);
+                while(grown.items[k].used) k = (k + 1) & (grown.cap - 1);
+                grown.items[k] = m->items[j];
+            }
+            free(m->items);
+            m->items = grown.items;
+            m->cap = grown.cap;
+        } else if(m->count + 1 >= m->cap){
+            return NULL;
+        }
+    }
+    size_t i = dedup_size_hash(off, m->cap);
+    for(; m->items[i].used; i = (i + 1) & (m->cap - 1)){
+        if(m->items[i].old_off == off && m->items[i].size == size) return &m->items[i];
+    }
+    if(!add) return NULL;
+    m->count++;
+    m->items[i].used = 1;
+    m->items[i].old_off = off;
+    m->items[i].size = size;
+    m->items[i].new_off = UINT64_MAX;
+    return &m->items[i];
+}
+
+/* Copy the chunks of chunked entry `e` from `old` to the end of `newf` (each shared chunk once,
+   via `remap`) and append its manifest rewritten with the new offsets at *new_off. */
+static int copy_chunked_blob(FILE *old, FILE *newf, const entry_t *e, blob_remap_t *remap, uint64_t *new_off){
+    unsigned char *m = NULL;
+    long n = cdc_manifest_read(fileno(old), e, &m);
+    if(n < 0) return -1;
+    unsigned char *chunk = NULL;
+    size_t chunk_cap = 0;
+    int status = 0;
+    for(long k=0; k<n; k++){
+        unsigned char *rec = m + BAAR_CDC_HEADER_SIZE + (size_t)k * BAAR_CDC_RECORD_SIZE;
+        cdc_chunk_t c;
+        cdc_record_get(rec, &c);
+        blob_remap_item_t *r = blob_remap_get(remap, c.offset, c.comp_size, 1);
+        if(r && r->new_off < UINT64_MAX - 1){
+            c.offset = r->new_off;
+        } else {
+            if(c.comp_size > chunk_cap){
+                unsigned char *grown = realloc(chunk, c.comp_size);
+                if(!grown){ status = -1; break; }
+                chunk = grown;
+                chunk_cap = c.comp_size;
+            }
+            if(pread_full(fileno(old), chunk, c.comp_size, c.offset) != 0){ status = -1; break; }
+            c.offset = (uint64_t)ftello(newf);
+            if(fwrite(chunk, 1, c.comp_size, newf) != c.comp_size){ status = -1; break; }
+            if(r) r->new_off = c.offset;
+        }
+        cdc_record_put(rec, &c);
+    }
+    if(status == 0){
+        *new_off = (uint64_t)ftello(newf);
+        if(fwrite(m, 1, (size_t)e->comp_size, newf) != (size_t)e->comp_size) status = -1;
+    }
+    free(chunk);
+    free(m);
+    return status;
+}
+
+/* Expand delta entry `e` of `idx` (read from `f`) into a standalone blob, compressed again at the
+   entry's level when that helps. Used when compaction drops the entry's base. */
+static int delta_collapse(FILE *f, index_t *idx, entry_t *e, unsigned char **blob_out,
+                          size_t *blob_sz, int *compressed_out){
+    if(e->uncomp_size > SIZE_MAX) return -1;
+    size_t n = (size_t)e->uncomp_size;
+    unsigned char *full = malloc(n ? n : 1);
+    if(!full) return -1;
+    size_t got = 0;
+    if(entry_decode_into(f, idx, e, NULL, full, n, &got) != 0 || got != n || crc32_buf(0, full, n) != e->crc32){
+        free(full);
+        return -1;
+    }
+    *compressed_out = 0;
+    unsigned char *tmpout = NULL;
+    size_t tmpoutsz = 0;
+    if(e->comp_level > 0 && compress_data_level(e->comp_level, full, n, &tmpout, &tmpoutsz) == 0){
+        if(tmpoutsz < n){
+            free(full);
+            full = tmpout;
+            n = tmpoutsz;
+            *compressed_out = 1;
+        } else {
+            free(tmpout);
+        }
+    }
+    *blob_out = full;
+    *blob_sz = n;
+    return 0;
+}
+
+/* Remove the keys starting with `prefix` from an entry whose meta is loaded, e.g. BAAR_DELTA_
+   after a delta is expanded. */
+static void entry_drop_meta_prefix(entry_t *e, const char *prefix){
+    uint32_t kept = 0;
+    size_t pl = strlen(prefix);
+    for(uint32_t m=0; e->meta && m<e->meta_n; m++){
+        if(e->meta[m].key && strncmp(e->meta[m].key, prefix, pl) == 0){
+            free(e->meta[m].key);
+            free(e->meta[m].value);
+            continue;
+        }
+        e->meta[kept++] = e->meta[m];
+    }
+    e->meta_n = e->meta ? kept : 0;
 }
 
+static void clone_entry_meta(index_t *idx, entry_t *e, entry_t *dst){
+    dst->meta_n = e->meta_n;
+    dst->meta = NULL;
+    if(!e->meta_n) return;
+    if(!e->meta) entry_load_meta(idx, e);
+    dst->meta = calloc(e->meta_n, sizeof(*dst->meta));
+    for(uint32_t m=0; dst->meta && e->meta && m<e->meta_n; m++){
+        dst->meta[m].key = e->meta[m].key ? strdup(e->meta[m].key) : NULL;
+        dst->meta[m].value = e->meta[m].value ? strdup(e->meta[m].value) : NULL;
+    }
+}
 
 static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uint32_t exclude_count, int quiet){
     char bak[4096]; snprintf(bak,sizeof(bak),"%s.bak", archive);
@@ -7729,19 +12798,43 @@ static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uin
     if(!quiet){ fprintf(stderr, "Rebuilding archive: reading from '%s' -> writing new '%s'\n", bak, archive); fflush(stderr); }
     FILE *old = fopen(bak, "rb"); if(!old){ perror("open bak"); return 1; }
     index_t idx = load_index(old);
-    FILE *newf = fopen(archive, "w+b"); if(!newf){ perror("create new"); fclose(old); return 1; }
+    idx.archive_path = archive; /* volumes are named from the archive's directory */
+    id_set_t excluded = {0};
+    for(uint32_t j=0;j<exclude_count;j++){
+        if(id_set_add(&excluded, exclude_ids[j]) < 0){
+            fprintf(stderr, "Out of memory while planning the rebuild\n");
+            id_set_free(&excluded); free_index(&idx); fclose(old);
+            rename(bak, archive);
+            return 1;
+        }
+    }
+    FILE *newf = fopen(archive, "w+b"); if(!newf){ perror("create new"); id_set_free(&excluded); free_index(&idx); fclose(old); return 1; }
     ensure_header(newf);
 
     index_t newidx = {0}; newidx.next_id = 1;
+    /* at most one new entry per old one */
+    newidx.entries = malloc(sizeof(entry_t) * (idx.n ? idx.n : 1));
+    if(!newidx.entries){
+        fprintf(stderr, "Out of memory while planning the rebuild\n");
+        id_set_free(&excluded); free_index(&idx); fclose(old); fclose(newf);
+        rename(bak, archive);
+        return 1;
+    }
     uint64_t total_copied = 0;
     uint32_t copied_count = 0;
+    /* a shared blob stays as long as any kept entry references it */
+    blob_remap_t remap = {0};
+    blob_remap_init(&remap, idx.n);
         uint64_t total_to_copy = 0;
         for(uint32_t i=0;i<idx.n;i++){
             entry_t *e = &idx.entries[i];
-            int skip=0;
-            if(e->flags & 4) skip=1;
-            for(uint32_t j=0;j<exclude_count;j++) if(e->id==exclude_ids[j]) skip=1;
-            if(!skip) total_to_copy += e->comp_size;
+            if((e->flags & 4) || id_set_has(&excluded, e->id)) continue;
+            if(e->flags & 64) continue; /* stays in its volume */
+            blob_remap_item_t *r = blob_remap_get(&remap, e->data_offset, e->comp_size, 1);
+            if(!r || r->new_off == UINT64_MAX){
+                total_to_copy += e->comp_size;
+                if(r) r->new_off = UINT64_MAX - 1; /* counted */
+            }
         }
     char oldsz[64]={0};
 
@@ -7749,9 +12842,7 @@ static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uin
     uint32_t skipped_count = 0;
     for(uint32_t i=0;i<idx.n;i++){
         entry_t *e = &idx.entries[i];
-        int skip=0;
-        if(e->flags & 4) skip=1;
-        for(uint32_t j=0;j<exclude_count;j++) if(e->id==exclude_ids[j]) skip=1;
+        int skip = (e->flags & 4) || id_set_has(&excluded, e->id);
         if(skip){
             skipped_count++;
             if(!quiet && global_verbose){ fprintf(stderr, "  Skipping id %u  %s\n", e->id, e->name); fflush(stderr); }
@@ -7761,17 +12852,58 @@ static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uin
         if(!quiet && global_verbose){ 
             fprintf(stderr, "  Copying id %u  %s  (comp=%" PRIu64 ") ", e->id, e->name, e->comp_size); fflush(stderr);
         }
-        fseek(old, e->data_offset, SEEK_SET);
-        unsigned char *buf = malloc(e->comp_size);
-        fread(buf,1,e->comp_size,old);
-        uint64_t off = ftell(newf);
-        fwrite(buf,1,e->comp_size,newf);
-        total_copied += e->comp_size;
+        /* a delta whose base is dropped is stored in full, so chains collapse on compaction */
+        int collapse = 0;
+        unsigned char *full = NULL;
+        size_t full_sz = 0;
+        int full_comp = 0;
+        if(e->flags & 16){
+            entry_t *base = delta_base_entry(&idx, e);
+            collapse = !base || (base->flags & 4);
+            if(base && id_set_has(&excluded, base->id)) collapse = 1;
+            if(collapse && delta_collapse(old, &idx, e, &full, &full_sz, &full_comp) != 0){
+                fprintf(stderr, "Cannot expand delta id %u; entry dropped\n", e->id);
+                skipped_count++;
+                continue;
+            }
+        }
+        blob_remap_item_t *shared = (e->flags & 64) ? NULL : blob_remap_get(&remap, e->data_offset, e->comp_size, 0);
+        uint64_t off;
+        if(e->flags & 64){
+            /* volume parts are left as they are; only the index moves */
+            off = e->data_offset;
+        } else if(collapse){
+            off = ftell(newf);
+            fwrite(full, 1, full_sz, newf);
+            total_copied += full_sz;
+            free(full);
+        } else if(shared && shared->new_off < UINT64_MAX - 1){
+            off = shared->new_off;
+        } else if(e->flags & 8){
+            fflush(newf);
+            if(copy_chunked_blob(old, newf, e, &remap, &off) != 0){
+                fprintf(stderr, "Cannot copy chunks of id %u; entry dropped\n", e->id);
+                skipped_count++;
+                continue;
+            }
+            total_copied += e->comp_size;
+            shared = blob_remap_get(&remap, e->data_offset, e->comp_size, 0);
+            if(shared) shared->new_off = off;
+        } else {
+            fseek(old, e->data_offset, SEEK_SET);
+            unsigned char *buf = malloc(e->comp_size);
+            fread(buf,1,e->comp_size,old);
+            off = ftell(newf);
+            fwrite(buf,1,e->comp_size,newf);
+            total_copied += e->comp_size;
+            free(buf);
+            if(shared) shared->new_off = off;
+        }
         copied_count++;
-        free(buf);
 
         if(!quiet){
             if(total_to_copy>0){ unsigned int prog = (unsigned int)(total_copied * 100ULL / total_to_copy);
+                if(prog > 100) prog = 100; /* expanded deltas are larger than counted */
                 if(global_verbose) fprintf(stderr, "(%u%%)\n", prog);
                 else { char bn[PATH_MAX]; const char *ename = entry_get_name(&idx, e); compact_basename(ename ? ename : "", bn, sizeof(bn)); fprintf(stderr, "\rRebuilding: %s (%u%%)\x1b[K", bn, prog); fflush(stderr); }
             }
@@ -7779,7 +12911,6 @@ static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uin
         }
 
 
-        newidx.entries = realloc(newidx.entries, sizeof(entry_t)*(newidx.n+1));
         entry_t *ne = &newidx.entries[newidx.n];
         memset(ne,0,sizeof(*ne));
         ne->id = e->id;
@@ -7802,24 +12933,937 @@ static int rebuild_archive(const char *archive, const uint32_t *exclude_ids, uin
             ne->meta = calloc(e->meta_n, sizeof(*ne->meta));
             for(uint32_t m=0;m<e->meta_n;m++){ ne->meta[m].key = e->meta[m].key ? strdup(e->meta[m].key) : NULL; ne->meta[m].value = e->meta[m].value ? strdup(e->meta[m].value) : NULL; }
         } else ne->meta = NULL;
+        if(collapse){
+            ne->flags = (uint8_t)(full_comp ? 1 : 0);
+            ne->comp_level = full_comp ? e->comp_level : 0;
+            ne->comp_size = full_sz;
+            entry_drop_meta_prefix(ne, "BAAR_DELTA_");
+        }
         newidx.n++;
         if(ne->id >= newidx.next_id) newidx.next_id = ne->id+1;
     }
-    uint64_t index_offset = ftell(newf);
-    write_index(newf, &newidx);
-    update_header_index_offset(newf, index_offset);
-    if(!quiet){ fprintf(stderr, "Rebuild complete: copied %u entries, skipped %u entries, total bytes copied: %" PRIu64 "\n", copied_count, skipped_count, total_copied); fflush(stderr); }
-    fclose(old); fclose(newf);
-    free_index(&idx); free_index(&newidx);
-
-    char bakpath[4096]; snprintf(bakpath,sizeof(bakpath),"%s.bak", archive);
-    unlink(bakpath);
-    return 0;
-}
-
-static int remove_entry(const char *archive, uint32_t id){
-    const uint32_t arr[1] = { id };
-    return rebuild_archive(archive, arr, 1u, 0);
+    uint64_t index_offset = ftell(newf);
+    write_index(newf, &newidx);
+    update_header_index_offset(newf, index_offset);
+    if(!quiet){ fprintf(stderr, "Rebuild complete: copied %u entries, skipped %u entries, total bytes copied: %" PRIu64 "\n", copied_count, skipped_count, total_copied); fflush(stderr); }
+    fclose(old); fclose(newf);
+    free(remap.items);
+    id_set_free(&excluded);
+    free_index(&idx); free_index(&newidx);
+
+    char bakpath[4096]; snprintf(bakpath,sizeof(bakpath),"%s.bak", archive);
+    unlink(bakpath);
+    return 0;
+}
+
+/* 'baar r': flags the entries deleted and appends one new index; their data stays in the
+   archive until the compaction policy, 'baar f' or 'baar compress' reclaims it. */
+static int remove_entries(const char *archive, const uint32_t *ids, uint32_t id_count,
+                          char **globs, size_t glob_count, int quiet){
+    FILE *f = fopen(archive, "r+b");
+    if(!f){ perror("open"); return 1; }
+    index_t idx = load_index(f);
+    int status = 0;
+    uint32_t removed = 0;
+
+    for(uint32_t i=0;i<id_count;i++){
+        entry_t *e = entry_by_id(&idx, ids[i]);
+        if(!e || (e->flags & 4)){
+            fprintf(stderr, "Entry with id %u not found\n", ids[i]);
+            status = 1;
+            continue;
+        }
+        e->flags |= 4;
+        removed++;
+    }
+    for(size_t g=0;g<glob_count;g++){
+        uint32_t matched = 0;
+        for(uint32_t i=0;i<idx.n;i++){
+            entry_t *e = &idx.entries[i];
+            const char *ename = entry_get_name(&idx, e);
+            if(!ename || fnmatch(globs[g], ename, 0) != 0) continue;
+            matched++;
+            if(e->flags & 4) continue;
+            e->flags |= 4;
+            removed++;
+        }
+        if(matched == 0){
+            fprintf(stderr, "No entries match '%s'\n", globs[g]);
+            status = 1;
+        }
+    }
+
+    if(removed > 0){
+        fseek(f, 0, SEEK_END);
+        uint64_t index_offset = ftell(f);
+        write_index(f, &idx);
+        update_header_index_offset(f, index_offset);
+        if(!quiet) fprintf(stderr, "Removed %u entr%s\n", removed, removed == 1 ? "y" : "ies");
+    }
+    fclose(f);
+    free_index(&idx);
+    if(removed > 0 && maybe_compact_archive(archive, quiet) != 0) status = 1;
+    return status;
+}
+
+/* ---- baar batch --------------------------------------------------------------------------
+   Applies a script of add/rename/move/mkdir/remove operations with one index load and one
+   index write. Added data is appended as usual; if any operation fails the archive is cut
+   back to its previous size and its index is left untouched. */
+
+/* Entry name -> position in idx->entries for the live entries, kept current while the batch
+   renames, adds and removes entries. Slots hold position + 1; NAME_SLOT_GONE marks a removal. */
+#define NAME_SLOT_GONE UINT32_MAX
+
+typedef struct {
+    index_t *idx;
+    uint32_t *slots;
+    size_t cap;
+    size_t used; /* occupied slots, removals included */
+} name_table_t;
+
+static uint64_t name_hash(const char *s){
+    uint64_t h = 1469598103934665603ULL;
+    for(; *s; s++){ h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
+
+static int name_table_insert_slot(name_table_t *t, uint32_t pos){
+    const char *name = entry_get_name(t->idx, &t->idx->entries[pos]);
+    if(!name) return -1;
+    size_t mask = t->cap - 1;
+    for(size_t i = (size_t)name_hash(name) & mask;; i = (i + 1) & mask){
+        if(t->slots[i] == 0 || t->slots[i] == NAME_SLOT_GONE){
+            if(t->slots[i] == 0) t->used++;
+            t->slots[i] = pos + 1;
+            return 0;
+        }
+    }
+}
+
+static int name_table_rehash(name_table_t *t, size_t cap){
+    uint32_t *old = t->slots;
+    size_t old_cap = t->cap;
+    t->slots = calloc(cap, sizeof(*t->slots));
+    if(!t->slots){ t->slots = old; return -1; }
+    t->cap = cap;
+    t->used = 0;
+    for(size_t i=0;i<old_cap;i++){
+        if(old[i] && old[i] != NAME_SLOT_GONE) name_table_insert_slot(t, old[i] - 1);
+    }
+    free(old);
+    return 0;
+}
+
+static int name_table_put(name_table_t *t, uint32_t pos){
+    if((t->used + 1) * 4 >= t->cap * 3){
+        size_t cap = t->cap ? t->cap * 2 : 1024;
+        if(name_table_rehash(t, cap) != 0) return -1;
+    }
+    return name_table_insert_slot(t, pos);
+}
+
+/* Position of the live entry called `name`, or -1. */
+static int64_t name_table_find(const name_table_t *t, const char *name){
+    if(t->cap == 0) return -1;
+    size_t mask = t->cap - 1;
+    for(size_t i = (size_t)name_hash(name) & mask; t->slots[i]; i = (i + 1) & mask){
+        if(t->slots[i] == NAME_SLOT_GONE) continue;
+        const char *cur = entry_get_name(t->idx, &t->idx->entries[t->slots[i] - 1]);
+        if(cur && strcmp(cur, name) == 0) return (int64_t)t->slots[i] - 1;
+    }
+    return -1;
+}
+
+/* Drops entry `pos`; call before its name changes. */
+static void name_table_del(name_table_t *t, uint32_t pos){
+    if(t->cap == 0) return;
+    const char *name = entry_get_name(t->idx, &t->idx->entries[pos]);
+    if(!name) return;
+    size_t mask = t->cap - 1;
+    for(size_t i = (size_t)name_hash(name) & mask; t->slots[i]; i = (i + 1) & mask){
+        if(t->slots[i] == pos + 1){
+            t->slots[i] = NAME_SLOT_GONE;
+            return;
+        }
+    }
+}
+
+typedef struct {
+    index_t idx;
+    name_table_t names;
+    add_stream_ctx_t *ctx;
+    int clevel;
+    uint32_t added, renamed, removed, dirs;
+} batch_state_t;
+
+static void batch_delete_pos(batch_state_t *b, uint32_t pos){
+    name_table_del(&b->names, pos);
+    b->idx.entries[pos].flags |= 4;
+    b->removed++;
+}
+
+/* Gives live entry `pos` the name `to`, replacing a live entry that already has it. */
+static int batch_set_name(batch_state_t *b, uint32_t pos, const char *to){
+    int64_t clash = name_table_find(&b->names, to);
+    if(clash == (int64_t)pos) return 0;
+    if(clash >= 0) batch_delete_pos(b, (uint32_t)clash);
+    char *dup = strdup(to);
+    if(!dup) return -1;
+    name_table_del(&b->names, pos);
+    entry_t *e = &b->idx.entries[pos];
+    free(e->name);
+    e->name = dup;
+    e->name_len = (uint16_t)strlen(dup);
+    return name_table_put(&b->names, pos);
+}
+
+/* Strips trailing slashes; "" for the archive root. */
+static void batch_trim_path(char *p){
+    size_t n = strlen(p);
+    while(n > 0 && p[n-1] == '/') p[--n] = '\0';
+}
+
+static int batch_op_add(batch_state_t *b, const char *src, const char *dst){
+    struct stat st;
+    if(lstat(src, &st) != 0){
+        fprintf(stderr, "%s: %s\n", src, strerror(errno));
+        return -1;
+    }
+    add_job_t job = { .clevel = b->clevel };
+    job.src_root = normalize_path_basic(src);
+    job.archive_override = dst ? normalize_path_basic(dst) : NULL;
+    if(!job.src_root || (dst && !job.archive_override)){
+        fprintf(stderr, "Invalid path: %s\n", dst && job.src_root ? dst : src);
+        free(job.src_root);
+        free(job.archive_override);
+        return -1;
+    }
+    uint32_t before = b->idx.n;
+    int rc = walk_job_tree(b->ctx, &job);
+    free(job.src_root);
+    free(job.archive_override);
+    if(rc != 0) return -1;
+    /* the walker does not know about this batch's names; replace same-named entries here */
+    for(uint32_t pos=before; pos<b->idx.n; pos++){
+        const char *name = entry_get_name(&b->idx, &b->idx.entries[pos]);
+        if(!name) continue;
+        int64_t old = name_table_find(&b->names, name);
+        if(old >= 0) batch_delete_pos(b, (uint32_t)old);
+        if(name_table_put(&b->names, pos) != 0) return -1;
+        b->added++;
+    }
+    return 0;
+}
+
+static int batch_op_rename(batch_state_t *b, const char *from, const char *to_arg){
+    char *src = strdup(from);
+    size_t to_len = strlen(to_arg);
+    char *dst = malloc(to_len + strlen(from) + 2);
+    if(!src || !dst){ free(src); free(dst); return -1; }
+    batch_trim_path(src);
+    /* "move a/b dir/" keeps the last path component */
+    const char *base = strrchr(src, '/');
+    base = base ? base + 1 : src;
+    if(to_len > 0 && to_arg[to_len-1] == '/') snprintf(dst, to_len + strlen(from) + 2, "%s%s", to_arg, base);
+    else snprintf(dst, to_len + 2, "%s", to_arg);
+    batch_trim_path(dst);
+    size_t sl = strlen(src), dl = strlen(dst);
+    int status = 0;
+    if(sl == 0 || dl == 0){
+        fprintf(stderr, "rename needs two non-empty paths\n");
+        status = -1;
+    } else if(strncmp(dst, src, sl) == 0 && (dst[sl] == '/' || dst[sl] == '\0')){
+        if(dst[sl] == '/') fprintf(stderr, "Cannot move %s into itself\n", src);
+        status = dst[sl] == '/' ? -1 : 0;
+    } else {
+        /* the entry itself (file or "dir/") plus everything below it, in one pass */
+        uint32_t moved = 0;
+        size_t cap = dl + 256;
+        char *name_buf = malloc(cap);
+        for(uint32_t pos=0; name_buf && status == 0 && pos<b->idx.n; pos++){
+            entry_t *e = &b->idx.entries[pos];
+            if(e->flags & 4) continue;
+            const char *name = entry_get_name(&b->idx, e);
+            if(!name || strncmp(name, src, sl) != 0 || (name[sl] != '\0' && name[sl] != '/')) continue;
+            size_t need = dl + strlen(name + sl) + 1;
+            if(need > cap){
+                char *tmp = realloc(name_buf, need);
+                if(!tmp){ status = -1; break; }
+                name_buf = tmp;
+                cap = need;
+            }
+            snprintf(name_buf, cap, "%s%s", dst, name + sl);
+            if(batch_set_name(b, pos, name_buf) != 0) status = -1;
+            moved++;
+        }
+        if(!name_buf) status = -1;
+        free(name_buf);
+        if(status == 0 && moved == 0){
+            fprintf(stderr, "No entry named %s\n", src);
+            status = -1;
+        }
+        b->renamed += moved;
+    }
+    free(src);
+    free(dst);
+    return status;
+}
+
+static int batch_op_mkdir(batch_state_t *b, const char *path){
+    size_t len = strlen(path);
+    char *dname = malloc(len + 2);
+    if(!dname) return -1;
+    memcpy(dname, path, len + 1);
+    batch_trim_path(dname);
+    if(!dname[0]){ free(dname); fprintf(stderr, "mkdir needs a path\n"); return -1; }
+    strcat(dname, "/");
+    if(name_table_find(&b->names, dname) >= 0){
+        fprintf(stderr, "Directory already exists in archive: %s\n", dname);
+        free(dname);
+        return -1;
+    }
+    entry_t *tmp = realloc(b->idx.entries, sizeof(entry_t) * (b->idx.n + 1));
+    if(!tmp){ free(dname); return -1; }
+    b->idx.entries = tmp;
+    entry_t *e = &b->idx.entries[b->idx.n];
+    memset(e, 0, sizeof(*e));
+    e->id = b->idx.next_id++;
+    e->name = dname;
+    b->idx.n++;
+    b->dirs++;
+    return name_table_put(&b->names, b->idx.n - 1);
+}
+
+/* An exact name, everything below a directory, or a shell pattern. */
+static int batch_op_remove(batch_state_t *b, const char *path){
+    char *p = strdup(path);
+    if(!p) return -1;
+    int glob = strpbrk(p, "*?[") != NULL;
+    if(!glob) batch_trim_path(p);
+    size_t pl = strlen(p);
+    uint32_t hits = 0;
+    for(uint32_t pos=0; pos<b->idx.n; pos++){
+        entry_t *e = &b->idx.entries[pos];
+        if(e->flags & 4) continue;
+        const char *name = entry_get_name(&b->idx, e);
+        if(!name) continue;
+        if(glob ? fnmatch(p, name, 0) != 0
+                : (strncmp(name, p, pl) != 0 || (name[pl] != '\0' && name[pl] != '/'))) continue;
+        batch_delete_pos(b, pos);
+        hits++;
+    }
+    if(hits == 0) fprintf(stderr, "No entry named %s\n", path);
+    free(p);
+    return hits ? 0 : -1;
+}
+
+/* Decodes the JSON string starting at *pp (just after the opening quote) in place. */
+static char *batch_json_string(char **pp){
+    char *r = *pp, *w = *pp, *start = *pp;
+    while(*r && *r != '"'){
+        if(*r != '\\'){ *w++ = *r++; continue; }
+        r++;
+        switch(*r){
+            case '"': case '\\': case '/': *w++ = *r++; break;
+            case 'b': *w++ = '\b'; r++; break;
+            case 'f': *w++ = '\f'; r++; break;
+            case 'n': *w++ = '\n'; r++; break;
+            case 'r': *w++ = '\r'; r++; break;
+            case 't': *w++ = '\t'; r++; break;
+            case 'u': {
+                unsigned cp = 0;
+                if(sscanf(r + 1, "%4x", &cp) != 1) return NULL;
+                r += 5;
+                if(cp >= 0xD800 && cp < 0xDC00 && r[0] == '\\' && r[1] == 'u'){
+                    unsigned lo = 0;
+                    if(sscanf(r + 2, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000){
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        r += 6;
+                    }
+                }
+                /* the encoding is never longer than the escape it replaces */
+                if(cp < 0x80){ *w++ = (char)cp; }
+                else if(cp < 0x800){ *w++ = (char)(0xC0 | (cp >> 6)); *w++ = (char)(0x80 | (cp & 0x3F)); }
+                else if(cp < 0x10000){ *w++ = (char)(0xE0 | (cp >> 12)); *w++ = (char)(0x80 | ((cp >> 6) & 0x3F)); *w++ = (char)(0x80 | (cp & 0x3F)); }
+                else { *w++ = (char)(0xF0 | (cp >> 18)); *w++ = (char)(0x80 | ((cp >> 12) & 0x3F)); *w++ = (char)(0x80 | ((cp >> 6) & 0x3F)); *w++ = (char)(0x80 | (cp & 0x3F)); }
+                break;
+            }
+            default: return NULL;
+        }
+    }
+    if(*r != '"') return NULL;
+    *pp = r + 1;
+    *w = '\0';
+    return start;
+}
+
+/* {"op":"rename","from":"a","to":"b"}: string members only; "path"/"src"/"from" give the first
+   operand and "dst"/"to" the second. */
+static int batch_parse_json(char *line, char **op, char **a1, char **a2){
+    char *p = line + 1;
+    for(;;){
+        while(isspace((unsigned char)*p) || *p == ',') p++;
+        if(*p == '}') return 0;
+        if(*p != '"') return -1;
+        p++;
+        char *key = batch_json_string(&p);
+        while(key && isspace((unsigned char)*p)) p++;
+        if(!key || *p != ':') return -1;
+        p++;
+        while(isspace((unsigned char)*p)) p++;
+        if(*p != '"') return -1;
+        p++;
+        char *val = batch_json_string(&p);
+        if(!val) return -1;
+        if(strcmp(key, "op") == 0) *op = val;
+        else if(strcmp(key, "path") == 0 || strcmp(key, "src") == 0 || strcmp(key, "from") == 0) *a1 = val;
+        else if(strcmp(key, "dst") == 0 || strcmp(key, "to") == 0) *a2 = val;
+    }
+}
+
+/* "op a1 [a2]": fields are tab-separated when the line has a tab, else space-separated. */
+static int batch_parse_text(char *line, char **op, char **a1, char **a2){
+    const char *sep = strchr(line, '\t') ? "\t" : " ";
+    char *fields[4] = {0};
+    int n = 0;
+    char *save = NULL;
+    for(char *tok = strtok_r(line, sep, &save); tok; tok = strtok_r(NULL, sep, &save)){
+        if(n == 3) return -1;
+        fields[n++] = tok;
+    }
+    *op = fields[0];
+    *a1 = fields[1];
+    *a2 = fields[2];
+    return 0;
+}
+
+static int batch_archive(const char *archive, const char *script, const char *pwd, int clevel){
+    FILE *in = (!script || strcmp(script, "-") == 0) ? stdin : fopen(script, "r");
+    if(!in){ perror(script); return 1; }
+    FILE *f = fopen(archive, "r+b");
+    if(!f) f = fopen(archive, "w+b");
+    if(!f){ perror("open archive"); if(in != stdin) fclose(in); return 1; }
+    ensure_header(f);
+    fseeko(f, 0, SEEK_END);
+    off_t original_size = ftello(f);
+
+    batch_state_t b = { .clevel = clevel };
+    b.idx = load_index(f);
+    b.names.idx = &b.idx;
+    int status = 0;
+    for(uint32_t i=0; i<b.idx.n && status == 0; i++){
+        if(!(b.idx.entries[i].flags & 4) && name_table_put(&b.names, i) != 0) status = 1;
+    }
+
+    uint32_t *to_remove = NULL;
+    uint32_t remove_count = 0;
+    id_set_t remove_set = {0};
+    add_stream_ctx_t ctx = {
+        .archive_fp = f,
+        .idx = &b.idx,
+        .to_remove = &to_remove,
+        .remove_count = &remove_count,
+        .remove_set = &remove_set,
+        .pwd = pwd
+    };
+    struct stat arch_st;
+    if(fstat(fileno(f), &arch_st) == 0){
+        ctx.archive_dev = arch_st.st_dev;
+        ctx.archive_ino = arch_st.st_ino;
+        ctx.archive_id_valid = 1;
+    }
+    b.ctx = &ctx;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t got;
+    unsigned long lineno = 0;
+    uint32_t ops = 0;
+    while(status == 0 && !g_abort_requested && (got = getline(&line, &line_cap, in)) >= 0){
+        lineno++;
+        while(got > 0 && (line[got-1] == '\n' || line[got-1] == '\r')) line[--got] = '\0';
+        char *p = line;
+        while(*p == ' ' || *p == '\t') p++;
+        if(!*p || *p == '#') continue;
+        char *op = NULL, *a1 = NULL, *a2 = NULL;
+        int prc = *p == '{' ? batch_parse_json(p, &op, &a1, &a2) : batch_parse_text(p, &op, &a1, &a2);
+        int rc = -1;
+        if(prc != 0 || !op){
+            fprintf(stderr, "Line %lu: cannot parse operation\n", lineno);
+            status = 1;
+            break;
+        }
+        if(strcmp(op, "add") == 0 && a1) rc = batch_op_add(&b, a1, a2);
+        else if((strcmp(op, "rename") == 0 || strcmp(op, "move") == 0 || strcmp(op, "mv") == 0) && a1 && a2) rc = batch_op_rename(&b, a1, a2);
+        else if(strcmp(op, "mkdir") == 0 && a1 && !a2) rc = batch_op_mkdir(&b, a1);
+        else if((strcmp(op, "remove") == 0 || strcmp(op, "rm") == 0) && a1 && !a2) rc = batch_op_remove(&b, a1);
+        else {
+            fprintf(stderr, "Line %lu: unknown operation or wrong operands: %s\n", lineno, op);
+            status = 1;
+            break;
+        }
+        if(rc != 0){
+            fprintf(stderr, "Line %lu: %s failed; archive left unchanged\n", lineno, op);
+            status = 1;
+            break;
+        }
+        ops++;
+    }
+    free(line);
+    if(in != stdin) fclose(in);
+    if(g_abort_requested) status = 1;
+    io_worker_release(ctx.io);
+    if(ctx.timed_out_count > 0) status = 1;
+    str_list_free(ctx.timed_out_paths, ctx.timed_out_count);
+    free(to_remove);
+    id_set_free(&remove_set);
+
+    if(status == 0){
+        fseeko(f, 0, SEEK_END);
+        uint64_t index_offset = (uint64_t)ftello(f);
+        write_index(f, &b.idx);
+        if(fflush(f) != 0 || ferror(f)){
+            fprintf(stderr, "Error: cannot write the index: %s\n", strerror(errno));
+            status = 1;
+        } else {
+            update_header_index_offset(f, index_offset);
+        }
+    }
+    if(status != 0){
+        /* drop the data appended by this batch; the header still points at the old index */
+        fflush(f);
+        if(ftruncate(fileno(f), original_size) != 0){ /* left unreferenced */ }
+    }
+    fclose(f);
+    free(b.names.slots);
+    free_index(&b.idx);
+    if(!global_verbose && !global_quiet && b.added) fprintf(stderr, "\n");
+    if(status == 0 && !global_quiet){
+        fprintf(stderr, "Batch: %u operation(s): %u added, %u renamed, %u removed, %u director%s created\n",
+                ops, b.added, b.renamed, b.removed, b.dirs, b.dirs == 1 ? "y" : "ies");
+    }
+    if(status == 0 && b.removed > 0) status = maybe_compact_archive(archive, global_quiet);
+    return status;
+}
+
+/* ---- baar merge --------------------------------------------------------------------------
+   Combines archives into a new one by copying their stored blobs as they are: compression,
+   encryption flags and CRCs are kept, ids are renumbered and name clashes between inputs are
+   settled by a policy before any data is written. */
+enum {
+    MERGE_KEEP_LAST = 0,
+    MERGE_KEEP_FIRST,
+    MERGE_KEEP_NEWER,
+    MERGE_RENAME,
+    MERGE_FAIL
+};
+
+typedef struct {
+    const char *path;
+    FILE *f;
+    index_t idx;
+    blob_remap_t remap;
+    uint32_t *new_ids; /* by entry position: id in the merged archive, UINT32_MAX when dropped */
+} merge_input_t;
+
+/* Appends `len` bytes at `off` of `in_fd` to `out`. copy_file_range() lets the kernel (or a
+   reflink-capable filesystem) move the data without a round trip through user space; other
+   filesystem pairs fall back to pread/write. */
+static int append_file_range(int in_fd, uint64_t off, FILE *out, uint64_t len){
+    if(fflush(out) != 0) return -1;
+    int out_fd = fileno(out);
+    off_t in_off = (off_t)off;
+    off_t out_off = lseek(out_fd, 0, SEEK_END);
+    if(out_off < 0) return -1;
+    uint64_t left = len;
+    int use_cfr = 1;
+    unsigned char *buf = NULL;
+    while(left > 0){
+        size_t want = left > (1u << 30) ? (1u << 30) : (size_t)left;
+        ssize_t n;
+        if(use_cfr){
+            n = copy_file_range(in_fd, &in_off, out_fd, &out_off, want, 0);
+            if(n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)){
+                use_cfr = 0;
+                continue;
+            }
+            if(n == 0){ errno = EIO; n = -1; } /* the blob runs past the end of the input */
+        } else {
+            if(!buf && !(buf = malloc(BAAR_STREAM_CHUNK_SIZE))) break;
+            if(want > BAAR_STREAM_CHUNK_SIZE) want = BAAR_STREAM_CHUNK_SIZE;
+            n = -1;
+            if(pread_full(in_fd, buf, want, (uint64_t)in_off) == 0){
+                size_t done = 0;
+                while(done < want){
+                    ssize_t w = pwrite(out_fd, buf + done, want - done, out_off + (off_t)done);
+                    if(w < 0 && errno == EINTR) continue;
+                    if(w <= 0) break;
+                    done += (size_t)w;
+                }
+                if(done == want){
+                    n = (ssize_t)want;
+                    in_off += n;
+                    out_off += n;
+                }
+            }
+        }
+        if(n < 0) break;
+        left -= (uint64_t)n;
+    }
+    free(buf);
+    fseeko(out, 0, SEEK_END);
+    return left == 0 ? 0 : -1;
+}
+
+static int merge_archives(const char *out_path, char **inputs, int input_count, int policy){
+    struct stat ost;
+    if(stat(out_path, &ost) == 0){
+        fprintf(stderr, "%s already exists; merge writes a new archive\n", out_path);
+        return 1;
+    }
+    char out_dir[PATH_MAX];
+    if(archive_dir_real(out_path, out_dir) != 0) return 1;
+
+    merge_input_t *in = calloc((size_t)input_count, sizeof(*in));
+    index_t oidx = {0};
+    name_table_t names = { .idx = &oidx };
+    uint32_t *src_in = NULL, *src_pos = NULL;
+    size_t src_cap = 0;
+    uint32_t conflicts = 0;
+    int status = in ? 0 : 1;
+    FILE *out = NULL;
+    char *tmp = NULL;
+
+    for(int k=0; status == 0 && k<input_count; k++){
+        in[k].path = inputs[k];
+        in[k].f = fopen(inputs[k], "rb");
+        if(!in[k].f){ fprintf(stderr, "%s: %s\n", inputs[k], strerror(errno)); status = 1; break; }
+        char magic[8] = {0};
+        if(fread(magic, 1, 8, in[k].f) != 8 || strncmp(magic, MAGIC, 6) != 0){
+            fprintf(stderr, "%s is not a BAAR archive\n", inputs[k]);
+            status = 1;
+            break;
+        }
+        in[k].idx = load_index(in[k].f);
+        in[k].idx.archive_path = inputs[k];
+        in[k].new_ids = malloc(sizeof(uint32_t) * (in[k].idx.n ? in[k].idx.n : 1));
+        if(!in[k].new_ids || blob_remap_init(&in[k].remap, in[k].idx.n) != 0){
+            fprintf(stderr, "Out of memory while planning the merge\n");
+            status = 1;
+        }
+    }
+
+    /* plan: decide which entry owns each name, then renumber */
+    for(int k=0; status == 0 && k<input_count; k++){
+        index_t *idx = &in[k].idx;
+        for(uint32_t pos=0; status == 0 && pos<idx->n; pos++){
+            entry_t *e = &idx->entries[pos];
+            in[k].new_ids[pos] = UINT32_MAX;
+            const char *name = entry_get_name(idx, e);
+            if((e->flags & 4) || !name) continue;
+            size_t nl = strlen(name);
+            char *final_name = strdup(name);
+            if(!final_name){ status = 1; break; }
+            int64_t clash = name_table_find(&names, name);
+            if(clash >= 0){
+                /* the same directory in several inputs is simply kept once */
+                if(nl > 0 && name[nl-1] == '/'){ free(final_name); continue; }
+                conflicts++;
+                entry_t *prev = &oidx.entries[clash];
+                int take = 1;
+                if(policy == MERGE_KEEP_FIRST) take = 0;
+                else if(policy == MERGE_KEEP_NEWER) take = e->mtime > prev->mtime;
+                else if(policy == MERGE_FAIL){
+                    fprintf(stderr, "Conflict: %s is in %s and %s\n", name, in[src_in[clash]].path, in[k].path);
+                    status = 1;
+                    take = 0;
+                } else if(policy == MERGE_RENAME){
+                    /* name~K, the input's position on the command line, then name~K.2 ... */
+                    char *alt = malloc(nl + 32);
+                    if(!alt){ free(final_name); status = 1; break; }
+                    snprintf(alt, nl + 32, "%s~%d", name, k + 1);
+                    for(int n=2; name_table_find(&names, alt) >= 0; n++){
+                        snprintf(alt, nl + 32, "%s~%d.%d", name, k + 1, n);
+                    }
+                    free(final_name);
+                    final_name = alt;
+                }
+                if(!take){ free(final_name); continue; }
+                if(policy != MERGE_RENAME){
+                    name_table_del(&names, (uint32_t)clash);
+                    prev->flags |= 4;
+                    in[src_in[clash]].new_ids[src_pos[clash]] = UINT32_MAX;
+                }
+            }
+            if(oidx.n == src_cap){
+                size_t cap = src_cap ? src_cap * 2 : 1024;
+                entry_t *ne = realloc(oidx.entries, sizeof(entry_t) * cap);
+                if(ne) oidx.entries = ne;
+                uint32_t *a = ne ? realloc(src_in, sizeof(uint32_t) * cap) : NULL;
+                if(a) src_in = a;
+                uint32_t *b = a ? realloc(src_pos, sizeof(uint32_t) * cap) : NULL;
+                if(b) src_pos = b;
+                if(!ne || !a || !b){ free(final_name); status = 1; break; }
+                src_cap = cap;
+            }
+            entry_t *o = &oidx.entries[oidx.n];
+            memset(o, 0, sizeof(*o));
+            o->id = oidx.next_id++;
+            o->name = final_name;
+            o->mtime = e->mtime;
+            src_in[oidx.n] = (uint32_t)k;
+            src_pos[oidx.n] = pos;
+            in[k].new_ids[pos] = o->id;
+            oidx.n++;
+            if(name_table_put(&names, oidx.n - 1) != 0) status = 1;
+        }
+    }
+    if(status != 0) goto done;
+
+    tmp = make_name(out_path, ".tmp");
+    out = tmp ? fopen(tmp, "w+b") : NULL;
+    if(!out){ perror("create output"); status = 1; goto done; }
+    ensure_header(out);
+    fseeko(out, 0, SEEK_END);
+
+    /* blobs shared by several kept entries of one input are copied once */
+    for(uint32_t j=0; j<oidx.n; j++){
+        if(oidx.entries[j].flags & 4) continue;
+        entry_t *e = &in[src_in[j]].idx.entries[src_pos[j]];
+        if(!(e->flags & (32 | 64))) blob_remap_get(&in[src_in[j]].remap, e->data_offset, e->comp_size, 1);
+    }
+
+    uint64_t copied = 0;
+    uint32_t kept = 0;
+    for(uint32_t j=0; status == 0 && j<oidx.n; j++){
+        entry_t *o = &oidx.entries[j];
+        if(o->flags & 4) continue;
+        merge_input_t *src = &in[src_in[j]];
+        entry_t *e = &src->idx.entries[src_pos[j]];
+        o->flags = e->flags;
+        o->comp_level = e->comp_level;
+        o->comp_size = e->comp_size;
+        o->uncomp_size = e->uncomp_size;
+        o->crc32 = e->crc32;
+        o->mode = e->mode;
+        o->uid = e->uid;
+        o->gid = e->gid;
+        o->mtime = e->mtime;
+        clone_entry_meta(&src->idx, e, o);
+
+        char idbuf[16];
+        int collapse = 0;
+        if(e->flags & 16){
+            entry_t *base = delta_base_entry(&src->idx, e);
+            uint32_t base_id = base ? src->new_ids[base - src->idx.entries] : UINT32_MAX;
+            if(base_id == UINT32_MAX){
+                collapse = 1;
+            } else {
+                snprintf(idbuf, sizeof(idbuf), "%u", base_id);
+                entry_set_meta(&oidx, o, "BAAR_DELTA_BASE", idbuf);
+            }
+        }
+        blob_remap_item_t *shared = (e->flags & (32 | 64)) ? NULL : blob_remap_get(&src->remap, e->data_offset, e->comp_size, 0);
+        if(e->flags & 32){
+            /* a reference keeps pointing at the same holder, named relative to the new archive */
+            char path[PATH_MAX], holder[PATH_MAX];
+            char *ref = NULL;
+            if(ref_resolve_path(&src->idx, e, path, sizeof(path)) == 0 && realpath(path, holder)){
+                ref = base_ref_name(holder, out_dir);
+            }
+            if(!ref){
+                fprintf(stderr, "Cannot resolve the base archive of %s\n", o->name);
+                status = 1;
+                break;
+            }
+            entry_set_meta(&oidx, o, "BAAR_BASE", ref);
+            free(ref);
+            o->data_offset = e->data_offset;
+        } else if(e->flags & 64){
+            /* so does a volume entry: the parts stay where they are */
+            char *ref = volume_ref_name(&src->idx, e, out_dir);
+            if(!ref){
+                fprintf(stderr, "Cannot resolve the volume of %s\n", o->name);
+                status = 1;
+                break;
+            }
+            entry_set_meta(&oidx, o, "BAAR_VOLUME", ref);
+            free(ref);
+            o->data_offset = e->data_offset;
+        } else if(collapse){
+            unsigned char *full = NULL;
+            size_t full_sz = 0;
+            int full_comp = 0;
+            if(delta_collapse(src->f, &src->idx, e, &full, &full_sz, &full_comp) != 0){
+                fprintf(stderr, "Cannot expand delta %s in %s\n", o->name, src->path);
+                status = 1;
+                break;
+            }
+            o->data_offset = (uint64_t)ftello(out);
+            if(fwrite(full, 1, full_sz, out) != full_sz) status = 1;
+            free(full);
+            o->flags = (uint8_t)(full_comp ? 1 : 0);
+            o->comp_level = full_comp ? e->comp_level : 0;
+            o->comp_size = full_sz;
+            entry_drop_meta_prefix(o, "BAAR_DELTA_");
+            copied += full_sz;
+        } else if(e->comp_size == 0){
+            o->data_offset = e->data_offset;
+        } else if(shared && shared->new_off < UINT64_MAX - 1){
+            o->data_offset = shared->new_off;
+        } else if(e->flags & 8){
+            fflush(out);
+            if(copy_chunked_blob(src->f, out, e, &src->remap, &o->data_offset) != 0){
+                fprintf(stderr, "Cannot copy chunks of %s in %s\n", o->name, src->path);
+                status = 1;
+                break;
+            }
+            shared = blob_remap_get(&src->remap, e->data_offset, e->comp_size, 0);
+            if(shared) shared->new_off = o->data_offset;
+            copied += e->comp_size;
+        } else {
+            o->data_offset = (uint64_t)ftello(out);
+            if(append_file_range(fileno(src->f), e->data_offset, out, e->comp_size) != 0){
+                fprintf(stderr, "Cannot copy %s from %s: %s\n", o->name, src->path, strerror(errno));
+                status = 1;
+                break;
+            }
+            if(shared) shared->new_off = o->data_offset;
+            copied += e->comp_size;
+        }
+        kept++;
+    }
+
+    if(status == 0){
+        /* dropped plan entries are left out of the index */
+        uint32_t w = 0;
+        for(uint32_t j=0; j<oidx.n; j++){
+            if(oidx.entries[j].flags & 4){
+                free(oidx.entries[j].name);
+                entry_free_meta(&oidx.entries[j]);
+                continue;
+            }
+            oidx.entries[w++] = oidx.entries[j];
+        }
+        oidx.n = w;
+        fseeko(out, 0, SEEK_END);
+        uint64_t index_offset = (uint64_t)ftello(out);
+        write_index(out, &oidx);
+        update_header_index_offset(out, index_offset);
+        if(ferror(out) || fflush(out) != 0){
+            fprintf(stderr, "Error: cannot write %s: %s\n", tmp, strerror(errno));
+            status = 1;
+        }
+    }
+    if(fclose(out) != 0) status = 1;
+    out = NULL;
+    if(status == 0 && rename(tmp, out_path) != 0){
+        perror("rename output");
+        status = 1;
+    }
+    if(status != 0) unlink(tmp);
+    else if(!global_quiet){
+        static const char *policy_names[] = { "last", "first", "newer", "rename", "error" };
+        fprintf(stderr, "Merged %u entries from %d archive(s) into %s (%" PRIu64 " bytes copied", kept, input_count, out_path, copied);
+        if(conflicts) fprintf(stderr, ", %u name conflict(s) resolved by '%s'", conflicts, policy_names[policy]);
+        fprintf(stderr, ")\n");
+    }
+
+done:
+    if(out) fclose(out);
+    free(tmp);
+    for(int k=0; in && k<input_count; k++){
+        free_index(&in[k].idx);
+        if(in[k].f) fclose(in[k].f);
+        free(in[k].remap.items);
+        free(in[k].new_ids);
+    }
+    free(in);
+    ref_bases_close();
+    free(names.slots);
+    free(src_in);
+    free(src_pos);
+    free_index(&oidx);
+    return status;
+}
+
+/* 'baar recover': rebuild the index of an archive written with --local-headers from the local
+   headers, e.g. after a truncated copy lost the index at the end. A path stored more than once
+   keeps its last copy. The new index is appended and the header pointed at it. */
+static int recover_archive(const char *archive){
+    FILE *f = fopen(archive, "r+b");
+    if(!f){ perror("open"); return 1; }
+    struct stat st;
+    if(fstat(fileno(f), &st) != 0 || fseeko(f, HEADER_SIZE, SEEK_SET) != 0){
+        perror("recover");
+        fclose(f);
+        return 1;
+    }
+    index_t idx = {0};
+    name_table_t names = { .idx = &idx };
+    id_set_t ids = {0};
+    uint64_t pos = HEADER_SIZE;
+    uint32_t superseded = 0, renumbered = 0;
+    int status = 0;
+    entry_t e;
+    while(local_header_next(f, &pos, &e)){
+        if(e.data_offset + e.comp_size > (uint64_t)st.st_size || fseeko(f, (off_t)e.comp_size, SEEK_CUR) != 0){
+            fprintf(stderr, "Dropping %s: its data is cut off\n", e.name);
+            entry_free_meta(&e);
+            free(e.name);
+            break;
+        }
+        pos += e.comp_size;
+        entry_t *tmp = realloc(idx.entries, sizeof(*idx.entries) * (idx.n + 1));
+        if(!tmp){
+            fprintf(stderr, "Out of memory\n");
+            entry_free_meta(&e);
+            free(e.name);
+            status = 1;
+            break;
+        }
+        idx.entries = tmp;
+        e.flags &= (uint8_t)~4;
+        if(id_set_has(&ids, e.id)){ e.id = UINT32_MAX; renumbered++; }
+        else { id_set_add(&ids, e.id); if(e.id >= idx.next_id) idx.next_id = e.id + 1; }
+        idx.entries[idx.n] = e;
+        int64_t prev = name_table_find(&names, e.name);
+        if(prev >= 0){
+            idx.entries[prev].flags |= 4;
+            name_table_del(&names, (uint32_t)prev);
+            superseded++;
+        }
+        if(name_table_put(&names, idx.n) != 0){ fprintf(stderr, "Out of memory\n"); status = 1; }
+        idx.n++;
+        if(status) break;
+    }
+    /* ids clashing with an earlier header get fresh ones once every id is known */
+    for(uint32_t i=0; renumbered && i<idx.n; i++){
+        if(idx.entries[i].id == UINT32_MAX) idx.entries[i].id = idx.next_id++;
+    }
+    if(status == 0 && idx.n == 0){
+        fprintf(stderr, "No local headers found in %s; only archives written with --local-headers can be recovered\n", archive);
+        status = 1;
+    }
+    if(status == 0){
+        fseeko(f, 0, SEEK_END);
+        uint64_t index_offset = (uint64_t)ftello(f);
+        write_index(f, &idx);
+        update_header_index_offset(f, index_offset);
+        if(ferror(f)){
+            fprintf(stderr, "Write error while writing the index of %s\n", archive);
+            status = 1;
+        } else if(!global_quiet){
+            fprintf(stderr, "Recovered %u entr%s (%u superseded by a later copy)\n",
+                    idx.n - superseded, idx.n - superseded == 1 ? "y" : "ies", superseded);
+        }
+    }
+    free(names.slots);
+    id_set_free(&ids);
+    free_index(&idx);
+    if(fclose(f) != 0) status = 1;
+    return status;
 }
 
 static int fix_archive(const char *archive){
@@ -7834,6 +13878,7 @@ static int compress_archive(const char *archive, int target_clevel, const char *
 
     FILE *src = fopen(archive, "rb"); if(!src){ perror("open"); return 1; }
     index_t idx = load_index(src);
+    idx.archive_path = archive;
 
     char *tmp = make_name(archive, ".tmp");
     if(!tmp){ perror("create tmp name"); fclose(src); return 1; }
@@ -7841,12 +13886,93 @@ static int compress_archive(const char *archive, int target_clevel, const char *
     ensure_header(out);
 
     index_t newidx = {0}; newidx.next_id = 1;
+    /* at most one new entry per old one */
+    newidx.entries = malloc(sizeof(entry_t) * (idx.n ? idx.n : 1));
+    if(!newidx.entries){
+        fprintf(stderr, "Out of memory\n");
+        free_index(&idx); fclose(src); fclose(out); unlink(tmp); free(tmp);
+        return 1;
+    }
     uint32_t total_entries = 0; for(uint32_t ii=0; ii<idx.n; ii++){ if(!(idx.entries[ii].flags & 4)) total_entries++; }
     uint32_t processed_entries = 0;
+    blob_remap_t remap = {0};
+    blob_remap_init(&remap, idx.n);
     for(uint32_t i=0;i<idx.n;i++){
         entry_t *e = &idx.entries[i];
         if(e->flags & 4) continue;
 
+        /* references into a base archive have no blob of their own, and volume entries
+           keep theirs in the volume parts */
+        if(e->flags & (32 | 64)){
+            entry_t *ne = &newidx.entries[newidx.n]; memset(ne,0,sizeof(*ne));
+            ne->id = e->id;
+            const char *ename = entry_get_name(&idx, e);
+            ne->name = strdup(ename ? ename : "");
+            ne->flags = e->flags;
+            ne->comp_level = e->comp_level;
+            ne->data_offset = e->data_offset;
+            ne->comp_size = e->comp_size;
+            ne->uncomp_size = e->uncomp_size;
+            ne->crc32 = e->crc32;
+            ne->mode = e->mode; ne->uid = e->uid; ne->gid = e->gid; ne->mtime = e->mtime;
+            clone_entry_meta(&idx, e, ne);
+            newidx.n++; if(ne->id >= newidx.next_id) newidx.next_id = ne->id+1;
+            processed_entries++;
+            continue;
+        }
+
+        /* a blob shared with an earlier entry (--dedup) is recompressed once and referenced again */
+        blob_remap_item_t *shared = blob_remap_get(&remap, e->data_offset, e->comp_size, 1);
+        if(shared && shared->new_off != UINT64_MAX){
+            entry_t *ne = &newidx.entries[newidx.n]; memset(ne,0,sizeof(*ne));
+            ne->id = e->id;
+            const char *ename = entry_get_name(&idx, e);
+            ne->name = strdup(ename ? ename : "");
+            ne->flags = shared->new_flags;
+            ne->comp_level = shared->new_level;
+            ne->data_offset = shared->new_off;
+            ne->comp_size = shared->new_size;
+            ne->uncomp_size = e->uncomp_size;
+            ne->crc32 = shared->new_crc;
+            ne->mode = e->mode; ne->uid = e->uid; ne->gid = e->gid; ne->mtime = e->mtime;
+            clone_entry_meta(&idx, e, ne);
+            newidx.n++; if(ne->id >= newidx.next_id) newidx.next_id = ne->id+1;
+            processed_entries++;
+            continue;
+        }
+        /* chunked entries keep their per-chunk compression; chunks and manifest are copied */
+        if(e->flags & 8){
+            uint64_t off = 0;
+            if(copy_chunked_blob(src, out, e, &remap, &off) != 0){
+                fprintf(stderr, "Cannot copy chunks of id %u\n", e->id);
+                free_index(&idx); free_index(&newidx); free(remap.items); fclose(src); fclose(out); unlink(tmp); free(tmp);
+                return 2;
+            }
+            entry_t *ne = &newidx.entries[newidx.n]; memset(ne,0,sizeof(*ne));
+            ne->id = e->id;
+            const char *ename = entry_get_name(&idx, e);
+            ne->name = strdup(ename ? ename : "");
+            ne->flags = e->flags;
+            ne->comp_level = e->comp_level;
+            ne->data_offset = off;
+            ne->comp_size = e->comp_size;
+            ne->uncomp_size = e->uncomp_size;
+            ne->crc32 = e->crc32;
+            ne->mode = e->mode; ne->uid = e->uid; ne->gid = e->gid; ne->mtime = e->mtime;
+            clone_entry_meta(&idx, e, ne);
+            shared = blob_remap_get(&remap, e->data_offset, e->comp_size, 0);
+            if(shared){
+                shared->new_off = off;
+                shared->new_size = ne->comp_size;
+                shared->new_crc = ne->crc32;
+                shared->new_flags = ne->flags;
+                shared->new_level = ne->comp_level;
+            }
+            newidx.n++; if(ne->id >= newidx.next_id) newidx.next_id = ne->id+1;
+            processed_entries++;
+            continue;
+        }
+
         fseek(src, e->data_offset, SEEK_SET);
         unsigned char *blob = malloc(e->comp_size);
         fread(blob,1,e->comp_size,src);
@@ -7856,7 +13982,13 @@ static int compress_archive(const char *archive, int target_clevel, const char *
         else {
 
             unsigned char *uncomp = NULL; uLong un_sz = e->uncomp_size;
-            if(e->flags & 1){ uncomp = malloc(un_sz+1); int zr = uncompress(uncomp, &un_sz, blob, e->comp_size); if(zr!=Z_OK){ fprintf(stderr,"Decompress failed for id %u\n", e->id); free(blob); free_index(&idx); fclose(src); fclose(out); return 2; } }
+            if(e->flags & 16){
+                /* deltas are expanded and stored in full */
+                size_t got = 0;
+                uncomp = malloc(un_sz+1);
+                if(!uncomp || entry_decode_into(src, &idx, e, NULL, uncomp, un_sz, &got) != 0 || got != un_sz){ fprintf(stderr,"Decompress failed for id %u\n", e->id); free(uncomp); free(blob); free_index(&idx); fclose(src); fclose(out); return 2; }
+            }
+            else if(e->flags & 1){ uncomp = malloc(un_sz+1); int zr = uncompress(uncomp, &un_sz, blob, e->comp_size); if(zr!=Z_OK){ fprintf(stderr,"Decompress failed for id %u\n", e->id); free(blob); free_index(&idx); fclose(src); fclose(out); return 2; } }
             else { uncomp = malloc(un_sz); memcpy(uncomp, blob, un_sz); }
 
             if(target_clevel==0){
@@ -7868,7 +14000,7 @@ static int compress_archive(const char *archive, int target_clevel, const char *
                 } else {
                     if(outbuf) free(outbuf);
 
-                    if(e->flags & 1){ final_blob = blob; final_sz = e->comp_size; final_comp = 1; free(uncomp); }
+                    if((e->flags & 1) && !(e->flags & 16)){ final_blob = blob; final_sz = e->comp_size; final_comp = 1; free(uncomp); }
                     else { final_blob = uncomp; final_sz = un_sz; final_comp = 0; }
                 }
             }
@@ -7879,7 +14011,6 @@ static int compress_archive(const char *archive, int target_clevel, const char *
         uint64_t off = ftell(out);
         fwrite(final_blob,1,final_sz,out);
 
-        newidx.entries = realloc(newidx.entries, sizeof(entry_t)*(newidx.n+1));
         entry_t *ne = &newidx.entries[newidx.n]; memset(ne,0,sizeof(*ne));
         ne->id = e->id;
         const char *ename = entry_get_name(&idx, e);
@@ -7898,6 +14029,13 @@ static int compress_archive(const char *archive, int target_clevel, const char *
             else { crc = crc32(0, final_blob, ne->uncomp_size); }
         }
         ne->crc32 = crc;
+        if(shared){
+            shared->new_off = ne->data_offset;
+            shared->new_size = ne->comp_size;
+            shared->new_crc = ne->crc32;
+            shared->new_flags = ne->flags;
+            shared->new_level = ne->comp_level;
+        }
 
     ne->mode = e->mode; ne->uid = e->uid; ne->gid = e->gid; ne->mtime = e->mtime;
     ne->meta_n = e->meta_n;
@@ -7906,6 +14044,7 @@ static int compress_archive(const char *archive, int target_clevel, const char *
         ne->meta = calloc(e->meta_n, sizeof(*ne->meta));
         for(uint32_t m=0;m<e->meta_n;m++){ ne->meta[m].key = e->meta[m].key?strdup(e->meta[m].key):NULL; ne->meta[m].value = e->meta[m].value?strdup(e->meta[m].value):NULL; }
     } else ne->meta = NULL;
+    if(e->flags & 16) entry_drop_meta_prefix(ne, "BAAR_DELTA_");
         newidx.n++; if(ne->id >= newidx.next_id) newidx.next_id = ne->id+1;
         processed_entries++;
         if(!global_quiet){ unsigned int prog = 0; if(total_entries>0) prog = (unsigned int)(processed_entries * 100ULL / total_entries);
@@ -7924,6 +14063,7 @@ static int compress_archive(const char *archive, int target_clevel, const char *
     write_index(out, &newidx);
     update_header_index_offset(out, index_off);
     fclose(src); fclose(out);
+    free(remap.items);
     free_index(&idx); free_index(&newidx);
 
     char *bak = make_name(archive, ".bak");
@@ -7935,6 +14075,199 @@ static int compress_archive(const char *archive, int target_clevel, const char *
     return 0;
 }
 
+/* Copy the plain blob of base entry `be` from `src` to `dst` unchanged, decoding it on the side
+   so a damaged base is not carried into the archive. Encrypted blobs are only checked when `pwd`
+   is given. Returns 0, -1 on I/O errors or 1 when the data does not match `crc_want`. */
+static int flatten_copy_blob(FILE *src, entry_t *be, FILE *dst, const char *pwd, uint32_t crc_want){
+    int check = !(be->flags & 2) || (pwd && pwd[0]);
+    int inflating = check && entry_is_effectively_compressed(be);
+    unsigned char *chunk = malloc(BAAR_STREAM_CHUNK_SIZE);
+    unsigned char *plain = malloc(BAAR_STREAM_CHUNK_SIZE);
+    unsigned char *out = inflating ? malloc(BAAR_STREAM_CHUNK_SIZE) : NULL;
+    xor_stream_t xs;
+    if(!chunk || !plain || (inflating && !out) || xor_stream_init(&xs, check && (be->flags & 2) ? pwd : NULL) != 0){
+        free(chunk); free(plain); free(out);
+        return -1;
+    }
+    z_stream zs; memset(&zs, 0, sizeof(zs));
+    int status = 0, zr = Z_OK;
+    /* 15 + 32: accept both zlib and gzip wrapped streams, as entry_decode_into() does */
+    if(inflating && inflateInit2(&zs, 15 + 32) != Z_OK){ inflating = 0; status = -1; }
+    if(status == 0 && fseeko(src, (off_t)be->data_offset, SEEK_SET) != 0) status = -1;
+    uint32_t crc = 0;
+    uint64_t total_out = 0;
+    for(uint64_t pos = 0; status == 0 && pos < be->comp_size; ){
+        size_t want = be->comp_size - pos > BAAR_STREAM_CHUNK_SIZE ? BAAR_STREAM_CHUNK_SIZE : (size_t)(be->comp_size - pos);
+        if(fread(chunk, 1, want, src) != want || fwrite(chunk, 1, want, dst) != want){ status = -1; break; }
+        if(check){
+            memcpy(plain, chunk, want);
+            xor_stream_apply(&xs, plain, want, pos);
+            if(!inflating){
+                crc = crc32_buf(crc, plain, want);
+                total_out += want;
+            } else if(zr != Z_STREAM_END){
+                zs.next_in = plain;
+                zs.avail_in = (uInt)want;
+                do {
+                    zs.next_out = out;
+                    zs.avail_out = BAAR_STREAM_CHUNK_SIZE;
+                    zr = inflate(&zs, Z_NO_FLUSH);
+                    if(zr != Z_OK && zr != Z_STREAM_END && zr != Z_BUF_ERROR){ status = 1; break; }
+                    size_t got = BAAR_STREAM_CHUNK_SIZE - zs.avail_out;
+                    crc = crc32_buf(crc, out, got);
+                    total_out += got;
+                } while(zr == Z_OK && zs.avail_out == 0);
+            }
+        }
+        pos += want;
+    }
+    if(status == 0 && check &&
+       ((inflating && zr != Z_STREAM_END) || total_out != be->uncomp_size || crc != crc_want)) status = 1;
+    if(inflating) inflateEnd(&zs);
+    xor_stream_clear(&xs);
+    free(chunk); free(plain); free(out);
+    return status;
+}
+
+/* Copy the data of every --base reference into the archive itself so it no longer needs its
+   base. Blobs stored plainly in the base are copied as they are; chunked or delta-encoded ones
+   are decoded and stored in full (this needs the password for encrypted entries). A base blob
+   shared by several references (--dedup) is copied once. */
+static int flatten_archive(const char *archive, const char *pwd){
+    FILE *f = fopen(archive, "r+b"); if(!f){ perror("open"); return 1; }
+    index_t idx = load_index(f);
+    idx.archive_path = archive;
+    fseeko(f, 0, SEEK_END);
+    off_t orig_end = ftello(f);
+    uint32_t flattened = 0;
+    uint64_t copied = 0;
+    int status = 0;
+    /* one blob table per base archive, since offsets are only unique within one file */
+    ref_base_t **bases = NULL;
+    blob_remap_t *remaps = NULL;
+    size_t base_count = 0;
+    for(uint32_t i=0; i<idx.n && status == 0; i++){
+        entry_t *e = &idx.entries[i];
+        if((e->flags & 4) || !(e->flags & 32)) continue;
+        const char *ename = entry_get_name(&idx, e);
+        ref_base_t *rb = NULL;
+        entry_t *be = ref_holder(&idx, e, &rb);
+        if(!be){
+            const char *v = entry_get_meta_val(&idx, e, "BAAR_BASE");
+            fprintf(stderr, "Base archive data missing for %s (base %s)\n", ename ? ename : "?", v ? v : "?");
+            status = 2;
+            break;
+        }
+        size_t b = 0;
+        while(b < base_count && bases[b] != rb) b++;
+        if(b == base_count){
+            ref_base_t **grown_bases = realloc(bases, sizeof(*bases) * (base_count + 1));
+            if(grown_bases) bases = grown_bases;
+            blob_remap_t *grown_remaps = grown_bases ? realloc(remaps, sizeof(*remaps) * (base_count + 1)) : NULL;
+            if(grown_remaps) remaps = grown_remaps;
+            if(!grown_remaps || blob_remap_init(&remaps[base_count], rb->idx.n) != 0){
+                fprintf(stderr, "Out of memory\n");
+                status = 1;
+                break;
+            }
+            bases[base_count++] = rb;
+        }
+        blob_remap_item_t *shared = blob_remap_get(&remaps[b], be->data_offset, be->comp_size, 1);
+        uint64_t off = (uint64_t)ftello(f);
+        if(shared && shared->new_off != UINT64_MAX){
+            /* already copied for an earlier reference */
+            off = shared->new_off;
+            e->flags = shared->new_flags;
+            e->comp_level = shared->new_level;
+            e->comp_size = shared->new_size;
+            e->data_offset = off;
+            if(e->meta_n && !e->meta) entry_load_meta(&idx, e);
+            entry_drop_meta_prefix(e, "BAAR_BASE");
+            flattened++;
+            continue;
+        }
+        if(!(be->flags & (8 | 16 | 64))){
+            /* plain blob: copy it byte for byte, keeping compression and encryption */
+            int rc = flatten_copy_blob(rb->f, be, f, pwd, e->crc32);
+            if(rc != 0){
+                fprintf(stderr, rc > 0 ? "CRC mismatch for %s in its base\n" : "Copy failed for %s\n", ename ? ename : "?");
+                status = 2;
+                break;
+            }
+            e->flags = (uint8_t)(be->flags & 3);
+            e->comp_level = be->comp_level;
+            e->comp_size = be->comp_size;
+        } else {
+            if((be->flags & 2) && !(pwd && pwd[0])){
+                fprintf(stderr, "%s is stored encrypted in its base; a password is required\n", ename ? ename : "?");
+                status = 1;
+                break;
+            }
+            if(be->uncomp_size > SIZE_MAX){ fprintf(stderr, "%s: entry too large\n", ename ? ename : "?"); status = 1; break; }
+            size_t n = (size_t)be->uncomp_size, got = 0;
+            unsigned char *full = malloc(n ? n : 1);
+            if(!full || entry_decode_into(rb->f, &rb->idx, be, pwd, full, n, &got) != 0 || got != n ||
+               (uint32_t)crc32(0L, full, (uInt)n) != e->crc32){
+                fprintf(stderr, "Cannot decode %s from its base\n", ename ? ename : "?");
+                free(full);
+                status = 2;
+                break;
+            }
+            int level = be->comp_level ? be->comp_level : 2;
+            unsigned char *packed = NULL; size_t packed_sz = 0;
+            int comp = compress_data_level(level, full, n, &packed, &packed_sz) == 0 && packed_sz < n;
+            unsigned char *blob = comp ? packed : full;
+            size_t blob_sz = comp ? packed_sz : n;
+            if(be->flags & 2) xor_buf(blob, blob_sz, pwd);
+            if(fwrite(blob, 1, blob_sz, f) != blob_sz){
+                fprintf(stderr, "Write error while flattening %s\n", ename ? ename : "?");
+                status = 1;
+            }
+            free(packed);
+            free(full);
+            if(status != 0) break;
+            e->flags = (uint8_t)((comp ? 1 : 0) | (be->flags & 2));
+            e->comp_level = comp ? (uint8_t)level : 0;
+            e->comp_size = blob_sz;
+        }
+        e->data_offset = off;
+        if(shared){
+            shared->new_off = off;
+            shared->new_size = e->comp_size;
+            shared->new_flags = e->flags;
+            shared->new_level = e->comp_level;
+        }
+        if(e->meta_n && !e->meta) entry_load_meta(&idx, e);
+        entry_drop_meta_prefix(e, "BAAR_BASE");
+        flattened++;
+        copied += e->comp_size;
+        if(!global_quiet){
+            if(global_verbose) fprintf(stderr, "Flattened id %u %s\n", e->id, ename ? ename : "");
+            else { char bn[PATH_MAX]; compact_basename(ename ? ename : "", bn, sizeof(bn)); fprintf(stderr, "\rFlattening: %s\x1b[K", bn); fflush(stderr); }
+        }
+    }
+    for(size_t b=0;b<base_count;b++) free(remaps[b].items);
+    free(remaps);
+    free(bases);
+    if(status == 0 && flattened > 0){
+        uint64_t index_offset = (uint64_t)ftello(f);
+        write_index(f, &idx);
+        update_header_index_offset(f, index_offset);
+    } else if(status != 0){
+        /* leave the archive as it was: its index still describes the references */
+        fflush(f);
+        if(ftruncate(fileno(f), orig_end) != 0){ /* best effort */ }
+    }
+    fclose(f);
+    free_index(&idx);
+    ref_bases_close();
+    if(!global_quiet){
+        if(!global_verbose && flattened > 0) fprintf(stderr, "\n");
+        if(status == 0) fprintf(stderr, "Flattened %u reference(s) (%llu bytes copied)\n", flattened, (unsigned long long)copied);
+    }
+    return status;
+}
+
 
 static int rename_entry(const char *archive, uint32_t id, const char *new_name) {
     FILE *f = fopen(archive, "r+b");
@@ -7974,6 +14307,366 @@ static int rename_entry(const char *archive, uint32_t id, const char *new_name)
     return 0;
 }
 
+/* ---- baar watch -------------------------------------------------------------------------
+   Keeps an archive current by subscribing to inotify on the source trees and committing
+   batches of changed paths as incremental runs. Each root has its own inotify instance so a
+   queue overflow only forces a rescan of that root. */
+#define BAAR_WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+/* more queued paths than this for one root and the root is rescanned instead */
+#define BAAR_WATCH_PENDING_MAX 65536
+
+typedef struct {
+    int wd;
+    char *path;
+} watch_dir_t;
+
+typedef struct {
+    char *root;
+    int fd;
+    watch_dir_t *dirs; /* sorted by wd */
+    size_t dir_count;
+    int rescan;        /* queue overflowed: walk the whole root at the next commit */
+    int unwatched;     /* watch limit reached: walk the whole root at every commit */
+    char **pending;
+    size_t pending_count;
+} watch_root_t;
+
+static watch_dir_t *watch_find_wd(watch_root_t *wr, int wd){
+    size_t lo = 0, hi = wr->dir_count;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(wr->dirs[mid].wd == wd) return &wr->dirs[mid];
+        if(wr->dirs[mid].wd < wd) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static void watch_forget_wd(watch_root_t *wr, int wd){
+    watch_dir_t *d = watch_find_wd(wr, wd);
+    if(!d) return;
+    free(d->path);
+    size_t i = (size_t)(d - wr->dirs);
+    memmove(&wr->dirs[i], &wr->dirs[i+1], sizeof(*wr->dirs) * (wr->dir_count - i - 1));
+    wr->dir_count--;
+}
+
+static int watch_add_dir(watch_root_t *wr, const char *path){
+    int wd = inotify_add_watch(wr->fd, path, BAAR_WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if(wd < 0) return -1;
+    watch_dir_t *d = watch_find_wd(wr, wd);
+    char *copy = strdup(path);
+    if(!copy) return -1;
+    if(d){ free(d->path); d->path = copy; return 0; }
+    watch_dir_t *tmp = realloc(wr->dirs, sizeof(*wr->dirs) * (wr->dir_count + 1));
+    if(!tmp){ free(copy); return -1; }
+    wr->dirs = tmp;
+    size_t i = wr->dir_count;
+    while(i > 0 && wr->dirs[i-1].wd > wd){ wr->dirs[i] = wr->dirs[i-1]; i--; }
+    wr->dirs[i].wd = wd;
+    wr->dirs[i].path = copy;
+    wr->dir_count++;
+    return 0;
+}
+
+/* Watch `path` and every directory below it. Running out of watches switches the root to
+   rescan-on-every-commit rather than silently missing changes. */
+static void watch_add_tree(watch_root_t *wr, const char *path, char **ignore, size_t ignore_count){
+    if(wr->unwatched) return;
+    char **stack = NULL;
+    size_t depth = 0;
+    if(str_list_append(&stack, &depth, path) != 0) return;
+    while(depth > 0){
+        char *dir = stack[--depth];
+        if(watch_add_dir(wr, dir) != 0){
+            if(errno == ENOSPC){
+                fprintf(stderr, "Warning: inotify watch limit reached under %s; it will be rescanned on every commit "
+                                "(raise fs.inotify.max_user_watches)\n", wr->root);
+                wr->unwatched = 1;
+                free(dir);
+                break;
+            }
+            free(dir);
+            continue;
+        }
+        DIR *d = opendir(dir);
+        struct dirent *ent;
+        while(d && (ent = readdir(d)) != NULL){
+            if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            int is_dir = ent->d_type == DT_DIR;
+            if(ent->d_type == DT_UNKNOWN){
+                struct stat cst;
+                is_dir = fstatat(dirfd(d), ent->d_name, &cst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(cst.st_mode);
+            }
+            if(!is_dir) continue;
+            char *child = build_child_path(dir, ent->d_name);
+            if(!child) continue;
+            if(should_ignore_path(child, child, ignore, ignore_count) || is_pseudo_path(child) ||
+               str_list_append(&stack, &depth, child) != 0){
+                free(child);
+                continue;
+            }
+            free(child);
+        }
+        if(d) closedir(d);
+        free(dir);
+    }
+    str_list_free(stack, depth);
+}
+
+static void watch_queue(watch_root_t *wr, const char *path){
+    if(wr->rescan || wr->unwatched) return;
+    if(wr->pending_count >= BAAR_WATCH_PENDING_MAX ||
+       str_list_append(&wr->pending, &wr->pending_count, path) != 0){
+        str_list_free(wr->pending, wr->pending_count);
+        wr->pending = NULL;
+        wr->pending_count = 0;
+        wr->rescan = 1;
+    }
+}
+
+static void watch_drain(watch_root_t *wr, char **ignore, size_t ignore_count){
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;){
+        ssize_t n = read(wr->fd, buf, sizeof(buf));
+        if(n <= 0) return;
+        for(char *p = buf; p < buf + n; ){
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if(ev->mask & IN_Q_OVERFLOW){
+                if(!global_quiet) fprintf(stderr, "Watch: event queue overflowed for %s; rescanning it\n", wr->root);
+                wr->rescan = 1;
+                continue;
+            }
+            if(ev->mask & IN_IGNORED){ watch_forget_wd(wr, ev->wd); continue; }
+            watch_dir_t *d = watch_find_wd(wr, ev->wd);
+            if(!d) continue;
+            if(ev->len == 0){
+                /* events about a watched directory itself are also reported by its parent,
+                   except for the root */
+                if(strcmp(d->path, wr->root) == 0) watch_queue(wr, wr->root);
+                continue;
+            }
+            char *full = build_child_path(d->path, ev->name);
+            if(!full) continue;
+            if(should_ignore_path(full, full, ignore, ignore_count)){ free(full); continue; }
+            if((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)){
+                /* watches below a moved-away directory would report stale paths */
+                size_t fl = strlen(full);
+                for(size_t i=wr->dir_count; i-- > 0; ){
+                    const char *wp = wr->dirs[i].path;
+                    if(strncmp(wp, full, fl) == 0 && (wp[fl] == '\0' || wp[fl] == '/')){
+                        inotify_rm_watch(wr->fd, wr->dirs[i].wd);
+                        watch_forget_wd(wr, wr->dirs[i].wd);
+                    }
+                }
+            }
+            if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))){
+                watch_add_tree(wr, full, ignore, ignore_count);
+            }
+            watch_queue(wr, full);
+            free(full);
+        }
+    }
+}
+
+/* True if some proper ancestor directory of `path` is in the sorted `set`. */
+static int watch_has_queued_ancestor(char **set, size_t count, const char *path){
+    char tmp[PATH_MAX];
+    size_t len = strlen(path);
+    if(len >= sizeof(tmp)) return 0;
+    memcpy(tmp, path, len + 1);
+    for(size_t i=len; i-- > 1; ){
+        if(tmp[i] != '/') continue;
+        tmp[i] = '\0';
+        const char *key = tmp;
+        if(bsearch(&key, set, count, sizeof(char*), compare_cstr)) return 1;
+    }
+    return 0;
+}
+
+static void watch_append_job(add_job_t **jobs, int *job_count, const char *src, int clevel){
+    add_job_t *tmp = realloc(*jobs, sizeof(add_job_t) * (*job_count + 1));
+    if(!tmp) return;
+    *jobs = tmp;
+    memset(&tmp[*job_count], 0, sizeof(add_job_t));
+    tmp[*job_count].src_root = strdup(src);
+    tmp[*job_count].clevel = clevel;
+    if(tmp[*job_count].src_root) (*job_count)++;
+}
+
+/* Archive path prefix for a watched source path, in the form entry names are compared in
+   (entry_get_name() drops the leading slash of absolute paths). */
+static void watch_add_scope(char ***list, size_t *count, const char *path){
+    add_job_t job = { .src_root = (char *)path };
+    char *name = strip_leading_slashes(resolve_archive_path(&job, path));
+    if(name) str_list_append(list, count, name);
+    free(name);
+}
+
+/* Turn everything queued since the last commit into one incremental run. */
+static int watch_commit(const char *archive, watch_root_t *roots, size_t nroots, int clevel, const char *pwd,
+                        char **ignore, size_t ignore_count, add_options_t *opts){
+    struct stat ast;
+    int have_archive_id = stat(archive, &ast) == 0;
+    add_job_t *jobs = NULL;
+    int job_count = 0;
+    size_t rescans = 0;
+    add_options_t run = *opts;
+    run.remove_paths = NULL; run.remove_count = 0;
+    run.mirror_scope = NULL; run.mirror_scope_count = 0;
+
+    for(size_t r=0;r<nroots;r++){
+        watch_root_t *wr = &roots[r];
+        if(wr->rescan || wr->unwatched){
+            if(wr->rescan) watch_add_tree(wr, wr->root, ignore, ignore_count);
+            watch_append_job(&jobs, &job_count, wr->root, clevel);
+            watch_add_scope(&run.mirror_scope, &run.mirror_scope_count, wr->root);
+            wr->rescan = 0;
+            rescans++;
+        } else if(wr->pending_count > 0){
+            qsort(wr->pending, wr->pending_count, sizeof(char*), compare_cstr);
+            for(size_t i=0;i<wr->pending_count;i++){
+                const char *p = wr->pending[i];
+                if(i > 0 && strcmp(p, wr->pending[i-1]) == 0) continue;
+                if(watch_has_queued_ancestor(wr->pending, wr->pending_count, p)) continue;
+                struct stat st;
+                if(lstat(p, &st) == 0){
+                    if(have_archive_id && st.st_dev == ast.st_dev && st.st_ino == ast.st_ino) continue;
+                    watch_append_job(&jobs, &job_count, p, clevel);
+                    /* a queued directory is walked again; entries gone from it are dropped */
+                    if(S_ISDIR(st.st_mode)) watch_add_scope(&run.mirror_scope, &run.mirror_scope_count, p);
+                } else if(errno == ENOENT || errno == ENOTDIR){
+                    watch_add_scope(&run.remove_paths, &run.remove_count, p);
+                }
+            }
+        }
+        str_list_free(wr->pending, wr->pending_count);
+        wr->pending = NULL;
+        wr->pending_count = 0;
+    }
+
+    int res = 0;
+    if(job_count > 0 || run.remove_count > 0){
+        res = add_files_streaming(archive, jobs, job_count, pwd, 1, run.mirror_scope_count > 0,
+                                  ignore, ignore_count, &run);
+        if(!global_quiet){
+            time_t now = time(NULL);
+            struct tm tmv;
+            char ts[16];
+            localtime_r(&now, &tmv);
+            strftime(ts, sizeof(ts), "%H:%M:%S", &tmv);
+            fprintf(stderr, "[%s] Watch: committed %d path(s), %zu removed, %zu rescan(s)\n",
+                    ts, job_count, run.remove_count, rescans);
+        }
+    }
+    for(int j=0;j<job_count;j++) free(jobs[j].src_root);
+    free(jobs);
+    str_list_free(run.remove_paths, run.remove_count);
+    str_list_free(run.mirror_scope, run.mirror_scope_count);
+    return res;
+}
+
+/* baar watch: initial incremental mirror of the roots, then commit queued changes at most
+   every interval_ms until interrupted. */
+static int watch_archive(const char *archive, char **src_roots, int root_count, int clevel, const char *pwd,
+                         char **ignore, size_t ignore_count, add_options_t *opts, int interval_ms){
+    watch_root_t *roots = calloc((size_t)root_count, sizeof(*roots));
+    if(!roots){ fprintf(stderr, "Out of memory\n"); return 1; }
+    int status = 0;
+    size_t nroots = 0;
+    for(int i=0;i<root_count;i++){
+        struct stat st;
+        if(stat(src_roots[i], &st) != 0 || !S_ISDIR(st.st_mode)){
+            fprintf(stderr, "Cannot watch %s: %s\n", src_roots[i], errno ? strerror(errno) : "not a directory");
+            status = 1;
+            continue;
+        }
+        watch_root_t *wr = &roots[nroots];
+        wr->root = normalize_path_basic(src_roots[i]);
+        wr->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(!wr->root || wr->fd < 0){
+            fprintf(stderr, "Cannot watch %s: %s\n", src_roots[i], strerror(errno));
+            free(wr->root);
+            if(wr->fd >= 0) close(wr->fd);
+            status = 1;
+            continue;
+        }
+        nroots++;
+    }
+    if(status != 0 || nroots == 0){
+        for(size_t r=0;r<nroots;r++){ free(roots[r].root); close(roots[r].fd); }
+        free(roots);
+        return 1;
+    }
+
+    install_cli_signal_handlers();
+    /* subscribe before the initial pass so nothing changed during it is missed */
+    for(size_t r=0;r<nroots;r++){
+        watch_add_tree(&roots[r], roots[r].root, ignore, ignore_count);
+        roots[r].rescan = 1;
+    }
+    if(!global_quiet) fprintf(stderr, "Watch: initial sync of %zu root(s) into %s\n", nroots, archive);
+    int res = watch_commit(archive, roots, nroots, clevel, pwd, ignore, ignore_count, opts);
+    if(!global_quiet && !g_abort_requested){
+        size_t dirs = 0;
+        for(size_t r=0;r<nroots;r++) dirs += roots[r].dir_count;
+        fprintf(stderr, "Watch: watching %zu director%s; press Ctrl+C to stop\n", dirs, dirs == 1 ? "y" : "ies");
+    }
+
+    struct pollfd *pfds = calloc(nroots, sizeof(*pfds));
+    struct timespec first_change = {0, 0};
+    int have_changes = 0;
+    while(pfds && !g_abort_requested && (res == 0 || res == 1)){
+        int timeout = 1000;
+        if(have_changes){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (long)(now.tv_sec - first_change.tv_sec) * 1000L + (now.tv_nsec - first_change.tv_nsec) / 1000000L;
+            if(elapsed >= interval_ms){
+                res = watch_commit(archive, roots, nroots, clevel, pwd, ignore, ignore_count, opts);
+                have_changes = 0;
+                continue;
+            }
+            if(interval_ms - elapsed < timeout) timeout = (int)(interval_ms - elapsed);
+        }
+        for(size_t r=0;r<nroots;r++){ pfds[r].fd = roots[r].fd; pfds[r].events = POLLIN; pfds[r].revents = 0; }
+        int pr = poll(pfds, nroots, timeout);
+        if(pr < 0 && errno != EINTR){ perror("poll"); res = 1; break; }
+        for(size_t r=0;r<nroots && pr > 0;r++){
+            if(!(pfds[r].revents & POLLIN)) continue;
+            watch_drain(&roots[r], ignore, ignore_count);
+        }
+        if(!have_changes){
+            for(size_t r=0;r<nroots;r++){
+                if(roots[r].pending_count > 0 || roots[r].rescan || roots[r].unwatched){
+                    have_changes = 1;
+                    clock_gettime(CLOCK_MONOTONIC, &first_change);
+                    break;
+                }
+            }
+        }
+    }
+    /* commit what was queued before the interrupt */
+    if(have_changes && g_abort_requested){
+        g_abort_requested = 0;
+        res = watch_commit(archive, roots, nroots, clevel, pwd, ignore, ignore_count, opts);
+    }
+    restore_cli_signal_handlers();
+
+    free(pfds);
+    for(size_t r=0;r<nroots;r++){
+        for(size_t i=0;i<roots[r].dir_count;i++) free(roots[r].dirs[i].path);
+        free(roots[r].dirs);
+        str_list_free(roots[r].pending, roots[r].pending_count);
+        free(roots[r].root);
+        close(roots[r].fd);
+    }
+    free(roots);
+    return (res == 130) ? 0 : res;
+}
+
 int main(int argc, char **argv){
 
     for(int gi=1; gi<argc; gi++){
@@ -8155,7 +14848,9 @@ int main(int argc, char **argv){
 
 
     char archive_buf[4096];
-    if(strlen(archive_arg) > 6 && strcmp(archive_arg + strlen(archive_arg) - 5, ".baar") == 0) {
+    if(strcmp(archive_arg, "-") == 0 && (strcmp(cmd, "a") == 0 || strcmp(cmd, "x") == 0)){
+        snprintf(archive_buf, sizeof(archive_buf), "-");
+    } else if(strlen(archive_arg) > 6 && strcmp(archive_arg + strlen(archive_arg) - 5, ".baar") == 0) {
         strncpy(archive_buf, archive_arg, sizeof(archive_buf)-1);
         archive_buf[sizeof(archive_buf)-1]=0;
     } else {
@@ -8177,6 +14872,13 @@ int main(int argc, char **argv){
         else if(strcmp(argv[i],"--verbose")==0 || strcmp(argv[i],"-v")==0){ global_verbose = 1; }
         else if(strcmp(argv[i],"--incremental")==0 || strcmp(argv[i],"--i")==0 || strcmp(argv[i],"-i")==0){ incremental_mode = 1; }
         else if(strcmp(argv[i],"--mirror")==0 || strcmp(argv[i],"--m")==0 || strcmp(argv[i],"-m")==0){ mirror_mode = 1; incremental_mode = 1; }
+        else if(strcmp(argv[i],"--compact-threshold")==0 || strncmp(argv[i],"--compact-threshold=",20)==0){
+            const char *thr = argv[i][19] == '=' ? argv[i] + 20 : (i+1 < argc ? argv[++i] : NULL);
+            if(parse_compact_threshold(thr, &g_compact_policy) != 0){
+                fprintf(stderr, "Invalid --compact-threshold '%s' (expected e.g. 30%%, 512M or off)\n", thr ? thr : "");
+                return 1;
+            }
+        }
     }
 
     if(!pwd) pwd = getenv("BAAR_PWD");
@@ -8188,6 +14890,7 @@ int main(int argc, char **argv){
             size_t ignore_count = 0;
             char **devdir_patterns = NULL;
             size_t devdir_count = 0;
+            add_options_t add_opts = {0};
 
             for(int i=3;i<argc;i++){
                 if(strcmp(argv[i],"--ignore")==0){
@@ -8232,7 +14935,158 @@ int main(int argc, char **argv){
                         free_ignore_patterns(devdir_patterns, devdir_count);
                         return 1;
                     }
+                } else if(strcmp(argv[i], "--one-file-system") == 0 || strcmp(argv[i], "--xdev") == 0){
+                    add_opts.one_file_system = 1;
+                } else if(strcmp(argv[i], "--verify-content") == 0){
+                    add_opts.verify_content = 1;
+                } else if(strcmp(argv[i], "--dedup") == 0){
+                    add_opts.dedup = 1;
+                } else if(strcmp(argv[i], "--cdc") == 0){
+                    add_opts.cdc = 1;
+                } else if(strcmp(argv[i], "--low-memory") == 0){
+                    add_opts.low_memory = 1;
+                } else if(strcmp(argv[i], "--local-headers") == 0){
+                    add_opts.local_headers = 1;
+                } else if(strcmp(argv[i], "--volume-size") == 0 || strncmp(argv[i], "--volume-size=", 14) == 0){
+                    const char *size = argv[i][13] == '=' ? argv[i] + 14 : (i+1 < argc ? argv[++i] : NULL);
+                    if(parse_size_suffix(size, &add_opts.volume_size) != 0){
+                        fprintf(stderr, "Invalid --volume-size '%s' (expected e.g. 50G or 700M)\n", size ? size : "");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                } else if(strcmp(argv[i], "--stripe") == 0 || strncmp(argv[i], "--stripe=", 9) == 0){
+                    const char *n = argv[i][8] == '=' ? argv[i] + 9 : (i+1 < argc ? argv[++i] : NULL);
+                    char *endp = NULL;
+                    long stripes = n ? strtol(n, &endp, 10) : 0;
+                    if(!n || !endp || *endp || stripes < 1 || stripes > 64){
+                        fprintf(stderr, "Invalid --stripe '%s' (expected 1-64)\n", n ? n : "");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                    add_opts.stripe = (int)stripes;
+                } else if(strcmp(argv[i], "--stripe-dir") == 0 || strncmp(argv[i], "--stripe-dir=", 13) == 0){
+                    const char *dir = argv[i][12] == '=' ? argv[i] + 13 : NULL;
+                    if(!dir){
+                        if(i+1 >= argc){
+                            fprintf(stderr, "--stripe-dir requires a directory\n");
+                            free_ignore_patterns(ignore_patterns, ignore_count);
+                            free_ignore_patterns(devdir_patterns, devdir_count);
+                            return 1;
+                        }
+                        dir = argv[++i];
+                    }
+                    if(str_list_append(&add_opts.stripe_dirs, &add_opts.stripe_dir_count, dir) != 0){
+                        fprintf(stderr, "Failed to store --stripe-dir path\n");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                } else if(strcmp(argv[i], "--base") == 0 || strncmp(argv[i], "--base=", 7) == 0){
+                    const char *bp = argv[i][6] == '=' ? argv[i] + 7 : NULL;
+                    if(!bp){
+                        if(i+1 >= argc){
+                            fprintf(stderr, "--base requires an archive path\n");
+                            free_ignore_patterns(ignore_patterns, ignore_count);
+                            free_ignore_patterns(devdir_patterns, devdir_count);
+                            return 1;
+                        }
+                        bp = argv[++i];
+                    }
+                    add_opts.base_path = bp;
+                } else if(strcmp(argv[i], "--delta") == 0 || strncmp(argv[i], "--delta=", 8) == 0){
+                    add_opts.delta_depth = BAAR_DELTA_DEFAULT_DEPTH;
+                    if(argv[i][7] == '='){
+                        char *endp = NULL;
+                        long depth = strtol(argv[i] + 8, &endp, 10);
+                        if(!endp || *endp || depth < 1 || depth > 64){
+                            fprintf(stderr, "Invalid --delta depth '%s' (expected 1-64)\n", argv[i] + 8);
+                            free_ignore_patterns(ignore_patterns, ignore_count);
+                            free_ignore_patterns(devdir_patterns, devdir_count);
+                            return 1;
+                        }
+                        add_opts.delta_depth = (int)depth;
+                    }
+                } else if(strcmp(argv[i], "--allow-fs") == 0 || strncmp(argv[i], "--allow-fs=", 11) == 0){
+                    const char *fs_path = argv[i][10] == '=' ? argv[i] + 11 : NULL;
+                    if(!fs_path){
+                        if(i+1 >= argc){
+                            fprintf(stderr, "--allow-fs requires a path\n");
+                            free_ignore_patterns(ignore_patterns, ignore_count);
+                            free_ignore_patterns(devdir_patterns, devdir_count);
+                            return 1;
+                        }
+                        fs_path = argv[++i];
+                    }
+                    if(str_list_append(&add_opts.allow_fs_paths, &add_opts.allow_fs_count, fs_path) != 0){
+                        fprintf(stderr, "Failed to store --allow-fs path\n");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                }
+            }
+            for(int i=3;i<argc;i++){
+                const char *order = NULL;
+                const char *timeout = NULL;
+                if(strcmp(argv[i], "--io-timeout") == 0){
+                    if(i+1 >= argc){
+                        fprintf(stderr, "--io-timeout requires a duration\n");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                    timeout = argv[++i];
+                } else if(strncmp(argv[i], "--io-timeout=", 13) == 0){
+                    timeout = argv[i] + 13;
+                }
+                if(timeout){
+                    if(parse_duration_ms(timeout, &add_opts.io_timeout_ms) != 0){
+                        fprintf(stderr, "Invalid --io-timeout '%s' (expected e.g. 30s, 500ms or 2m)\n", timeout);
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                    continue;
+                }
+                if(strcmp(argv[i], "--read-order") == 0){
+                    if(i+1 >= argc){
+                        fprintf(stderr, "--read-order requires inode or physical\n");
+                        free_ignore_patterns(ignore_patterns, ignore_count);
+                        free_ignore_patterns(devdir_patterns, devdir_count);
+                        return 1;
+                    }
+                    order = argv[++i];
+                } else if(strncmp(argv[i], "--read-order=", 13) == 0){
+                    order = argv[i] + 13;
+                } else {
+                    continue;
+                }
+                if(strcmp(order, "inode") == 0) add_opts.read_order = BAAR_READ_ORDER_INODE;
+                else if(strcmp(order, "physical") == 0) add_opts.read_order = BAAR_READ_ORDER_PHYSICAL;
+                else if(strcmp(order, "readdir") == 0) add_opts.read_order = BAAR_READ_ORDER_READDIR;
+                else {
+                    fprintf(stderr, "Unknown --read-order '%s' (expected inode or physical)\n", order);
+                    free_ignore_patterns(ignore_patterns, ignore_count);
+                    free_ignore_patterns(devdir_patterns, devdir_count);
+                    return 1;
+                }
+            }
+            if(add_opts.allow_fs_count > 0 && !add_opts.one_file_system && !global_quiet){
+                fprintf(stderr, "Note: --allow-fs has no effect without --one-file-system\n");
+            }
+            if(add_opts.volume_size > 0 || add_opts.stripe > 0){
+                const char *clash = strcmp(archive, "-") == 0 ? "writing to standard output" :
+                                    add_opts.local_headers ? "--local-headers" : NULL;
+                if(clash){
+                    fprintf(stderr, "--volume-size and --stripe cannot be combined with %s\n", clash);
+                    free_ignore_patterns(ignore_patterns, ignore_count);
+                    free_ignore_patterns(devdir_patterns, devdir_count);
+                    return 1;
                 }
+            } else if(add_opts.stripe_dir_count > 0 && !global_quiet){
+                fprintf(stderr, "Note: --stripe-dir has no effect without --stripe or --volume-size\n");
             }
 
             for(int i=3;i<argc;i++){
@@ -8243,6 +15097,12 @@ int main(int argc, char **argv){
                 if(strcmp(argv[i],"--verbose")==0 || strcmp(argv[i],"-v")==0){ continue; }
                 if(strcmp(argv[i],"--ignore")==0){ i++; continue; }
                 if(strcmp(argv[i],"--devdir")==0){ i++; continue; }
+                if(strcmp(argv[i],"--allow-fs")==0){ i++; continue; }
+                if(strcmp(argv[i],"--read-order")==0){ i++; continue; }
+                if(strcmp(argv[i],"--io-timeout")==0){ i++; continue; }
+                if(strcmp(argv[i],"--base")==0){ i++; continue; }
+                if(strcmp(argv[i],"--volume-size")==0 || strcmp(argv[i],"--stripe")==0 || strcmp(argv[i],"--stripe-dir")==0){ i++; continue; }
+                if(strcmp(argv[i],"--compact-threshold")==0){ i++; continue; }
                 if(argv[i][0] == '-') continue;
                 if(strncmp(argv[i], "--ignore=", 9) == 0){ continue; }
                 if(strncmp(argv[i], "--devdir=", 9) == 0){ continue; }
@@ -8328,7 +15188,7 @@ int main(int argc, char **argv){
                 }
                 job_count++;
             }
-    if(job_count==0 && !incremental_mode){
+    if(job_count==0 && !incremental_mode && strcmp(archive, "-") != 0){
 
         FILE *f = fopen(archive, "rb");
         if(!f) {
@@ -8377,7 +15237,7 @@ int main(int argc, char **argv){
         if(job_count > 0){
             install_cli_signal_handlers();
         }
-        int res = add_files_streaming(archive, jobs, job_count, pwd, incremental_mode, mirror_mode, ignore_patterns, ignore_count);
+        int res = add_files_streaming(archive, jobs, job_count, pwd, incremental_mode, mirror_mode, ignore_patterns, ignore_count, &add_opts);
         if(job_count > 0){
             restore_cli_signal_handlers();
         }
@@ -8389,6 +15249,48 @@ int main(int argc, char **argv){
         if(!global_quiet && !global_verbose) fprintf(stderr, "\n");
         free_ignore_patterns(ignore_patterns, ignore_count);
         free_ignore_patterns(devdir_patterns, devdir_count);
+        str_list_free(add_opts.allow_fs_paths, add_opts.allow_fs_count);
+        str_list_free(add_opts.stripe_dirs, add_opts.stripe_dir_count);
+        return res;
+    } else if(strcmp(cmd,"watch")==0){
+        char **roots = NULL;
+        size_t root_count = 0;
+        char **ignore_patterns = NULL;
+        size_t ignore_count = 0;
+        int interval_ms = 2000;
+        add_options_t watch_opts = {0};
+        int bad = 0;
+        for(int i=3;i<argc && !bad;i++){
+            if(strcmp(argv[i],"-c")==0 || strcmp(argv[i],"-p")==0){ i++; continue; }
+            if(strcmp(argv[i],"--ignore")==0 || strcmp(argv[i],"--interval")==0){
+                if(i+1 >= argc){ fprintf(stderr, "%s requires a value\n", argv[i]); bad = 1; break; }
+                if(strcmp(argv[i],"--ignore")==0) bad = add_ignore_pattern(&ignore_patterns, &ignore_count, argv[i+1]) != 0;
+                else if(parse_duration_ms(argv[i+1], &interval_ms) != 0){
+                    fprintf(stderr, "Invalid --interval '%s' (expected e.g. 2s or 500ms)\n", argv[i+1]);
+                    bad = 1;
+                }
+                i++;
+                continue;
+            }
+            if(strncmp(argv[i], "--ignore=", 9) == 0){ bad = add_ignore_pattern(&ignore_patterns, &ignore_count, argv[i] + 9) != 0; continue; }
+            if(strncmp(argv[i], "--interval=", 11) == 0){
+                if(parse_duration_ms(argv[i] + 11, &interval_ms) != 0){
+                    fprintf(stderr, "Invalid --interval '%s' (expected e.g. 2s or 500ms)\n", argv[i] + 11);
+                    bad = 1;
+                }
+                continue;
+            }
+            if(argv[i][0] == '-') continue;
+            bad = str_list_append(&roots, &root_count, argv[i]) != 0;
+        }
+        if(!bad && root_count == 0){
+            fprintf(stderr, "watch requires at least one directory\n");
+            bad = 1;
+        }
+        int res = bad ? 1 : watch_archive(archive, roots, (int)root_count, clevel, pwd,
+                                          ignore_patterns, ignore_count, &watch_opts, interval_ms);
+        str_list_free(roots, root_count);
+        free_ignore_patterns(ignore_patterns, ignore_count);
         return res;
     } else if(strcmp(cmd,"l")==0){ return list_archive(archive, json); }
     else if(strcmp(cmd,"search")==0){
@@ -8438,7 +15340,42 @@ int main(int argc, char **argv){
     else if(strcmp(cmd,"x")==0){
         const char *dest = NULL;
         if(argc>=4 && argv[3][0] != '-') dest = argv[3];
-        return extract_archive(archive, dest, pwd);
+        extract_options_t xopts = {0};
+        int bad = 0;
+        for(int i=3;i<argc && !bad;i++){
+            if(strcmp(argv[i], "--update") == 0 || strcmp(argv[i], "-u") == 0) xopts.update = 1;
+            else if(strcmp(argv[i], "--checksum") == 0) xopts.checksum = 1;
+            else if(strcmp(argv[i], "--delete") == 0) xopts.delete_extraneous = 1;
+            else {
+                static const char *sel_opts[] = { "--include", "--exclude", "--prefix" };
+                for(int k=0;k<3;k++){
+                    size_t ol = strlen(sel_opts[k]);
+                    if(strncmp(argv[i], sel_opts[k], ol) != 0 || (argv[i][ol] != '\0' && argv[i][ol] != '=')) continue;
+                    const char *val = argv[i][ol] == '=' ? argv[i] + ol + 1 : (i+1 < argc ? argv[++i] : NULL);
+                    char ***list = k == 0 ? &xopts.include : (k == 1 ? &xopts.exclude : &xopts.prefixes);
+                    size_t *count = k == 0 ? &xopts.include_count : (k == 1 ? &xopts.exclude_count : &xopts.prefix_count);
+                    if(!val || str_list_append(list, count, val) != 0){
+                        fprintf(stderr, "%s requires a value\n", sel_opts[k]);
+                        bad = 1;
+                    }
+                    break;
+                }
+            }
+        }
+        if(!bad && xopts.delete_extraneous && (xopts.include_count || xopts.exclude_count || xopts.prefix_count)){
+            fprintf(stderr, "--delete cannot be combined with --include, --exclude or --prefix\n");
+            bad = 1;
+        }
+        int from_stdin = strcmp(archive, "-") == 0;
+        if(!bad && from_stdin && xopts.delete_extraneous){
+            fprintf(stderr, "--delete needs the archive index and cannot be used with 'baar x -'\n");
+            bad = 1;
+        }
+        int rc = bad ? 1 : (from_stdin ? extract_stream(stdin, dest, pwd, &xopts) : extract_archive(archive, dest, pwd, &xopts));
+        str_list_free(xopts.include, xopts.include_count);
+        str_list_free(xopts.exclude, xopts.exclude_count);
+        str_list_free(xopts.prefixes, xopts.prefix_count);
+        return rc;
     } else if(strcmp(cmd,"t")==0){ return test_archive(archive, pwd, json); }
     else if(strcmp(cmd,"info")==0){
         if(argc<4){ fprintf(stderr,"ID required\n"); return 1; }
@@ -8449,7 +15386,43 @@ int main(int argc, char **argv){
         uint32_t id = (uint32_t)strtoul(argv[3], NULL, 10);
         return cat_entry(archive, id, pwd);
     } else if(strcmp(cmd,"f")==0){ return fix_archive(archive); }
-    else if(strcmp(cmd,"r")==0){ if(argc<4){ fprintf(stderr,"ID required\n"); return 1; } uint32_t id = atoi(argv[3]); return remove_entry(archive,id); }
+    else if(strcmp(cmd,"recover")==0){ return recover_archive(archive); }
+    else if(strcmp(cmd,"r")==0){
+        uint32_t *ids = NULL;
+        uint32_t id_count = 0;
+        char **globs = NULL;
+        size_t glob_count = 0;
+        int bad = 0;
+        for(int i=3;i<argc && !bad;i++){
+            if(strcmp(argv[i], "--glob") == 0 || strncmp(argv[i], "--glob=", 7) == 0){
+                const char *pat = argv[i][6] == '=' ? argv[i] + 7 : NULL;
+                if(!pat){
+                    if(i+1 >= argc){ fprintf(stderr, "--glob requires a pattern\n"); bad = 1; break; }
+                    pat = argv[++i];
+                }
+                if(str_list_append(&globs, &glob_count, pat) != 0){ fprintf(stderr, "Failed to store glob pattern\n"); bad = 1; }
+                continue;
+            }
+            if(strcmp(argv[i], "--compact-threshold") == 0){ i++; continue; }
+            if(argv[i][0] == '-') continue; /* -q, -v, --compact-threshold=... */
+            char *endp = NULL;
+            unsigned long v = strtoul(argv[i], &endp, 10);
+            if(!endp || *endp || v > UINT32_MAX){
+                fprintf(stderr, "Invalid entry id '%s'\n", argv[i]);
+                bad = 1;
+                break;
+            }
+            uint32_t *tmp = realloc(ids, sizeof(*ids) * (id_count + 1));
+            if(!tmp){ fprintf(stderr, "Out of memory\n"); bad = 1; break; }
+            ids = tmp;
+            ids[id_count++] = (uint32_t)v;
+        }
+        if(!bad && id_count == 0 && glob_count == 0){ fprintf(stderr, "ID required\n"); bad = 1; }
+        int rc = bad ? 1 : remove_entries(archive, ids, id_count, globs, glob_count, global_quiet);
+        free(ids);
+        str_list_free(globs, glob_count);
+        return rc;
+    }
     else if(strcmp(cmd,"rename") == 0) {
         if (argc < 5) {
             fprintf(stderr, "Usage: baar rename archive id new_name\n");
@@ -8471,6 +15444,84 @@ int main(int argc, char **argv){
 
         return compress_archive(archive, clevel, pwd);
     }
+    else if(strcmp(cmd, "flatten") == 0) {
+        return flatten_archive(archive, pwd);
+    }
+    else if(strcmp(cmd, "merge") == 0) {
+        int policy = MERGE_KEEP_LAST;
+        char **inputs = calloc((size_t)argc, sizeof(char*));
+        int input_count = 0;
+        if(!inputs){ fprintf(stderr, "Out of memory\n"); return 1; }
+        for(int i=3;i<argc;i++){
+            const char *pol = NULL;
+            if(strcmp(argv[i], "--on-conflict") == 0){
+                if(i+1 >= argc){ fprintf(stderr, "--on-conflict requires a policy\n"); free(inputs); return 1; }
+                pol = argv[++i];
+            } else if(strncmp(argv[i], "--on-conflict=", 14) == 0){
+                pol = argv[i] + 14;
+            } else if(strcmp(argv[i], "--compact-threshold") == 0){
+                i++;
+                continue;
+            } else if(argv[i][0] != '-'){
+                inputs[input_count++] = argv[i];
+                continue;
+            } else {
+                continue;
+            }
+            if(strcmp(pol, "last") == 0) policy = MERGE_KEEP_LAST;
+            else if(strcmp(pol, "first") == 0) policy = MERGE_KEEP_FIRST;
+            else if(strcmp(pol, "newer") == 0) policy = MERGE_KEEP_NEWER;
+            else if(strcmp(pol, "rename") == 0) policy = MERGE_RENAME;
+            else if(strcmp(pol, "error") == 0) policy = MERGE_FAIL;
+            else {
+                fprintf(stderr, "Unknown --on-conflict '%s' (expected last, first, newer, rename or error)\n", pol);
+                free(inputs);
+                return 1;
+            }
+        }
+        if(input_count == 0){
+            fprintf(stderr, "Usage: baar merge <out> <archive>... [--on-conflict=last|first|newer|rename|error]\n");
+            free(inputs);
+            return 1;
+        }
+        int rc = merge_archives(archive, inputs, input_count, policy);
+        free(inputs);
+        return rc;
+    }
+    else if(strcmp(cmd, "batch") == 0) {
+        const char *script = argc >= 4 && (argv[3][0] != '-' || strcmp(argv[3], "-") == 0) ? argv[3] : NULL;
+        return batch_archive(archive, script, pwd, clevel);
+    }
+    else if(strcmp(cmd, "diff") == 0) {
+        if(argc < 4 || argv[3][0] == '-'){
+            fprintf(stderr, "Usage: baar diff <archive> <dir> [--content] [--ignore PATTERN] [--one-file-system] [-j|--json]\n");
+            return 2;
+        }
+        int content = 0;
+        char **ignore_patterns = NULL;
+        size_t ignore_count = 0;
+        add_options_t diff_opts = {0};
+        int rc = 0;
+        for(int i=4;i<argc && rc == 0;i++){
+            if(strcmp(argv[i], "--content") == 0){
+                content = 1;
+            } else if(strcmp(argv[i], "--one-file-system") == 0 || strcmp(argv[i], "--xdev") == 0){
+                diff_opts.one_file_system = 1;
+            } else if(strcmp(argv[i], "--ignore") == 0 || strncmp(argv[i], "--ignore=", 9) == 0){
+                const char *pattern = argv[i][8] == '=' ? argv[i] + 9 : (i+1 < argc ? argv[++i] : NULL);
+                if(!pattern){ fprintf(stderr, "--ignore requires a pattern\n"); rc = 2; }
+                else if(add_ignore_pattern(&ignore_patterns, &ignore_count, pattern) != 0){ fprintf(stderr, "Failed to store ignore pattern\n"); rc = 2; }
+            } else if(strcmp(argv[i], "--allow-fs") == 0 || strncmp(argv[i], "--allow-fs=", 11) == 0){
+                const char *fs_path = argv[i][10] == '=' ? argv[i] + 11 : (i+1 < argc ? argv[++i] : NULL);
+                if(!fs_path){ fprintf(stderr, "--allow-fs requires a path\n"); rc = 2; }
+                else if(str_list_append(&diff_opts.allow_fs_paths, &diff_opts.allow_fs_count, fs_path) != 0){ fprintf(stderr, "Failed to store --allow-fs path\n"); rc = 2; }
+            }
+        }
+        if(rc == 0) rc = diff_archive(archive, argv[3], content, json, ignore_patterns, ignore_count, &diff_opts);
+        free_ignore_patterns(ignore_patterns, ignore_count);
+        str_list_free(diff_opts.allow_fs_paths, diff_opts.allow_fs_count);
+        return rc;
+    }
     usage();
     return 1;
 }
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Planner benchmark for the baar CLI: sh tests/bench.sh [path/to/baar] [path/to/bench_index]
+# For each size in BENCH_SIZES (default 1M and 10M entries) a synthetic archive is written by
+# tests/bench_index.c and the timed commands run against copies of it. The source tree on disk
+# holds only the first 1000 of those paths, so the mirror run marks the rest deleted.
+BAAR=$(cd "$(dirname "${1:-./baar}")" && pwd)/$(basename "${1:-./baar}")
+GEN=$(cd "$(dirname "${2:-tests/bench_index}")" && pwd)/$(basename "${2:-tests/bench_index}")
+SIZES=${BENCH_SIZES:-"1000000 10000000"}
+MTIME=1700000000
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now(){ date +%s%N; }
+# run a command in $WORK and print its wall time in seconds
+timed(){
+    t0=$(now)
+    (cd "$WORK" && "$@" >/dev/null 2>&1) || echo "  warning: '$*' exited with status $?"
+    t1=$(now)
+    awk -v a="$t0" -v b="$t1" 'BEGIN{ printf "%.2fs", (b - a) / 1e9 }'
+}
+
+mkdir -p "$WORK/bench/d0000"
+i=0
+while [ $i -lt 1000 ]; do
+    : > "$WORK/bench/d0000/$(printf 'f%08d' $i)"
+    i=$((i + 1))
+done
+chmod 644 "$WORK"/bench/d0000/*
+touch -d "@$MTIME" "$WORK"/bench/d0000/*
+
+for n in $SIZES; do
+    "$GEN" "$WORK/base.baar" "$n" "$MTIME" || exit 1
+    echo "$n entries ($(du -h "$WORK/base.baar" | cut -f1) index):"
+    echo "  list:                 $(timed "$BAAR" l base.baar)"
+    cp "$WORK/base.baar" "$WORK/run.baar"
+    echo "  add -i, unchanged:    $(timed "$BAAR" a run.baar bench -i -q)"
+    cp "$WORK/base.baar" "$WORK/run.baar"
+    echo "  add, 1000 replaced:   $(timed "$BAAR" a run.baar bench -q)"
+    cp "$WORK/base.baar" "$WORK/run.baar"
+    echo "  add -i -m, $((n - 1000)) deleted: $(timed "$BAAR" a run.baar bench -i -m -q)"
+    rm -f "$WORK/base.baar" "$WORK/run.baar"
+done
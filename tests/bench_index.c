@@ -0,0 +1,52 @@
+/* Writes a synthetic archive for tests/bench.sh: COUNT empty regular files named
+   bench/dNNNN/fNNNNNNNN, 1000 to a directory, all with mode 0644 and mtime MTIME.
+   Usage: bench_index <archive> <count> <mtime> */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static void write_u16(FILE *f, uint16_t v){ fwrite(&v,2,1,f); }
+static void write_u32(FILE *f, uint32_t v){ fwrite(&v,4,1,f); }
+static void write_u64(FILE *f, uint64_t v){ fwrite(&v,8,1,f); }
+
+int main(int argc, char **argv){
+    if(argc != 4){
+        fprintf(stderr, "Usage: %s <archive> <count> <mtime>\n", argv[0]);
+        return 2;
+    }
+    uint32_t count = (uint32_t)strtoul(argv[2], NULL, 10);
+    uint64_t mtime = strtoull(argv[3], NULL, 10);
+    FILE *f = fopen(argv[1], "wb");
+    if(!f){ perror(argv[1]); return 1; }
+    static char buf[1 << 20];
+    setvbuf(f, buf, _IOFBF, sizeof(buf));
+
+    /* header: magic, index offset, padding to 32 bytes; no file data follows */
+    char magic[8] = "BAARv1";
+    fwrite(magic,1,8,f);
+    write_u64(f, 32);
+    for(int i=16;i<32;i++) fputc(0,f);
+
+    write_u32(f, count);
+    for(uint32_t i=0;i<count;i++){
+        char name[64];
+        int len = snprintf(name, sizeof(name), "bench/d%04u/f%08u", i / 1000, i);
+        write_u32(f, i);
+        write_u16(f, (uint16_t)len);
+        fwrite(name,1,(size_t)len,f);
+        fputc(0,f); /* flags */
+        fputc(0,f); /* compression level */
+        write_u64(f, 32);
+        write_u64(f, 0);
+        write_u64(f, 0);
+        write_u32(f, 0);
+        write_u32(f, 0644);
+        write_u32(f, 0);
+        write_u32(f, 0);
+        write_u64(f, mtime);
+        write_u32(f, 0); /* no metadata */
+    }
+    if(fclose(f) != 0){ perror(argv[1]); return 1; }
+    return 0;
+}
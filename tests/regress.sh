@@ -0,0 +1,153 @@
+#!/bin/sh
+# Regression checks for the baar CLI: sh tests/regress.sh [path/to/baar]
+# Each case builds its input under a scratch directory and fails loudly on a mismatch.
+BAAR=$(cd "$(dirname "${1:-./baar}")" && pwd)/$(basename "${1:-./baar}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+fail(){ echo "FAIL: $1"; failed=1; }
+pass(){ echo "ok: $1"; }
+
+# --dedup with --read-order: same-size files of different content must keep their own data
+# after the batch is put back into readdir order, and a later copy must match the right one.
+case_dedup_read_order(){
+    d="$WORK/dedup"
+    mkdir -p "$d/src/a" "$d/src/b" "$d/out"
+    for n in 1 2 3 4 5 6 7 8; do
+        head -c 4096 /dev/urandom > "$d/src/a/f$n"
+    done
+    for n in 1 2 3 4 5 6 7 8; do
+        cp "$d/src/a/f$n" "$d/src/b/copy$n"
+    done
+    (cd "$d" && "$BAAR" a dedup.baar src --dedup --read-order=inode 2>/dev/null) || { fail "dedup: add"; return; }
+    (cd "$d" && "$BAAR" t dedup.baar 2>/dev/null | grep -v ' OK$') && { fail "dedup: test reports errors"; return; }
+    (cd "$d" && "$BAAR" x dedup.baar out 2>/dev/null) || { fail "dedup: extract"; return; }
+    diff -r "$d/src" "$d/out/src" >/dev/null || { fail "dedup: extracted content differs"; return; }
+    pass "dedup with --read-order"
+}
+
+# --dedup with --delta: a copy of a file stored as a delta must not reuse the delta's blob.
+case_dedup_delta(){
+    d="$WORK/delta"
+    mkdir -p "$d/src" "$d/out"
+    seq 1 200000 > "$d/src/log.txt"
+    (cd "$d" && "$BAAR" a delta.baar src -i --delta --dedup 2>/dev/null) || { fail "delta: add"; return; }
+    echo extra >> "$d/src/log.txt"
+    (cd "$d" && "$BAAR" a delta.baar src -i --delta --dedup 2>/dev/null) || { fail "delta: add delta"; return; }
+    cp "$d/src/log.txt" "$d/src/copy.txt"
+    (cd "$d" && "$BAAR" a delta.baar src -i --delta --dedup 2>/dev/null) || { fail "delta: add copy"; return; }
+    (cd "$d" && "$BAAR" t delta.baar 2>/dev/null | grep -v ' OK$') && { fail "delta: test reports errors"; return; }
+    (cd "$d" && "$BAAR" x delta.baar out 2>/dev/null) || { fail "delta: extract"; return; }
+    diff -r "$d/src" "$d/out/src" >/dev/null || { fail "delta: extracted content differs"; return; }
+    pass "dedup with --delta"
+}
+
+# diff prunes like 'a': an unchanged tree added with --ignore, holding a link out of the tree,
+# compares clean from an absolute path.
+case_diff_filters(){
+    d="$WORK/diff"
+    mkdir -p "$d/src/skip"
+    echo a > "$d/src/a"
+    echo c > "$d/src/skip/c"
+    echo o > "$d/outside"
+    ln -s ../outside "$d/src/ext"
+    (cd "$d" && "$BAAR" a diff.baar "$d/src" --ignore skip 2>/dev/null) || { fail "diff: add"; return; }
+    (cd "$d" && "$BAAR" diff diff.baar "$d/src" --ignore skip >/dev/null 2>&1) || { fail "diff: unchanged tree differs"; return; }
+    echo b > "$d/src/b"
+    (cd "$d" && "$BAAR" diff diff.baar "$d/src" --ignore skip 2>/dev/null | grep -qx "A ${d#/}/src/b") || { fail "diff: new file not reported"; return; }
+    pass "diff with --ignore and an absolute root"
+}
+
+# watch with an absolute root: files and directories removed while watching are marked deleted,
+# entries outside the root are left alone.
+case_watch_absolute(){
+    d="$WORK/watch"
+    mkdir -p "$d/src/sub"
+    echo a > "$d/src/a"
+    echo b > "$d/src/sub/b"
+    echo k > "$d/keep.txt"
+    (cd "$d" && "$BAAR" a watch.baar keep.txt 2>/dev/null) || { fail "watch: add"; return; }
+    (cd "$d" && exec "$BAAR" watch watch.baar "$d/src" --interval 100ms 2>"$d/watch.log") &
+    pid=$!
+    # change the tree only once the initial sync is done and the directories are watched
+    n=0
+    until grep -q "^Watch: watching" "$d/watch.log" 2>/dev/null; do
+        n=$((n + 1))
+        [ $n -le 100 ] || { kill -INT $pid; wait $pid; fail "watch: watcher did not start"; return; }
+        sleep 0.1
+    done
+    rm "$d/src/a"
+    rm -r "$d/src/sub"
+    # stop once both removals are committed, or after about 10s
+    n=0
+    until list=$(cd "$d" && "$BAAR" l watch.baar 2>/dev/null) &&
+          echo "$list" | grep -q " 04 .* ${d#/}/src/a$" &&
+          echo "$list" | grep -q " 04 .* ${d#/}/src/sub/b$"; do
+        n=$((n + 1))
+        [ $n -le 100 ] || break
+        sleep 0.1
+    done
+    kill -INT $pid
+    wait $pid
+    list=$(cd "$d" && "$BAAR" l watch.baar 2>/dev/null)
+    echo "$list" | grep -q " 04 .* ${d#/}/src/a$" || { fail "watch: removed file not marked deleted"; return; }
+    echo "$list" | grep -q " 04 .* ${d#/}/src/sub/b$" || { fail "watch: removed directory not marked deleted"; return; }
+    echo "$list" | grep -q " 00 .* keep.txt$" || { fail "watch: entry outside the root removed"; return; }
+    pass "watch with an absolute root"
+}
+
+# --local-headers with --read-order: the ids written in the local headers must be the ones in
+# the index, so an archive recovered without its index lists the same entries under the same ids.
+case_local_headers_read_order(){
+    d="$WORK/lhd"
+    mkdir -p "$d/src"
+    for n in 9 3 7 1 8 2 6 4 5 0; do
+        echo "file $n" > "$d/src/f$n"
+        mv "$d/src/f$n" "$d/src/g$n"
+    done
+    (cd "$d" && "$BAAR" a lhd.baar src --read-order=inode --local-headers 2>/dev/null) || { fail "lhd: add"; return; }
+    (cd "$d" && "$BAAR" l lhd.baar 2>/dev/null) > "$d/before" || { fail "lhd: list"; return; }
+    off=$(od -An -t u8 -j 8 -N 8 "$d/lhd.baar" | tr -d ' ')
+    truncate -s "$off" "$d/lhd.baar" || { fail "lhd: truncate"; return; }
+    (cd "$d" && "$BAAR" recover lhd.baar >/dev/null 2>&1) || { fail "lhd: recover"; return; }
+    (cd "$d" && "$BAAR" l lhd.baar 2>/dev/null) > "$d/after"
+    cmp -s "$d/before" "$d/after" || { fail "lhd: recovered ids differ"; return; }
+    pass "--local-headers with --read-order"
+}
+
+# --dedup with passwords: a copy added with another password must not share the first blob.
+case_dedup_password(){
+    d="$WORK/dpwd"
+    mkdir -p "$d/src"
+    head -c 50000 /dev/urandom > "$d/src/f"
+    cp "$d/src/f" "$d/src/g"
+    (cd "$d" && "$BAAR" a dpwd.baar src/f --dedup -p one 2>/dev/null) || { fail "dedup pwd: add"; return; }
+    (cd "$d" && "$BAAR" a dpwd.baar src/g --dedup -p two 2>/dev/null) || { fail "dedup pwd: add copy"; return; }
+    (cd "$d" && "$BAAR" cat dpwd.baar 1 -p two 2>/dev/null) | cmp -s - "$d/src/g" || { fail "dedup pwd: copy unreadable with its password"; return; }
+    pass "dedup with different passwords"
+}
+
+# 'l -j' carries the deleted-data summary of the text listing.
+case_list_json(){
+    d="$WORK/ljson"
+    mkdir -p "$d/src"
+    head -c 1000 /dev/urandom > "$d/src/f"
+    (cd "$d" && "$BAAR" a ljson.baar src -c 0 2>/dev/null) || { fail "list json: add"; return; }
+    head -c 1000 /dev/urandom > "$d/src/f"
+    (cd "$d" && "$BAAR" a ljson.baar src -c 0 --compact-threshold off 2>/dev/null) || { fail "list json: re-add"; return; }
+    out=$(cd "$d" && "$BAAR" l ljson.baar -j 2>/dev/null)
+    echo "$out" | grep -q '^{"entries":\[' || { fail "list json: no entries array"; return; }
+    echo "$out" | grep -q '"deleted":1,"reclaimable_bytes":1000,"threshold":"30%","due":true}$' || { fail "list json: summary: $out"; return; }
+    pass "list json summary"
+}
+
+case_dedup_read_order
+case_dedup_delta
+case_dedup_password
+case_diff_filters
+case_watch_absolute
+case_local_headers_read_order
+case_list_json
+
+exit $failed